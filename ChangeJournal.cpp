@@ -0,0 +1,1344 @@
+#include "stdafx.h"
+#include "ChangeJournal.h"
+#include "Utf8Transcoder.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace
+{
+	const uint32_t	JOURNAL_MAGIC = 0x534A5744;	//"DWJS"
+	const uint32_t	JOURNAL_VERSION = 1;
+	const size_t	SEGMENT_HEADER_SIZE = 64 * 1024;	//the header and its index, the records start after it
+	const size_t	RECORD_ALIGNMENT = 8;
+
+	struct CIndexEntry
+	{
+		uint64_t	ullSequence;
+		uint64_t	ullTimestamp;
+		uint64_t	ullOffset;	//of the record, in the segment
+	};
+
+	struct CSegmentHeader
+	{
+		uint32_t	dwMagic;
+		uint32_t	dwVersion;
+		uint64_t	ullSegmentNo;
+		uint64_t	ullSize;
+		uint64_t	ullFirstSequence;	//0: not started yet, a spare
+		uint64_t	ullFirstTimestamp;
+		uint32_t	dwIndexCount;
+		uint32_t	dwIndexCapacity;
+		CIndexEntry	index[1];	//dwIndexCapacity of them, up to SEGMENT_HEADER_SIZE
+	};
+
+	const size_t	INDEX_CAPACITY = (SEGMENT_HEADER_SIZE - offsetof(CSegmentHeader, index)) / sizeof(CIndexEntry);
+
+	//	a record is this header, then for each event: a CEventHeader, the name and the new name
+	//	(UTF-8, not terminated), padded w/ zeros to RECORD_ALIGNMENT.
+	struct CRecordHeader
+	{
+		uint32_t	dwLength;	//of the whole record, 0: none (yet).  written last
+		uint32_t	dwChecksum;	//of the rest of the record, from ullFirstSequence on
+		uint64_t	ullFirstSequence;
+		uint64_t	ullTimestamp;
+		uint32_t	dwEventCount;
+		uint32_t	dwReserved;
+	};
+
+	struct CEventHeader	//not aligned in the record, memcpy()'d
+	{
+		uint32_t	dwAction;
+		uint16_t	wNameLength;
+		uint16_t	wNewNameLength;
+	};
+
+	inline size_t AlignRecord(size_t n)
+	{
+		return (n + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1);
+	}
+
+	//	FNV-1a, a 64 bit word at a time (nLength is a multiple of 8)
+	uint32_t Checksum(const BYTE * p, size_t nLength)
+	{
+		uint64_t h = 0xCBF29CE484222325ULL;
+		for (size_t i = 0; i < nLength; i += sizeof(uint64_t))
+		{
+			uint64_t w;
+			memcpy(&w, p + i, sizeof(w));
+			h = (h ^ w) * 0x100000001B3ULL;
+			h ^= h >> 29;
+		}
+		return (uint32_t)(h ^ (h >> 32));
+	}
+
+	uint64_t NowMicroseconds()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	CString SegmentPath(const CString& strDirectory, uint64_t ullSegmentNo)
+	{
+		TCHAR szName[32];
+#ifdef _WIN32
+		_stprintf_s(szName, _countof(szName), _T("\\%016llx"), ullSegmentNo);
+#else
+		snprintf(szName, sizeof(szName), "/%016llx", (unsigned long long)ullSegmentNo);
+#endif
+		return strDirectory + szName + JOURNAL_SEGMENT_EXT;
+	}
+
+	//	"<16 hex digits>.djs"
+	bool ParseSegmentName(LPCTSTR pszName, OUT uint64_t & ullSegmentNo)
+	{
+#ifdef _WIN32
+		TCHAR * pEnd = nullptr;
+		ullSegmentNo = _tcstoui64(pszName, &pEnd, 16);
+		return pEnd == pszName + 16 && _tcsicmp(pEnd, JOURNAL_SEGMENT_EXT) == 0;
+#else
+		char * pEnd = nullptr;
+		ullSegmentNo = strtoull(pszName, &pEnd, 16);
+		return pEnd == pszName + 16 && strcmp(pEnd, JOURNAL_SEGMENT_EXT) == 0;
+#endif
+	}
+
+	//	the segment numbers of the files in strDirectory, in order
+	std::vector<uint64_t> ListSegmentNos(const CString& strDirectory)
+	{
+		std::vector<uint64_t> segmentNos;
+		uint64_t ullSegmentNo;
+
+#ifdef _WIN32
+		WIN32_FIND_DATA fd;
+		HANDLE hFind = FindFirstFile(strDirectory + _T("\\*") JOURNAL_SEGMENT_EXT, &fd);
+		if (hFind != INVALID_HANDLE_VALUE)
+		{
+			do
+			{
+				if (ParseSegmentName(fd.cFileName, ullSegmentNo))
+				{
+					segmentNos.push_back(ullSegmentNo);
+				}
+			} while (FindNextFile(hFind, &fd));
+			FindClose(hFind);
+		}
+#else
+		DIR * pDir = opendir(strDirectory);
+		if (pDir != nullptr)
+		{
+			while (auto pEntry = readdir(pDir))
+			{
+				if (ParseSegmentName(pEntry->d_name, ullSegmentNo))
+				{
+					segmentNos.push_back(ullSegmentNo);
+				}
+			}
+			closedir(pDir);
+		}
+#endif
+
+		std::sort(segmentNos.begin(), segmentNos.end());
+		return segmentNos;
+	}
+
+	//	pHeader is the record at nOffset if there's a valid one there, that starts w/ ullExpectedSequence.
+	//	Otherwise that's the end of the records: nothing's been appended there yet, or it's been torn by
+	//	a crash, or it's what's left of an earlier one.
+	bool ReadRecordHeader(const BYTE * pData, size_t nSize, size_t nOffset, uint64_t ullExpectedSequence, OUT CRecordHeader & header)
+	{
+		if (nOffset + sizeof(CRecordHeader) > nSize)
+		{
+			return false;
+		}
+
+		memcpy(&header.dwLength, pData + nOffset, sizeof(header.dwLength));
+		std::atomic_thread_fence(std::memory_order_acquire);	//the length is written last
+		memcpy(&header, pData + nOffset, sizeof(header));
+
+		if (header.dwLength < sizeof(CRecordHeader)
+			|| header.dwLength % RECORD_ALIGNMENT != 0
+			|| header.dwLength > nSize - nOffset
+			|| header.ullFirstSequence != ullExpectedSequence
+			|| header.dwEventCount == 0)
+		{
+			return false;
+		}
+		return Checksum(pData + nOffset + 8, header.dwLength - 8) == header.dwChecksum;
+	}
+
+	CString DecodeName(const char * p, size_t n)
+	{
+#if defined(_WIN32) && defined(_UNICODE)
+		CString str;
+		int nChars = MultiByteToWideChar(CP_UTF8, 0, p, (int)n, nullptr, 0);
+		if (nChars > 0)
+		{
+			MultiByteToWideChar(CP_UTF8, 0, p, (int)n, str.GetBuffer(nChars), nChars);
+			str.ReleaseBuffer(nChars);
+		}
+		return str;
+#else
+		return CString(p, (int)n);
+#endif
+	}
+}
+
+
+//
+//	One segment file, mapped (read only for a reader).
+//
+class CJournalSegment
+{
+public:
+	~CJournalSegment();
+
+	//	preallocated to nSize, zeros but for the header
+	static std::shared_ptr<CJournalSegment>	Create(const CString& strPath, size_t nSize, uint64_t ullSegmentNo, OUT DWORD & dwError);
+	static std::shared_ptr<CJournalSegment>	Open(const CString& strPath, bool bWrite, OUT DWORD & dwError);
+
+	BYTE *	GetData() const { return _pView; }
+	size_t	GetSize() const { return _nSize; }
+	CSegmentHeader *	GetHeader() const { return (CSegmentHeader *)_pView; }
+
+	//	writes [nOffset, nOffset + nLength) through to the disk
+	bool	Sync(size_t nOffset, size_t nLength);
+
+private:
+	CJournalSegment();
+	DWORD	_Map(bool bWrite);
+
+private:
+#ifdef _WIN32
+	HANDLE	_hFile;
+	HANDLE	_hMapping;
+#else
+	int		_fd;
+#endif
+	BYTE *	_pView;
+	size_t	_nSize;
+};
+
+CJournalSegment::CJournalSegment()
+#ifdef _WIN32
+	: _hFile(INVALID_HANDLE_VALUE)
+	, _hMapping(nullptr)
+#else
+	: _fd(-1)
+#endif
+	, _pView(nullptr)
+	, _nSize(0)
+{
+}
+
+CJournalSegment::~CJournalSegment()
+{
+#ifdef _WIN32
+	if (_pView != nullptr)
+	{
+		UnmapViewOfFile(_pView);
+	}
+	if (_hMapping != nullptr)
+	{
+		CloseHandle(_hMapping);
+	}
+	if (_hFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(_hFile);
+	}
+#else
+	if (_pView != nullptr)
+	{
+		munmap(_pView, _nSize);
+	}
+	if (_fd != -1)
+	{
+		close(_fd);
+	}
+#endif
+}
+
+DWORD CJournalSegment::_Map(bool bWrite)
+{
+#ifdef _WIN32
+	_hMapping = CreateFileMapping(_hFile, nullptr, bWrite ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+	if (_hMapping == nullptr)
+	{
+		return GetLastError();
+	}
+	_pView = (BYTE *)MapViewOfFile(_hMapping, bWrite ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, _nSize);
+	if (_pView == nullptr)
+	{
+		return GetLastError();
+	}
+#else
+	void * pView = mmap(nullptr, _nSize, bWrite ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, _fd, 0);
+	if (pView == MAP_FAILED)
+	{
+		return errno;
+	}
+	_pView = (BYTE *)pView;
+#endif
+	return ERROR_SUCCESS;
+}
+
+std::shared_ptr<CJournalSegment> CJournalSegment::Create(const CString& strPath, size_t nSize, uint64_t ullSegmentNo, OUT DWORD & dwError)
+{
+	std::shared_ptr<CJournalSegment> pSegment(new CJournalSegment());
+	pSegment->_nSize = nSize;
+
+#ifdef _WIN32
+	pSegment->_hFile = CreateFile(strPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (pSegment->_hFile == INVALID_HANDLE_VALUE)
+	{
+		dwError = GetLastError();
+		return nullptr;
+	}
+	LARGE_INTEGER liSize;
+	liSize.QuadPart = (LONGLONG)nSize;
+	if (!SetFilePointerEx(pSegment->_hFile, liSize, nullptr, FILE_BEGIN) || !SetEndOfFile(pSegment->_hFile))
+	{
+		dwError = GetLastError();
+		DeleteFile(strPath);
+		return nullptr;
+	}
+#else
+	pSegment->_fd = open(strPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (pSegment->_fd == -1)
+	{
+		dwError = errno;
+		return nullptr;
+	}
+	// the blocks are allocated now, not on a page fault in the middle of an append
+#ifdef __linux__
+	int nError = posix_fallocate(pSegment->_fd, 0, (off_t)nSize);
+#else
+	int nError = ftruncate(pSegment->_fd, (off_t)nSize) == 0 ? 0 : errno;
+#endif
+	if (nError != 0)
+	{
+		dwError = nError;
+		unlink(strPath);
+		return nullptr;
+	}
+#endif
+
+	dwError = pSegment->_Map(true);
+	if (dwError != ERROR_SUCCESS)
+	{
+		return nullptr;
+	}
+
+	auto pHeader = pSegment->GetHeader();
+	pHeader->dwVersion = JOURNAL_VERSION;
+	pHeader->ullSegmentNo = ullSegmentNo;
+	pHeader->ullSize = nSize;
+	pHeader->dwIndexCapacity = (uint32_t)INDEX_CAPACITY;
+	std::atomic_thread_fence(std::memory_order_release);
+	pHeader->dwMagic = JOURNAL_MAGIC;
+	return pSegment;
+}
+
+std::shared_ptr<CJournalSegment> CJournalSegment::Open(const CString& strPath, bool bWrite, OUT DWORD & dwError)
+{
+	std::shared_ptr<CJournalSegment> pSegment(new CJournalSegment());
+
+#ifdef _WIN32
+	pSegment->_hFile = CreateFile(strPath, bWrite ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (pSegment->_hFile == INVALID_HANDLE_VALUE)
+	{
+		dwError = GetLastError();
+		return nullptr;
+	}
+	LARGE_INTEGER liSize;
+	if (!GetFileSizeEx(pSegment->_hFile, &liSize))
+	{
+		dwError = GetLastError();
+		return nullptr;
+	}
+	pSegment->_nSize = (size_t)liSize.QuadPart;
+#else
+	pSegment->_fd = open(strPath, (bWrite ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	struct stat st;
+	if (pSegment->_fd == -1 || fstat(pSegment->_fd, &st) != 0)
+	{
+		dwError = errno;
+		return nullptr;
+	}
+	pSegment->_nSize = (size_t)st.st_size;
+#endif
+
+	if (pSegment->_nSize < SEGMENT_HEADER_SIZE)
+	{
+		dwError = ERROR_INVALID_DATA;
+		return nullptr;
+	}
+	dwError = pSegment->_Map(bWrite);
+	if (dwError != ERROR_SUCCESS)
+	{
+		return nullptr;
+	}
+
+	auto pHeader = pSegment->GetHeader();
+	if (pHeader->dwMagic != JOURNAL_MAGIC || pHeader->dwVersion != JOURNAL_VERSION
+		|| pHeader->ullSize != pSegment->_nSize || pHeader->dwIndexCapacity != INDEX_CAPACITY)
+	{
+		dwError = ERROR_INVALID_DATA;
+		return nullptr;
+	}
+	return pSegment;
+}
+
+bool CJournalSegment::Sync(size_t nOffset, size_t nLength)
+{
+#ifdef _WIN32
+	return FlushViewOfFile(_pView + nOffset, nLength) && FlushFileBuffers(_hFile);
+#else
+	static const size_t nPageSize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t nStart = nOffset & ~(nPageSize - 1);
+	return msync(_pView + nStart, nOffset + nLength - nStart, MS_SYNC) == 0;
+#endif
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////
+//	CChangeJournal
+
+CChangeJournal::CChangeJournal()
+	: _nSegmentSize(SEGMENT_SIZE_DEFAULT)
+	, _dwSyncIntervalMs(SYNC_INTERVAL_MS_DEFAULT)
+	, _nMaxSegments(0)
+	, _nWriteOffset(0)
+	, _nNextIndexOffset(0)
+	, _nIndexInterval(0)
+	, _ullNextSequence(1)
+	, _ullLastTimestamp(0)
+	, _ullNextSegmentNo(1)
+	, _bOpen(false)
+	, _bFailed(false)
+	, _nSyncedOffset(0)
+	, _ullDurableSequence(0)
+	, _bSyncRequested(false)
+	, _bStop(false)
+{
+	_stats = CStats{ 0ULL, 0ULL, 0ULL, 0, 0 };
+}
+
+CChangeJournal::~CChangeJournal()
+{
+	Close();
+}
+
+DWORD CChangeJournal::Open(const CString& strDirectory, size_t nSegmentSize, DWORD dwSyncIntervalMs, size_t nMaxSegments)
+{
+	Close();
+
+	if (strDirectory.IsEmpty())
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	_strDirectory = strDirectory;
+	_strDirectory.TrimRight(_T('/'));
+#ifdef _WIN32
+	_strDirectory.TrimRight(_T('\\'));
+#endif
+#ifdef _WIN32
+	if (!CreateDirectory(_strDirectory, nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+	{
+		DWORD dwError = GetLastError();
+#else
+	if (mkdir(_strDirectory, 0755) != 0 && errno != EEXIST)
+	{
+		DWORD dwError = errno;
+#endif
+		LOGF(FATAL, _T("CChangeJournal::Open() -- unable to create %s: %u\n"), (LPCTSTR)_strDirectory, dwError);
+		return dwError;
+	}
+
+	// whole header areas, so that the records are page aligned in the mapping
+	_nSegmentSize = (std::max)(nSegmentSize, (size_t)SEGMENT_SIZE_MIN);
+	_nSegmentSize = (_nSegmentSize + SEGMENT_HEADER_SIZE - 1) & ~(SEGMENT_HEADER_SIZE - 1);
+	_nIndexInterval = (_nSegmentSize - SEGMENT_HEADER_SIZE) / INDEX_CAPACITY;
+	_dwSyncIntervalMs = (std::max)(dwSyncIntervalMs, (DWORD)1);
+	_nMaxSegments = nMaxSegments;
+
+	std::lock_guard<std::mutex> lock(_mut);
+
+	DWORD dwError = _Recover();
+	if (dwError != ERROR_SUCCESS)
+	{
+		_pSegment.reset();
+		_pSpareSegment.reset();
+		_segmentNos.clear();
+		return dwError;
+	}
+
+	_bOpen = true;
+	_bFailed = false;
+	_bStop = false;
+	_bSyncRequested = true;	//the sync thread prepares the spare segment right away
+	_heldBack.clear();
+	_stats = CStats{ 0ULL, 0ULL, 0ULL, 0, 0 };
+	_ullDurableSequence = _ullNextSequence - 1;	//whatever's been recovered is on disk
+	_pSyncedSegment = _pSegment;
+	_nSyncedOffset = _nWriteOffset;
+
+	try
+	{
+		_syncThread = std::thread(_SyncThreadProc, this);
+	}
+	catch (const std::system_error& e)
+	{
+		LOGF(FATAL, _T("CChangeJournal::Open() -- unable to start the sync thread: %d\n"), e.code().value());
+		_bOpen = false;
+		_pSegment.reset();
+		_pSyncedSegment.reset();
+		_pSpareSegment.reset();
+		_segmentNos.clear();
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	return ERROR_SUCCESS;
+}
+
+//
+//	Picks up where the journal was left: the last segment that's been started, at the end of its valid records.
+//	_mut is locked.
+//
+DWORD CChangeJournal::_Recover()
+{
+	auto segmentNos = ListSegmentNos(_strDirectory);
+	_segmentNos.assign(segmentNos.begin(), segmentNos.end());
+	_ullNextSegmentNo = segmentNos.empty() ? 1 : segmentNos.back() + 1;
+	_ullNextSequence = 1;
+	_ullLastTimestamp = 0;
+	_pSegment.reset();
+	_pSpareSegment.reset();
+	_sealedSegments.clear();
+
+	for (size_t i = segmentNos.size(); i-- > 0; )
+	{
+		DWORD dwError;
+		auto pSegment = CJournalSegment::Open(SegmentPath(_strDirectory, segmentNos[i]), true, dwError);
+		if (pSegment == nullptr)
+		{
+			LOGF(WARNING, _T("CChangeJournal::Open() -- segment %llx isn't readable (%u), it's left as it is\n"),
+				(unsigned long long)segmentNos[i], dwError);
+			continue;
+		}
+
+		auto pHeader = pSegment->GetHeader();
+		if (pHeader->ullFirstSequence == 0)
+		{
+			// preallocated, and not started before the journal was closed
+			if (_pSpareSegment == nullptr && pSegment->GetSize() == _nSegmentSize)
+			{
+				_pSpareSegment = pSegment;
+			}
+			continue;
+		}
+
+		// the end of its records
+		auto pData = pSegment->GetData();
+		size_t nOffset = SEGMENT_HEADER_SIZE;
+		uint64_t ullSequence = pHeader->ullFirstSequence;
+		uint64_t ullTimestamp = pHeader->ullFirstTimestamp;
+		CRecordHeader record;
+		while (ReadRecordHeader(pData, pSegment->GetSize(), nOffset, ullSequence, record))
+		{
+			ullSequence += record.dwEventCount;
+			ullTimestamp = record.ullTimestamp;
+			nOffset += record.dwLength;
+		}
+
+		// what's left of a torn record (and what was appended after it, if it was written out of order)
+		// mustn't be taken for a record once it's been partly overwritten.  It ends where there's a page
+		// of zeros: there isn't one in a record, the names have no NULs.
+		size_t nZeros = 0;
+		for (size_t n = nOffset; n + sizeof(uint64_t) <= pSegment->GetSize() && nZeros < 4096; n += sizeof(uint64_t))
+		{
+			uint64_t w;
+			memcpy(&w, pData + n, sizeof(w));
+			if (w != 0)
+			{
+				memset(pData + n, 0, sizeof(w));
+				nZeros = 0;
+			}
+			else
+			{
+				nZeros += sizeof(w);
+			}
+		}
+
+		uint32_t dwIndexCount = (std::min)(pHeader->dwIndexCount, pHeader->dwIndexCapacity);
+		while (dwIndexCount > 0 && pHeader->index[dwIndexCount - 1].ullOffset >= nOffset)
+		{
+			--dwIndexCount;
+		}
+		pHeader->dwIndexCount = dwIndexCount;
+
+		_pSegment = pSegment;
+		_nWriteOffset = nOffset;
+		_nNextIndexOffset = dwIndexCount > 0 ? (size_t)pHeader->index[dwIndexCount - 1].ullOffset + _nIndexInterval : SEGMENT_HEADER_SIZE;
+		_ullNextSequence = ullSequence;
+		_ullLastTimestamp = ullTimestamp;
+		return ERROR_SUCCESS;
+	}
+
+	// a new journal (or one w/o any records)
+	auto pSegment = std::move(_pSpareSegment);
+	if (pSegment == nullptr)
+	{
+		uint64_t ullSegmentNo = _ullNextSegmentNo++;
+		pSegment = _CreateSegment(ullSegmentNo);
+		if (pSegment == nullptr)
+		{
+			return ERROR_CANNOT_MAKE;
+		}
+		_segmentNos.push_back(ullSegmentNo);
+	}
+	_StartSegment(std::move(pSegment));
+	return ERROR_SUCCESS;
+}
+
+std::shared_ptr<CJournalSegment> CChangeJournal::_CreateSegment(uint64_t ullSegmentNo) const
+{
+	DWORD dwError;
+	auto strPath = SegmentPath(_strDirectory, ullSegmentNo);
+	auto pSegment = CJournalSegment::Create(strPath, _nSegmentSize, ullSegmentNo, dwError);
+	if (pSegment == nullptr)
+	{
+		LOGF(FATAL, _T("CChangeJournal -- unable to create %s: %u\n"), (LPCTSTR)strPath, dwError);
+	}
+	return pSegment;
+}
+
+//	_mut is locked
+void CChangeJournal::_StartSegment(std::shared_ptr<CJournalSegment> pSegment)
+{
+	_ullLastTimestamp = (std::max)(_ullLastTimestamp, NowMicroseconds());
+
+	auto pHeader = pSegment->GetHeader();
+	pHeader->ullFirstTimestamp = _ullLastTimestamp;
+	std::atomic_thread_fence(std::memory_order_release);
+	pHeader->ullFirstSequence = _ullNextSequence;	//a reader takes it as started from here on
+
+	_pSegment = std::move(pSegment);
+	_nWriteOffset = SEGMENT_HEADER_SIZE;
+	_nNextIndexOffset = SEGMENT_HEADER_SIZE;
+}
+
+//
+//	The current segment is full: on to the spare one, and the sync thread's woken up to sync
+//	the full one and to prepare the next one.  _mut is locked, _pSpareSegment is there.
+//
+void CChangeJournal::_RollOver()
+{
+	_sealedSegments.push_back(std::move(_pSegment));
+	_StartSegment(std::move(_pSpareSegment));
+	_cvSync.notify_one();
+}
+
+//	_mut is locked
+bool CChangeJournal::_AppendEvents(const char * pPayload, const std::vector<size_t>& eventEnds, size_t& nFirst, size_t& nStart)
+{
+	while (nFirst < eventEnds.size())
+	{
+		size_t nRoom = _pSegment->GetSize() - _nWriteOffset;
+
+		// as many events as there's room for, all of them normally
+		size_t nEnd = eventEnds.size();
+		if (AlignRecord(sizeof(CRecordHeader) + eventEnds.back() - nStart) > nRoom)
+		{
+			nEnd = nFirst;
+			while (nEnd < eventEnds.size() && AlignRecord(sizeof(CRecordHeader) + eventEnds[nEnd] - nStart) <= nRoom)
+			{
+				++nEnd;
+			}
+		}
+
+		if (nEnd == nFirst)
+		{
+			if (_nWriteOffset == SEGMENT_HEADER_SIZE)
+			{
+				// doesn't fit in an empty segment either
+				LOGF(WARNING, _T("CChangeJournal::Append() -- an event is too large for a segment, it's left out\n"));
+				nStart = eventEnds[nFirst++];
+				continue;
+			}
+			if (_pSpareSegment == nullptr)
+			{
+				return false;
+			}
+			_RollOver();
+			continue;
+		}
+
+		_AppendRecord(pPayload + nStart, eventEnds[nEnd - 1] - nStart, (uint32_t)(nEnd - nFirst));
+		nFirst = nEnd;
+		nStart = eventEnds[nEnd - 1];
+	}
+	return true;
+}
+
+//	_mut is locked, there's room for the record
+void CChangeJournal::_AppendRecord(const char * pPayload, size_t nPayloadSize, uint32_t dwEventCount)
+{
+	auto pData = _pSegment->GetData();
+	auto pRecord = pData + _nWriteOffset;
+	size_t nLength = AlignRecord(sizeof(CRecordHeader) + nPayloadSize);
+
+	_ullLastTimestamp = (std::max)(_ullLastTimestamp, NowMicroseconds());
+
+	CRecordHeader header;
+	header.dwLength = 0;
+	header.dwChecksum = 0;
+	header.ullFirstSequence = _ullNextSequence;
+	header.ullTimestamp = _ullLastTimestamp;
+	header.dwEventCount = dwEventCount;
+	header.dwReserved = 0;
+	memcpy(pRecord + sizeof(CRecordHeader), pPayload, nPayloadSize);
+	memset(pRecord + sizeof(CRecordHeader) + nPayloadSize, 0, nLength - sizeof(CRecordHeader) - nPayloadSize);
+	memcpy(pRecord + 8, (const BYTE *)&header + 8, sizeof(CRecordHeader) - 8);
+	header.dwChecksum = Checksum(pRecord + 8, nLength - 8);
+	memcpy(pRecord + 4, &header.dwChecksum, sizeof(header.dwChecksum));
+
+	// the length last, a reader (or the recovery) doesn't see a partial record
+	uint32_t dwLength = (uint32_t)nLength;
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(pRecord, &dwLength, sizeof(dwLength));
+
+	auto pHeader = _pSegment->GetHeader();
+	if (_nWriteOffset >= _nNextIndexOffset && pHeader->dwIndexCount < pHeader->dwIndexCapacity)
+	{
+		auto & entry = pHeader->index[pHeader->dwIndexCount];
+		entry.ullSequence = _ullNextSequence;
+		entry.ullTimestamp = _ullLastTimestamp;
+		entry.ullOffset = _nWriteOffset;
+		std::atomic_thread_fence(std::memory_order_release);
+		pHeader->dwIndexCount++;
+		_nNextIndexOffset = _nWriteOffset + _nIndexInterval;
+	}
+
+	_nWriteOffset += nLength;
+	_ullNextSequence += dwEventCount;
+}
+
+BOOL CChangeJournal::Append(const std::vector<CDirChangeEvent>& events)
+{
+	if (events.empty())
+	{
+		return TRUE;
+	}
+
+	// encoded before the lock's taken, in a buffer that's kept by the (watcher's) thread
+	static thread_local std::string t_strPayload;
+	static thread_local std::vector<size_t> t_eventEnds;
+	auto & strPayload = t_strPayload;
+	auto & eventEnds = t_eventEnds;
+	strPayload.clear();
+	eventEnds.clear();
+
+	for (const auto & event : events)
+	{
+		CEventHeader eventHeader;
+		eventHeader.dwAction = event.dwAction;
+		size_t nHeaderPos = strPayload.size();
+		strPayload.append(sizeof(eventHeader), '\0');
+
+		size_t nStart = strPayload.size();
+		CUtf8Transcoder::AppendName(event.strFileName.GetString(), event.strFileName.GetLength(), strPayload);
+		if (strPayload.size() - nStart > 0xFFFF)
+		{
+			strPayload.resize(nStart + 0xFFFF);
+		}
+		eventHeader.wNameLength = (uint16_t)(strPayload.size() - nStart);
+
+		nStart = strPayload.size();
+		CUtf8Transcoder::AppendName(event.strNewFileName.GetString(), event.strNewFileName.GetLength(), strPayload);
+		if (strPayload.size() - nStart > 0xFFFF)
+		{
+			strPayload.resize(nStart + 0xFFFF);
+		}
+		eventHeader.wNewNameLength = (uint16_t)(strPayload.size() - nStart);
+
+		memcpy(&strPayload[nHeaderPos], &eventHeader, sizeof(eventHeader));
+		eventEnds.push_back(strPayload.size());
+	}
+
+	std::lock_guard<std::mutex> lock(_mut);
+	if (!_bOpen || _bFailed)
+	{
+		return FALSE;
+	}
+
+	// after the ones that are held back already, if any
+	size_t nFirst = 0;
+	size_t nStart = 0;
+	if (_heldBack.empty()
+		&& _AppendEvents(strPayload.data(), eventEnds, nFirst, nStart))
+	{
+		++_stats.ullBatches;
+		return TRUE;
+	}
+
+	// the next segment isn't ready yet, the sync thread appends the rest once it is.
+	// no more than a segment's worth, that's what it can catch up w/ in one go.
+	size_t nBytes = eventEnds.back() - nStart;
+	if (_stats.nHeldBackBytes + nBytes > _nSegmentSize)
+	{
+		++_stats.ullRefusedBatches;
+		return FALSE;
+	}
+	CHeldBackBatch batch;
+	batch.strPayload = strPayload;
+	batch.eventEnds = eventEnds;
+	batch.nFirst = nFirst;
+	batch.nStart = nStart;
+	_heldBack.push_back(std::move(batch));
+	_stats.nHeldBackBytes += nBytes;
+	_stats.nHeldBackBytesPeak = (std::max)(_stats.nHeldBackBytesPeak, _stats.nHeldBackBytes);
+	++_stats.ullHeldBackBatches;
+	++_stats.ullBatches;
+	_cvSync.notify_one();
+	return TRUE;
+}
+
+BOOL CChangeJournal::Flush()
+{
+	std::unique_lock<std::mutex> lock(_mut);
+	if (!_bOpen)
+	{
+		return FALSE;
+	}
+
+	// w/ the batches that are held back
+	_cvDurable.wait(lock, [this] { return _heldBack.empty() || _bFailed || !_bOpen; });
+	uint64_t ullTarget = _ullNextSequence - 1;
+	_bSyncRequested = true;
+	_cvSync.notify_one();
+	_cvDurable.wait(lock, [this, ullTarget] { return _ullDurableSequence >= ullTarget || _bFailed || !_bOpen; });
+	return _ullDurableSequence >= ullTarget;
+}
+
+CChangeJournal::CStats CChangeJournal::GetStats() const
+{
+	std::lock_guard<std::mutex> lock(_mut);
+	return _stats;
+}
+
+uint64_t CChangeJournal::GetLastSequence() const
+{
+	std::lock_guard<std::mutex> lock(_mut);
+	return _ullNextSequence - 1;
+}
+
+uint64_t CChangeJournal::GetDurableSequence() const
+{
+	std::lock_guard<std::mutex> lock(_mut);
+	return _ullDurableSequence;
+}
+
+void CChangeJournal::Close()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		if (!_bOpen)
+		{
+			return;
+		}
+		// nothing's appended from here on, the sync thread syncs what has been on its way out
+		_bOpen = false;
+		_bStop = true;
+		_cvSync.notify_one();
+		_cvDurable.notify_all();
+	}
+
+	if (_syncThread.joinable())
+	{
+		_syncThread.join();
+	}
+
+	std::lock_guard<std::mutex> lock(_mut);
+	_pSegment.reset();
+	_pSpareSegment.reset();	//stays on disk, it's the next segment when the journal's opened again
+	_pSyncedSegment.reset();
+	_sealedSegments.clear();
+	_segmentNos.clear();
+	_heldBack.clear();
+}
+
+//
+//	the oldest segments beyond _nMaxSegments (the spare one isn't counted).  _mut is locked.
+//
+std::vector<uint64_t> CChangeJournal::_TakeOldSegments()
+{
+	std::vector<uint64_t> oldSegmentNos;
+	if (_nMaxSegments == 0 || _pSegment == nullptr)
+	{
+		return oldSegmentNos;
+	}
+
+	size_t nMax = _nMaxSegments + (_pSpareSegment != nullptr ? 1 : 0);
+	uint64_t ullCurrentNo = _pSegment->GetHeader()->ullSegmentNo;
+	while (_segmentNos.size() > nMax && _segmentNos.front() < ullCurrentNo)
+	{
+		oldSegmentNos.push_back(_segmentNos.front());
+		_segmentNos.pop_front();
+	}
+	return oldSegmentNos;
+}
+
+//
+//	Group commit: every _dwSyncIntervalMs, or when it's asked to, whatever has been appended meanwhile
+//	is synced in one go, then the appenders waiting in Flush() are let go.  The appenders aren't held
+//	up meanwhile, the lock's only held to take the state and to publish what's done: the segments
+//	are created, synced, deleted and unmapped w/o it.
+//
+//	The spare segment comes first, a segment that's filled up has to be replaced before anything else.
+//	The batches that were held back for it are appended then, one at a time.
+//
+UINT CChangeJournal::_SyncThreadProc(LPVOID lpThis)
+{
+	auto pThis = (CChangeJournal *)lpThis;
+
+	std::unique_lock<std::mutex> lock(pThis->_mut);
+	for (;;)
+	{
+		pThis->_cvSync.wait_for(lock, std::chrono::milliseconds(pThis->_dwSyncIntervalMs),
+			[pThis] { return pThis->_bStop || pThis->_bSyncRequested || !pThis->_sealedSegments.empty() || !pThis->_heldBack.empty(); });
+
+		bool bStop = pThis->_bStop;
+		pThis->_bSyncRequested = false;
+
+		// the spare one, also on the way out if there are batches held back for it
+		if (pThis->_pSpareSegment == nullptr && !pThis->_bFailed
+			&& (!bStop || !pThis->_heldBack.empty()))
+		{
+			uint64_t ullSpareNo = pThis->_ullNextSegmentNo++;
+			lock.unlock();
+			auto pSpare = pThis->_CreateSegment(ullSpareNo);
+			lock.lock();
+
+			if (pSpare != nullptr)
+			{
+				pThis->_pSpareSegment = std::move(pSpare);
+				pThis->_segmentNos.push_back(ullSpareNo);
+			}
+			else if (!pThis->_heldBack.empty())
+			{
+				// there's nowhere to put them
+				pThis->_bFailed = true;
+				pThis->_heldBack.clear();
+				pThis->_stats.nHeldBackBytes = 0;
+				pThis->_cvDurable.notify_all();
+			}
+		}
+
+		// in order, w/ the appenders let in between them (theirs go after these meanwhile)
+		while (!pThis->_heldBack.empty() && !pThis->_bFailed)
+		{
+			auto & batch = pThis->_heldBack.front();
+			size_t nBytes = batch.eventEnds.back() - batch.nStart;
+			if (!pThis->_AppendEvents(batch.strPayload.data(), batch.eventEnds, batch.nFirst, batch.nStart))
+			{
+				// filled up another segment, a spare one's created first
+				pThis->_stats.nHeldBackBytes -= nBytes - (batch.eventEnds.back() - batch.nStart);
+				break;
+			}
+			pThis->_stats.nHeldBackBytes -= nBytes;
+			pThis->_heldBack.pop_front();
+			if (pThis->_heldBack.empty())
+			{
+				pThis->_cvDurable.notify_all();
+				break;
+			}
+			lock.unlock();
+			lock.lock();
+		}
+
+		// one full segment at a time, the spare one's looked at again in between.
+		// the current one's synced (and the changes are durable) once there's none left.
+		std::shared_ptr<CJournalSegment> pSealed;
+		if (!pThis->_sealedSegments.empty())
+		{
+			pSealed = std::move(pThis->_sealedSegments.front());
+			pThis->_sealedSegments.erase(pThis->_sealedSegments.begin());
+		}
+		bool bLastSealed = pThis->_sealedSegments.empty();
+		std::shared_ptr<CJournalSegment> pSegment;
+		size_t nFrom = 0;
+		size_t nTo = 0;
+		uint64_t ullTarget = 0;
+		if (bLastSealed)
+		{
+			pSegment = pThis->_pSegment;
+			nFrom = (pSegment == pThis->_pSyncedSegment) ? pThis->_nSyncedOffset : SEGMENT_HEADER_SIZE;
+			nTo = pThis->_nWriteOffset;
+			ullTarget = pThis->_ullNextSequence - 1;
+		}
+
+		lock.unlock();
+
+		bool bSynced = true;
+		if (pSealed != nullptr)
+		{
+			bSynced = pSealed->Sync(0, pSealed->GetSize());
+		}
+		if (pSegment != nullptr && nTo > nFrom)
+		{
+			// w/ the header, its index may have moved on
+			bSynced = pSegment->Sync(nFrom, nTo - nFrom) && pSegment->Sync(0, SEGMENT_HEADER_SIZE) && bSynced;
+		}
+
+		lock.lock();
+
+		std::shared_ptr<CJournalSegment> pPreviousSynced;
+		if (!bSynced)
+		{
+			LOGF(FATAL, _T("CChangeJournal -- unable to sync the journal: %d\n"), (int)GetLastError());
+			pThis->_bFailed = true;
+		}
+		else if (bLastSealed)
+		{
+			pPreviousSynced = std::move(pThis->_pSyncedSegment);
+			pThis->_pSyncedSegment = pSegment;
+			pThis->_nSyncedOffset = nTo;
+			pThis->_ullDurableSequence = (std::max)(pThis->_ullDurableSequence, ullTarget);
+		}
+		pThis->_cvDurable.notify_all();
+
+		auto oldSegmentNos = pThis->_TakeOldSegments();
+
+		// the segments that are let go of here are unmapped w/o the lock
+		lock.unlock();
+		pSealed.reset();
+		pSegment.reset();
+		pPreviousSynced.reset();
+
+		for (size_t i = 0; i < oldSegmentNos.size(); ++i)
+		{
+			auto strPath = SegmentPath(pThis->_strDirectory, oldSegmentNos[i]);
+#ifdef _WIN32
+			if (!DeleteFile(strPath) && GetLastError() != ERROR_FILE_NOT_FOUND)
+			{
+				DWORD dwError = GetLastError();
+#else
+			if (unlink(strPath) != 0 && errno != ENOENT)
+			{
+				DWORD dwError = errno;
+#endif
+				// eg: mapped by a reader on Windows, it's tried again next time
+				LOGF(WARNING, _T("CChangeJournal -- unable to delete %s: %u\n"), (LPCTSTR)strPath, dwError);
+				std::lock_guard<std::mutex> relock(pThis->_mut);
+				pThis->_segmentNos.insert(pThis->_segmentNos.begin(), oldSegmentNos.begin() + i, oldSegmentNos.end());
+				break;
+			}
+		}
+		lock.lock();
+
+		if (bStop
+			&& ((pThis->_heldBack.empty() && pThis->_sealedSegments.empty()) || pThis->_bFailed))
+		{
+			break;
+		}
+	}
+	return 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////
+//	CChangeJournalReader
+
+CChangeJournalReader::CChangeJournalReader()
+	: _nSegment(0)
+	, _nOffset(0)
+	, _ullNextSequence(0)
+	, _ullSkipBefore(0)
+{
+}
+
+CChangeJournalReader::~CChangeJournalReader()
+{
+}
+
+DWORD CChangeJournalReader::Open(const CString& strDirectory)
+{
+	_strDirectory = strDirectory;
+	_strDirectory.TrimRight(_T('/'));
+#ifdef _WIN32
+	_strDirectory.TrimRight(_T('\\'));
+#endif
+	_segments.clear();
+	_pSegment.reset();
+	_nSegment = 0;
+	_ullSkipBefore = 0;
+
+#ifdef _WIN32
+	DWORD dwAttributes = GetFileAttributes(_strDirectory);
+	if (dwAttributes == INVALID_FILE_ATTRIBUTES || !(dwAttributes & FILE_ATTRIBUTE_DIRECTORY))
+	{
+		return ERROR_PATH_NOT_FOUND;
+	}
+#else
+	struct stat st;
+	if (stat(_strDirectory, &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		return ERROR_PATH_NOT_FOUND;
+	}
+#endif
+
+	_ListSegments();
+	if (!_segments.empty())
+	{
+		_OpenSegment(0);
+	}
+	return ERROR_SUCCESS;
+}
+
+//
+//	the segments that have been started, by their first sequence numbers.  The current one stays current.
+//
+void CChangeJournalReader::_ListSegments()
+{
+	uint64_t ullCurrentNo = _pSegment != nullptr ? _segments[_nSegment].ullSegmentNo : 0;
+
+	_segments.clear();
+	for (auto ullSegmentNo : ListSegmentNos(_strDirectory))
+	{
+		DWORD dwError;
+		auto pSegment = CJournalSegment::Open(SegmentPath(_strDirectory, ullSegmentNo), false, dwError);
+		if (pSegment == nullptr)
+		{
+			continue;
+		}
+		auto pHeader = pSegment->GetHeader();
+		uint64_t ullFirstSequence = pHeader->ullFirstSequence;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (ullFirstSequence != 0)
+		{
+			CSegmentInfo info = { ullSegmentNo, ullFirstSequence, pHeader->ullFirstTimestamp };
+			_segments.push_back(info);
+		}
+	}
+	std::sort(_segments.begin(), _segments.end(),
+		[](const CSegmentInfo& a, const CSegmentInfo& b) { return a.ullFirstSequence < b.ullFirstSequence; });
+
+	if (_pSegment != nullptr)
+	{
+		auto it = std::find_if(_segments.begin(), _segments.end(),
+			[ullCurrentNo](const CSegmentInfo& info) { return info.ullSegmentNo == ullCurrentNo; });
+		if (it != _segments.end())
+		{
+			_nSegment = it - _segments.begin();
+		}
+		else
+		{
+			// deleted meanwhile, still mapped though: the next one is the oldest that's left
+			_segments.insert(_segments.begin(), CSegmentInfo{ ullCurrentNo, 0, 0 });
+			_nSegment = 0;
+		}
+	}
+}
+
+bool CChangeJournalReader::_OpenSegment(size_t nIdx)
+{
+	DWORD dwError;
+	auto pSegment = CJournalSegment::Open(SegmentPath(_strDirectory, _segments[nIdx].ullSegmentNo), false, dwError);
+	if (pSegment == nullptr)
+	{
+		return false;
+	}
+	_pSegment = std::move(pSegment);
+	_nSegment = nIdx;
+	_nOffset = SEGMENT_HEADER_SIZE;
+	_ullNextSequence = _pSegment->GetHeader()->ullFirstSequence;
+	return true;
+}
+
+BOOL CChangeJournalReader::SeekToSequence(uint64_t ullSequence)
+{
+	return _Seek(true, ullSequence);
+}
+
+BOOL CChangeJournalReader::SeekToTime(uint64_t ullTimestamp)
+{
+	return _Seek(false, ullTimestamp);
+}
+
+//
+//	The last segment that starts at or before the target, the last index entry in it at or before
+//	the target, then the records from there on up to the one w/ the target.
+//
+BOOL CChangeJournalReader::_Seek(bool bBySequence, uint64_t ullTarget)
+{
+	_pSegment.reset();
+	_ullSkipBefore = 0;
+	_ListSegments();
+
+	size_t nIdx = 0;
+	while (nIdx + 1 < _segments.size()
+		&& (bBySequence ? _segments[nIdx + 1].ullFirstSequence <= ullTarget : _segments[nIdx + 1].ullFirstTimestamp < ullTarget))
+	{
+		++nIdx;
+	}
+
+	for (; nIdx < _segments.size(); ++nIdx)
+	{
+		if (!_OpenSegment(nIdx))
+		{
+			continue;
+		}
+
+		auto pHeader = _pSegment->GetHeader();
+		uint32_t dwIndexCount = pHeader->dwIndexCount;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		dwIndexCount = (std::min)(dwIndexCount, pHeader->dwIndexCapacity);
+		// the first entry after the target (for a time: at or after it, the records before it may have the same time)
+		auto itEntry = bBySequence
+			? std::upper_bound(pHeader->index, pHeader->index + dwIndexCount, ullTarget,
+				[](uint64_t ullKey, const CIndexEntry& entry) { return ullKey < entry.ullSequence; })
+			: std::lower_bound(pHeader->index, pHeader->index + dwIndexCount, ullTarget,
+				[](const CIndexEntry& entry, uint64_t ullKey) { return entry.ullTimestamp < ullKey; });
+		if (itEntry != pHeader->index)
+		{
+			--itEntry;
+			_nOffset = (size_t)itEntry->ullOffset;
+			_ullNextSequence = itEntry->ullSequence;
+		}
+
+		CRecordHeader record;
+		while (ReadRecordHeader(_pSegment->GetData(), _pSegment->GetSize(), _nOffset, _ullNextSequence, record))
+		{
+			if (bBySequence ? (record.ullFirstSequence + record.dwEventCount > ullTarget) : (record.ullTimestamp >= ullTarget))
+			{
+				if (bBySequence)
+				{
+					_ullSkipBefore = ullTarget;
+				}
+				return TRUE;
+			}
+			_nOffset += record.dwLength;
+			_ullNextSequence += record.dwEventCount;
+		}
+
+		if (nIdx + 1 == _segments.size())
+		{
+			break;
+		}
+	}
+
+	// at the end of what's there, Next() goes on from here
+	if (bBySequence)
+	{
+		_ullSkipBefore = ullTarget;
+	}
+	return FALSE;
+}
+
+BOOL CChangeJournalReader::Next(OUT CRecord& record)
+{
+	bool bRelisted = false;
+	for (;;)
+	{
+		if (_pSegment == nullptr)
+		{
+			if (_segments.empty())
+			{
+				_ListSegments();
+			}
+			if (_segments.empty() || !_OpenSegment(_nSegment < _segments.size() ? _nSegment : 0))
+			{
+				return FALSE;
+			}
+		}
+
+		CRecordHeader header;
+		auto pData = _pSegment->GetData();
+		if (ReadRecordHeader(pData, _pSegment->GetSize(), _nOffset, _ullNextSequence, header))
+		{
+			record.ullFirstSequence = header.ullFirstSequence;
+			record.ullTimestamp = header.ullTimestamp;
+			record.events.clear();
+			record.events.reserve(header.dwEventCount);
+
+			const BYTE * p = pData + _nOffset + sizeof(CRecordHeader);
+			const BYTE * pEnd = pData + _nOffset + header.dwLength;
+			uint64_t ullSequence = header.ullFirstSequence;
+			for (uint32_t i = 0; i < header.dwEventCount; ++i, ++ullSequence)
+			{
+				CEventHeader eventHeader;
+				if (pEnd - p < (ptrdiff_t)sizeof(eventHeader))
+				{
+					break;
+				}
+				memcpy(&eventHeader, p, sizeof(eventHeader));
+				p += sizeof(eventHeader);
+				if (pEnd - p < (ptrdiff_t)eventHeader.wNameLength + eventHeader.wNewNameLength)
+				{
+					break;
+				}
+				if (ullSequence >= _ullSkipBefore)
+				{
+					CDirChangeEvent event;
+					event.dwAction = eventHeader.dwAction;
+					event.strFileName = DecodeName((const char *)p, eventHeader.wNameLength);
+					event.strNewFileName = DecodeName((const char *)p + eventHeader.wNameLength, eventHeader.wNewNameLength);
+					if (record.events.empty())
+					{
+						record.ullFirstSequence = ullSequence;
+					}
+					record.events.push_back(std::move(event));
+				}
+				p += eventHeader.wNameLength + eventHeader.wNewNameLength;
+			}
+
+			_nOffset += header.dwLength;
+			_ullNextSequence += header.dwEventCount;
+			if (record.events.empty())
+			{
+				continue;	//all of it before SeekToSequence()'s
+			}
+			_ullSkipBefore = 0;
+			return TRUE;
+		}
+
+		// the end of this segment so far.  it's done w/ once a later one has been started,
+		// this one's looked at once more then: its last records may have come in meanwhile
+		if (_nSegment + 1 >= _segments.size())
+		{
+			if (bRelisted)
+			{
+				return FALSE;
+			}
+			_ListSegments();
+			bRelisted = true;
+			continue;
+		}
+
+		if (!_OpenSegment(_nSegment + 1))
+		{
+			// deleted meanwhile, on to the oldest one that's left
+			_pSegment.reset();
+			_segments.clear();
+			_nSegment = 0;
+		}
+		bRelisted = false;
+	}
+}
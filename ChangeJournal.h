@@ -0,0 +1,193 @@
+#pragma once
+#include "DirectoryChangeHandler.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+
+#define JOURNAL_SEGMENT_EXT		_T(".djs")
+
+class CJournalSegment;
+
+//
+//	An append-only, on disk record of the changes that a CDirectoryChangeWatcher has read,
+//	so that a consumer that's crashed (or wasn't running) can replay them w/ a CChangeJournalReader.
+//	See CDirectoryChangeWatcher::SetJournal().
+//
+//	The journal is a directory of segment files ("<segment number, 16 hex digits>.djs"), each one
+//	preallocated to its full size and memory mapped.  A batch of changes (one read of a watched
+//	directory) goes in as one compact record, copied into the mapping under a lock that's held
+//	for just that: the watcher's threads don't write to the file, nor wait for the disk, nor
+//	for the journal's thread.  Should a segment fill up before the next one's been prepared,
+//	the batches are held back in memory until it's there (see GetStats(), up to a segment's worth,
+//	beyond that Append() fails).
+//	Every change gets a sequence number (from 1 on), a record keeps the one of its first change
+//	and the time it was appended (microseconds since 1970, never going backwards in a journal).
+//
+//	The journal's thread makes the records durable in groups: every dwSyncIntervalMs (or right
+//	away for Flush()) whatever has been appended since the last time is synced w/ one
+//	msync()/FlushViewOfFile(), so a crash loses at most that interval.  A record that was torn
+//	by the crash fails its checksum, the journal ends before it and goes on from there when it's
+//	opened again.  The same thread has the next segment preallocated as soon as the current one's
+//	started, before it syncs anything.
+//
+//	A segment starts w/ a header that has a sparse index of its records: every so many bytes,
+//	the sequence number, time and offset of the record there.  A reader finds the segment
+//	from the headers and the record w/ a binary search of the index and a short scan.
+//
+class CChangeJournal
+{
+public:
+	enum {
+		SEGMENT_SIZE_DEFAULT = 64 * 1024 * 1024,
+		SEGMENT_SIZE_MIN = 1024 * 1024,
+		SYNC_INTERVAL_MS_DEFAULT = 20
+	};
+
+	CChangeJournal();
+	~CChangeJournal();//everything that's been appended is synced
+
+	CChangeJournal(const CChangeJournal&) = delete;
+	CChangeJournal& operator=(const CChangeJournal&) = delete;
+
+	//	opens the journal in strDirectory, which is created if need be, and appends after what's there already.
+	//	nMaxSegments: the oldest segments are deleted beyond that many, 0 keeps them all.
+	//	returns ERROR_SUCCESS, or why the journal couldn't be opened.
+	DWORD	Open(const CString& strDirectory, size_t nSegmentSize = SEGMENT_SIZE_DEFAULT,
+		DWORD dwSyncIntervalMs = SYNC_INTERVAL_MS_DEFAULT, size_t nMaxSegments = 0);
+	void	Close();
+
+	//	called by the watcher for each batch it reads, from any of its threads.  Never waits.
+	//	FALSE if the journal isn't open or has failed (eg: the disk is full), or it's held back as much as it
+	//	can already: the batch (or the rest of it) isn't in it then.
+	BOOL	Append(const std::vector<CDirChangeEvent>& events);
+
+	//	waits until everything that's been appended so far is durable
+	BOOL	Flush();
+
+	//	the sequence number of the last change that's been appended/synced, 0 if none
+	uint64_t	GetLastSequence() const;
+	uint64_t	GetDurableSequence() const;
+
+	struct CStats
+	{
+		uint64_t	ullBatches;				//appended
+		uint64_t	ullHeldBackBatches;		//the next segment wasn't ready yet
+		uint64_t	ullRefusedBatches;		//held back as much as it could already, not in the journal
+		size_t		nHeldBackBytes;
+		size_t		nHeldBackBytesPeak;
+	};
+	CStats	GetStats() const;
+
+private:
+	//	a batch (from its event nFirst on) that's waiting for the next segment
+	struct CHeldBackBatch
+	{
+		std::string			strPayload;
+		std::vector<size_t>	eventEnds;
+		size_t				nFirst;
+		size_t				nStart;
+	};
+
+	DWORD	_Recover();
+	void	_StartSegment(std::shared_ptr<CJournalSegment> pSegment);
+	void	_RollOver();
+	//	appends the events [nFirst, eventEnds.size()), which start at pPayload[nStart].  false if the segment's
+	//	full w/o a spare one, nFirst/nStart are where it's got to then.
+	bool	_AppendEvents(const char * pPayload, const std::vector<size_t>& eventEnds, size_t& nFirst, size_t& nStart);
+	void	_AppendRecord(const char * pPayload, size_t nPayloadSize, uint32_t dwEventCount);
+	std::shared_ptr<CJournalSegment>	_CreateSegment(uint64_t ullSegmentNo) const;
+	//	the files of the oldest segments beyond nMaxSegments, to be deleted w/o the lock
+	std::vector<uint64_t>	_TakeOldSegments();
+
+	UINT static	_SyncThreadProc(LPVOID lpThis);
+
+private:
+	CString		_strDirectory;
+	size_t		_nSegmentSize;
+	DWORD		_dwSyncIntervalMs;
+	size_t		_nMaxSegments;
+
+	mutable std::mutex	_mut;	//the appending state below, held for one copy into the mapping
+	std::shared_ptr<CJournalSegment>	_pSegment;	//being appended to
+	size_t		_nWriteOffset;		//in _pSegment, where the next record goes
+	size_t		_nNextIndexOffset;	//the first record at or after this gets an index entry
+	size_t		_nIndexInterval;
+	uint64_t	_ullNextSequence;
+	uint64_t	_ullLastTimestamp;
+	uint64_t	_ullNextSegmentNo;
+	bool		_bOpen;
+	bool		_bFailed;
+	std::deque<CHeldBackBatch>	_heldBack;	//appended by the sync thread once there's a segment for them
+	CStats		_stats;
+
+	//	the sync thread's, w/ _mut locked
+	std::thread	_syncThread;
+	std::condition_variable	_cvSync;	//there's work for the sync thread
+	std::condition_variable	_cvDurable;	//_ullDurableSequence has moved on, or _heldBack's been appended
+	std::shared_ptr<CJournalSegment>	_pSpareSegment;	//preallocated, the next one.  Created by the sync thread only
+	std::vector<std::shared_ptr<CJournalSegment>>	_sealedSegments;	//full, not synced to the end yet
+	std::deque<uint64_t>	_segmentNos;	//on disk, oldest first (nMaxSegments)
+	std::shared_ptr<CJournalSegment>	_pSyncedSegment;	//_nSyncedOffset is in this one
+	size_t		_nSyncedOffset;
+	uint64_t	_ullDurableSequence;
+	bool		_bSyncRequested;
+	bool		_bStop;
+};
+
+
+//
+//	Reads the records of a journal back, in order, eg: to replay what a consumer missed.
+//	The journal may be appended to meanwhile (by this process or another one), Next() returns
+//	FALSE at the end of what's there so far and picks up from there when it's called again.
+//
+class CChangeJournalReader
+{
+public:
+	struct CRecord
+	{
+		uint64_t	ullFirstSequence;	//of events[0]
+		uint64_t	ullTimestamp;		//microseconds since 1970
+		std::vector<CDirChangeEvent>	events;
+	};
+
+	CChangeJournalReader();
+	~CChangeJournalReader();
+
+	//	positioned at the oldest record.  returns ERROR_SUCCESS, or why the journal couldn't be opened.
+	DWORD	Open(const CString& strDirectory);
+
+	//	the next record is the one w/ the change ullSequence (w/o the changes before it in its batch),
+	//	or the first one after it if it's been deleted.  FALSE if the journal doesn't go that far (yet).
+	BOOL	SeekToSequence(uint64_t ullSequence);
+	//	the next record is the first one that was appended at or after ullTimestamp
+	BOOL	SeekToTime(uint64_t ullTimestamp);
+
+	BOOL	Next(OUT CRecord& record);
+
+private:
+	struct CSegmentInfo
+	{
+		uint64_t	ullSegmentNo;
+		uint64_t	ullFirstSequence;
+		uint64_t	ullFirstTimestamp;
+	};
+
+	void	_ListSegments();
+	bool	_OpenSegment(size_t nIdx);
+	BOOL	_Seek(bool bBySequence, uint64_t ullTarget);
+
+private:
+	CString		_strDirectory;
+	std::vector<CSegmentInfo>	_segments;	//oldest first, the ones that have been started
+	size_t		_nSegment;	//_segments[_nSegment] is _pSegment
+	std::shared_ptr<CJournalSegment>	_pSegment;
+	size_t		_nOffset;	//of the next record in _pSegment
+	uint64_t	_ullNextSequence;	//the first one of the next record, anything else isn't one (a stale or torn record)
+	uint64_t	_ullSkipBefore;	//SeekToSequence(): the changes before it are left out of the next record
+};
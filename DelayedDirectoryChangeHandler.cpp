@@ -1,11 +1,64 @@
 #include "stdafx.h"
 #include "DelayedDirectoryChangeHandler.h"
+#include "DelayedNotificationPool.h"
+#include "DelayedNotificationThread.h"
+#include "DelayedNotificationWindow.h"
+#include "Utf8Transcoder.h"
+#include <algorithm>
 
 
 CDelayedDirectoryChangeHandler::CDelayedDirectoryChangeHandler(std::shared_ptr<CDirectoryChangeHandler> pRealHandler, 
-	bool bAppHasGUI, const std::string& strIncludeFilter, const std::string& strExcludeFilter, DWORD dwFilterFlags)
+	bool bAppHasGUI, const std::string& strIncludeFilter, const std::string& strExcludeFilter, DWORD dwFilterFlags,
+	std::shared_ptr<CDelayedNotifier> pNotifier)
+	: _pRealHandler(std::move(pRealHandler))
+	, _bAppHasGUI(bAppHasGUI)
+	, _dwFilterFlags(dwFilterFlags)
+	, _dwPartialPathOffset(0UL)
+	, _evWatchStoppedDispatched(FALSE, TRUE) //NOT SIGNALLED, MANUAL RESET
+	, _notificationPool(MAX_POOLED_NOTIFICATIONS)
+	, _nQueuedHead(0)
+	, _nQueuedEvents(0)
+	, _ullNextSequence(1)
+	, _dwBackpressurePolicy(CDirectoryChangeWatcher::BACKPRESSURE_NONE)
+	, _nMaxQueuedEvents(0)
+	, _bUnblockScheduled(false)
+	, _bReleaseBlockedPosts(false)
 {
-
+	_backpressureStats = CDirectoryChangeWatcher::CBackpressureStats{ 0ULL, 0ULL, 0ULL, 0ULL, 0, 0 };
+
+	if (_pRealHandler != nullptr)
+	{
+		// a handler that's read from, rather than called (CDirChangeStream), brings its own
+		_pDelayNotifier = _pRealHandler->GetDelayedNotifier();
+	}
+
+	if (_pDelayNotifier == nullptr)
+	{
+		// the watcher's (FILTERS_POLLABLE_NOTIFICATIONS)
+		_pDelayNotifier = std::move(pNotifier);
+	}
+
+	if (_pDelayNotifier == nullptr)
+	{
+#ifdef _WIN32
+		if (_bAppHasGUI)
+		{
+			_pDelayNotifier = CDelayedNotificationWindow::Instance();
+		}
+		else
+#endif
+		if (_dwFilterFlags & CDirectoryChangeWatcher::FILTERS_PARALLEL_HANDLERS)
+		{
+			_pDelayNotifier = CDelayedNotificationPool::Instance();
+		}
+		else
+		{
+			// w/o a message pump (and everywhere but Windows) the notifications are dispatched by a worker thread
+			_pDelayNotifier = CDelayedNotificationThread::Instance();
+		}
+	}
+
+	_InitPatterns(strIncludeFilter, strExcludeFilter);
 }
 
 CDelayedDirectoryChangeHandler::~CDelayedDirectoryChangeHandler()
@@ -14,117 +67,807 @@ CDelayedDirectoryChangeHandler::~CDelayedDirectoryChangeHandler()
 
 void CDelayedDirectoryChangeHandler::PostNotification(std::shared_ptr<CDirChangeNotification> pNotification)
 {
-
+	if (_pDelayNotifier == nullptr)
+	{
+		return;
+	}
+
+	if (pNotification->IsControl())
+	{
+		// it goes ahead of the other watches' changes, not of this watch's own:
+		// the ones posted before it are dispatched first, see _DispatchQueuedBefore()
+		{
+			std::lock_guard<std::mutex> lock(_mutQueued);
+			pNotification->m_ullSequence = _ullNextSequence++;
+		}
+		_pDelayNotifier->PostControlNotification(std::move(pNotification));
+		return;
+	}
+
+	_pDelayNotifier->PostNotification(std::move(pNotification));
 }
 
+//
+//	Called by the notifier, in the context of the thread that runs the real handler.
+//
 void CDelayedDirectoryChangeHandler::DispatchNotificationFunction(std::shared_ptr<CDirChangeNotification> pNotification)
 {
+	ASSERT(pNotification != nullptr);
+
+	auto pRealHandler = GetRealChangeHandler();
+	switch (pNotification->m_eFunctionToDispatch)
+	{
+	case CDirChangeNotification::eOn_EventBatch:
+		// from here on the events are left alone by the backpressure policy.
+		// they may have been dropped, or dispatched already ahead of a control notification.
+		if (_Dequeue(pNotification))
+		{
+			_DispatchEventBatch(pRealHandler.get(), pNotification->m_events);
+		}
+		break;
+	case CDirChangeNotification::eOn_SubtreeDirty:
+		if (_Dequeue(pNotification))
+		{
+			_DispatchSubtreeDirty(pRealHandler.get(), pNotification->m_strDirName);
+		}
+		break;
+	case CDirChangeNotification::eOn_ReadDirectoryChangesError:
+		_DispatchQueuedBefore(pNotification->m_ullSequence, pRealHandler.get());
+		if (pRealHandler != nullptr)
+		{
+			pRealHandler->On_ReadDirectoryChangesError(pNotification->m_dwError, pNotification->m_strDirName);
+		}
+		break;
+	case CDirChangeNotification::eOn_WatchStarted:
+		_DispatchQueuedBefore(pNotification->m_ullSequence, pRealHandler.get());
+		if (pRealHandler != nullptr
+			&& !(_dwFilterFlags & CDirectoryChangeWatcher::FILTERS_NO_WATCHSTART_NOTIFICATION))
+		{
+			pRealHandler->On_WatchStarted(pNotification->m_dwError, pNotification->m_strDirName);
+		}
+		break;
+	case CDirChangeNotification::eOn_WatchStopped:
+		try
+		{
+			_DispatchQueuedBefore(pNotification->m_ullSequence, pRealHandler.get());
+			if (pRealHandler != nullptr
+				&& !(_dwFilterFlags & CDirectoryChangeWatcher::FILTERS_NO_WATCHSTOP_NOTIFICATION))
+			{
+				pRealHandler->On_WatchStopped(pNotification->m_strDirName);
+			}
+		}
+		catch (...)
+		{
+			// don't leave WaitForOnWatchStoppedDispatched() hanging
+			_evWatchStoppedDispatched.SetEvent();
+			throw;
+		}
+		_evWatchStoppedDispatched.SetEvent();
+		break;
+	default:
+		LOGF(WARNING, _T("CDelayedDirectoryChangeHandler::DispatchNotificationFunction() -- unknown function! : %d\n"), pNotification->m_eFunctionToDispatch);
+		break;
+	}
+
+	DisposeOfNotification(pNotification);
+}
+
+void CDelayedDirectoryChangeHandler::_DispatchEventBatch(CDirectoryChangeHandler * pRealHandler, std::vector<CDirChangeEvent>& events)
+{
+	if (pRealHandler == nullptr)
+	{
+		return;
+	}
+
+	// the notification is ours until it's disposed of, filter the events in place
+	if ((_dwFilterFlags & CDirectoryChangeWatcher::FILTERS_DONT_USE_ANY_FILTER_TESTS) != CDirectoryChangeWatcher::FILTERS_DONT_USE_ANY_FILTER_TESTS)
+	{
+		events.erase(std::remove_if(events.begin(), events.end(),
+			[this, pRealHandler](const CDirChangeEvent& event) { return !NotifyClientOfFileChanged(pRealHandler, event); }),
+			events.end());
+	}
+
+	if (!events.empty())
+	{
+		pRealHandler->SetChangedDirectoryName(GetChangedDirectoryName());
+		pRealHandler->On_EventBatch(CDirChangeEventBatch(events.data(), events.size()));
+	}
+}
 
+void CDelayedDirectoryChangeHandler::_DispatchSubtreeDirty(CDirectoryChangeHandler * pRealHandler, const CString& strDirName)
+{
+	if (pRealHandler != nullptr)
+	{
+		pRealHandler->SetChangedDirectoryName(GetChangedDirectoryName());
+		pRealHandler->On_SubtreeDirty(strDirName);
+	}
 }
 
-void CDelayedDirectoryChangeHandler::On_FileAdd(const CString& strFileName)
+//
+//	A control notification has overtaken the changes that were posted before it (see PostNotification()),
+//	they're dispatched right away, ahead of it.  Their own notifications are dispatched w/o them later on.
+//
+void CDelayedDirectoryChangeHandler::_DispatchQueuedBefore(uint64_t ullSequence, CDirectoryChangeHandler * pRealHandler)
 {
+	std::vector<std::shared_ptr<CDirChangeNotification>> earlier;
+	{
+		std::lock_guard<std::mutex> lock(_mutQueued);
+		while (_nQueuedHead < _queuedBatches.size()
+			&& _queuedBatches[_nQueuedHead]->m_ullSequence < ullSequence)
+		{
+			_nQueuedEvents -= _queuedBatches[_nQueuedHead]->m_events.size();
+			earlier.push_back(std::move(_queuedBatches[_nQueuedHead]));
+			_PopOldestQueuedBatch();
+		}
+		if (_pQueuedDirtyMarker != nullptr
+			&& _pQueuedDirtyMarker->m_ullSequence < ullSequence)
+		{
+			earlier.push_back(std::move(_pQueuedDirtyMarker));
+			_pQueuedDirtyMarker.reset();
+		}
+		_UnblockIfCaughtUp();
+	}
+
+	if (earlier.empty())
+	{
+		return;
+	}
+
+	std::sort(earlier.begin(), earlier.end(),
+		[](const std::shared_ptr<CDirChangeNotification>& p1, const std::shared_ptr<CDirChangeNotification>& p2) { return p1->m_ullSequence < p2->m_ullSequence; });
+	for (auto & pEarlier : earlier)
+	{
+		if (pEarlier->m_eFunctionToDispatch == CDirChangeNotification::eOn_SubtreeDirty)
+		{
+			_DispatchSubtreeDirty(pRealHandler, pEarlier->m_strDirName);
+		}
+		else
+		{
+			_DispatchEventBatch(pRealHandler, pEarlier->m_events);
+			pEarlier->m_events.clear();
+		}
+	}
+}
 
+void CDelayedDirectoryChangeHandler::On_FileAdd(const CString& strFileName)
+{
+	_PostEvent(FILE_ACTION_ADDED, strFileName);
 }
 
 void CDelayedDirectoryChangeHandler::On_FileRemoved(const CString& strFileName)
 {
-	
+	_PostEvent(FILE_ACTION_REMOVED, strFileName);
 }
 
 void CDelayedDirectoryChangeHandler::On_FileModified(const CString& strFileName)
 {
+	_PostEvent(FILE_ACTION_MODIFIED, strFileName);
+}
 
+void CDelayedDirectoryChangeHandler::On_FileNameChanged(const CString& strFileName, const CString& strNewFileName)
+{
+	_PostEvent(FILE_ACTION_RENAMED_OLD_NAME, strFileName, strNewFileName);
 }
 
-void CDelayedDirectoryChangeHandler::On_FileNameChanged(const CString& strFileName)
+void CDelayedDirectoryChangeHandler::On_ReadDiretoryChangesError(DWORD dwError, const CString& strDirName)
 {
+	auto pNotification = GetNotificationObj();
+	if (pNotification != nullptr)
+	{
+		pNotification->PostOn_ReadDirectoryChangesError(dwError, strDirName);
+	}
+}
 
+void CDelayedDirectoryChangeHandler::On_WatchStarted(DWORD dwError, const CString& strDirName)
+{
+	auto pNotification = GetNotificationObj();
+	if (pNotification != nullptr)
+	{
+		pNotification->PostOn_WatchStarted(dwError, strDirName);
+	}
 }
 
-void CDelayedDirectoryChangeHandler::On_ReadDiretoryChangesError(DWORD dwError, const CString& strDirName)
+void CDelayedDirectoryChangeHandler::On_WatchStopped(const CString& strDirName)
 {
+	_evWatchStoppedDispatched.ResetEvent();
+
+	auto pNotification = GetNotificationObj();
+	if (pNotification != nullptr)
+	{
+		pNotification->PostOn_WatchStopped(strDirName);
+	}
+	else
+	{
+		_evWatchStoppedDispatched.SetEvent();
+	}
+}
 
+void CDelayedDirectoryChangeHandler::PostEventBatch(std::vector<CDirChangeEvent>&& events)
+{
+	if (events.empty())
+	{
+		return;
+	}
+
+	std::shared_ptr<CDirChangeNotification> pNotification;
+	{
+		std::lock_guard<std::mutex> lock(_mutQueued);
+		if (!_blockedBatches.empty())
+		{
+			// behind the ones that are held back already
+			_blockedBatches.push_back(std::move(events));
+		}
+		else if (_nMaxQueuedEvents == 0
+			|| _nQueuedEvents + events.size() <= _nMaxQueuedEvents
+			|| _ApplyBackpressure(events, pNotification))
+		{
+			pNotification = GetNotificationObj();
+			if (pNotification != nullptr)
+			{
+				_nQueuedEvents += events.size();
+				_backpressureStats.nQueuedEventsPeak = (std::max)(_backpressureStats.nQueuedEventsPeak, _nQueuedEvents);
+
+				pNotification->m_ullSequence = _ullNextSequence++;
+				pNotification->SetOn_EventBatch(std::move(events));
+				_queuedBatches.push_back(pNotification);
+			}
+		}
+	}
+
+	// the batch (or the dirty marker that's replaced it) is posted once the lock has been released:
+	// a notifier may dispatch it right away, on this thread (see CDirChangeStream)
+	if (pNotification != nullptr)
+	{
+		pNotification->Post();
+	}
 }
 
-void CDelayedDirectoryChangeHandler::On_WatchStarted(DWORD dwError, const CString& strDirName)
+void CDelayedDirectoryChangeHandler::SetBackpressurePolicy(DWORD dwPolicy, size_t nMaxQueuedEvents)
 {
+	std::lock_guard<std::mutex> lock(_mutQueued);
+	_dwBackpressurePolicy = dwPolicy;
+	_nMaxQueuedEvents = (dwPolicy == CDirectoryChangeWatcher::BACKPRESSURE_NONE) ? 0 : nMaxQueuedEvents;
+	// the limit may have been raised (or lifted)
+	_UnblockIfCaughtUp();
+}
 
+CDirectoryChangeWatcher::CBackpressureStats CDelayedDirectoryChangeHandler::GetBackpressureStats() const
+{
+	std::lock_guard<std::mutex> lock(_mutQueued);
+	auto stats = _backpressureStats;
+	stats.nQueuedEvents = _nQueuedEvents;
+	return stats;
 }
 
-void CDelayedDirectoryChangeHandler::On_WatchStopped(const CString& strDirName)
+bool CDelayedDirectoryChangeHandler::IsPostingBlocked() const
 {
+	std::lock_guard<std::mutex> lock(_mutQueued);
+	return !_blockedBatches.empty();
+}
 
+void CDelayedDirectoryChangeHandler::PostBlockedBatches()
+{
+	std::vector<std::vector<CDirChangeEvent>> blocked;
+	{
+		std::lock_guard<std::mutex> lock(_mutQueued);
+		_bUnblockScheduled = false;
+		blocked.swap(_blockedBatches);
+	}
+
+	// the first one that's over the limit again is held back again, and the rest behind it
+	for (auto & events : blocked)
+	{
+		PostEventBatch(std::move(events));
+	}
 }
 
-void CDelayedDirectoryChangeHandler::SetChangeDirectoryName(const CString& strDirName)
+void CDelayedDirectoryChangeHandler::SetUnblockedCallback(std::function<void()> fnUnblocked)
 {
+	std::lock_guard<std::mutex> lock(_mutQueued);
+	_fnUnblocked = std::move(fnUnblocked);
+}
 
+void CDelayedDirectoryChangeHandler::ReleaseBlockedPosts()
+{
+	std::lock_guard<std::mutex> lock(_mutQueued);
+	_bReleaseBlockedPosts = true;
+	_fnUnblocked = nullptr;
 }
 
-const CString& CDelayedDirectoryChangeHandler::GetChangedDirectoryName() const
+void CDelayedDirectoryChangeHandler::_UnblockIfCaughtUp()
 {
+	if (_blockedBatches.empty()
+		|| _bUnblockScheduled
+		|| !_fnUnblocked)
+	{
+		return;
+	}
+
+	// the same test as PostEventBatch()'s, for the oldest one that's held back
+	if (_dwBackpressurePolicy == CDirectoryChangeWatcher::BACKPRESSURE_BLOCK
+		&& _nMaxQueuedEvents != 0
+		&& _nQueuedEvents != 0
+		&& _nQueuedEvents + _blockedBatches.front().size() > _nMaxQueuedEvents)
+	{
+		return;
+	}
+
+	_bUnblockScheduled = true;
+	_fnUnblocked();
+}
 
+void CDelayedDirectoryChangeHandler::SetChangeDirectoryName(const CString& strDirName)
+{
+	// the same for every change of this watch, only written before the first one is posted
+	if (CDirectoryChangeHandler::GetChangedDirectoryName() != strDirName)
+	{
+		SetChangedDirectoryName(strDirName);
+	}
+}
+
+const CString& CDelayedDirectoryChangeHandler::GetChangedDirectoryName() const
+{
+	return CDirectoryChangeHandler::GetChangedDirectoryName();
 }
 
+//
+//	Waits until the real handler's On_WatchStopped() has been called.
+//	Returns FALSE w/o waiting when called from the thread that dispatches the notifications,
+//	eg: a handler that unwatches its directory from one of its On_Filexxx() functions.
+//
 BOOL CDelayedDirectoryChangeHandler::WaitForOnWatchStoppedDispatched()
 {
+	if (_pDelayNotifier == nullptr)
+	{
+		return FALSE;
+	}
 
+	return _pDelayNotifier->WaitForDispatch(_evWatchStoppedDispatched);
 }
 
-bool CDelayedDirectoryChangeHandler::NotifyClientOfFileChanged(std::shared_ptr<CDirChangeNotification> pNotify)
+bool CDelayedDirectoryChangeHandler::NotifyClientOfFileChanged(CDirectoryChangeHandler * pRealHandler, const CDirChangeEvent& event)
 {
-
+	bool bRename = (event.dwAction == FILE_ACTION_RENAMED_OLD_NAME);
+
+	auto filtersPass = [this, &event, bRename]() -> bool
+	{
+		// w/ FiltersWhenPosted(), the changes that didn't pass haven't been posted
+		if (!HasFilterSpecs() || FiltersWhenPosted())
+		{
+			return true;
+		}
+
+		// a rename is reported if either of the names is of interest
+		return _PassesFilterSpecs(event.strFileName)
+			|| (bRename && _PassesFilterSpecs(event.strNewFileName));
+	};
+
+	auto handlerPasses = [pRealHandler, &event, bRename, this]() -> bool
+	{
+		if ((_dwFilterFlags & CDirectoryChangeWatcher::FILTERS_DONT_USE_HANDLER_FILTER)
+			|| pRealHandler == nullptr)
+		{
+			return true;
+		}
+
+		return pRealHandler->On_FilterNotification(event.dwAction, event.strFileName,
+			bRename ? (LPCTSTR)event.strNewFileName : nullptr);
+	};
+
+	if (_dwFilterFlags & CDirectoryChangeWatcher::FILTERS_TEST_HANDLER_FIRST)
+	{
+		return handlerPasses() && filtersPass();
+	}
+
+	return filtersPass() && handlerPasses();
 }
 
 bool CDelayedDirectoryChangeHandler::IncludeThisNotification(const std::string& strFileName)
 {
+	if (_includeFilterSpecs.IsEmpty())
+	{
+		// no include filter, everything is included
+		return true;
+	}
 
+	return _includeFilterSpecs.Matches(strFileName);
 }
 
 bool CDelayedDirectoryChangeHandler::ExcludeThisNotification(const std::string& strFileName)
 {
-
+	return _excludeFilterSpecs.Matches(strFileName);
 }
 
 std::shared_ptr<CDirChangeNotification> CDelayedDirectoryChangeHandler::GetNotificationObj()
 {
-
+	std::shared_ptr<CDirChangeNotification> pNotification;
+	std::unique_lock<std::mutex> lock(_mutNotificationPool, std::try_to_lock);
+	if (lock.owns_lock()
+		&& _notificationPool.TryPop(pNotification))
+	{
+		// the notifier drops its reference right after the dispatch, the one that was disposed of first
+		// has almost always been let go of.  If not, it goes to the back, w/o looking any further.
+		// W/ only the pool's reference left, no one can take another.
+		if (pNotification.use_count() == 1)
+		{
+			// the notifier's last use of it happened before its reference was dropped
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			// the notification keeps this object alive until it's been dispatched
+			pNotification->m_pDelayedHandler = shared_from_this();
+			return pNotification;
+		}
+		_notificationPool.TryPush(pNotification);
+	}
+
+	return std::make_shared<CDirChangeNotification>(shared_from_this());
 }
 
 void CDelayedDirectoryChangeHandler::DisposeOfNotification(std::shared_ptr<CDirChangeNotification> pNotify)
 {
+	// the notifier may hold on to the object a while longer, let go of the handler now
+	// (the pool mustn't keep this object alive), the events' buffer is kept for the next batch
+	pNotify->Clear();
 
+	// beyond MAX_POOLED_NOTIFICATIONS the ring is full, pNotify is freed instead
+	_notificationPool.TryPush(pNotify);
 }
 
 void CDelayedDirectoryChangeHandler::SetPartialPathOffset(const CString& strWatchedDirname)
 {
+	//	FILTERS_CHECK_PARTIAL_PATH: "C:\FolderName\SubFolder\FileName.xyz" is checked as "SubFolder\FileName.xyz"
+	//	when "C:\FolderName" is watched.
+	_dwPartialPathOffset = (DWORD)strWatchedDirname.GetLength();
+	_strWatchedDirUtf8 = CUtf8Transcoder::ToUtf8(strWatchedDirname);
+	if (strWatchedDirname.IsEmpty()
+		|| strWatchedDirname[strWatchedDirname.GetLength() - 1] != DIR_SEPARATOR_CHAR)
+	{
+		++_dwPartialPathOffset;
+		_strWatchedDirUtf8 += (char)DIR_SEPARATOR_CHAR;
+	}
+}
 
+bool CDelayedDirectoryChangeHandler::HasFilterSpecs() const
+{
+	return !(_dwFilterFlags & CDirectoryChangeWatcher::FILTERS_DONT_USE_FILTERS)
+		&& !(_includeFilterSpecs.IsEmpty() && _excludeFilterSpecs.IsEmpty());
 }
 
+bool CDelayedDirectoryChangeHandler::PassesFilterSpecs(const char * pszRelName, size_t nLength) const
+{
+	if (!HasFilterSpecs())
+	{
+		return true;
+	}
+
+	// what's checked is a view into pszRelName, except for FILTERS_CHECK_FULL_PATH:
+	// the watched directory goes in front of it, in a buffer that's reused
+	const char * pszPath = pszRelName;
+	size_t nPathLength = nLength;
+	if (_dwFilterFlags & CDirectoryChangeWatcher::FILTERS_CHECK_FULL_PATH)
+	{
+		static thread_local std::string s_strPath;
+		s_strPath.assign(_strWatchedDirUtf8);
+		s_strPath.append(pszRelName, nLength);
+		pszPath = s_strPath.data();
+		nPathLength = s_strPath.size();
+	}
+	else if (!(_dwFilterFlags & CDirectoryChangeWatcher::FILTERS_CHECK_PARTIAL_PATH))
+	{
+		// FILTERS_CHECK_FILE_NAME_ONLY, the default
+		while (nPathLength > 0 && pszRelName[nPathLength - 1] != (char)DIR_SEPARATOR_CHAR)
+		{
+			--nPathLength;
+		}
+		pszPath = pszRelName + nPathLength;
+		nPathLength = nLength - nPathLength;
+	}
+
+	if (_pFilterCache != nullptr)
+	{
+		return _pFilterCache->Passes(pszPath, nPathLength);
+	}
+	return (_includeFilterSpecs.IsEmpty() || _includeFilterSpecs.Matches(pszPath, nPathLength))
+		&& !_excludeFilterSpecs.Matches(pszPath, nPathLength);
+}
 
-//////////////////////////////////////////////////////////////////////////
-BOOL CDelayedDirectoryChangeHandler::_PathMatchSpec(const std::string& strPath)
+bool CDelayedDirectoryChangeHandler::IsExcludedSubtree(LPCTSTR pszRelDir, size_t nLength) const
 {
+	if (_pFilterCache == nullptr)
+	{
+		return false;
+	}
+
+#ifdef _WIN32
+	static thread_local std::string s_strDir;
+	s_strDir.clear();
+	CUtf8Transcoder::AppendName(pszRelDir, nLength, s_strDir);
+	return IsExcludedSubtreeUtf8(s_strDir.data(), s_strDir.size());
+#else
+	return IsExcludedSubtreeUtf8(pszRelDir, nLength);
+#endif
+}
 
+bool CDelayedDirectoryChangeHandler::IsExcludedSubtreeUtf8(const char * pszRelDir, size_t nLength) const
+{
+	if (_pFilterCache == nullptr)
+	{
+		return false;
+	}
+
+	// the directory as the filters see it (FILTERS_CHECK_FULL_PATH/FILTERS_CHECK_PARTIAL_PATH),
+	// in a buffer that's reused, so that the changes that are read are checked w/o allocating
+	static thread_local std::string s_strDir;
+	s_strDir.clear();
+	if (_dwFilterFlags & CDirectoryChangeWatcher::FILTERS_CHECK_FULL_PATH)
+	{
+		s_strDir += _strWatchedDirUtf8;
+	}
+	s_strDir.append(pszRelDir, nLength);
+	s_strDir += (char)DIR_SEPARATOR_CHAR;
+
+	return _pFilterCache->IsExcludedSubtree(s_strDir);
 }
 
-BOOL CDelayedDirectoryChangeHandler::_InitPathMatchFunc(const std::string& strIncludeFilter, const std::string& strExcludeFilter)
+CFilterVerdictCache::CStats CDelayedDirectoryChangeHandler::GetFilterCacheStats() const
 {
+	if (_pFilterCache == nullptr)
+	{
+		CFilterVerdictCache::CStats stats = { 0ULL, 0ULL, 0ULL };
+		return stats;
+	}
+	return _pFilterCache->GetStats();
+}
+
+bool CDelayedDirectoryChangeHandler::_PassesFilterSpecs(const CString& strFileName) const
+{
+	// the names are below the watched directory, their part after it is what PassesFilterSpecs() takes
+	auto nOffset = std::min((int)_dwPartialPathOffset, strFileName.GetLength());
 
+	static thread_local std::string s_strRelName;
+	s_strRelName.clear();
+	CUtf8Transcoder::AppendName((LPCTSTR)strFileName + nOffset, (size_t)(strFileName.GetLength() - nOffset), s_strRelName);
+	return PassesFilterSpecs(s_strRelName.data(), s_strRelName.size());
 }
 
+
+//////////////////////////////////////////////////////////////////////////
+//
+//	Splits the filters into their semi-colon separated specs, eg: "*.txt;*.cpp;*.h",
+//	and compiles each set once, so that an event is checked against all of them in one pass.
+//
 BOOL CDelayedDirectoryChangeHandler::_InitPatterns(const std::string& strIncludeFilter, const std::string& strExcludeFilter)
 {
+	_strIncludeFilter = strIncludeFilter;
+	_strExcludeFilter = strExcludeFilter;
+
+	auto splitSpecs = [](const std::string& strFilter, CFilterSpecMatcher& matcher)
+	{
+		std::vector<std::string> specs;
+		size_t nStart = 0;
+		while (nStart <= strFilter.size())
+		{
+			auto nEnd = strFilter.find(';', nStart);
+			if (nEnd == std::string::npos)
+			{
+				nEnd = strFilter.size();
+			}
+
+			auto nFirst = strFilter.find_first_not_of(" \t", nStart);
+			if (nFirst != std::string::npos && nFirst < nEnd)
+			{
+				auto nLast = strFilter.find_last_not_of(" \t", nEnd - 1);
+				specs.push_back(strFilter.substr(nFirst, nLast - nFirst + 1));
+			}
+			nStart = nEnd + 1;
+		}
+		matcher.Compile(specs);
+	};
+
+	splitSpecs(_strIncludeFilter, _includeFilterSpecs);
+	splitSpecs(_strExcludeFilter, _excludeFilterSpecs);
+
+	// the directories are part of what's matched, the verdicts for them are worth keeping
+	_pFilterCache.reset();
+	if ((_dwFilterFlags & (CDirectoryChangeWatcher::FILTERS_CHECK_FULL_PATH | CDirectoryChangeWatcher::FILTERS_CHECK_PARTIAL_PATH))
+		&& !(_dwFilterFlags & CDirectoryChangeWatcher::FILTERS_DONT_USE_FILTERS)
+		&& !(_includeFilterSpecs.IsEmpty() && _excludeFilterSpecs.IsEmpty()))
+	{
+		_pFilterCache.reset(new CFilterVerdictCache(_includeFilterSpecs, _excludeFilterSpecs));
+	}
+
+	return TRUE;
+}
 
+void CDelayedDirectoryChangeHandler::_PostEvent(DWORD dwAction, const CString& strFileName, const CString& strNewFileName)
+{
+	if (FiltersWhenPosted()
+		&& !_PassesFilterSpecs(strFileName)
+		&& !(dwAction == FILE_ACTION_RENAMED_OLD_NAME && _PassesFilterSpecs(strNewFileName)))
+	{
+		return;
+	}
+
+	std::vector<CDirChangeEvent> events;
+	events.push_back(CDirChangeEvent{ dwAction, strFileName, strNewFileName });
+	PostEventBatch(std::move(events));
 }
 
-void CDelayedDirectoryChangeHandler::_UninitPathMatchFunc()
+//////////////////////////////////////////////////////////////////////////
+//
+//	The batches that are queued and events together are over _nMaxQueuedEvents.
+//
+//	BACKPRESSURE_BLOCK		-- events are held back until they aren't anymore (a batch that's over the limit
+//							   by itself until the queue is empty), and so are the batches after it.  The watch's
+//							   strand sees IsPostingBlocked() and doesn't read the directory in the meantime,
+//							   nothing waits: the threads it shares w/ the other watches go on.
+//	BACKPRESSURE_DROP_OLDEST-- empties the oldest batches that haven't been dispatched, and the oldest events
+//							   of events if that's still not enough.  Their notifications are dispatched
+//							   w/o any events.
+//	BACKPRESSURE_RESCAN		-- the queued batches and events are replaced by one eOn_SubtreeDirty.
+//
+bool CDelayedDirectoryChangeHandler::_ApplyBackpressure(std::vector<CDirChangeEvent>& events,
+	OUT std::shared_ptr<CDirChangeNotification>& pNewMarker)
 {
+	switch (_dwBackpressurePolicy)
+	{
+	case CDirectoryChangeWatcher::BACKPRESSURE_BLOCK:
+		if (_nQueuedEvents == 0
+			|| _bReleaseBlockedPosts
+			|| !_fnUnblocked)
+		{
+			// there's nothing to wait for, or nobody to hold up
+			return true;
+		}
+		++_backpressureStats.ullBlockedPosts;
+		_blockedBatches.push_back(std::move(events));
+		return false;
+
+	case CDirectoryChangeWatcher::BACKPRESSURE_DROP_OLDEST:
+		while (_nQueuedHead < _queuedBatches.size()
+			&& _nQueuedEvents + events.size() > _nMaxQueuedEvents)
+		{
+			auto & pOldest = _queuedBatches[_nQueuedHead];
+			_nQueuedEvents -= pOldest->m_events.size();
+			_backpressureStats.ullEventsDropped += pOldest->m_events.size();
+			pOldest->m_events.clear();
+			_PopOldestQueuedBatch();
+		}
+		if (events.size() > _nMaxQueuedEvents)
+		{
+			auto nDropped = events.size() - _nMaxQueuedEvents;
+			events.erase(events.begin(), events.begin() + nDropped);
+			_backpressureStats.ullEventsDropped += nDropped;
+		}
+		return true;
+
+	case CDirectoryChangeWatcher::BACKPRESSURE_RESCAN:
+		pNewMarker = _CollapseIntoDirtyMarker(events);
+		return false;
+
+	default:
+		return true;
+	}
+}
 
+std::shared_ptr<CDirChangeNotification> CDelayedDirectoryChangeHandler::_CollapseIntoDirtyMarker(std::vector<CDirChangeEvent>& events)
+{
+	// a marker that's still queued covers the changes that have been posted after it as well:
+	// the handler looks at the tree when it's dispatched, after they happened.
+	CString strDir;
+	if (_pQueuedDirtyMarker != nullptr)
+	{
+		strDir = _pQueuedDirtyMarker->m_strDirName;
+	}
+
+	auto collapse = [this, &strDir](std::vector<CDirChangeEvent>& collapsed)
+	{
+		for (const auto & event : collapsed)
+		{
+			_CommonDirectory(strDir, event.strFileName);
+			if (!event.strNewFileName.IsEmpty())
+			{
+				_CommonDirectory(strDir, event.strNewFileName);
+			}
+		}
+		_backpressureStats.ullEventsCollapsed += collapsed.size();
+		collapsed.clear();
+	};
+
+	for (size_t i = _nQueuedHead; i < _queuedBatches.size(); ++i)
+	{
+		collapse(_queuedBatches[i]->m_events);
+	}
+	_queuedBatches.clear();
+	_nQueuedHead = 0;
+	_nQueuedEvents = 0;
+	collapse(events);
+	++_backpressureStats.ullCollapses;
+
+	if (_pQueuedDirtyMarker != nullptr)
+	{
+		_pQueuedDirtyMarker->m_strDirName = strDir;
+		return nullptr;
+	}
+
+	auto pMarker = GetNotificationObj();
+	if (pMarker != nullptr)
+	{
+		_pQueuedDirtyMarker = pMarker;
+		pMarker->m_ullSequence = _ullNextSequence++;
+		pMarker->SetOn_SubtreeDirty(strDir);
+	}
+	return pMarker;
 }
 
-bool CDelayedDirectoryChangeHandler::_UseRealPathMatchSpec() const
+bool CDelayedDirectoryChangeHandler::_Dequeue(const std::shared_ptr<CDirChangeNotification>& pNotification)
 {
+	{
+		std::lock_guard<std::mutex> lock(_mutQueued);
+		if (pNotification == _pQueuedDirtyMarker)
+		{
+			_pQueuedDirtyMarker.reset();
+			return true;
+		}
+
+		// the oldest one, unless it's been dropped or dispatched already (and isn't queued anymore)
+		if (_nQueuedHead < _queuedBatches.size()
+			&& _queuedBatches[_nQueuedHead] == pNotification)
+		{
+			_nQueuedEvents -= pNotification->m_events.size();
+			_PopOldestQueuedBatch();
+		}
+		else
+		{
+			auto it = std::find(_queuedBatches.begin() + _nQueuedHead, _queuedBatches.end(), pNotification);
+			if (it == _queuedBatches.end())
+			{
+				return false;
+			}
+			_nQueuedEvents -= pNotification->m_events.size();
+			_queuedBatches.erase(it);
+		}
+		_UnblockIfCaughtUp();
+	}
+	return true;
+}
 
+void CDelayedDirectoryChangeHandler::_PopOldestQueuedBatch()
+{
+	_queuedBatches[_nQueuedHead++].reset();
+	if (_nQueuedHead == _queuedBatches.size())
+	{
+		_queuedBatches.clear();
+		_nQueuedHead = 0;
+	}
+	else if (_nQueuedHead > _queuedBatches.size() / 2)
+	{
+		// the ones left are moved to the front once they're fewer than the gone ones
+		_queuedBatches.erase(_queuedBatches.begin(), _queuedBatches.begin() + _nQueuedHead);
+		_nQueuedHead = 0;
+	}
+}
+
+void CDelayedDirectoryChangeHandler::_CommonDirectory(CString& strDir, const CString& strPath) const
+{
+	const auto & strWatchedDir = GetChangedDirectoryName();
+
+	if (strDir.IsEmpty())
+	{
+		strDir = strPath.Left((std::max)(strPath.ReverseFind(DIR_SEPARATOR_CHAR), 0));
+	}
+
+	// up from strDir until strPath is below it, but not above the watched directory
+	while (strDir.GetLength() > strWatchedDir.GetLength())
+	{
+		if (strPath.GetLength() > strDir.GetLength()
+			&& strPath[strDir.GetLength()] == DIR_SEPARATOR_CHAR
+			&& strPath.Left(strDir.GetLength()) == strDir)
+		{
+			return;
+		}
+		strDir = strDir.Left((std::max)(strDir.ReverseFind(DIR_SEPARATOR_CHAR), 0));
+	}
+
+	strDir = strWatchedDir;
 }
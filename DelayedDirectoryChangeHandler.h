@@ -1,12 +1,17 @@
 #pragma once
 #include "DirectoryChangeHandler.h"
+#include "DirectoryChangeWatcher.h"
 #include "DirChangeNotification.h"
 #include "DelayedNotifier.h"
+#include "FilterSpecMatcher.h"
+#include "FilterVerdictCache.h"
+#include "MpscRing.h"
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
 
 
-typedef BOOL(STDAPICALLTYPE * Func_PatternMatchSpec)
-	(const std::string& strFile, const std::string& strSpec);
-
 //
 //	Decorates an instance of a CDirectoryChangeHandler object.
 //	Intercepts notification function calls and posts them to 
@@ -19,17 +24,37 @@ typedef BOOL(STDAPICALLTYPE * Func_PatternMatchSpec)
 //
 //	Also supports the include and exclude filters for each directory
 //
+//	The changes are posted in batches (PostEventBatch()), one per read of the directory,
+//	and reach the real handler through CDirectoryChangeHandler::On_EventBatch().
+//	The include/exclude filters are applied before a change is posted (see PassesFilterSpecs()),
+//	so that what they drop costs no more than their verdict.  The handler's own filter
+//	(On_FilterNotification()) is called on the notifier's thread, just before the batch is
+//	dispatched, and so are the include/exclude filters if it goes first (FILTERS_TEST_HANDLER_FIRST).
+//
+//	The batches that have been posted and not dispatched yet are kept track of, so that
+//	a handler that can't keep up w/ its watch doesn't make them pile up w/o limit,
+//	see SetBackpressurePolicy().  W/ BACKPRESSURE_BLOCK nothing waits: the batches over the
+//	limit are held back here, the watch doesn't read any further (IsPostingBlocked()), and
+//	it's let go on once the handler has caught up (see SetUnblockedCallback()).
+//
+//	Control notifications (On_WatchStarted(), On_WatchStopped(), On_ReadDirectoryChangesError())
+//	go through the notifier's priority lane, past the backlog of the other watches.  The changes
+//	of this watch that were posted before one of them are dispatched right before it, so a watch's
+//	handler still sees its changes and its stop in order.
+//
 class CDelayedDirectoryChangeHandler : public CDirectoryChangeHandler
+	, public std::enable_shared_from_this<CDelayedDirectoryChangeHandler>
 {
 public:
 	CDelayedDirectoryChangeHandler() = delete;
 
 	CDelayedDirectoryChangeHandler(std::shared_ptr<CDirectoryChangeHandler> pRealHandler, 
 		bool bAppHasGUI, const std::string& strIncludeFilter, 
-		const std::string& strExcludeFilter, DWORD dwFilterFlags);
+		const std::string& strExcludeFilter, DWORD dwFilterFlags,
+		std::shared_ptr<CDelayedNotifier> pNotifier = nullptr);//nullptr: picked by bAppHasGUI/dwFilterFlags
 	virtual ~CDelayedDirectoryChangeHandler();
 
-	std::shared_ptr<CDirectoryChangeHandler> GetRealChangeHandler() const { return _pRealHandler; }
+	std::shared_ptr<CDirectoryChangeHandler> GetRealChangeHandler() const { return std::atomic_load(&_pRealHandler); }
 	//CDirectoryChangeHandler*& GetRealChangeHandler() { return _pRealHandler; }//FYI: PCLint will give a warning that this exposes a private/protected member& defeats encapsulation.  
 
 	void	PostNotification(std::shared_ptr<CDirChangeNotification> pNotification);
@@ -40,27 +65,68 @@ protected:
 	void	On_FileAdd(const CString& strFileName);
 	void	On_FileRemoved(const CString& strFileName);
 	void	On_FileModified(const CString& strFileName);
-	void	On_FileNameChanged(const CString& strFileName);
+	void	On_FileNameChanged(const CString& strFileName, const CString& strNewFileName);
 	void	On_ReadDiretoryChangesError(DWORD dwError, const CString& strDirName);
 
 	void	On_WatchStarted(DWORD dwError, const CString& strDirName);
 	void	On_WatchStopped(const CString& strDirName);
 
+	//	the changes found by one read of the directory, in one notification
+	void	PostEventBatch(std::vector<CDirChangeEvent>&& events);
+
 	void	SetChangeDirectoryName(const CString& strDirName);
 	const CString& GetChangedDirectoryName() const;
 
 	BOOL	WaitForOnWatchStoppedDispatched();
 
-	bool	NotifyClientOfFileChanged(std::shared_ptr<CDirChangeNotification> pNotify);
+	bool	NotifyClientOfFileChanged(CDirectoryChangeHandler * pRealHandler, const CDirChangeEvent& event);
 
 	bool	IncludeThisNotification(const std::string& strFileName);
 	bool	ExcludeThisNotification(const std::string& strFileName);
 
+	//	notifications are recycled: a disposed of one goes to the back of _notificationPool,
+	//	and is handed out again from the front once the notifier has let go of it
 	std::shared_ptr<CDirChangeNotification>	GetNotificationObj();
 	void	DisposeOfNotification(std::shared_ptr<CDirChangeNotification> pNotify);
 
 	void	SetPartialPathOffset(const CString& strWatchedDirname);
 
+	//	there are include/exclude filters to check (and FILTERS_DONT_USE_FILTERS isn't set)
+	bool	HasFilterSpecs() const;
+	//	the include/exclude filters are checked before the changes are posted, not when they're dispatched
+	bool	FiltersWhenPosted() const { return HasFilterSpecs() && !(_dwFilterFlags & CDirectoryChangeWatcher::FILTERS_TEST_HANDLER_FIRST); }
+
+	//	true if the include/exclude filters let the change to pszRelName[0..nLength) through.
+	//	The name is UTF-8 and relative to the watched directory, eg: a view into the read's CUtf8NameArena,
+	//	the part of it that's checked depends on FILTERS_CHECK_xxx.
+	bool	PassesFilterSpecs(const char * pszRelName, size_t nLength) const;
+
+	//	true if the filters let nothing below the watched directory's pszRelDir[0..nLength) through,
+	//	its changes can be dropped as soon as they're read (and on Linux, it needn't be watched at all)
+	bool	IsExcludedSubtree(LPCTSTR pszRelDir, size_t nLength) const;
+	//	the same w/ a UTF-8 name
+	bool	IsExcludedSubtreeUtf8(const char * pszRelDir, size_t nLength) const;
+
+	//	all zero unless the filters check the directories too (FILTERS_CHECK_FULL_PATH/FILTERS_CHECK_PARTIAL_PATH)
+	CFilterVerdictCache::CStats	GetFilterCacheStats() const;
+
+	//	CDirectoryChangeWatcher::BACKPRESSURE_xxx, nMaxQueuedEvents == 0: no limit
+	void	SetBackpressurePolicy(DWORD dwPolicy, size_t nMaxQueuedEvents);
+	CDirectoryChangeWatcher::CBackpressureStats	GetBackpressureStats() const;
+
+	//	BACKPRESSURE_BLOCK: there are batches held back until the handler has caught up,
+	//	the watch isn't to read any further meanwhile
+	bool	IsPostingBlocked() const;
+	//	posts the batches that have been held back, in order, as far as the limit lets it.  Called by the watch's strand
+	void	PostBlockedBatches();
+	//	called once the handler has caught up w/ a blocked watch, for its strand to call PostBlockedBatches().
+	//	It's called w/ the handler's lock held: it mustn't call back into the handler, nor wait.
+	//	W/o one, BACKPRESSURE_BLOCK doesn't hold anything back.
+	void	SetUnblockedCallback(std::function<void()> fnUnblocked);
+	//	nothing's held back from now on, and the callback isn't called anymore: the watch is being stopped.
+	//	What's been held back already is posted by the next PostBlockedBatches().
+	void	ReleaseBlockedPosts();
+
 protected:
 	std::shared_ptr<CDelayedNotifier>			_pDelayNotifier;
 	std::shared_ptr<CDirectoryChangeHandler>	_pRealHandler;
@@ -68,40 +134,76 @@ protected:
 	bool	_bAppHasGUI;
 	DWORD	_dwFilterFlags;
 	DWORD	_dwPartialPathOffset;	//helps support FILTERS_CHECK_PARTIAL_PATH
+	std::string	_strWatchedDirUtf8;	//w/ a trailing separator, for the filters w/ FILTERS_CHECK_FULL_PATH
 
 	friend	class CDirectoryChangeWatcher;
 	friend	class CDirectoryChangeWatcher::CDirWatchInfo;
 
 private:
-	BOOL	_PathMatchSpec(const std::string& strPath);
-	BOOL	_InitPathMatchFunc(const std::string& strIncludeFilter, const std::string& strExcludeFilter);
 	BOOL	_InitPatterns(const std::string& strIncludeFilter, const std::string& strExcludeFilter);
-	void	_UninitPathMatchFunc();
 
-	bool	_UseRealPathMatchSpec() const;
+	void	_PostEvent(DWORD dwAction, const CString& strFileName, const CString& strNewFileName = CString());
+	//	PassesFilterSpecs() w/ a full path
+	bool	_PassesFilterSpecs(const CString& strFileName) const;
+
+	//	the queued batches are over the limit before events are posted, _mutQueued is locked.
+	//	returns false if events aren't to be posted: they've been held back (BACKPRESSURE_BLOCK), or dropped along
+	//	w/ the queued ones, pNewMarker is the dirty marker to post then (if it's a new one)
+	bool	_ApplyBackpressure(std::vector<CDirChangeEvent>& events, OUT std::shared_ptr<CDirChangeNotification>& pNewMarker);
+	//	calls _fnUnblocked if the watch is blocked and the handler has caught up, _mutQueued is locked
+	void	_UnblockIfCaughtUp();
+	std::shared_ptr<CDirChangeNotification>	_CollapseIntoDirtyMarker(std::vector<CDirChangeEvent>& events);
+	//	pNotification is about to be dispatched, it's no longer queued.
+	//	false if its changes are gone already (dropped, or dispatched by _DispatchQueuedBefore())
+	bool	_Dequeue(const std::shared_ptr<CDirChangeNotification>& pNotification);
+	//	the oldest queued batch is gone, _mutQueued is locked
+	void	_PopOldestQueuedBatch();
+
+	void	_DispatchEventBatch(CDirectoryChangeHandler * pRealHandler, std::vector<CDirChangeEvent>& events);
+	void	_DispatchSubtreeDirty(CDirectoryChangeHandler * pRealHandler, const CString& strDirName);
+	void	_DispatchQueuedBefore(uint64_t ullSequence, CDirectoryChangeHandler * pRealHandler);
+	//	narrows strDir down to the deepest directory that has strDir and strPath in it
+	void	_CommonDirectory(CString& strDir, const CString& strPath) const;
 
 private:
-	HANDLE		_hWatchStoppedDispatchedEvent;
+	CEvent		_evWatchStoppedDispatched;//set once On_WatchStopped() has been dispatched
+
+	//	the high water mark of _notificationPool: notifications disposed of beyond it are freed.
+	//	A watch seldom has more than a few in flight, the ones above that were for a burst.
+	enum { MAX_POOLED_NOTIFICATIONS = 64 };
+	//	DisposeOfNotification() pushes w/o locking.  The ring has one consumer, GetNotificationObj() takes from it
+	//	under _mutNotificationPool, but never waits for it: a thread that doesn't get it allocates instead.
+	std::mutex	_mutNotificationPool;
+	CMpscRing<std::shared_ptr<CDirChangeNotification>>	_notificationPool;//disposed of, oldest first, w/ their event buffers
+
+	//	the eOn_EventBatch notifications that have been posted and not dispatched yet, oldest first
+	mutable std::mutex		_mutQueued;
+	//	not a std::deque: one that's drained w/ its end on a block boundary allocates a block for
+	//	every batch from then on.  The vector keeps its capacity, the ones before _nQueuedHead are gone.
+	std::vector<std::shared_ptr<CDirChangeNotification>>	_queuedBatches;
+	size_t	_nQueuedHead;
+	std::shared_ptr<CDirChangeNotification>	_pQueuedDirtyMarker;//BACKPRESSURE_RESCAN: the eOn_SubtreeDirty that hasn't been dispatched yet
+	size_t	_nQueuedEvents;
+	uint64_t	_ullNextSequence;//the order in which the notifications have been posted, see PostNotification()
+	DWORD	_dwBackpressurePolicy;
+	size_t	_nMaxQueuedEvents;
+	std::vector<std::vector<CDirChangeEvent>>	_blockedBatches;//BACKPRESSURE_BLOCK: held back, oldest first, the watch waits for them
+	std::function<void()>	_fnUnblocked;
+	bool	_bUnblockScheduled;//_fnUnblocked has been called, PostBlockedBatches() hasn't yet
+	bool	_bReleaseBlockedPosts;
+	CDirectoryChangeWatcher::CBackpressureStats	_backpressureStats;
 
 	std::string	_strIncludeFilter;
 	std::string	_strExcludeFilter;
 
-	//
-	//	Load PathMatchSpec dynamically because it's only supported if IE 4.0 or greater is
-	//	installed.
-	static HMODULE	_hShlwapi_dll;
-	static BOOL		_hShlwapi_dllExists;
-	static long		_nRefCnt_hShlwapi;
-	static Func_PatternMatchSpec	_fpPatternMatchSpec;
-
-	//note: if the PathMatchSpec function isn't found, wildcmp() is used instead.
 	//
 	//	to support multiple file specs separated by a semi-colon,
 	//	the include and exclude filters that are passed into the 
-	//	the constructor are parsed into separate strings
-	//	which are all checked in a loop.
+	//	the constructor are split into their specs, and each set
+	//	is compiled into one matcher that checks all of them in a single pass.
 	//
-	int _nNumIncludeFilterSpecs;
-	int _nNumExcludeFilterSpecs;
+	CFilterSpecMatcher	_includeFilterSpecs;
+	CFilterSpecMatcher	_excludeFilterSpecs;
+	std::unique_ptr<CFilterVerdictCache>	_pFilterCache;//the verdicts for the directories, see _InitPatterns()
 };
 
@@ -0,0 +1,233 @@
+#include "stdafx.h"
+#include "DelayedNotificationPollable.h"
+#include "DirChangeNotification.h"
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+
+CDelayedNotificationPollable::CDelayedNotificationPollable()
+	: _fdRead(-1)
+	, _fdWrite(-1)
+	, _bControl(false)
+	, _bSignalled(false)
+{
+#ifdef __linux__
+	_fdRead = _fdWrite = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_fdRead == -1)
+	{
+		LOGF(FATAL, _T("CDelayedNotificationPollable() -- eventfd() failed: %d\n"), errno);
+	}
+#else
+	int fds[2];
+	if (pipe(fds) == 0)
+	{
+		for (auto fd : fds)
+		{
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+		_fdRead = fds[0];
+		_fdWrite = fds[1];
+	}
+	else
+	{
+		LOGF(FATAL, _T("CDelayedNotificationPollable() -- pipe() failed: %d\n"), errno);
+	}
+#endif
+}
+
+CDelayedNotificationPollable::~CDelayedNotificationPollable()
+{
+	if (_fdWrite != -1 && _fdWrite != _fdRead)
+	{
+		close(_fdWrite);
+	}
+	if (_fdRead != -1)
+	{
+		close(_fdRead);
+	}
+}
+
+void CDelayedNotificationPollable::PostNotification(std::shared_ptr<CDirChangeNotification> pNotification)
+{
+	bool bSignal;
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		_notifications.push_back(std::move(pNotification));
+		bSignal = !_bSignalled;
+		_bSignalled = true;
+	}
+
+	if (bSignal)
+	{
+		_Signal();
+	}
+}
+
+void CDelayedNotificationPollable::PostControlNotification(std::shared_ptr<CDirChangeNotification> pNotification)
+{
+	bool bSignal;
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		_controls.push_back(std::move(pNotification));
+		_bControl = true;
+		bSignal = !_bSignalled;
+		_bSignalled = true;
+	}
+
+	if (bSignal)
+	{
+		_Signal();
+	}
+}
+
+void CDelayedNotificationPollable::_Signal()
+{
+	// a full pipe is readable already, EAGAIN is fine
+#ifdef __linux__
+	uint64_t ullOne = 1;
+	if (write(_fdWrite, &ullOne, sizeof(ullOne)) == -1 && errno != EAGAIN)
+#else
+	char ch = 0;
+	if (write(_fdWrite, &ch, 1) == -1 && errno != EAGAIN)
+#endif
+	{
+		LOGF(WARNING, _T("CDelayedNotificationPollable -- unable to signal the descriptor: %d\n"), errno);
+	}
+}
+
+void CDelayedNotificationPollable::_ClearSignal()
+{
+#ifdef __linux__
+	uint64_t ullCount;
+	if (read(_fdRead, &ullCount, sizeof(ullCount)) == -1 && errno != EAGAIN)
+	{
+		LOGF(WARNING, _T("CDelayedNotificationPollable -- unable to read the descriptor: %d\n"), errno);
+	}
+#else
+	char buf[64];
+	while (read(_fdRead, buf, sizeof(buf)) > 0)
+	{
+	}
+#endif
+}
+
+bool CDelayedNotificationPollable::_IsDispatchingThread()
+{
+	std::lock_guard<std::mutex> lock(_mut);
+	return _idDispatchingThread == std::this_thread::get_id();
+}
+
+size_t CDelayedNotificationPollable::DispatchPending()
+{
+	if (_IsDispatchingThread())
+	{
+		LOGF(WARNING, _T("CDelayedNotificationPollable::DispatchPending() -- called from a handler function\n"));
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> lockDispatch(_mutDispatch);
+
+	// cleared before the queue is taken: whatever's posted after that signals again
+	_ClearSignal();
+
+	std::deque<std::shared_ptr<CDirChangeNotification>> notifications;
+	std::deque<std::shared_ptr<CDirChangeNotification>> controls;
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		notifications.swap(_notifications);
+		controls.swap(_controls);
+		_bControl = false;
+		_bSignalled = false;
+		_idDispatchingThread = _idLoopThread = std::this_thread::get_id();
+	}
+
+	size_t nDispatched = 0;
+	auto fnDispatch = [&nDispatched](std::shared_ptr<CDirChangeNotification>& pNotification)
+	{
+		try
+		{
+			CDirChangeNotification::DispatchNotificationFunction(pNotification);
+		}
+		catch (...)
+		{
+			LOGF(WARNING, _T("CDelayedNotificationPollable -- a handler function has thrown an exception\n"));
+		}
+		pNotification.reset();
+		++nDispatched;
+	};
+
+	for (;;)
+	{
+		for (auto & pControl : controls)
+		{
+			fnDispatch(pControl);
+		}
+		controls.clear();
+
+		if (notifications.empty())
+		{
+			break;
+		}
+
+		fnDispatch(notifications.front());
+		notifications.pop_front();
+
+		if (_bControl.load(std::memory_order_relaxed))
+		{
+			// posted while this was dispatching, it goes ahead of the rest
+			std::lock_guard<std::mutex> lock(_mut);
+			controls.swap(_controls);
+			_bControl = false;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(_mut);
+	_idDispatchingThread = std::thread::id();
+	return nDispatched;
+}
+
+BOOL CDelayedNotificationPollable::WaitForDispatch(CEvent & evDispatched)
+{
+	if (_IsDispatchingThread())
+	{
+		// called from a handler function, the notification can't be dispatched until it returns
+		return FALSE;
+	}
+
+	bool bLoopThread;
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		bLoopThread = (_idLoopThread == std::this_thread::get_id() || _idLoopThread == std::thread::id());
+	}
+	if (!bLoopThread)
+	{
+		return evDispatched.Lock();
+	}
+
+	// the notification is dispatched by this thread's event loop, keep dispatching while waiting
+	for (;;)
+	{
+		DispatchPending();
+		if (evDispatched.Lock(0))
+		{
+			return TRUE;
+		}
+
+		pollfd pfd = { _fdRead, POLLIN, 0 };
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+		{
+			return FALSE;
+		}
+	}
+}
+
+#endif // !_WIN32
@@ -0,0 +1,64 @@
+#pragma once
+#include "DelayedNotifier.h"
+
+#ifndef _WIN32
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+
+//
+//	Dispatches the notifications on the application's own thread, from its event loop
+//	(FILTERS_POLLABLE_NOTIFICATIONS, w/o a GUI).
+//
+//	The notifications wait in a queue, and a descriptor (an eventfd(2), a pipe where there's
+//	none) is readable while there are any.  The application polls it along w/ its other
+//	descriptors (poll/epoll/libuv...) and calls DispatchPending() when it's readable, which
+//	runs everything that's waiting in one go.  The descriptor is only written to when the
+//	queue goes from empty to not empty, not once per notification.
+//
+//	Control notifications have a lane of their own, which is looked at before each data notification.
+//
+//	One CDelayedNotificationPollable per CDirectoryChangeWatcher, see GetNotificationFd().
+//
+class CDelayedNotificationPollable :
+	public CDelayedNotifier
+{
+public:
+	CDelayedNotificationPollable();
+	virtual ~CDelayedNotificationPollable();
+
+	virtual void	PostNotification(std::shared_ptr<CDirChangeNotification> pNotification) override;
+	virtual void	PostControlNotification(std::shared_ptr<CDirChangeNotification> pNotification) override;
+	virtual BOOL	WaitForDispatch(CEvent & evDispatched) override;
+
+	//	readable while notifications are waiting, -1 if it couldn't be created
+	int		GetFd() const { return _fdRead; }
+
+	//	runs the notifications that are waiting, on the calling thread (one at a time), returns how many.
+	//	The ones that are posted meanwhile are left for the next call.  Not from a handler function.
+	size_t	DispatchPending();
+
+private:
+	void	_Signal();
+	void	_ClearSignal();
+	bool	_IsDispatchingThread();
+
+private:
+	int		_fdRead;	//the eventfd, or the read end of the pipe
+	int		_fdWrite;	//the same eventfd, or the write end of the pipe
+
+	std::mutex	_mut;
+	std::deque<std::shared_ptr<CDirChangeNotification>>	_notifications;
+	std::deque<std::shared_ptr<CDirChangeNotification>>	_controls;	//the priority lane
+	std::atomic<bool>	_bControl;
+	bool		_bSignalled;	//_fdWrite has been written to since the queue was last taken
+	std::thread::id	_idDispatchingThread;	//in DispatchPending()
+	std::thread::id	_idLoopThread;	//the last one that called DispatchPending()
+
+	std::mutex	_mutDispatch;	//one DispatchPending() at a time, so that a watch's notifications stay in order
+};
+
+#endif // !_WIN32
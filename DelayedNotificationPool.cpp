@@ -0,0 +1,305 @@
+#include "stdafx.h"
+#include "DelayedNotificationPool.h"
+#include "DirChangeNotification.h"
+#include <stdint.h>
+
+
+namespace
+{
+	//	the pool (and the worker) of the calling thread, if it's one of the workers
+	thread_local const void *	t_pWorkerState = nullptr;
+	thread_local size_t			t_nWorker = 0;
+}
+
+std::shared_ptr<CDelayedNotifier> CDelayedNotificationPool::Instance()
+{
+	static std::mutex s_mutInstance;
+	static std::weak_ptr<CDelayedNotificationPool> s_pInstance;
+
+	std::lock_guard<std::mutex> lock(s_mutInstance);
+	auto pInstance = s_pInstance.lock();
+	if (pInstance == nullptr)
+	{
+		pInstance = std::make_shared<CDelayedNotificationPool>((std::max)(2U, std::thread::hardware_concurrency()));
+		s_pInstance = pInstance;
+	}
+
+	return pInstance;
+}
+
+CDelayedNotificationPool::CState::CState(size_t nThreads)
+	: shards(nThreads * SHARDS_PER_THREAD)
+	, workers(nThreads)
+	, nNextWorker(0)
+	, bStop(false)
+	, nIdle(0)
+	, ullWorkVersion(0)
+{
+}
+
+CDelayedNotificationPool::CDelayedNotificationPool(size_t nThreads)
+	: _pState(std::make_shared<CState>(nThreads))
+{
+	for (size_t i = 0; i < nThreads; ++i)
+	{
+		auto pThreadState = new std::shared_ptr<CState>(_pState);
+		try
+		{
+			_threads.emplace_back(_WorkerThreadProc, pThreadState, i);
+		}
+		catch (const std::system_error& e)
+		{
+			delete pThreadState;
+			LOGF(FATAL, _T("CDelayedNotificationPool() -- unable to start a worker thread: %s\n"), e.what());
+			break;
+		}
+	}
+}
+
+CDelayedNotificationPool::~CDelayedNotificationPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_pState->mutIdle);
+		_pState->bStop = true;
+		++_pState->ullWorkVersion;
+	}
+	_pState->cvIdle.notify_all();
+
+	for (auto & thread : _threads)
+	{
+		if (thread.get_id() == std::this_thread::get_id())
+		{
+			// the last handler went away w/ a notification that was just dispatched,
+			// there's nothing left to run and the worker exits as soon as it's back.
+			thread.detach();
+		}
+		else if (thread.joinable())
+		{
+			thread.join();
+		}
+	}
+}
+
+void CDelayedNotificationPool::PostNotification(std::shared_ptr<CDirChangeNotification> pNotification)
+{
+	auto & state = *_pState;
+	if (state.workers.empty())
+	{
+		return;
+	}
+
+	auto pShard = _GetShard(pNotification);
+	{
+		std::lock_guard<std::mutex> lock(pShard->mut);
+		pShard->notifications.push_back(std::move(pNotification));
+		if (pShard->bScheduled)
+		{
+			// it's queued or running already, it'll get to this one
+			return;
+		}
+		pShard->bScheduled = true;
+	}
+
+	_Schedule(state, pShard);
+}
+
+void CDelayedNotificationPool::PostControlNotification(std::shared_ptr<CDirChangeNotification> pNotification)
+{
+	auto & state = *_pState;
+	if (state.workers.empty())
+	{
+		return;
+	}
+
+	auto pShard = _GetShard(pNotification);
+	{
+		std::lock_guard<std::mutex> lock(pShard->mut);
+		pShard->controls.push_back(std::move(pNotification));
+		if (pShard->bScheduled)
+		{
+			return;
+		}
+		pShard->bScheduled = true;
+	}
+
+	_Schedule(state, pShard, true);
+}
+
+//
+//	The shard of the watch, the same for all of its notifications.
+//
+CDelayedNotificationPool::CShard * CDelayedNotificationPool::_GetShard(const std::shared_ptr<CDirChangeNotification>& pNotification) const
+{
+	// the handlers are allocated on 16 byte boundaries, their addresses are mixed so that they spread over all the shards
+	auto ullHash = (uint64_t)(uintptr_t)pNotification->m_pDelayedHandler.get();
+	ullHash ^= ullHash >> 33;
+	ullHash *= 0xFF51AFD7ED558CCDULL;
+	ullHash ^= ullHash >> 33;
+	return &_pState->shards[(size_t)(ullHash % _pState->shards.size())];
+}
+
+BOOL CDelayedNotificationPool::WaitForDispatch(CEvent & evDispatched)
+{
+	if (t_pWorkerState == _pState.get())
+	{
+		// called from a handler function, the notification may be queued behind it on the same shard
+		return FALSE;
+	}
+
+	return evDispatched.Lock();
+}
+
+//
+//	Queues pShard on the calling worker's deque (or the next one's, round robin, from outside the pool)
+//	and wakes a parked worker to run or steal it.  An urgent one is run next.
+//
+void CDelayedNotificationPool::_Schedule(CState & state, CShard * pShard, bool bUrgent)
+{
+	auto nWorker = (t_pWorkerState == &state)
+		? t_nWorker
+		: state.nNextWorker.fetch_add(1, std::memory_order_relaxed) % state.workers.size();
+
+	{
+		auto & worker = state.workers[nWorker];
+		std::lock_guard<std::mutex> lock(worker.mut);
+		if (bUrgent)
+		{
+			worker.shards.push_front(pShard);
+		}
+		else
+		{
+			worker.shards.push_back(pShard);
+		}
+	}
+
+	// pairs w/ the fence in _WorkerThreadProc(): either the worker that's about to park
+	// sees the shard when it looks one last time, or this sees it idle
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (state.nIdle.load(std::memory_order_relaxed) > 0)
+	{
+		{
+			std::lock_guard<std::mutex> lock(state.mutIdle);
+			++state.ullWorkVersion;
+		}
+		state.cvIdle.notify_one();
+	}
+}
+
+//
+//	The oldest shard on the worker's own deque, or else the newest one on another's.
+//
+CDelayedNotificationPool::CShard * CDelayedNotificationPool::_TakeShard(CState & state, size_t nWorker)
+{
+	{
+		auto & worker = state.workers[nWorker];
+		std::lock_guard<std::mutex> lock(worker.mut);
+		if (!worker.shards.empty())
+		{
+			auto pShard = worker.shards.front();
+			worker.shards.pop_front();
+			return pShard;
+		}
+	}
+
+	for (size_t i = 1; i < state.workers.size(); ++i)
+	{
+		auto & victim = state.workers[(nWorker + i) % state.workers.size()];
+		std::lock_guard<std::mutex> lock(victim.mut);
+		if (!victim.shards.empty())
+		{
+			auto pShard = victim.shards.back();
+			victim.shards.pop_back();
+			return pShard;
+		}
+	}
+
+	return nullptr;
+}
+
+void CDelayedNotificationPool::_RunShard(CState & state, CShard * pShard)
+{
+	for (int i = 0; i < SHARD_BATCH_SIZE; ++i)
+	{
+		std::shared_ptr<CDirChangeNotification> pNotification;
+		{
+			std::lock_guard<std::mutex> lock(pShard->mut);
+			auto & lane = pShard->controls.empty() ? pShard->notifications : pShard->controls;
+			if (lane.empty())
+			{
+				pShard->bScheduled = false;
+				return;
+			}
+			pNotification = std::move(lane.front());
+			lane.pop_front();
+		}
+
+		try
+		{
+			CDirChangeNotification::DispatchNotificationFunction(pNotification);
+		}
+		catch (...)
+		{
+			LOGF(WARNING, _T("CDelayedNotificationPool -- a handler function has thrown an exception\n"));
+		}
+		// this may release the last reference to the handler (and to the pool)
+		pNotification.reset();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(pShard->mut);
+		if (pShard->notifications.empty()
+			&& pShard->controls.empty())
+		{
+			pShard->bScheduled = false;
+			return;
+		}
+	}
+
+	// still scheduled: to the back of the line, behind the shards that have been waiting,
+	// or to an idle worker that steals it
+	_Schedule(state, pShard);
+}
+
+UINT CDelayedNotificationPool::_WorkerThreadProc(std::shared_ptr<CState> * pThreadState, size_t nWorker)
+{
+	std::shared_ptr<CState> pState(std::move(*pThreadState));
+	delete pThreadState;
+
+	auto & state = *pState;
+	t_pWorkerState = &state;
+	t_nWorker = nWorker;
+
+	while (!state.bStop)
+	{
+		auto pShard = _TakeShard(state, nWorker);
+		if (pShard != nullptr)
+		{
+			_RunShard(state, pShard);
+			continue;
+		}
+
+		uint64_t ullVersion;
+		{
+			std::lock_guard<std::mutex> lock(state.mutIdle);
+			ullVersion = state.ullWorkVersion;
+		}
+		state.nIdle.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		// scheduled in the meantime, by a poster that didn't see this one idle yet
+		pShard = _TakeShard(state, nWorker);
+		if (pShard == nullptr)
+		{
+			std::unique_lock<std::mutex> lock(state.mutIdle);
+			state.cvIdle.wait(lock, [&state, ullVersion]() { return state.ullWorkVersion != ullVersion || state.bStop; });
+		}
+		state.nIdle.fetch_sub(1);
+
+		if (pShard != nullptr)
+		{
+			_RunShard(state, pShard);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include "DelayedNotifier.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+
+//
+//	Dispatches the notifications on a pool of worker threads, one per processor
+//	(FILTERS_PARALLEL_HANDLERS, w/o a message pump).
+//
+//	The notifications are sharded by the watch they come from: the ones of a watch go
+//	to the same shard, which runs them one at a time and in the order they were posted,
+//	so a watch's handler sees its changes exactly as w/ CDelayedNotificationThread.
+//	Different watches run in parallel, a slow handler only holds up its own watches
+//	(and the ones that share its shard).
+//
+//	A shard that has notifications is queued on a worker's deque, the worker runs it
+//	and idle workers steal queued shards from the others, so the work spreads over
+//	the pool even if it's all posted from one thread.  A shard is run by one worker
+//	at a time, it's requeued after SHARD_BATCH_SIZE notifications so that a busy
+//	watch doesn't keep the others on that worker waiting.
+//
+//	Control notifications go ahead of the shard's data notifications, and a shard that
+//	isn't queued yet goes to the front of its worker's deque for them.
+//
+//	NOTE: a CDirectoryChangeHandler that's used for several watches may be called
+//	for them at the same time.
+//
+class CDelayedNotificationPool :
+	public CDelayedNotifier
+{
+public:
+	static std::shared_ptr<CDelayedNotifier>	Instance();
+
+	explicit CDelayedNotificationPool(size_t nThreads);
+	virtual ~CDelayedNotificationPool();
+
+	virtual void	PostNotification(std::shared_ptr<CDirChangeNotification> pNotification) override;
+	virtual void	PostControlNotification(std::shared_ptr<CDirChangeNotification> pNotification) override;
+	virtual BOOL	WaitForDispatch(CEvent & evDispatched) override;
+
+private:
+	enum { SHARDS_PER_THREAD = 16, SHARD_BATCH_SIZE = 32, CACHE_LINE_SIZE = 64 };
+
+	//	the notifications of the watches that hash to it, in order
+	struct CShard
+	{
+		CShard() : bScheduled(false) {}
+
+		std::mutex	mut;
+		std::deque<std::shared_ptr<CDirChangeNotification>>	notifications;
+		std::deque<std::shared_ptr<CDirChangeNotification>>	controls;//the priority lane
+		bool		bScheduled;	//queued on a worker's deque, or being run
+		char		pad[CACHE_LINE_SIZE];
+	};
+
+	//	the shards that are waiting for a worker
+	struct CWorkerDeque
+	{
+		std::mutex	mut;
+		std::deque<CShard *>	shards;
+		char		pad[CACHE_LINE_SIZE];
+	};
+
+	//	shared w/ the threads, which may outlive this object (see ~CDelayedNotificationPool())
+	struct CState
+	{
+		explicit CState(size_t nThreads);
+
+		std::vector<CShard>			shards;
+		std::vector<CWorkerDeque>	workers;
+		std::atomic<size_t>			nNextWorker;	//round robin for the shards scheduled from outside the pool
+		std::atomic<bool>			bStop;
+
+		//	parking
+		std::mutex				mutIdle;
+		std::condition_variable	cvIdle;
+		std::atomic<int>		nIdle;
+		uint64_t				ullWorkVersion;	//bumped w/ mutIdle locked whenever a parked worker may have work
+	};
+
+	CShard *	_GetShard(const std::shared_ptr<CDirChangeNotification>& pNotification) const;
+	static void	_Schedule(CState & state, CShard * pShard, bool bUrgent = false);
+	static CShard *	_TakeShard(CState & state, size_t nWorker);
+	static void	_RunShard(CState & state, CShard * pShard);
+
+	UINT static	_WorkerThreadProc(std::shared_ptr<CState> * pState, size_t nWorker);
+
+private:
+	std::shared_ptr<CState>		_pState;
+	std::vector<std::thread>	_threads;
+};
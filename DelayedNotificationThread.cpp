@@ -1,12 +1,215 @@
 #include "stdafx.h"
 #include "DelayedNotificationThread.h"
+#include "DirChangeNotification.h"
+#include <vector>
 
 
-CDelayedNotificationThread::CDelayedNotificationThread()
+std::shared_ptr<CDelayedNotifier> CDelayedNotificationThread::Instance()
 {
+	static std::mutex s_mutInstance;
+	static std::weak_ptr<CDelayedNotificationThread> s_pInstance;
+
+	std::lock_guard<std::mutex> lock(s_mutInstance);
+	auto pInstance = s_pInstance.lock();
+	if (pInstance == nullptr)
+	{
+		pInstance = std::make_shared<CDelayedNotificationThread>();
+		s_pInstance = pInstance;
+	}
+
+	return pInstance;
 }
 
+CDelayedNotificationThread::CDelayedNotificationThread()
+	: _pQueue(std::make_shared<CQueue>())
+{
+	auto pThreadQueue = new std::shared_ptr<CQueue>(_pQueue);
+	try
+	{
+		_thread = std::thread(_NotificationThreadProc, pThreadQueue);
+	}
+	catch (const std::system_error& e)
+	{
+		delete pThreadQueue;
+		LOGF(FATAL, _T("CDelayedNotificationThread() -- unable to start the notification thread: %s\n"), e.what());
+	}
+}
 
 CDelayedNotificationThread::~CDelayedNotificationThread()
 {
+	_pQueue->bStop = true;
+	_Wake(*_pQueue);
+
+	if (_thread.joinable())
+	{
+		if (_thread.get_id() == std::this_thread::get_id())
+		{
+			// the last handler went away w/ a notification that was just dispatched,
+			// the thread's queue is empty and it exits as soon as it's back.
+			_thread.detach();
+		}
+		else
+		{
+			_thread.join();
+		}
+	}
+}
+
+void CDelayedNotificationThread::PostNotification(std::shared_ptr<CDirChangeNotification> pNotification)
+{
+	auto & queue = *_pQueue;
+	if (queue.bOverflow.load(std::memory_order_acquire)
+		|| !queue.ring.TryPush(pNotification))
+	{
+		std::lock_guard<std::mutex> lock(queue.mutOverflow);
+		queue.overflow.push_back(std::move(pNotification));
+		queue.bOverflow.store(true, std::memory_order_release);
+	}
+
+	_WakeIfParked(queue);
+}
+
+void CDelayedNotificationThread::PostControlNotification(std::shared_ptr<CDirChangeNotification> pNotification)
+{
+	auto & queue = *_pQueue;
+	{
+		std::lock_guard<std::mutex> lock(queue.mutControl);
+		queue.control.push_back(std::move(pNotification));
+		queue.bControl.store(true, std::memory_order_release);
+	}
+
+	_WakeIfParked(queue);
+}
+
+void CDelayedNotificationThread::_WakeIfParked(CQueue & queue)
+{
+	// pairs w/ the fence in _NotificationThreadProc(): either the thread sees the notification
+	// that's just been posted before it parks, or this sees that it has parked
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (queue.bParked.load(std::memory_order_relaxed)
+		&& queue.bParked.exchange(false))
+	{
+		_Wake(queue);
+	}
+}
+
+void CDelayedNotificationThread::_Wake(CQueue & queue)
+{
+	{
+		std::lock_guard<std::mutex> lock(queue.mutWakeup);
+		queue.bWakeup = true;
+	}
+	// not w/ the lock held, or the thread wakes up only to wait for it
+	queue.cvWakeup.notify_one();
+}
+
+BOOL CDelayedNotificationThread::WaitForDispatch(CEvent & evDispatched)
+{
+	if (_thread.get_id() == std::this_thread::get_id())
+	{
+		// called from a handler function, the notification can't be dispatched until it returns
+		return FALSE;
+	}
+
+	return evDispatched.Lock();
+}
+
+UINT CDelayedNotificationThread::_NotificationThreadProc(LPVOID lpvQueue)
+{
+	std::shared_ptr<CQueue> pQueue(std::move(*static_cast<std::shared_ptr<CQueue> *>(lpvQueue)));
+	delete static_cast<std::shared_ptr<CQueue> *>(lpvQueue);
+
+	auto & queue = *pQueue;
+	auto dispatch = [](std::shared_ptr<CDirChangeNotification>& pNotification)
+	{
+		try
+		{
+			CDirChangeNotification::DispatchNotificationFunction(pNotification);
+		}
+		catch (...)
+		{
+			LOGF(WARNING, _T("CDelayedNotificationThread -- a handler function has thrown an exception\n"));
+		}
+		// this may release the last reference to the handler (and to this notifier)
+		pNotification.reset();
+	};
+
+	std::deque<std::shared_ptr<CDirChangeNotification>> control;
+	auto dispatchControl = [&queue, &control, &dispatch]()
+	{
+		if (!queue.bControl.load(std::memory_order_acquire))
+		{
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(queue.mutControl);
+			control.swap(queue.control);
+			queue.bControl.store(false, std::memory_order_release);
+		}
+		while (!control.empty())
+		{
+			dispatch(control.front());
+			control.pop_front();
+		}
+	};
+
+	std::vector<std::shared_ptr<CDirChangeNotification>> batch(DRAIN_BATCH_SIZE);
+	std::deque<std::shared_ptr<CDirChangeNotification>> overflow;
+	for (;;)
+	{
+		dispatchControl();
+
+		auto nCount = queue.ring.PopBatch(batch.data(), batch.size());
+		if (nCount == 0
+			&& queue.bOverflow.load(std::memory_order_acquire))
+		{
+			// what went by the ring was posted first
+			std::lock_guard<std::mutex> lock(queue.mutOverflow);
+			overflow.swap(queue.overflow);
+			queue.bOverflow.store(false, std::memory_order_release);
+		}
+
+		if (nCount == 0
+			&& overflow.empty())
+		{
+			if (queue.bStop)
+			{
+				break;
+			}
+
+			queue.bParked.store(true);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (queue.ring.HasItems()
+				|| queue.bOverflow.load(std::memory_order_acquire)
+				|| queue.bControl.load(std::memory_order_acquire)
+				|| queue.bStop)
+			{
+				// posted in the meantime.  a poster that's seen bParked already wakes the thread up,
+				// which makes the next wait return right away, that's all.
+				queue.bParked.store(false);
+				continue;
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(queue.mutWakeup);
+				queue.cvWakeup.wait(lock, [&queue]() { return queue.bWakeup; });
+				queue.bWakeup = false;
+			}
+			continue;
+		}
+
+		for (size_t i = 0; i < nCount; ++i)
+		{
+			dispatchControl();
+			dispatch(batch[i]);
+		}
+		while (!overflow.empty())
+		{
+			dispatchControl();
+			dispatch(overflow.front());
+			overflow.pop_front();
+		}
+	}
+
+	return 0;
 }
@@ -1,10 +1,73 @@
 #pragma once
 #include "DelayedNotifier.h"
+#include "MpscRing.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+
+//
+//	Dispatches the notifications on a worker thread, for applications w/o a message pump.
+//	One thread is shared by all the handlers, it's started w/ the first of them and stopped
+//	when the last one is gone.
+//
+//	The watches post into a lock-free ring (CMpscRing), the thread takes the notifications out
+//	in batches.  It's only woken up when it's run out of work and parked, a busy thread is fed
+//	w/o any system call.  Should the ring fill up (a handler that's too slow for its watches),
+//	the rest goes to a locked overflow list until the thread has caught up, nothing is dropped
+//	and no watch is kept waiting.
+//	Control notifications have a lane of their own, which the thread checks before each data notification.
+//
 class CDelayedNotificationThread :
 	public CDelayedNotifier
 {
 public:
+	static std::shared_ptr<CDelayedNotifier>	Instance();
+
 	CDelayedNotificationThread();
 	virtual ~CDelayedNotificationThread();
-};
 
+	virtual void	PostNotification(std::shared_ptr<CDirChangeNotification> pNotification) override;
+	virtual void	PostControlNotification(std::shared_ptr<CDirChangeNotification> pNotification) override;
+	virtual BOOL	WaitForDispatch(CEvent & evDispatched) override;
+
+private:
+	//	shared w/ the thread, which may outlive this object (see ~CDelayedNotificationThread())
+	enum { RING_CAPACITY = 1024, DRAIN_BATCH_SIZE = 64 };
+	struct CQueue
+	{
+		CQueue() : ring(RING_CAPACITY), bOverflow(false), bControl(false), bParked(false), bStop(false), bWakeup(false) {}
+
+		CMpscRing<std::shared_ptr<CDirChangeNotification>>	ring;
+
+		//	once the ring has been full, everything goes here until the thread has taken it all,
+		//	which it does once it's emptied the ring: the order they were posted in is kept.
+		std::mutex				mutOverflow;
+		std::deque<std::shared_ptr<CDirChangeNotification>>	overflow;
+		std::atomic<bool>		bOverflow;
+
+		//	the priority lane: looked at before every data notification
+		std::mutex				mutControl;
+		std::deque<std::shared_ptr<CDirChangeNotification>>	control;
+		std::atomic<bool>		bControl;
+
+		std::atomic<bool>		bParked;	//the thread is (about to be) waiting on cvWakeup
+		std::atomic<bool>		bStop;
+
+		//	an auto reset event.  Not a CEvent: that one's set w/ its mutex held, the thread
+		//	it wakes up would block on the mutex right away (see _Wake())
+		std::mutex				mutWakeup;
+		std::condition_variable	cvWakeup;
+		bool					bWakeup;
+	};
+
+	static void	_WakeIfParked(CQueue & queue);
+	static void	_Wake(CQueue & queue);
+	UINT static	_NotificationThreadProc(LPVOID lpvQueue);
+
+private:
+	std::shared_ptr<CQueue>	_pQueue;
+	std::thread				_thread;
+};
@@ -1,12 +1,204 @@
 #include "stdafx.h"
 #include "DelayedNotificationWindow.h"
+#include "DirChangeNotification.h"
 
+#ifdef _WIN32
 
-CDelayedNotificationWindow::CDelayedNotificationWindow()
+static LPCTSTR s_szWindowClassName = _T("DWatcher_DelayedNotificationWindow");
+
+
+std::shared_ptr<CDelayedNotifier> CDelayedNotificationWindow::Instance()
 {
+	// one window per thread, the notifications have to be dispatched by the thread that watches the directory
+	static thread_local std::weak_ptr<CDelayedNotificationWindow> s_pInstance;
+
+	auto pInstance = s_pInstance.lock();
+	if (pInstance == nullptr)
+	{
+		pInstance = std::make_shared<CDelayedNotificationWindow>();
+		s_pInstance = pInstance;
+	}
+
+	return pInstance;
 }
 
+CDelayedNotificationWindow::CDelayedNotificationWindow()
+	: _hWnd(nullptr)
+	, _dwThreadId(GetCurrentThreadId())
+{
+	if (_RegisterWindowClass())
+	{
+		_hWnd = CreateWindowEx(0, s_szWindowClassName, _T("DelayedNotificationWindow"),
+			0, 0, 0, 0, 0, HWND_MESSAGE, nullptr, AfxGetInstanceHandle(), nullptr);
+	}
+
+	if (_hWnd == nullptr)
+	{
+		LOGF(FATAL, _T("CDelayedNotificationWindow() -- unable to create the notification window: %d\n"), GetLastError());
+	}
+}
 
 CDelayedNotificationWindow::~CDelayedNotificationWindow()
 {
+	if (_hWnd != nullptr)
+	{
+		// there's nothing left in its queue, every notification holds a reference to this object.
+		if (GetCurrentThreadId() == _dwThreadId)
+		{
+			DestroyWindow(_hWnd);
+		}
+		else
+		{
+			// only the owner thread can destroy it
+			PostMessage(_hWnd, WM_CLOSE, 0, 0);
+		}
+		_hWnd = nullptr;
+	}
+}
+
+void CDelayedNotificationWindow::PostNotification(std::shared_ptr<CDirChangeNotification> pNotification)
+{
+	_Post(UWM_DELAYED_DIRECTORY_NOTIFICATION, std::move(pNotification));
+}
+
+void CDelayedNotificationWindow::PostControlNotification(std::shared_ptr<CDirChangeNotification> pNotification)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutControl);
+		_controlNotifications.push_back(pNotification);
+	}
+	// dispatched by whichever comes first, this message or the next data one
+	_Post(UWM_DELAYED_CONTROL_NOTIFICATION, std::move(pNotification));
+}
+
+void CDelayedNotificationWindow::_Post(UINT uMsg, std::shared_ptr<CDirChangeNotification> pNotification)
+{
+	// the message owns a reference to the notification until it's dispatched,
+	// which keeps this object alive until then (see _WndProc())
+	auto pMsgNotification = new std::shared_ptr<CDirChangeNotification>(std::move(pNotification));
+	if (_hWnd == nullptr
+		|| !PostMessage(_hWnd, uMsg, reinterpret_cast<WPARAM>(this), reinterpret_cast<LPARAM>(pMsgNotification)))
+	{
+		LOGF(WARNING, _T("CDelayedNotificationWindow::PostNotification() -- unable to post the notification: %d\n"), GetLastError());
+		delete pMsgNotification;
+	}
+}
+
+void CDelayedNotificationWindow::_DispatchControlNotifications()
+{
+	// the handler of the last one keeps this object alive until the loop is done w/ it
+	std::shared_ptr<CDelayedDirectoryChangeHandler> pLastHandler;
+	for (;;)
+	{
+		std::shared_ptr<CDirChangeNotification> pNotification;
+		{
+			std::lock_guard<std::mutex> lock(_mutControl);
+			if (_controlNotifications.empty())
+			{
+				return;
+			}
+			pNotification = std::move(_controlNotifications.front());
+			_controlNotifications.pop_front();
+		}
+		pLastHandler = pNotification->m_pDelayedHandler;
+
+		try
+		{
+			CDirChangeNotification::DispatchNotificationFunction(pNotification);
+		}
+		catch (...)
+		{
+			LOGF(WARNING, _T("CDelayedNotificationWindow -- a handler function has thrown an exception\n"));
+		}
+	}
+}
+
+BOOL CDelayedNotificationWindow::WaitForDispatch(CEvent & evDispatched)
+{
+	if (GetCurrentThreadId() != _dwThreadId)
+	{
+		return evDispatched.Lock();
+	}
+
+	// the notification is dispatched by this thread's message pump, keep pumping while waiting
+	HANDLE hEvent = evDispatched.m_hObject;
+	for (;;)
+	{
+		auto dwWait = MsgWaitForMultipleObjects(1, &hEvent, FALSE, INFINITE, QS_ALLINPUT);
+		if (dwWait == WAIT_OBJECT_0)
+		{
+			return TRUE;
+		}
+		if (dwWait != WAIT_OBJECT_0 + 1)
+		{
+			return FALSE;
+		}
+
+		MSG msg;
+		while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE))
+		{
+			if (msg.message == WM_QUIT)
+			{
+				// leave it for the application's own message loop
+				PostQuitMessage((int)msg.wParam);
+				return FALSE;
+			}
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+		}
+	}
 }
+
+LRESULT CALLBACK CDelayedNotificationWindow::_WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+	if (uMsg == UWM_DELAYED_CONTROL_NOTIFICATION)
+	{
+		std::unique_ptr<std::shared_ptr<CDirChangeNotification>> pNotification(
+			reinterpret_cast<std::shared_ptr<CDirChangeNotification> *>(lParam));
+		// a notification that's been dispatched already has let go of its handler,
+		// and the window may be gone w/ it. otherwise it's still queued, and keeps the window alive.
+		if ((*pNotification)->m_pDelayedHandler != nullptr)
+		{
+			reinterpret_cast<CDelayedNotificationWindow *>(wParam)->_DispatchControlNotifications();
+		}
+		return 0;
+	}
+
+	if (uMsg == UWM_DELAYED_DIRECTORY_NOTIFICATION)
+	{
+		std::unique_ptr<std::shared_ptr<CDirChangeNotification>> pNotification(
+			reinterpret_cast<std::shared_ptr<CDirChangeNotification> *>(lParam));
+		try
+		{
+			// the control notifications that have been posted in the meantime go first
+			reinterpret_cast<CDelayedNotificationWindow *>(wParam)->_DispatchControlNotifications();
+			CDirChangeNotification::DispatchNotificationFunction(*pNotification);
+		}
+		catch (...)
+		{
+			LOGF(WARNING, _T("CDelayedNotificationWindow -- a handler function has thrown an exception\n"));
+		}
+		return 0;
+	}
+
+	return DefWindowProc(hWnd, uMsg, wParam, lParam);
+}
+
+BOOL CDelayedNotificationWindow::_RegisterWindowClass()
+{
+	WNDCLASSEX wc = { 0 };
+	if (GetClassInfoEx(AfxGetInstanceHandle(), s_szWindowClassName, &wc))
+	{
+		return TRUE;
+	}
+
+	wc.cbSize = sizeof(wc);
+	wc.lpfnWndProc = _WndProc;
+	wc.hInstance = AfxGetInstanceHandle();
+	wc.lpszClassName = s_szWindowClassName;
+
+	return RegisterClassEx(&wc) != 0
+		|| GetLastError() == ERROR_CLASS_ALREADY_EXISTS;
+}
+
+#endif // _WIN32
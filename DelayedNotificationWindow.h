@@ -1,10 +1,49 @@
 #pragma once
 #include "DelayedNotifier.h"
+#include <deque>
+#include <mutex>
+
+#ifdef _WIN32
+
+//
+//	Dispatches the notifications in the context of the thread that created it
+//	(the one that called CDirectoryChangeWatcher::WatchDirectory()), through a
+//	hidden message only window. REQUIRES that the thread has a message pump.
+//
+//	The window is shared by the handlers of the same thread, it's destroyed w/ the last of them.
+//
+//	Control notifications are posted as messages too, but also kept in _controlNotifications,
+//	which is dispatched before each data notification: they don't wait behind the data
+//	messages that were posted before them.
+//
 class CDelayedNotificationWindow :
 	public CDelayedNotifier
 {
 public:
+	static std::shared_ptr<CDelayedNotifier>	Instance();
+
 	CDelayedNotificationWindow();
 	virtual ~CDelayedNotificationWindow();
+
+	virtual void	PostNotification(std::shared_ptr<CDirChangeNotification> pNotification) override;
+	virtual void	PostControlNotification(std::shared_ptr<CDirChangeNotification> pNotification) override;
+	virtual BOOL	WaitForDispatch(CEvent & evDispatched) override;
+
+private:
+	enum { UWM_DELAYED_DIRECTORY_NOTIFICATION = WM_APP + 1024, UWM_DELAYED_CONTROL_NOTIFICATION };
+
+	void	_Post(UINT uMsg, std::shared_ptr<CDirChangeNotification> pNotification);
+	void	_DispatchControlNotifications();
+
+	static LRESULT CALLBACK	_WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+	static BOOL		_RegisterWindowClass();
+
+private:
+	HWND	_hWnd;
+	DWORD	_dwThreadId;//the thread that owns _hWnd
+
+	std::mutex	_mutControl;
+	std::deque<std::shared_ptr<CDirChangeNotification>>	_controlNotifications;//posted and not dispatched yet
 };
 
+#endif // _WIN32
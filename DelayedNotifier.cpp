@@ -10,3 +10,8 @@ CDelayedNotifier::CDelayedNotifier()
 CDelayedNotifier::~CDelayedNotifier()
 {
 }
+
+void CDelayedNotifier::PostControlNotification(std::shared_ptr<CDirChangeNotification> pNotification)
+{
+	PostNotification(std::move(pNotification));
+}
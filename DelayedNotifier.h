@@ -1,8 +1,36 @@
 #pragma once
+#include <memory>
+
+
+class CDirChangeNotification;
+
+//
+//	Delivers the notifications posted by a CDelayedDirectoryChangeHandler to
+//	the thread that runs the CDirectoryChangeHandler functions:
+//
+//	CDelayedNotificationWindow	-- the thread that called CDirectoryChangeWatcher::WatchDirectory(),
+//								   through its message pump (bAppHasGUI == true, Windows only)
+//	CDelayedNotificationThread	-- a worker thread (bAppHasGUI == false)
+//	CDelayedNotificationPool	-- a pool of worker threads (bAppHasGUI == false w/ FILTERS_PARALLEL_HANDLERS)
+//	CDelayedNotificationPollable	-- the application's event loop, through a descriptor (FILTERS_POLLABLE_NOTIFICATIONS, not on Windows)
+//
+//	The notifications of a watch are dispatched one at a time, in the order they were posted,
+//	except for the control notifications, which may overtake the data notifications (see
+//	PostControlNotification(), CDelayedDirectoryChangeHandler puts them back in order).
+//
 class CDelayedNotifier
 {
 public:
 	CDelayedNotifier();
 	virtual ~CDelayedNotifier();
-};
 
+	virtual void	PostNotification(std::shared_ptr<CDirChangeNotification> pNotification) = 0;
+	//	the priority lane, for the control notifications (CDirChangeNotification::IsControl()):
+	//	dispatched ahead of the data notifications that are waiting, in the order they were posted.
+	//	The default is the same lane as the data.
+	virtual void	PostControlNotification(std::shared_ptr<CDirChangeNotification> pNotification);
+
+	//	waits until evDispatched has been set by a notification that's dispatched by this notifier.
+	//	returns FALSE right away if that can't happen while the calling thread waits.
+	virtual BOOL	WaitForDispatch(CEvent & evDispatched) = 0;
+};
@@ -1,12 +1,85 @@
 #include "stdafx.h"
 #include "DirChangeNotification.h"
+#include "DelayedDirectoryChangeHandler.h"
 
 
-CDirChangeNotification::CDirChangeNotification()
+CDirChangeNotification::CDirChangeNotification(std::shared_ptr<CDelayedDirectoryChangeHandler> pDelayedHandler)
+	: m_pDelayedHandler(std::move(pDelayedHandler))
+	, m_eFunctionToDispatch(eFunctionNotDefined)
+	, m_dwError(ERROR_SUCCESS)
+	, m_ullSequence(0)
 {
 }
 
-
 CDirChangeNotification::~CDirChangeNotification()
 {
 }
+
+void CDirChangeNotification::PostOn_ReadDirectoryChangesError(DWORD dwError, const CString & strDirName)
+{
+	m_dwError = dwError;
+	m_strDirName = strDirName;
+	_Post(eOn_ReadDirectoryChangesError);
+}
+
+void CDirChangeNotification::PostOn_WatchStarted(DWORD dwError, const CString & strDirName)
+{
+	m_dwError = dwError;
+	m_strDirName = strDirName;
+	_Post(eOn_WatchStarted);
+}
+
+void CDirChangeNotification::PostOn_WatchStopped(const CString & strDirName)
+{
+	m_strDirName = strDirName;
+	_Post(eOn_WatchStopped);
+}
+
+void CDirChangeNotification::SetOn_EventBatch(std::vector<CDirChangeEvent>&& events)
+{
+	// the caller gets the (empty) buffer of the notification's previous batch back to fill next
+	m_events.clear();
+	m_events.swap(events);
+	m_eFunctionToDispatch = eOn_EventBatch;
+}
+
+void CDirChangeNotification::SetOn_SubtreeDirty(const CString & strDirName)
+{
+	m_strDirName = strDirName;
+	m_eFunctionToDispatch = eOn_SubtreeDirty;
+}
+
+void CDirChangeNotification::Post()
+{
+	_Post(m_eFunctionToDispatch);
+}
+
+void CDirChangeNotification::DispatchNotificationFunction(const std::shared_ptr<CDirChangeNotification>& pNotification)
+{
+	ASSERT(pNotification != nullptr);
+
+	// the handler may be released along w/ the notification, keep it until it's done
+	auto pDelayedHandler = pNotification->m_pDelayedHandler;
+	if (pDelayedHandler != nullptr)
+	{
+		pDelayedHandler->DispatchNotificationFunction(pNotification);
+	}
+}
+
+void CDirChangeNotification::Clear()
+{
+	m_pDelayedHandler.reset();
+	m_eFunctionToDispatch = eFunctionNotDefined;
+	m_events.clear();//keeps the capacity, see SetOn_EventBatch()
+	m_strDirName.Empty();
+	m_dwError = ERROR_SUCCESS;
+	m_ullSequence = 0;
+}
+
+void CDirChangeNotification::_Post(eFunctionToDispatch eFunction)
+{
+	ASSERT(m_pDelayedHandler != nullptr);
+
+	m_eFunctionToDispatch = eFunction;
+	m_pDelayedHandler->PostNotification(shared_from_this());
+}
@@ -1,8 +1,71 @@
 #pragma once
-class CDirChangeNotification
+#include "DirectoryChangeHandler.h"
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+
+class CDelayedDirectoryChangeHandler;
+
+//
+//	A call to one of the CDirectoryChangeHandler functions, on its way
+//	from the thread that found the change (CDirectoryChangeWatcher::MonitorDirectoryChanges())
+//	to the thread that runs the handler (see CDelayedNotifier).
+//
+//	The changes found by one read of the directory travel together, as one
+//	eOn_EventBatch notification.
+//
+class CDirChangeNotification : public std::enable_shared_from_this<CDirChangeNotification>
 {
 public:
-	CDirChangeNotification();
+	enum eFunctionToDispatch {
+		eFunctionNotDefined = -1,
+		eOn_EventBatch,						//On_EventBatch(), which calls On_FileAdded() etc. by default
+		eOn_ReadDirectoryChangesError,
+		eOn_WatchStarted,
+		eOn_WatchStopped,
+		eOn_SubtreeDirty					//BACKPRESSURE_RESCAN, stands in for the batches that were dropped
+	};
+
+	CDirChangeNotification(std::shared_ptr<CDelayedDirectoryChangeHandler> pDelayedHandler);
 	~CDirChangeNotification();
-};
 
+	CDirChangeNotification(const CDirChangeNotification&) = delete;
+	CDirChangeNotification& operator=(const CDirChangeNotification&) = delete;
+
+	//	these fill in the notification and post it w/ CDelayedDirectoryChangeHandler::PostNotification()
+	//	events is swapped w/ the notification's previous, emptied, event buffer
+	void	PostOn_ReadDirectoryChangesError(DWORD dwError, const CString& strDirName);
+	void	PostOn_WatchStarted(DWORD dwError, const CString& strDirName);
+	void	PostOn_WatchStopped(const CString& strDirName);
+
+	//	these only fill in the notification, for CDelayedDirectoryChangeHandler to post it w/ Post() later
+	void	SetOn_EventBatch(std::vector<CDirChangeEvent>&& events);
+	void	SetOn_SubtreeDirty(const CString& strDirName);
+	void	Post();
+
+	//	back to the CDelayedDirectoryChangeHandler, in the context of the notifier's thread
+	static void	DispatchNotificationFunction(const std::shared_ptr<CDirChangeNotification>& pNotification);
+
+	//	makes the object reusable
+	void	Clear();
+
+	//	a watch started/stopped or failed, these go through the notifier's priority lane
+	bool	IsControl() const
+	{
+		return m_eFunctionToDispatch == eOn_ReadDirectoryChangesError
+			|| m_eFunctionToDispatch == eOn_WatchStarted
+			|| m_eFunctionToDispatch == eOn_WatchStopped;
+	}
+
+public:
+	std::shared_ptr<CDelayedDirectoryChangeHandler>	m_pDelayedHandler;//keeps the handler alive until this has been dispatched
+	eFunctionToDispatch			m_eFunctionToDispatch;
+	std::vector<CDirChangeEvent>	m_events;//eOn_EventBatch
+	CString		m_strDirName;//eOn_ReadDirectoryChangesError, eOn_WatchStarted, eOn_WatchStopped, eOn_SubtreeDirty
+	DWORD		m_dwError;
+	uint64_t	m_ullSequence;//the order it was posted in, among its handler's notifications
+
+private:
+	void	_Post(eFunctionToDispatch eFunction);
+};
@@ -0,0 +1,414 @@
+#include "stdafx.h"
+#include "DirChangeStream.h"
+#include "DelayedNotifier.h"
+#include "DirChangeNotification.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+
+//
+//	The notifier of a stream: holds the watch's notifications until the consumer asks for
+//	the next batch, and dispatches them then, on the consumer's thread (or on the posting
+//	thread, for a pending NextBatchAsync()).  The batches that come out of the dispatch
+//	(CDirChangeStream::On_EventBatch()) wait in _ready until they're handed out.
+//
+//	Shared by the stream and its CDelayedDirectoryChangeHandler, it doesn't reference either
+//	one itself.  The notifications that it holds reference the latter, they're all let go of
+//	when the stream ends.
+//
+class CDirChangeStream::CChannel :
+	public CDelayedNotifier
+	, public std::enable_shared_from_this<CDirChangeStream::CChannel>
+{
+public:
+	CChannel()
+		: _bEnded(false)
+		, _dwError(ERROR_SUCCESS)
+	{
+	}
+
+	virtual void	PostNotification(std::shared_ptr<CDirChangeNotification> pNotification) override;
+	virtual void	PostControlNotification(std::shared_ptr<CDirChangeNotification> pNotification) override;
+	virtual BOOL	WaitForDispatch(CEvent & evDispatched) override;
+
+	BOOL	TryNextBatch(OUT std::vector<CDirChangeEvent>& events);
+	BOOL	NextBatch(OUT std::vector<CDirChangeEvent>& events, DWORD dwTimeoutMs);
+	BOOL	NextBatchAsync(OUT std::vector<CDirChangeEvent>& events, CCompletion fnCompletion, CExecutor fnExecutor);
+
+	//	from the stream's handler functions, in the dispatch
+	void	PushBatch(std::vector<CDirChangeEvent>&& events);
+
+	bool	IsEnded() const;
+	DWORD	GetError() const;
+
+private:
+	bool	_TakeBatch(OUT std::vector<CDirChangeEvent>& events);
+	void	_Dispatch(std::shared_ptr<CDirChangeNotification> pNotification);
+	void	_CompleteWaiter();
+	bool	_IsDrained() const { return _held.empty() && _ready.empty(); }//_mut is locked
+
+private:
+	//	one at a time, so that the batches are handed out in the order they were posted
+	std::mutex		_mutDispatch;
+	std::thread::id	_idDispatchingThread;
+
+	mutable std::mutex		_mut;
+	std::condition_variable	_cvPosted;
+	std::deque<std::shared_ptr<CDirChangeNotification>>	_held;	//posted, not dispatched yet
+	std::deque<std::vector<CDirChangeEvent>>	_ready;	//dispatched, not handed out yet
+	CCompletion		_fnCompletion;	//a pending NextBatchAsync()
+	CExecutor		_fnExecutor;
+	bool			_bEnded;
+	DWORD			_dwError;
+};
+
+void CDirChangeStream::CChannel::PostNotification(std::shared_ptr<CDirChangeNotification> pNotification)
+{
+	// the dispatch may let go of the last handler, and w/ it of this
+	auto pKeepAlive = shared_from_this();
+
+	bool bWaiter;
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		if (!_bEnded)
+		{
+			_held.push_back(std::move(pNotification));
+		}
+		bWaiter = (bool)_fnCompletion;
+	}
+
+	if (pNotification != nullptr)
+	{
+		// posted after the end, nobody's going to ask for it: through the handler (which disposes of it) to nowhere
+		std::lock_guard<std::mutex> lockDispatch(_mutDispatch);
+		_Dispatch(std::move(pNotification));
+		return;
+	}
+
+	if (bWaiter)
+	{
+		_CompleteWaiter();
+	}
+	else
+	{
+		_cvPosted.notify_one();
+	}
+}
+
+//
+//	Handled right away: a watch that's stopped or failed doesn't wait for the consumer.
+//	The changes that are still held were posted before it, they're dispatched first and wait
+//	to be handed out ahead of the end of the stream.
+//
+void CDirChangeStream::CChannel::PostControlNotification(std::shared_ptr<CDirChangeNotification> pNotification)
+{
+	// the notification has been cleared once it's been dispatched
+	auto eFunction = pNotification->m_eFunctionToDispatch;
+	auto dwError = pNotification->m_dwError;
+	bool bEnds = (eFunction == CDirChangeNotification::eOn_WatchStopped)
+		|| (eFunction == CDirChangeNotification::eOn_ReadDirectoryChangesError)
+		|| (eFunction == CDirChangeNotification::eOn_WatchStarted && dwError != ERROR_SUCCESS);
+	auto pKeepAlive = shared_from_this();
+
+	{
+		std::lock_guard<std::mutex> lockDispatch(_mutDispatch);
+
+		std::deque<std::shared_ptr<CDirChangeNotification>> held;
+		{
+			std::lock_guard<std::mutex> lock(_mut);
+			held.swap(_held);
+		}
+		for (auto & pHeld : held)
+		{
+			_Dispatch(std::move(pHeld));
+		}
+		_Dispatch(std::move(pNotification));
+
+		if (bEnds)
+		{
+			std::lock_guard<std::mutex> lock(_mut);
+			_bEnded = true;
+			_dwError = (eFunction == CDirChangeNotification::eOn_WatchStopped) ? ERROR_SUCCESS : dwError;
+		}
+	}
+
+	_cvPosted.notify_all();
+	_CompleteWaiter();
+}
+
+BOOL CDirChangeStream::CChannel::WaitForDispatch(CEvent & evDispatched)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		if (_idDispatchingThread == std::this_thread::get_id())
+		{
+			// called from the dispatch
+			return FALSE;
+		}
+	}
+
+	// the control notifications are dispatched by the thread that posts them, not by the consumer
+	return evDispatched.Lock();
+}
+
+//
+//	The next batch that's ready, dispatching the held notifications one by one until there is
+//	one: a notification may have no batch to show for it (filtered out, or dispatched already
+//	ahead of a control notification, see CDelayedDirectoryChangeHandler::_DispatchQueuedBefore()).
+//
+bool CDirChangeStream::CChannel::_TakeBatch(OUT std::vector<CDirChangeEvent>& events)
+{
+	std::lock_guard<std::mutex> lockDispatch(_mutDispatch);
+	for (;;)
+	{
+		std::shared_ptr<CDirChangeNotification> pNotification;
+		{
+			std::lock_guard<std::mutex> lock(_mut);
+			if (!_ready.empty())
+			{
+				events = std::move(_ready.front());
+				_ready.pop_front();
+				return true;
+			}
+			if (_held.empty())
+			{
+				return false;
+			}
+			pNotification = std::move(_held.front());
+			_held.pop_front();
+		}
+
+		_Dispatch(std::move(pNotification));
+	}
+}
+
+//	_mutDispatch is locked
+void CDirChangeStream::CChannel::_Dispatch(std::shared_ptr<CDirChangeNotification> pNotification)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		_idDispatchingThread = std::this_thread::get_id();
+	}
+
+	try
+	{
+		CDirChangeNotification::DispatchNotificationFunction(pNotification);
+	}
+	catch (...)
+	{
+		LOGF(WARNING, _T("CDirChangeStream -- a handler function has thrown an exception\n"));
+	}
+	// this may release the last reference to the handler
+	pNotification.reset();
+
+	std::lock_guard<std::mutex> lock(_mut);
+	_idDispatchingThread = std::thread::id();
+}
+
+BOOL CDirChangeStream::CChannel::TryNextBatch(OUT std::vector<CDirChangeEvent>& events)
+{
+	if (_TakeBatch(events))
+	{
+		return TRUE;
+	}
+
+	std::lock_guard<std::mutex> lock(_mut);
+	if (_bEnded && _IsDrained())
+	{
+		events.clear();
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+BOOL CDirChangeStream::CChannel::NextBatch(OUT std::vector<CDirChangeEvent>& events, DWORD dwTimeoutMs)
+{
+	auto tpDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(dwTimeoutMs);
+	for (;;)
+	{
+		if (_TakeBatch(events))
+		{
+			return TRUE;
+		}
+
+		std::unique_lock<std::mutex> lock(_mut);
+		auto fnPosted = [this]() { return _bEnded || !_IsDrained(); };
+		if (dwTimeoutMs == INFINITE)
+		{
+			_cvPosted.wait(lock, fnPosted);
+		}
+		else if (!_cvPosted.wait_until(lock, tpDeadline, fnPosted))
+		{
+			return FALSE;
+		}
+
+		if (_bEnded && _IsDrained())
+		{
+			events.clear();
+			return TRUE;
+		}
+	}
+}
+
+BOOL CDirChangeStream::CChannel::NextBatchAsync(OUT std::vector<CDirChangeEvent>& events, CCompletion fnCompletion, CExecutor fnExecutor)
+{
+	for (;;)
+	{
+		if (_TakeBatch(events))
+		{
+			return TRUE;
+		}
+
+		std::lock_guard<std::mutex> lock(_mut);
+		if (_bEnded && _IsDrained())
+		{
+			events.clear();
+			return TRUE;
+		}
+		ASSERT(!_fnCompletion);
+
+		// checked w/ _mut locked: whatever's posted from now on sees the waiter
+		if (_IsDrained())
+		{
+			_fnCompletion = std::move(fnCompletion);
+			_fnExecutor = std::move(fnExecutor);
+			return FALSE;
+		}
+	}
+}
+
+//
+//	Hands the next batch (or the end of the stream) to a pending NextBatchAsync(), if there's one.
+//
+void CDirChangeStream::CChannel::_CompleteWaiter()
+{
+	CCompletion fnCompletion;
+	CExecutor fnExecutor;
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		if (!_fnCompletion)
+		{
+			return;
+		}
+		fnCompletion = std::move(_fnCompletion);
+		fnExecutor = std::move(_fnExecutor);
+		_fnCompletion = nullptr;
+		_fnExecutor = nullptr;
+	}
+
+	std::vector<CDirChangeEvent> events;
+	while (!_TakeBatch(events))
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		if (_bEnded && _IsDrained())
+		{
+			events.clear();
+			break;
+		}
+		if (_IsDrained())
+		{
+			// nothing to show for it (filtered out), back to waiting
+			_fnCompletion = std::move(fnCompletion);
+			_fnExecutor = std::move(fnExecutor);
+			return;
+		}
+		// posted in the meantime
+	}
+
+	if (fnExecutor)
+	{
+		// std::function has to be copyable, the batch goes along in a shared_ptr
+		auto pEvents = std::make_shared<std::vector<CDirChangeEvent>>(std::move(events));
+		fnExecutor([fnCompletion, pEvents]() { fnCompletion(std::move(*pEvents)); });
+	}
+	else
+	{
+		fnCompletion(std::move(events));
+	}
+}
+
+void CDirChangeStream::CChannel::PushBatch(std::vector<CDirChangeEvent>&& events)
+{
+	std::lock_guard<std::mutex> lock(_mut);
+	if (!_bEnded)
+	{
+		_ready.push_back(std::move(events));
+	}
+}
+
+bool CDirChangeStream::CChannel::IsEnded() const
+{
+	std::lock_guard<std::mutex> lock(_mut);
+	return _bEnded;
+}
+
+DWORD CDirChangeStream::CChannel::GetError() const
+{
+	std::lock_guard<std::mutex> lock(_mut);
+	return _dwError;
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+CDirChangeStream::CDirChangeStream()
+	: _pChannel(std::make_shared<CChannel>())
+{
+}
+
+CDirChangeStream::~CDirChangeStream()
+{
+}
+
+BOOL CDirChangeStream::TryNextBatch(OUT std::vector<CDirChangeEvent>& events)
+{
+	return _pChannel->TryNextBatch(events);
+}
+
+BOOL CDirChangeStream::NextBatch(OUT std::vector<CDirChangeEvent>& events, DWORD dwTimeoutMs)
+{
+	return _pChannel->NextBatch(events, dwTimeoutMs);
+}
+
+BOOL CDirChangeStream::NextBatchAsync(OUT std::vector<CDirChangeEvent>& events, CCompletion fnCompletion, CExecutor fnExecutor)
+{
+	return _pChannel->NextBatchAsync(events, std::move(fnCompletion), std::move(fnExecutor));
+}
+
+bool CDirChangeStream::IsEnded() const
+{
+	return _pChannel->IsEnded();
+}
+
+DWORD CDirChangeStream::GetError() const
+{
+	return _pChannel->GetError();
+}
+
+void CDirChangeStream::On_EventBatch(const CDirChangeEventBatch & batch)
+{
+	if (batch.empty())
+	{
+		// all filtered out, an empty batch would end the stream
+		return;
+	}
+
+	// the batch is only valid during the call
+	_pChannel->PushBatch(std::vector<CDirChangeEvent>(batch.begin(), batch.end()));
+}
+
+void CDirChangeStream::On_SubtreeDirty(const CString& strDirectoryName)
+{
+	std::vector<CDirChangeEvent> events(1);
+	events[0].dwAction = FILE_ACTION_SUBTREE_DIRTY;
+	events[0].strFileName = strDirectoryName;
+	_pChannel->PushBatch(std::move(events));
+}
+
+std::shared_ptr<CDelayedNotifier> CDirChangeStream::GetDelayedNotifier()
+{
+	return _pChannel;
+}
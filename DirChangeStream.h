@@ -0,0 +1,112 @@
+#pragma once
+#include "DirectoryChangeHandler.h"
+#include <functional>
+#include <memory>
+#include <vector>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+
+//	not a Windows value: only in the batches of a CDirChangeStream, stands in for On_SubtreeDirty()
+//	(strFileName is the directory whose changes have been dropped)
+#define FILE_ACTION_SUBTREE_DIRTY		0x00000200
+
+
+/***********************************
+A CDirectoryChangeHandler that's read from, rather than called: the changes of the
+watch are taken out as batches by the consumer, on the consumer's own thread.
+
+	auto pStream = new CDirChangeStream();
+	pStream->AddRef();
+	watcher.WatchDirectory(strDir, FILE_NOTIFY_CHANGE_FILE_NAME, pStream, TRUE);
+	...
+	std::vector<CDirChangeEvent> events;
+	while (pStream->NextBatch(events) && !events.empty())
+	{
+		...
+	}
+	pStream->Release();
+
+A batch is the events of one read of the directory (see On_EventBatch()), after the
+filters.  An empty batch means the stream has ended: the watch has been stopped or has
+failed (see GetError()), whatever was read before that has been handed out.
+
+The notifications of the watch are kept as they were posted until they're asked for,
+the filters and On_EventBatch() run in the call that takes them out, and the completion
+of NextBatchAsync() runs right where the batch was posted, or on the executor given.
+There's no notifier thread in between, and the changes that pile up are the ones the
+watch's backpressure policy bounds (CDirectoryChangeWatcher::SetBackpressurePolicy()):
+BACKPRESSURE_BLOCK holds the watch up until the consumer has caught up.
+
+The control notifications (start/stop/error) are handled as soon as they're posted.
+
+One consumer at a time: TryNextBatch(), NextBatch() and NextBatchAsync() aren't to be
+called while another one of them is running, or while a NextBatchAsync() is pending.
+A stream handles one watch.
+
+W/ C++20 coroutines:
+	auto events = co_await pStream->AwaitNextBatch(executor);
+************************************/
+class CDirChangeStream : public CDirectoryChangeHandler
+{
+public:
+	//	runs the function it's given, on whatever thread it likes
+	typedef std::function<void(std::function<void()>)>	CExecutor;
+	typedef std::function<void(std::vector<CDirChangeEvent>&&)>	CCompletion;
+
+	CDirChangeStream();
+	virtual ~CDirChangeStream();
+
+	//	TRUE w/ the next batch if there is one (an empty one: the stream has ended), FALSE right away if not
+	BOOL	TryNextBatch(OUT std::vector<CDirChangeEvent>& events);
+	//	same, waits up to dwTimeoutMs for the next batch, FALSE if there wasn't any in time
+	BOOL	NextBatch(OUT std::vector<CDirChangeEvent>& events, DWORD dwTimeoutMs = INFINITE);
+	//	TRUE w/ the next batch if there is one already, like TryNextBatch(), fnCompletion isn't called then.
+	//	FALSE otherwise, and fnCompletion is called w/ the next batch once it's been posted, through fnExecutor
+	//	(w/o one: on the thread that posted it, which must not be held up).
+	BOOL	NextBatchAsync(OUT std::vector<CDirChangeEvent>& events, CCompletion fnCompletion, CExecutor fnExecutor = CExecutor());
+
+	bool	IsEnded() const;
+	//	why the stream has ended, ERROR_SUCCESS if it's been unwatched
+	DWORD	GetError() const;
+
+#if defined(__cpp_impl_coroutine)
+	class CBatchAwaiter
+	{
+	public:
+		CBatchAwaiter(CDirChangeStream & stream, CExecutor fnExecutor)
+			: _stream(stream)
+			, _fnExecutor(std::move(fnExecutor))
+		{
+		}
+
+		bool	await_ready() { return _stream.TryNextBatch(_events) != FALSE; }
+		bool	await_suspend(std::coroutine_handle<> hCoroutine)
+		{
+			// the awaiter lives in the coroutine's frame until it's resumed
+			return !_stream.NextBatchAsync(_events,
+				[this, hCoroutine](std::vector<CDirChangeEvent>&& events) { _events = std::move(events); hCoroutine.resume(); },
+				_fnExecutor);
+		}
+		std::vector<CDirChangeEvent>	await_resume() { return std::move(_events); }
+
+	private:
+		CDirChangeStream &	_stream;
+		CExecutor			_fnExecutor;
+		std::vector<CDirChangeEvent>	_events;
+	};
+
+	//	co_await it for the next batch, the coroutine is resumed through fnExecutor (see NextBatchAsync())
+	CBatchAwaiter	AwaitNextBatch(CExecutor fnExecutor = CExecutor()) { return CBatchAwaiter(*this, std::move(fnExecutor)); }
+#endif
+
+protected:
+	virtual void On_EventBatch(const CDirChangeEventBatch & batch) override;
+	virtual void On_SubtreeDirty(const CString& strDirectoryName) override;
+
+	virtual std::shared_ptr<CDelayedNotifier> GetDelayedNotifier() override;
+
+private:
+	class CChannel;
+	std::shared_ptr<CChannel>	_pChannel;
+};
@@ -1,5 +1,6 @@
 #include "stdafx.h"
 #include "DirectoryChangeHandler.h"
+#include "DirectoryChangeWatcher.h"
 
 
 CDirectoryChangeHandler::CDirectoryChangeHandler()
@@ -36,11 +37,16 @@ long CDirectoryChangeHandler::CurrentRefCount() const
 
 BOOL CDirectoryChangeHandler::UnWatchDirectory()
 {
-	std::lock_guard<std::mutex> lock(_mutWatcher);
+	std::shared_ptr<CDirectoryChangeWatcher> pDirChangeWatcher;
+	{
+		std::lock_guard<std::recursive_mutex> lock(_mutWatcher);
+		pDirChangeWatcher = _pDirChangeWatcher;
+	}
 
-	if (_pDirChangeWatcher != nullptr)
+	// not w/ _mutWatcher held, unwatching releases the references this handler has to the watcher
+	if (pDirChangeWatcher != nullptr)
 	{
-		return _pDirChangeWatcher->UnwatichDirectory(this);
+		return pDirChangeWatcher->_UnWatchDirectory(this);
 	}
 
 	return TRUE;
@@ -50,45 +56,83 @@ BOOL CDirectoryChangeHandler::UnWatchDirectory()
 //////////////////////////////////////////////////////////////////////////
 void CDirectoryChangeHandler::On_FileAdded(const CString& strFileName)
 {
-	LOGF(INFO, _T("The following file was added: %s\n"), strFileName);
+	LOGF(INFO, _T("The following file was added: %s\n"), (LPCTSTR)strFileName);
 }
 
 void CDirectoryChangeHandler::On_FileRemoved(const CString& strFileName)
 {
-	LOGF(INFO, _T("The following file was removed: %s\n"), strFileName);
+	LOGF(INFO, _T("The following file was removed: %s\n"), (LPCTSTR)strFileName);
 }
 
 void CDirectoryChangeHandler::On_FileNameChanged(const CString& strFileName, const CString& strNewFileName)
 {
-	LOGF(INFO, _T("The file %s was RENAMED to %s\n"), strFileName, strNewFileName);
+	LOGF(INFO, _T("The file %s was RENAMED to %s\n"), (LPCTSTR)strFileName, (LPCTSTR)strNewFileName);
 }
 
 void CDirectoryChangeHandler::On_FileModified(const CString& strFileName)
 {
-	LOGF(INFO, _T("The following file was modified: %s\n"), strFileName);
+	LOGF(INFO, _T("The following file was modified: %s\n"), (LPCTSTR)strFileName);
+}
+
+void CDirectoryChangeHandler::On_FileQuiescent(const CString& strFileName)
+{
+	LOGF(INFO, _T("The following file has settled: %s\n"), (LPCTSTR)strFileName);
+}
+
+void CDirectoryChangeHandler::On_EventBatch(const CDirChangeEventBatch & batch)
+{
+	for (const auto & event : batch)
+	{
+		switch (event.dwAction)
+		{
+		case FILE_ACTION_ADDED:
+			On_FileAdded(event.strFileName);
+			break;
+		case FILE_ACTION_REMOVED:
+			On_FileRemoved(event.strFileName);
+			break;
+		case FILE_ACTION_MODIFIED:
+			On_FileModified(event.strFileName);
+			break;
+		case FILE_ACTION_RENAMED_OLD_NAME:
+			On_FileNameChanged(event.strFileName, event.strNewFileName);
+			break;
+		case FILE_ACTION_QUIESCENT:
+			On_FileQuiescent(event.strFileName);
+			break;
+		default:
+			LOGF(WARNING, _T("CDirectoryChangeHandler::On_EventBatch() -- unknown FILE_ACTION_ value! : %u\n"), event.dwAction);
+			break;
+		}
+	}
 }
 
 void CDirectoryChangeHandler::On_ReadDirectoryChangesError(DWORD dwError, const CString& strDirectoryName)
 {
-	LOGF(FATAL, _T("An error has occurred on a watched directory!\n, This directory has become unwatched! -- %s \n"), strDirectoryName);
-	LOGF(FATAL, _T("ReadDirectoryChangesW has failed! %d"), dwError);
+	LOGF(FATAL, _T("An error has occurred on a watched directory!\n, This directory has become unwatched! -- %s \n"), (LPCTSTR)strDirectoryName);
+	LOGF(FATAL, _T("ReadDirectoryChangesW has failed! %u"), dwError);
+}
+
+void CDirectoryChangeHandler::On_SubtreeDirty(const CString& strDirectoryName)
+{
+	LOGF(WARNING, _T("Changes were dropped, the following directory has to be rescanned: %s\n"), (LPCTSTR)strDirectoryName);
 }
 
 void CDirectoryChangeHandler::On_WatchStarted(DWORD dwError, const CString & strDirectoryName)
 {
 	if (dwError == 0)
 	{
-		LOGF(INFO, _T("A watch has begun on the following directory: %s\n"), strDirectoryName);
+		LOGF(INFO, _T("A watch has begun on the following directory: %s\n"), (LPCTSTR)strDirectoryName);
 	}
 	else
 	{
-		LOGF(INFO, _T("A watch failed to start on the following directory: (Error: %d) %s\n"), dwError, strDirectoryName);
+		LOGF(INFO, _T("A watch failed to start on the following directory: (Error: %u) %s\n"), dwError, (LPCTSTR)strDirectoryName);
 	}
 }
 
 void CDirectoryChangeHandler::On_WatchStopped(const CString & strDirectoryName)
 {
-	LOGF(INFO, _T("The watch on the following directory has stopped: %s\n"), strDirectoryName);
+	LOGF(INFO, _T("The watch on the following directory has stopped: %s\n"), (LPCTSTR)strDirectoryName);
 }
 
 //	This function gives your class a chance to filter unwanted notifications.
@@ -107,6 +151,7 @@ void CDirectoryChangeHandler::On_WatchStopped(const CString & strDirectoryName)
 //		FILE_ACTION_REMOVED			-- On_FileRemoved() is about to be called.
 //		FILE_ACTION_MODIFIED		-- On_FileModified() is about to be called.
 //		FILE_ACTION_RENAMED_OLD_NAME-- On_FileNameChanged() is about to be call.
+//		FILE_ACTION_QUIESCENT		-- On_FileQuiescent() is about to be called.
 //
 //	  
 //	NOTE:  When the value of dwNotifyAction is FILE_ACTION_RENAMED_OLD_NAME,
@@ -118,6 +163,9 @@ void CDirectoryChangeHandler::On_WatchStopped(const CString & strDirectoryName)
 //	
 bool CDirectoryChangeHandler::On_FilterNotification(DWORD dwNotifyAction, LPCTSTR szFileName, LPCTSTR szNewFileName)
 {
+	UNREFERENCED_PARAMETER(dwNotifyAction);
+	UNREFERENCED_PARAMETER(szFileName);
+	UNREFERENCED_PARAMETER(szNewFileName);
 	return true;
 }
 
@@ -126,10 +174,15 @@ void CDirectoryChangeHandler::SetChangedDirectoryName(const CString & strChanged
 	_strChangedDirectoryName = strChangedDirName;
 }
 
+std::shared_ptr<CDelayedNotifier> CDirectoryChangeHandler::GetDelayedNotifier()
+{
+	return nullptr;
+}
+
 // TODO	
 long CDirectoryChangeHandler::_ReferencesWatcher(std::shared_ptr<CDirectoryChangeWatcher> pDirChangeWatcher)
 {
-	std::lock_guard<std::mutex> lock(_mutWatcher);
+	std::lock_guard<std::recursive_mutex> lock(_mutWatcher);
 
 	if (_pDirChangeWatcher != nullptr
 		&& _pDirChangeWatcher != pDirChangeWatcher)
@@ -164,10 +217,11 @@ long CDirectoryChangeHandler::_ReferencesWatcher(std::shared_ptr<CDirectoryChang
 
 long CDirectoryChangeHandler::_ReleaseReferenceToWatcher(std::shared_ptr<CDirectoryChangeWatcher> pDirChangeWatcher)
 {
-	std::lock_guard<std::mutex> lock(_mutWatcher);
+	UNREFERENCED_PARAMETER(pDirChangeWatcher);
+	std::lock_guard<std::recursive_mutex> lock(_mutWatcher);
 
 	long nRef = 0;
-	if ((nRef = InterlockedDecrement(&_nWatcherRefCount)) <= 0UL)
+	if ((nRef = InterlockedDecrement(&_nWatcherRefCount)) <= 0)
 	{
 		_pDirChangeWatcher.reset();
 		_nWatcherRefCount = 0;
@@ -1,10 +1,50 @@
 #pragma once
-#include "DirectoryChangeWatcher.h"
-#include "DelayedDirectoryChangeHandler.h"
 #include <memory>
 #include <mutex>
 
 
+class CDirectoryChangeWatcher;
+class CDelayedNotifier;
+
+//	not a Windows value: a file has been left alone for the watch's settle time, see On_FileQuiescent()
+#define FILE_ACTION_QUIESCENT			0x00000100
+
+
+//
+//	One change to a watched directory, see CDirectoryChangeHandler::On_EventBatch()
+//
+struct CDirChangeEvent
+{
+	DWORD	dwAction;		//FILE_ACTION_ADDED, _REMOVED, _MODIFIED, _RENAMED_OLD_NAME (a rename) or _QUIESCENT
+	CString	strFileName;	//full path, the old name of a rename
+	CString	strNewFileName;	//full path, the new name of a rename, empty otherwise
+};
+
+//
+//	A read only view of the events of one read completion, in the order they happened.
+//	The events are contiguous and only valid during the call to On_EventBatch().
+//
+class CDirChangeEventBatch
+{
+public:
+	CDirChangeEventBatch(const CDirChangeEvent * pEvents, size_t nCount)
+		: _pEvents(pEvents)
+		, _nCount(nCount)
+	{
+	}
+
+	const CDirChangeEvent *	begin() const { return _pEvents; }
+	const CDirChangeEvent *	end() const { return _pEvents + _nCount; }
+	size_t	size() const { return _nCount; }
+	bool	empty() const { return _nCount == 0; }
+	const CDirChangeEvent &	operator[](size_t nIdx) const { return _pEvents[nIdx]; }
+
+private:
+	const CDirChangeEvent *	_pEvents;
+	size_t					_nCount;
+};
+
+
 /***********************************
 A class to handle changes to files in a directory.
 The virtual On_Filexxx() functions are called whenever changes are made to
@@ -135,6 +175,34 @@ protected:
 	//
 	virtual void On_FileModified(const CString& strFileName);
 
+	//
+	//	On_FileQuiescent()
+	//
+	//	This function is called once a file that's been added, modified or renamed
+	//	hasn't changed again for the settle time of the watch (the dwSettleTimeMs
+	//	parameter of CDirectoryChangeWatcher::WatchDirectory()), eg: when a file
+	//	that's being copied or downloaded is done.  It's called after the
+	//	On_FileAdded()/On_FileModified()/On_FileNameChanged() calls for that file,
+	//	not instead of them.  It isn't called for a file that's been removed in the meantime.
+	//
+	virtual void On_FileQuiescent(const CString& strFileName);
+
+	//
+	//	On_EventBatch()
+	//
+	//	This function is called once for the changes found by one read of the
+	//	watched directory (one completion of ReadDirectoryChangesW()), instead of
+	//	once per change.  The events have passed the include/exclude filters and
+	//	On_FilterNotification() already.
+	//
+	//	The default implementation calls On_FileAdded(), On_FileRemoved(),
+	//	On_FileModified(), On_FileNameChanged() and On_FileQuiescent() for each event in turn.
+	//	Override it to handle the whole batch at once, eg: to take a lock or
+	//	start a transaction once per batch rather than once per file.
+	//	(tip: FILTERS_DONT_USE_HANDLER_FILTER saves the per event call to On_FilterNotification())
+	//
+	virtual void On_EventBatch(const CDirChangeEventBatch & batch);
+
 	//
 	//	On_ReadDirectoryChangesError()
 	//
@@ -152,6 +220,17 @@ protected:
 	//	On_WatchStopped() will not be called.
 	virtual void On_ReadDirectoryChangesError(DWORD dwError, const CString& strDirectoryName);
 
+	//
+	//	On_SubtreeDirty()
+	//
+	//	This function is called instead of the changes to strDirectoryName and below
+	//	when they piled up faster than they were handled, and the watch's backpressure
+	//	policy is BACKPRESSURE_RESCAN (see CDirectoryChangeWatcher::SetBackpressurePolicy()).
+	//	Whatever the handler knows about that tree may be stale, it should look at it again.
+	//	The changes after this call are reported as usual.
+	//
+	virtual void On_SubtreeDirty(const CString& strDirectoryName);
+
 	//
 	//	void On_WatchStarted()
 	//
@@ -215,6 +294,7 @@ protected:
 	//		FILE_ACTION_REMOVED			-- On_FileRemoved() is about to be called.
 	//		FILE_ACTION_MODIFIED		-- On_FileModified() is about to be called.
 	//		FILE_ACTION_RENAMED_OLD_NAME-- On_FileNameChanged() is about to be call.
+	//		FILE_ACTION_QUIESCENT		-- On_FileQuiescent() is about to be called.
 	//
 	//	  
 	//	NOTE:  When the value of dwNotifyAction is FILE_ACTION_RENAMED_OLD_NAME,
@@ -236,6 +316,15 @@ protected:
 	//please don't use this function, it will be removed in future releases.
 	void SetChangedDirectoryName(const CString & strChangedDirName);
 
+	//
+	//	GetDelayedNotifier()
+	//
+	//	The notifier that delivers the notifications of this handler's watches, instead of the
+	//	one that bAppHasGUI/FILTERS_PARALLEL_HANDLERS would pick (see CDirChangeStream).
+	//	It's asked once, by WatchDirectory().  The default is nullptr: the watcher's choice.
+	//
+	virtual std::shared_ptr<CDelayedNotifier> GetDelayedNotifier();
+
 private:
 	long	_nRefCount;
 	long	_nWatcherRefCount;
@@ -264,7 +353,7 @@ private:
 	friend class CDelayedDirectoryChangeHandler;
 
 	std::shared_ptr<CDirectoryChangeWatcher>	_pDirChangeWatcher;
-	std::mutex									_mutWatcher;
+	std::recursive_mutex						_mutWatcher;	//_ReferencesWatcher() may unwatch
 
 private:
 	long	_ReferencesWatcher(std::shared_ptr<CDirectoryChangeWatcher> pDirChangeWatcher);
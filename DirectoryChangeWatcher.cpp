@@ -1,16 +1,30 @@
 #include "stdafx.h"
 #include "DirectoryChangeWatcher.h"
+#include "DirectoryEventSource.h"
+#include "DelayedDirectoryChangeHandler.h"
+#include "DelayedNotificationPollable.h"
+#include "ChangeJournal.h"
+#include "ReadBufferPool.h"
+#include <algorithm>
+#ifdef _WIN32
 #include "PrivilegeEnabler.h"
 #include "DWatcher.h"	// IsDirectory
+#endif
+
+
+static std::atomic<uint64_t>	s_ulNextWatchId(0ULL);	//CDirWatchInfo::m_ulWatchId
 
 
 CDirectoryChangeWatcher::CDirectoryChangeWatcher(bool bAppHasGUI /*= true*/, 
-	DWORD dwFilterFlags /*= FILTERS_DEFAULT_BEHAVIOR*/)
-	: _hCompPort(nullptr)
-	, _hThread(nullptr)
-	, _dwThreadID(0UL)
+	DWORD dwFilterFlags /*= FILTERS_DEFAULT_BEHAVIOR*/, DWORD dwNumWorkerThreads /*= WORKER_THREADS_DEFAULT*/)
+	: _pEventSource(CDirectoryEventSource::Create())
+	, _dwNumWorkerThreads(dwNumWorkerThreads)
+	, _bStopPasses(false)
+	, _ullEventsCoalesced(0ULL)
+	, _ullEventsFolded(0ULL)
+	, _nWatchedDirectories(0)
 	, _bAppHasGUI(bAppHasGUI)
-	, _dwFilterFlags(dwFilterFlags == 0 ? FILTERS_DEFAULT_BEHAVIOR : dwFilterFlags)
+	, _dwFilterFlags(dwFilterFlags == 0 ? (DWORD)FILTERS_DEFAULT_BEHAVIOR : dwFilterFlags)
 {
 	//NOTE:  
 	//	The bAppHasGUI variable indicates that you have a message pump associated
@@ -23,15 +37,34 @@ CDirectoryChangeWatcher::CDirectoryChangeWatcher(bool bAppHasGUI /*= true*/,
 	//	Passing false is required for Console applications, or applications without a message pump.
 	//	Note that notifications are fired in a worker thread.
 	//
+	//	dwNumWorkerThreads is the number of threads that wait on the event source.
+	//	One busy directory holds up the others only as long as there are fewer busy
+	//	directories than threads.  A directory's notifications are still handled
+	//	one completion at a time and in order, see _DispatchCompletion().
+	//
+	if (_dwNumWorkerThreads == WORKER_THREADS_PER_CPU)
+	{
+		_dwNumWorkerThreads = (std::max)((DWORD)1UL, (DWORD)std::thread::hardware_concurrency());
+	}
+
+	for (auto & shard : _watchNameShards)
+	{
+		shard = new CWatchNameSet();
+	}
+
+#ifndef _WIN32
+	_InitPollableNotifier();
+#endif
 }
 
 CDirectoryChangeWatcher::~CDirectoryChangeWatcher()
 {
 	UnWatchAllDirectory();
-	if (_hCompPort != nullptr)
+
+	for (auto & shard : _watchNameShards)
 	{
-		CloseHandle(_hCompPort);
-		_hCompPort = nullptr;
+		delete shard.load();
+		shard = nullptr;
 	}
 }
 
@@ -46,10 +79,15 @@ PARAMETERS:
 const CString & strDirToWatch -- specifies the path of the directory to watch.
 DWORD dwChangesToWatchFor	-- specifies flags to be passed to ReadDirectoryChangesW()
 CDirectoryChangeHandler *	-- ptr to an object which will handle notifications of file changes.
-BOOL bWatchSubDirs			-- specifies to watch subdirectories.
+BOOL bWatchSubDirs			-- specifies to watch subdirectories. One of the WATCH_SUBDIRS_xxx values,
+TRUE/FALSE work as before. See Remarks.
 LPCTSTR szIncludeFilter		-- A file pattern string for files that you wish to receive notifications
 for. See Remarks.
 LPCTSTR szExcludeFilter		-- A file pattern string for files that you do not wish to receive notifications for. See Remarks
+DWORD dwReadBufferSize		-- initial size of the buffer that ReadDirectoryChangesW() fills. See Remarks.
+bool bDoubleBufferedReads	-- reissue ReadDirectoryChangesW() into a second buffer before the filled one is processed. See Remarks.
+DWORD dwCoalesceWindowMs	-- FILTERS_COALESCE_EVENTS: how long changes are held back to be folded, 0 folds each batch on its own. See Remarks.
+DWORD dwSettleTimeMs		-- call On_FileQuiescent() for a file once it hasn't changed for this long, 0 doesn't. See Remarks.
 
 Starts watching the specified directory(and optionally subdirectories) for the specified changes
 
@@ -85,10 +123,60 @@ You can only have one watch specified at a time for any particular directory.
 Calling this function with the same directory name will cause the directory to be
 unwatched, and then watched again(w/ the new parameters that have been passed in).
 
+The read buffer adapts to the directory's activity: it doubles whenever a read
+overflows or comes back mostly full, and halves after a long run of reads that
+used only a fraction of it, within READ_DIR_CHANGE_BUFFER_MIN_SIZE..READ_DIR_CHANGE_BUFFER_MAX_SIZE.
+Pass a bigger dwReadBufferSize for directories that are known to see bulk changes
+(checkouts, archive extraction, builds) so they start out w/o overflowing.
+The buffers of all watches together stay below SetReadBufferMemoryCap().
+
+With bDoubleBufferedReads the filled buffer is swapped for a fresh one from the
+read buffer pool and the watch is reissued before the handler sees any of its changes,
+so the OS keeps queueing into the new buffer while the old one is being processed.
+Use it for busy directories w/ slow handlers; it costs a second buffer while processing.
+
+On Linux, bWatchSubDirs == WATCH_SUBDIRS_FILESYSTEM watches the tree w/ a fanotify
+filesystem mark instead of one inotify watch per subdirectory.  Events for the whole
+filesystem are reported by the kernel, resolved back to paths, and the ones below
+strDirToWatch are delivered to the handler like any other notification.  The call fails
+with EPERM if the process lacks CAP_SYS_ADMIN, the caller may fall back to WATCH_SUBDIRS.
+Renames are reported as a rename only on kernels that support FAN_RENAME (5.17+),
+otherwise as a removal followed by an addition.
+
+When the read buffer overflows the notifications that didn't fit are lost.
+If the watcher was created w/ FILTERS_RESCAN_ON_OVERFLOW, every watch keeps a
+snapshot of its tree (listed in the background once the watch has started),
+and after an overflow the affected directories are rescanned and diffed against it:
+the changes that were lost are reported as On_FileAdded(), On_FileRemoved() and
+On_FileModified() (a rename shows up as a removal + an addition).
+Rescans are incremental and rate limited, see _OnRecordsLost().
+W/o the flag, the overflow is only logged.
+
+If the watcher was created w/ FILTERS_COALESCE_EVENTS, the changes to the same file
+are folded before they're dispatched (see CEventCoalescer): a file that's created,
+written 5 times and deleted again isn't reported at all, one that's written 5 times
+is reported as modified once.  W/ dwCoalesceWindowMs == 0 only the changes found by
+the same read of the directory are folded.  Otherwise the changes are held back for
+up to dwCoalesceWindowMs from the first one (or until CEventCoalescer::MAX_PENDING_EVENTS
+of them have piled up), which folds more at the cost of the delay.
+GetCoalescingStats() tells how many have been folded.
+
+W/ dwSettleTimeMs != 0, every file that's added, modified or renamed (to) is
+reported once more w/ On_FileQuiescent() when it hasn't changed again for dwSettleTimeMs,
+eg: to pick up a file once the copy or download that's writing it is done.
+Each change restarts the file's settle time, a removal cancels it.  The pending files
+are kept in the order they come due (see CSettleTimer), so there's no timer per
+file; they're reported w/in CSettleTimer::SETTLE_RESOLUTION_MS of their due time,
+the ones that settle together in one batch.  Files that haven't settled when the
+directory is unwatched aren't reported.
+
 **************************************************************/
 DWORD CDirectoryChangeWatcher::WatchDirectory(const CString & strDirToWatch, DWORD dwChangesToWatchFor, 
 	CDirectoryChangeHandler * pChangeHandler, BOOL bWatchSubDirs /*= FALSE*/, 
-	const std::string& strIncludeFilter /*= nullptr*/, const std::string& strExcludeFilter /*= nullptr*/)
+	const std::string& strIncludeFilter /*= std::string()*/, const std::string& strExcludeFilter /*= std::string()*/,
+	DWORD dwReadBufferSize /*= READ_DIR_CHANGE_BUFFER_SIZE*/,
+	bool bDoubleBufferedReads /*= false*/,
+	DWORD dwCoalesceWindowMs /*= 0*/, DWORD dwSettleTimeMs /*= 0*/)
 {
 	ASSERT(dwChangesToWatchFor != 0);
 
@@ -104,7 +192,7 @@ DWORD CDirectoryChangeWatcher::WatchDirectory(const CString & strDirToWatch, DWO
 	// double check that it's really a directory
 	if (!IsDirectory(strDirToWatch))
 	{
-		LOGF(FATAL, _T("ERROR: CDirectoryChangeWatcher::WatchDirectory() -- %s is not a directory!\n"), strDirToWatch);
+		LOGF(FATAL, _T("ERROR: CDirectoryChangeWatcher::WatchDirectory() -- %s is not a directory!\n"), (LPCTSTR)strDirToWatch);
 		::SetLastError(ERROR_BAD_PATHNAME);
 		return ERROR_BAD_PATHNAME;
 	}
@@ -116,114 +204,127 @@ DWORD CDirectoryChangeWatcher::WatchDirectory(const CString & strDirToWatch, DWO
 		UnWatchDirectory(strDirToWatch);
 	}
 
+#ifdef _WIN32
 	//
 	//	Reference this singleton so that privileges for this process are enabled 
 	//	so that it has required permissions to use the ReadDirectoryChangesW API, etc.
 	//
 	CPrivilegeEnabler::Instance();
+#endif
+
+	std::shared_ptr<CDelayedNotifier> pNotifier;//nullptr: CDelayedDirectoryChangeHandler picks one
+#ifndef _WIN32
+	if (_dwFilterFlags & FILTERS_POLLABLE_NOTIFICATIONS)
+	{
+		pNotifier = _pPollableNotifier;
+	}
+#endif
+
+	CDirWatchInfo *pDirInfo = new CDirWatchInfo(strDirToWatch, pChangeHandler,
+		dwChangesToWatchFor, bWatchSubDirs, _bAppHasGUI, pNotifier, strIncludeFilter,
+		strExcludeFilter, _dwFilterFlags, dwReadBufferSize, bDoubleBufferedReads, dwCoalesceWindowMs, dwSettleTimeMs);
+
+	// BACKPRESSURE_BLOCK: the watch's strand issues the read that waited for the handler, once it's caught up
+	pDirInfo->GetChangeHandler()->SetUnblockedCallback([this, pDirInfo, ulWatchId = pDirInfo->m_ulWatchId]()
+	{
+		_QueuePass(pDirInfo, ulWatchId, std::chrono::steady_clock::now());
+	});
 
 	// open the directory to watch
-	auto hDir = CreateFile(strDirToWatch,
-		FILE_LIST_DIRECTORY,
-		FILE_SHARE_READ | FILE_SHARE_WRITE,
-		nullptr,
-		OPEN_EXISTING,
-		FILE_FLAG_BACKUP_SEMANTICS | //<- the required privileges for this flag are: SE_BACKUP_NAME and SE_RESTORE_NAME
-		FILE_FLAG_OVERLAPPED,
-		nullptr);
-	if (hDir == INVALID_HANDLE_VALUE)
-	{
-		auto dwError = GetLastError();
-		LOGF(FATAL, _T("CDirectoryChangeWatcher::WatchDirectory() -- Couldn't open directory for monitoring. %d\n"), dwError);
+	pDirInfo->m_pEventSource = _pEventSource.get();
+	auto dwError = _pEventSource->OpenDirectory(pDirInfo);
+	if (dwError != ERROR_SUCCESS)
+	{
+		LOGF(FATAL, _T("CDirectoryChangeWatcher::WatchDirectory() -- Couldn't open directory for monitoring. %u\n"), dwError);
+		pDirInfo->DeleteSelf(nullptr);
 		::SetLastError(dwError);
 		return dwError;
 	}
 
-	CDirWatchInfo *pDirInfo = new CDirWatchInfo(hDir, strDirToWatch, pChangeHandler,
-		dwChangesToWatchFor, bWatchSubDirs, _bAppHasGUI, strIncludeFilter,
-		strExcludeFilter, _dwFilterFlags);
-	
 	// Create a IO completion port/or associate this key with
 	// the existing IO completion port
-	_hCompPort = CreateIoCompletionPort(hDir,
-		_hCompPort, // if m_hCompPort is NULL, hDir is associated with a NEW completion port,
-					// if m_hCompPort is NON-NULL, hDir is associated with the existing completion port that the handle m_hCompPort references
-		(DWORD)pDirInfo, // the completion 'key'... this ptr is returned from GetQueuedCompletionStatus() 
-						 // when one of the events in the dwChangesToWatchFor filter takes place
-		0);
-	if (_hCompPort == nullptr)
-	{
-		LOGF(FATAL, _T("ERROR -- Unable to create I/O Completion port! GetLastError(): %d File: %s Line: %d"), GetLastError(), _T(__FILE__), __LINE__);
-		auto dwError = GetLastError();
+	dwError = _pEventSource->Associate(pDirInfo);
+	if (dwError != ERROR_SUCCESS)
+	{
+		LOGF(FATAL, _T("ERROR -- Unable to associate the directory with the event source! Error: %u File: %s Line: %d"), dwError, _T(__FILE__), __LINE__);
 		pDirInfo->DeleteSelf(nullptr);
 		::SetLastError(dwError);//who knows what the last error will be after i call pDirInfo->DeleteSelf(), so set it just to make sure
 		return dwError;
 	}
-	else
-	{
-		// Completion port created/directory associated w/ it successfully
 
-		// If the thread isn't running, start it....
-		// when the thread starts, it will call ReadDirectoryChangesW and wait 
-		// for changes to take place
+	// directory associated w/ the event source successfully
 
-		if (_hThread == nullptr)
+	// If the threads aren't running, start them....
+	// when a thread starts, it will call ReadDirectoryChangesW and wait 
+	// for changes to take place
+	if (_workerThreads.empty())
+	{
+		try
 		{
-			auto pThread = AfxBeginThread(_MonitorDirectoryChanges, this);
-			if (pThread == nullptr)
-			{
-				LOGF(FATAL, _T("CDirectoryChangeWatcher::WatchDirectory()-- AfxBeginThread failed!\n"));
-				pDirInfo->DeleteSelf(nullptr);
-				return (GetLastError() == ERROR_SUCCESS) ? ERROR_MAX_THRDS_REACHED : GetLastError();
-			}
-			else
+			while (_workerThreads.size() < _dwNumWorkerThreads)
 			{
-				_hThread = pThread->m_hThread;
-				_dwThreadID = pThread->m_nThreadID;
-				pThread->m_bAutoDelete = TRUE;
+				_workerThreads.emplace_back(_MonitorDirectoryChanges, this);
 			}
 		}
-
-		if (_hThread != nullptr)
+		catch (const std::system_error& e)
 		{
-			// Signal the thread to issue the initial call to
-			// ReadDirectoryChangesW()
-			auto dwStarted = pDirInfo->StartMonitor(_hCompPort);
-			if (dwStarted != ERROR_SUCCESS)
+			LOGF(FATAL, _T("CDirectoryChangeWatcher::WatchDirectory()-- unable to start the worker thread! %s\n"), e.what());
+			if (_workerThreads.empty())
 			{
-				LOGF(FATAL, _T("Unable to watch directory: %s -- GetLastError(): %d\n"), dwStarted);
 				pDirInfo->DeleteSelf(nullptr);
-				::SetLastError(dwStarted);//I think this'll set the Err object in a VB app.....
-				return dwStarted;
-			}
-			else
-			{
-				// ReadDirectoryChangesW was successful!
-				// add the directory info to the first empty slot in the array
-				
-				pChangeHandler->_ReferencesWatcher(GetSharedPtr());
-				AddToWatchInfo(pDirInfo);
-
-				return dwStarted;
+				::SetLastError(ERROR_MAX_THRDS_REACHED);
+				return ERROR_MAX_THRDS_REACHED;
 			}
+			// make do w/ the ones that did start
 		}
-		else
-		{
-			ASSERT(FALSE);//control path shouldn't get here
-			::SetLastError(ERROR_MAX_THRDS_REACHED);
-			return ERROR_MAX_THRDS_REACHED;
-		}
 	}
-	ASSERT(FALSE);//shouldn't get here.
+
+	// Signal the thread to issue the initial call to
+	// ReadDirectoryChangesW()
+	auto dwStarted = pDirInfo->StartMonitor(_pEventSource.get());
+	if (dwStarted != ERROR_SUCCESS)
+	{
+		LOGF(FATAL, _T("Unable to watch directory: %s -- GetLastError(): %u\n"), (LPCTSTR)strDirToWatch, dwStarted);
+		pDirInfo->DeleteSelf(nullptr);
+		::SetLastError(dwStarted);//I think this'll set the Err object in a VB app.....
+		return dwStarted;
+	}
+
+	// ReadDirectoryChangesW was successful!
+	// add the directory info to the first empty slot in the array
+
+	pChangeHandler->_ReferencesWatcher(GetSharedPtr());
+
+	// the lifetime of the CDirWatchInfo is managed by DeleteSelf()
+	AddToWatchInfo(std::shared_ptr<CDirWatchInfo>(pDirInfo, [](CDirWatchInfo*) {}));
+
+	if (pDirInfo->m_pSnapshot != nullptr)
+	{
+		// the initial listing of the tree, in passes like any other rescan
+		_SchedulePass(pDirInfo, std::chrono::steady_clock::now());
+	}
+
+	return dwStarted;
 }
 
+//
+//	lock free, see _watchNameShards.
+//	The answer may be stale by the time it's returned, just like it could be w/ a lock.
+//
 BOOL CDirectoryChangeWatcher::IsWatchingDirectory(const CString& strDirName) const
 {
-	std::lock_guard<std::mutex> lock(_mutDirWatchInfo);
-	//std::unique_lock<std::mutex> lk(_mutDirWatchInfo);
+	if (strDirName.IsEmpty())
+	{
+		return FALSE;
+	}
+
+	auto strKey = _NormalizedDirName(strDirName);
+	auto & shard = _watchNameShards[std::hash<std::basic_string<TCHAR>>()(strKey) % WATCH_NAME_SHARDS];
 
-	int i;
-	if (GetDirWatchInfo(strDirName, i) != nullptr)
+	CRcuDomain::CReadLock lock(_rcuWatchNames);
+	auto pNames = shard.load();
+	if (pNames != nullptr
+		&& pNames->find(strKey) != pNames->end())
 	{
 		return TRUE;
 	}
@@ -232,31 +333,21 @@ BOOL CDirectoryChangeWatcher::IsWatchingDirectory(const CString& strDirName) con
 
 int CDirectoryChangeWatcher::NumWatchedDirectories() const
 {
-	std::lock_guard<std::mutex> lock(_mutDirWatchInfo);
-	int cnt(0), max = _directoriesToWatchVec.size();
-	for (auto i(0UL); i < max; ++i)
-	{
-		if (_directoriesToWatchVec.at(i) != nullptr)
-		{
-			++cnt;
-		}
-	}
-
-	return cnt;
+	return _nWatchedDirectories.load();
 }
 
 BOOL CDirectoryChangeWatcher::UnWatchDirectory(const CString& strDirName)
 {
 	BOOL bRetVal = FALSE;
-	if (_hCompPort != nullptr)
+	if (!_workerThreads.empty())
 	{
 		std::lock_guard<std::mutex> lock(_mutDirWatchInfo);
 		int nIdx = -1;
 		auto pDirInfo = GetDirWatchInfo(strDirName, nIdx);
 		if (pDirInfo != nullptr && nIdx != -1)
 		{
-			pDirInfo->UnwatchDirectory(_hCompPort);
-			_directoriesToWatchVec[nIdx] = nullptr;
+			pDirInfo->UnwatchDirectory(_pEventSource.get());
+			RemoveFromWatchInfo(nIdx);
 			pDirInfo->DeleteSelf(this);
 			bRetVal = TRUE;
 		}
@@ -267,7 +358,9 @@ BOOL CDirectoryChangeWatcher::UnWatchDirectory(const CString& strDirName)
 
 BOOL CDirectoryChangeWatcher::UnWatchAllDirectory()
 {
-	if (_hThread == nullptr)
+	_StopPasses();
+
+	if (!_workerThreads.empty())
 	{
 		std::lock_guard<std::mutex> lock(_mutDirWatchInfo);
 
@@ -279,22 +372,29 @@ BOOL CDirectoryChangeWatcher::UnWatchAllDirectory()
 			auto pDirInfo = _directoriesToWatchVec[i];
 			if (pDirInfo != nullptr)
 			{
-				pDirInfo->UnwatchDirectory(_hCompPort);
+				pDirInfo->UnwatchDirectory(_pEventSource.get());
 				_directoriesToWatchVec[i].reset();
-				_directoriesToWatchVec[i] = nullptr;
 				pDirInfo->DeleteSelf(this);
 			}
 		}
 
 		_directoriesToWatchVec.clear();
-
-		PostQueuedCompletionStatus(_hCompPort, 0, 0, nullptr);
-		WaitForSingleObject(_hThread, INFINITE);
-		_hThread = nullptr;
-		_dwThreadID = 0UL;
-
-		CloseHandle(_hCompPort);
-		_hCompPort = nullptr;
+		_freeWatchSlots.clear();
+		_watchIdxByName.clear();
+		_watchIdxByInfo.clear();
+		_watchIdxByHandler.clear();
+		_PublishNoWatchNames();
+
+		// a completion w/ a NULL key tells a worker thread to exit, one for each of them
+		for (auto i = 0UL; i < _workerThreads.size(); ++i)
+		{
+			_pEventSource->PostCompletion(nullptr);
+		}
+		for (auto & worker : _workerThreads)
+		{
+			worker.join();
+		}
+		_workerThreads.clear();
 
 		return TRUE;
 	}
@@ -304,29 +404,68 @@ BOOL CDirectoryChangeWatcher::UnWatchAllDirectory()
 		//make sure that there aren't any 
 		//CDirWatchInfo objects laying around... they should have all been destroyed 
 		//and removed from the array m_DirectoriesToWatch
-		for (auto i = 0UL; i < _directoriesToWatchVec.size(); ++i)
-		{
-			_directoriesToWatchVec[i].reset();
-			_directoriesToWatchVec[i] = nullptr;
-		}
+		ASSERT(_watchIdxByInfo.empty());
 #endif
 
 		return FALSE;
 	}
 }
 
+size_t CDirectoryChangeWatcher::SetReadBufferMemoryCap(size_t nBytes)
+{
+	return CReadBufferPool::Instance().SetMemoryCap(nBytes);
+}
+
+size_t CDirectoryChangeWatcher::GetReadBufferMemoryUsed()
+{
+	return CReadBufferPool::Instance().GetMemoryUsed();
+}
+
 DWORD CDirectoryChangeWatcher::SetFilterFlags(DWORD dwFilterFlags)
 {
 	auto dwOld = _dwFilterFlags;
 	_dwFilterFlags = dwFilterFlags;
 	if (_dwFilterFlags == 0)
 	{
-		_dwFilterFlags - FILTERS_DEFAULT_BEHAVIOR;
+		_dwFilterFlags = FILTERS_DEFAULT_BEHAVIOR;
 	}
 
+#ifndef _WIN32
+	_InitPollableNotifier();
+#endif
+
 	return dwOld;
 }
 
+#ifndef _WIN32
+void CDirectoryChangeWatcher::_InitPollableNotifier()
+{
+	// the descriptor stays the same once the application has it, for the watches that come later
+	if ((_dwFilterFlags & FILTERS_POLLABLE_NOTIFICATIONS)
+		&& !_bAppHasGUI
+		&& _pPollableNotifier == nullptr)
+	{
+		auto pNotifier = std::make_shared<CDelayedNotificationPollable>();
+		if (pNotifier->GetFd() != -1)
+		{
+			_pPollableNotifier = pNotifier;
+		}
+	}
+}
+
+int CDirectoryChangeWatcher::GetNotificationFd() const
+{
+	return (_pPollableNotifier != nullptr) ? _pPollableNotifier->GetFd() : -1;
+}
+
+size_t CDirectoryChangeWatcher::DispatchPendingNotifications()
+{
+	// a handler may let go of the watcher
+	auto pNotifier = _pPollableNotifier;
+	return (pNotifier != nullptr) ? pNotifier->DispatchPending() : 0;
+}
+#endif
+
 void CDirectoryChangeWatcher::ProcessChangeNotifications(IN CFileNotifyInformation & notify_info, 
 	IN CDirWatchInfo * pdi, OUT DWORD & ref_dwReadBuffer_Offset)
 {
@@ -338,16 +477,95 @@ void CDirectoryChangeWatcher::ProcessChangeNotifications(IN CFileNotifyInformati
 		return;
 	}
 
-	DWORD dwLastAction = 0;
 	ref_dwReadBuffer_Offset = 0UL;
 
-	CDirectoryChangeHandler *pChangerHandler = pdi->GetChangeHandler();
+	CDelayedDirectoryChangeHandler *pChangerHandler = pdi->GetChangeHandler();
 	if (pChangerHandler == nullptr)
 	{
 		LOGF(FATAL, _T("CDirectoryChangeWatcher::ProcessChangeNotifications() Unable to continue, pdi->GetChangeHandler() returned NULL!\n"));
 		return;
 	}
 
+	// FILTERS_RESCAN_ON_OVERFLOW: the snapshot follows along, so that a rescan only finds what's been lost
+	auto pSnapshot = pdi->m_pSnapshot.get();
+	auto relFileName = [&notify_info]()
+	{
+		auto name = notify_info.GetFileNameView();
+		return CDirectorySnapshot::tstring(name.pszName, name.nLength);
+	};
+
+	//	the changes are handed over all at once, one notification per read (see CDirectoryChangeHandler::On_EventBatch()).
+	//	Posting the batch swaps in the buffer of a recycled notification, w/ a busy watch nothing is allocated here.
+	auto & events = pdi->m_events;
+	events.clear();
+	auto addEvent = [&events](DWORD dwAction, const CString& strFileName, const CString& strNewFileName)
+	{
+		events.push_back(CDirChangeEvent{ dwAction, strFileName, strNewFileName });
+	};
+
+	//	the include/exclude filters are checked here, before anything's allocated for a change they drop.
+	//	The names of the whole read are converted to UTF-8 in one pass, the filters get views into them.
+	//	nRecord follows notify_info, nextRecord() is the only way forward.
+	const bool bFilters = pChangerHandler->FiltersWhenPosted();
+	auto & arena = pdi->m_nameArena;
+	if (bFilters)
+	{
+		arena.Assign(notify_info);
+	}
+	size_t nRecord = 0;
+	auto nextRecord = [&notify_info, &nRecord]() -> bool
+	{
+		if (!notify_info.GetNextNotifyInformation())
+		{
+			return false;
+		}
+		++nRecord;
+		return true;
+	};
+	auto passes = [bFilters, &arena, &nRecord, pChangerHandler]() -> bool
+	{
+		if (!bFilters)
+		{
+			return true;
+		}
+		size_t nLength = 0;
+		auto pszName = arena.GetName(nRecord, nLength);
+		return pChangerHandler->PassesFilterSpecs(pszName, nLength);
+	};
+
+	if (!pdi->m_strPendingOldName.IsEmpty())
+	{
+		//	double buffered reads: the previous buffer ended w/ a RENAMED_OLD_NAME record,
+		//	its RENAMED_NEW_NAME record should be the first one of this buffer.
+		CString strOldFileName = pdi->m_strPendingOldName;
+		bool bOldNamePasses = pdi->m_bPendingOldNamePasses;
+		pdi->m_strPendingOldName.Empty();
+
+		if (notify_info.GetAction() == FILE_ACTION_RENAMED_NEW_NAME)
+		{
+			if (bOldNamePasses || passes())
+			{
+				addEvent(FILE_ACTION_RENAMED_OLD_NAME, strOldFileName, notify_info.GetFileNameWithPath(pdi->m_strDirName));
+			}
+			if (pSnapshot != nullptr)
+			{
+				// the old name has been forgotten already
+				pSnapshot->NoteAdded(relFileName());
+			}
+			if (!nextRecord())
+			{
+				_JournalEvents(events);
+				_PostEvents(pdi, std::move(events));
+				return;
+			}
+		}
+		else if (bOldNamePasses)
+		{
+			// no new name, the file has been moved out of the watched directory
+			addEvent(FILE_ACTION_REMOVED, strOldFileName, CString());
+		}
+	}
+
 	//
 	//	go through and process the notifications contained in the
 	//	CFileChangeNotification object( CFileChangeNotification is a wrapper for the FILE_NOTIFY_INFORMATION structure
@@ -364,26 +582,91 @@ void CDirectoryChangeWatcher::ProcessChangeNotifications(IN CFileNotifyInformati
 		//and the file C:\Temp\OtherFolder\MyOtherFile.txt is modified,
 		//the file name will be "OtherFolder\MyOtherFile.txt
 
-		switch (notify_info.GetAction())
+		auto dwAction = notify_info.GetAction();
+		if (dwAction == FILE_ACTION_ADDED
+			|| dwAction == FILE_ACTION_REMOVED
+			|| dwAction == FILE_ACTION_MODIFIED)
+		{
+			// a directory that the filters exclude as a whole (eg: "*\node_modules\*"),
+			// dropped before anything's allocated for it.  Renames are reported if either name passes, they go on.
+			bool bExcluded = false;
+			if (bFilters)
+			{
+				size_t nLength = 0;
+				auto pszName = arena.GetName(nRecord, nLength);
+				bExcluded = pdi->IsInExcludedSubtreeUtf8(pszName, nLength);
+			}
+			else
+			{
+				auto name = notify_info.GetFileNameView();
+				bExcluded = pdi->IsInExcludedSubtree(name.pszName, name.nLength);
+			}
+			if (bExcluded)
+			{
+				continue;
+			}
+		}
+
+		switch (dwAction)
 		{
+		//	w/ a snapshot: a rescan may have found the change before its notification arrived,
+		//	the notification is dropped then (see CDirectorySnapshot).
+		//	It's told about the changes the filters drop too, it follows the whole tree.
 		case FILE_ACTION_ADDED:
-			pChangerHandler->On_FileAdd(notify_info.GetFileNameWithPath(pdi->m_strDirName));
+			if ((pSnapshot == nullptr || pSnapshot->NoteAdded(relFileName()))
+				&& passes())
+			{
+				addEvent(FILE_ACTION_ADDED, notify_info.GetFileNameWithPath(pdi->m_strDirName), CString());
+			}
+			break;
 		case FILE_ACTION_REMOVED:
-			pChangerHandler->On_FileRemoved(notify_info.GetFileNameWithPath(pdi->m_strDirName));
+			if ((pSnapshot == nullptr || pSnapshot->NoteRemoved(relFileName()))
+				&& passes())
+			{
+				addEvent(FILE_ACTION_REMOVED, notify_info.GetFileNameWithPath(pdi->m_strDirName), CString());
+			}
+			break;
 		case FILE_ACTION_MODIFIED:
-			pChangerHandler->On_FileModified(notify_info.GetFileNameWithPath(pdi->m_strDirName));
+			if ((pSnapshot == nullptr || pSnapshot->NoteModified(relFileName()))
+				&& passes())
+			{
+				addEvent(FILE_ACTION_MODIFIED, notify_info.GetFileNameWithPath(pdi->m_strDirName), CString());
+			}
+			break;
 		case FILE_ACTION_RENAMED_OLD_NAME:
 		{
+			bool bOldNamePasses = passes();
 			auto strOldFileName = notify_info.GetFileNameWithPath(pdi->m_strDirName);
-			if (notify_info.GetNextNotifyInformation())
+			CDirectorySnapshot::tstring strOldRelName;
+			if (pSnapshot != nullptr)
+			{
+				strOldRelName = relFileName();
+			}
+
+			if (nextRecord())
 			{
 				// there is another PFILE_NOTIFY_INFORMATION record following the one we're working on now...
 				// it will be the record for the FILE_ACTION_RENAMED_NEW_NAME record
 
 				ASSERT(notify_info.GetAction() == FILE_ACTION_RENAMED_NEW_NAME);//making sure that the next record after the OLD_NAME record is the NEW_NAME record
 
-				auto strNewFileName = notify_info.GetFileNameWithPath(pdi->m_strDirName);
-				pChangerHandler->On_FileNameChanged(strOldFileName, strNewFileName);
+				if ((pSnapshot == nullptr || pSnapshot->NoteRenamed(strOldRelName, relFileName()))
+					&& (bOldNamePasses || passes()))
+				{
+					addEvent(FILE_ACTION_RENAMED_OLD_NAME, strOldFileName, notify_info.GetFileNameWithPath(pdi->m_strDirName));
+				}
+			}
+			else if (pdi->m_bDoubleBufferedReads)
+			{
+				//this OLD_NAME was the last record returned by ReadDirectoryChangesW,
+				//and the next read is already going into another buffer.
+				//Keep the name, the NEW_NAME record will be the first one of the next buffer.
+				pdi->m_strPendingOldName = strOldFileName;
+				pdi->m_bPendingOldNamePasses = bOldNamePasses;
+				if (pSnapshot != nullptr)
+				{
+					pSnapshot->NoteRemoved(strOldRelName);
+				}
 			}
 			else
 			{
@@ -455,28 +738,31 @@ void CDirectoryChangeWatcher::ProcessChangeNotifications(IN CFileNotifyInformati
 				notify_info.CopyCurrentRecordToBeginningOfBuffer(ref_dwReadBuffer_Offset);
 			}
 		}
+		break;
 		case FILE_ACTION_RENAMED_NEW_NAME:
 		{
 			//This should have been handled in FILE_ACTION_RENAMED_OLD_NAME
 			ASSERT(FALSE);//this shouldn't get here
 		}
+		break;
 		default:
-			LOGF(WARNING, ("CDirectoryChangeWatcher::ProcessChangeNotifications() -- unknown FILE_ACTION_ value! : %d\n"), notify_info.GetAction());
+			LOGF(WARNING, ("CDirectoryChangeWatcher::ProcessChangeNotifications() -- unknown FILE_ACTION_ value! : %u\n"), notify_info.GetAction());
 			break;
 		}
+	} while (nextRecord());
 
-		dwLastAction = notify_info.GetAction();
-
-	} while (notify_info.GetNextNotifyInformation());
-
+	_JournalEvents(events);
+	_PostEvents(pdi, std::move(events));
 }
 
 long CDirectoryChangeWatcher::ReleaseReferenceToWatcher(CDirectoryChangeHandler * pChangeHandler)
 {
 	if (pChangeHandler != nullptr)
 	{
-		pChangeHandler->_ReleaseReferenceToWatcher(GetSharedPtr());
+		return pChangeHandler->_ReleaseReferenceToWatcher(GetSharedPtr());
 	}
+
+	return 0L;
 }
 
 BOOL CDirectoryChangeWatcher::UnwatchDirectoryBecauseOfError(CDirWatchInfo * pWatchInfo)
@@ -486,9 +772,9 @@ BOOL CDirectoryChangeWatcher::UnwatchDirectoryBecauseOfError(CDirWatchInfo * pWa
 	{
 		std::lock_guard<std::mutex> lk(_mutDirWatchInfo);
 		int nIdx = -1;
-		if (GetDirWatchInfo(pWatchInfo, nIdx) == pWatchInfo)
+		if (GetDirWatchInfo(pWatchInfo, nIdx) != nullptr)
 		{
-			_directoriesToWatchVec.at(nIdx).reset();
+			RemoveFromWatchInfo(nIdx);
 			pWatchInfo->DeleteSelf(this);
 			bRetVal = TRUE;
 		}
@@ -497,34 +783,84 @@ BOOL CDirectoryChangeWatcher::UnwatchDirectoryBecauseOfError(CDirWatchInfo * pWa
 	return bRetVal;
 }
 
+//
+//	The watched directories live in _directoriesToWatchVec, slots that have been
+//	freed are reused (_freeWatchSlots), and _watchIdxByXXX map
+//	the directory name, the CDirWatchInfo and the handler to their slot(s)
+//	so that none of the lookups have to scan the array.
+//
+//	returns the slot that pWatchInfo was put in.
+//
 int CDirectoryChangeWatcher::AddToWatchInfo(std::shared_ptr<CDirWatchInfo> pWatchInfo)
 {
 	std::lock_guard<std::mutex> lk(_mutDirWatchInfo);
-	auto count = _directoriesToWatchVec.size();
-	auto i = 0U;
-	for (i = 0U; i < count; ++i)
+
+	int nIdx = -1;
+	if (!_freeWatchSlots.empty())
 	{
-		if (_directoriesToWatchVec.at(i) == nullptr)
-		{
-			_directoriesToWatchVec.at(i) = pWatchInfo;
-			break;
-		}
+		nIdx = _freeWatchSlots.back();
+		_freeWatchSlots.pop_back();
+		_directoriesToWatchVec.at(nIdx) = pWatchInfo;
+	}
+	else
+	{
+		nIdx = (int)_directoriesToWatchVec.size();
+		_directoriesToWatchVec.push_back(pWatchInfo);
+	}
+
+	auto strKey = _NormalizedDirName(pWatchInfo->m_strDirName);
+	_watchIdxByName[strKey] = nIdx;
+	_watchIdxByInfo[pWatchInfo.get()] = nIdx;
+	_watchIdxByHandler[pWatchInfo->GetRealChangeHandler()].push_back(nIdx);
+
+	_PublishWatchName(strKey, true);
+	_nWatchedDirectories = (int)_watchIdxByInfo.size();
+
+	return nIdx;
+}
+
+//
+//	frees the slot nIdx, _mutDirWatchInfo must be locked.
+//
+void CDirectoryChangeWatcher::RemoveFromWatchInfo(int nIdx)
+{
+	auto pWatchInfo = _directoriesToWatchVec.at(nIdx);
+	if (pWatchInfo == nullptr)
+	{
+		return;
 	}
 
-	if (i == count)
+	auto strKey = _NormalizedDirName(pWatchInfo->m_strDirName);
+	auto itName = _watchIdxByName.find(strKey);
+	if (itName != _watchIdxByName.end()
+		&& itName->second == nIdx)
 	{
-		try 
-		{
-			_directoriesToWatchVec.push_back(pWatchInfo);
-		}
-		catch (CMemoryException * e) 
+		_watchIdxByName.erase(itName);
+		_PublishWatchName(strKey, false);
+	}
+
+	_watchIdxByInfo.erase(pWatchInfo.get());
+	_nWatchedDirectories = (int)_watchIdxByInfo.size();
+
+	auto itHandler = _watchIdxByHandler.find(pWatchInfo->GetRealChangeHandler());
+	if (itHandler != _watchIdxByHandler.end())
+	{
+		auto & idxs = itHandler->second;
+		idxs.erase(std::remove(idxs.begin(), idxs.end(), nIdx), idxs.end());
+		if (idxs.empty())
 		{
-			e->ReportError();
-			e->Delete();//??? delete this? I thought CMemoryException objects where pre allocated in mfc? -- sample code in msdn does, so will i
+			_watchIdxByHandler.erase(itHandler);
 		}
 	}
+
+	_directoriesToWatchVec.at(nIdx).reset();
+	_freeWatchSlots.push_back(nIdx);
 }
 
+//
+//	functions for retrieving the directory watch info,
+//	_mutDirWatchInfo must be locked.
+//
 std::shared_ptr<CDirectoryChangeWatcher::CDirWatchInfo> CDirectoryChangeWatcher::GetDirWatchInfo(
 	IN const CString& strDirName, OUT int& ref_nIdx) const
 {
@@ -532,62 +868,111 @@ std::shared_ptr<CDirectoryChangeWatcher::CDirWatchInfo> CDirectoryChangeWatcher:
 	{
 		return nullptr;
 	}
-	
-	std::lock_guard<std::mutex> lk(_mutDirWatchInfo);
-	auto count = _directoriesToWatchVec.size();
-	std::shared_ptr<CDirWatchInfo> pWatchInfo = nullptr;
-	if (auto i = 0U; i < count; ++i)
+
+	auto it = _watchIdxByName.find(_NormalizedDirName(strDirName));
+	if (it == _watchIdxByName.end())
 	{
-		pWatchInfo = _directoriesToWatchVec.at(i);
-		if (pWatchInfo != nullptr
-			&& pWatchInfo->m_strDirName.CompareNoCase(strDirName) == 0)
-		{
-			ref_nIdx = i;
-			return pWatchInfo;
-		}
+		return nullptr;
 	}
 
-	return nullptr;
+	ref_nIdx = it->second;
+	return _directoriesToWatchVec.at(it->second);
 }
 
-std::shared_ptr<CDirectoryChangeWatcher::CDirWatchInfo>  CDirectoryChangeWatcher::GetDirWatchInfo(
-	IN std::shared_ptr<CDirWatchInfo> pWatchInfo, OUT int& ref_nIdx) const
+std::shared_ptr<CDirectoryChangeWatcher::CDirWatchInfo> CDirectoryChangeWatcher::GetDirWatchInfo(
+	IN const CDirWatchInfo * pWatchInfo, OUT int& ref_nIdx) const
 {
-	std::lock_guard<std::mutex> lk(_mutDirWatchInfo);
-	auto count = _directoriesToWatchVec.size();
-	std::shared_ptr<CDirWatchInfo> pTmpWatchInfo = nullptr;
-	if (auto i = 0U; i < count; ++i)
+	auto it = _watchIdxByInfo.find(pWatchInfo);
+	if (it == _watchIdxByInfo.end())
 	{
-		pTmpWatchInfo = _directoriesToWatchVec.at(i);
-		if (pTmpWatchInfo != nullptr
-			&& pTmpWatchInfo == pWatchInfo)
-		{
-			ref_nIdx = i;
-			return pTmpWatchInfo;
-		}
+		return nullptr;
 	}
 
-	return nullptr;
+	ref_nIdx = it->second;
+	return _directoriesToWatchVec.at(it->second);
 }
 
-std::shared_ptr<CDirectoryChangeWatcher::CDirWatchInfo>  CDirectoryChangeWatcher::GetDirWatchInfo(
-	IN std::shared_ptr<CDirectoryChangeHandler> pChangeHandler, OUT int& ref_nIdx) const
+//
+//	a handler may be used for any number of directories, this returns one of them.
+//
+std::shared_ptr<CDirectoryChangeWatcher::CDirWatchInfo> CDirectoryChangeWatcher::GetDirWatchInfo(
+	IN const CDirectoryChangeHandler * pChangeHandler, OUT int& ref_nIdx) const
 {
-	std::lock_guard<std::mutex> lk(_mutDirWatchInfo);
-	auto count = _directoriesToWatchVec.size();
-	std::shared_ptr<CDirWatchInfo> pTmpWatchInfo = nullptr;
-	if (auto i = 0U; i < count; ++i)
+	auto it = _watchIdxByHandler.find(pChangeHandler);
+	if (it == _watchIdxByHandler.end()
+		|| it->second.empty())
+	{
+		return nullptr;
+	}
+
+	ref_nIdx = it->second.back();
+	return _directoriesToWatchVec.at(ref_nIdx);
+}
+
+//
+//	the key for _watchIdxByName: directory names are compared case insensitively
+//	and w/o the trailing separator on Windows, as they are by the file system.
+//	Linux file systems are case sensitive, so the name is only trimmed there.
+//
+std::basic_string<TCHAR> CDirectoryChangeWatcher::_NormalizedDirName(const CString& strDirName)
+{
+	CString strKey(strDirName);
+#ifdef _WIN32
+	strKey.Replace(_T('/'), DIR_SEPARATOR_CHAR);
+	strKey.MakeLower();
+#endif
+	if (strKey.GetLength() > 1)
 	{
-		pTmpWatchInfo = _directoriesToWatchVec.at(i);
-		if (pTmpWatchInfo != nullptr
-			&& pTmpWatchInfo->GetRealChangeHandler() == pChangeHandler.get())
+		strKey.TrimRight(DIR_SEPARATOR_CHAR);
+		if (strKey.IsEmpty())
 		{
-			ref_nIdx = i;
-			return pTmpWatchInfo;
+			strKey = DIR_SEPARATOR_STR;
 		}
 	}
 
-	return nullptr;
+	return std::basic_string<TCHAR>((LPCTSTR)strKey, strKey.GetLength());
+}
+
+//
+//	replaces the shard that strKey belongs to w/ a copy that has (or hasn't) got strKey,
+//	_mutDirWatchInfo must be locked.
+//
+void CDirectoryChangeWatcher::_PublishWatchName(const std::basic_string<TCHAR>& strKey, bool bWatched)
+{
+	auto & shard = _watchNameShards[std::hash<std::basic_string<TCHAR>>()(strKey) % WATCH_NAME_SHARDS];
+
+	auto pOldNames = shard.load();
+	std::unique_ptr<CWatchNameSet> pNewNames(new CWatchNameSet(*pOldNames));
+	if (bWatched)
+	{
+		pNewNames->insert(strKey);
+	}
+	else
+	{
+		pNewNames->erase(strKey);
+	}
+
+	shard.store(pNewNames.release());
+
+	// readers that got the old copy are done w/ it after this
+	_rcuWatchNames.Synchronize();
+	delete pOldNames;
+}
+
+void CDirectoryChangeWatcher::_PublishNoWatchNames()
+{
+	std::vector<const CWatchNameSet *> oldNames;
+	for (auto & shard : _watchNameShards)
+	{
+		oldNames.push_back(shard.exchange(new CWatchNameSet()));
+	}
+	_nWatchedDirectories = 0;
+
+	_rcuWatchNames.Synchronize();
+	for (auto pOldNames : oldNames)
+	{
+		delete pOldNames;
+	}
 }
 
 /************************************
@@ -602,7 +987,7 @@ CDirectoryChangeHandler * pChangeHandler to handle changes to a watched director
 The CDirWatchInfo::m_pChangeHandler member of objects in the m_DirectoriesToWatch
 array will == pChangeHandler if that handler is being used to handle changes to a directory....
 ************************************/
-BOOL CDirectoryChangeWatcher::_UnWatchDirectory(std::shared_ptr<CDirectoryChangeHandler> pDirCH)
+BOOL CDirectoryChangeWatcher::_UnWatchDirectory(CDirectoryChangeHandler * pDirCH)
 {
 	std::lock_guard<std::mutex> lk(_mutDirWatchInfo);
 
@@ -613,33 +998,30 @@ BOOL CDirectoryChangeWatcher::_UnWatchDirectory(std::shared_ptr<CDirectoryChange
 
 	while ((pDirInfo = GetDirWatchInfo(pDirCH, nIdx)) != nullptr)
 	{
-		pDirInfo->UnwatchDirectory(_hCompPort);
+		pDirInfo->UnwatchDirectory(_pEventSource.get());
 
 		++nUnwatched;
-		_directoriesToWatchVec.at(nIdx).reset();
+		RemoveFromWatchInfo(nIdx);
 		pDirInfo->DeleteSelf(this);
 	}
 
-	return (BOOL)(nUnwatched != 0)
+	return (BOOL)(nUnwatched != 0);
 }
 
 UINT CDirectoryChangeWatcher::_MonitorDirectoryChanges(LPVOID lpThis)
 {
 	DWORD numBytes;
 	CDirWatchInfo *pdi;
-	std::shared_ptr<CDirWatchInfo> pDI;
-	LPOVERLAPPED lpOverlapped;
 
 	auto *pThis = reinterpret_cast<CDirectoryChangeWatcher*>(lpThis);
+	auto *pEventSource = pThis->_pEventSource.get();
 	pThis->On_ThreadInitialize();
 
 	do 
 	{
 		// Retrieve the directory info for this directory
 		// through the io port's completion key
-		if (!GetQueuedCompletionStatus(pThis->_hCompPort,
-			&numBytes, (LPDWORD)&pdi,
-			&lpOverlapped, INFINITE))
+		if (!pEventSource->GetCompletion(pdi, numBytes))
 		{
 			// The io completion request failed...
 			// probably because the handle to the directory that
@@ -647,278 +1029,1273 @@ UINT CDirectoryChangeWatcher::_MonitorDirectoryChanges(LPVOID lpThis)
 			if (pdi != nullptr && pdi->m_hDir != INVALID_HANDLE_VALUE)
 			{
 				// the directory handle is still open! (we expect this when after we close the directory handle )
-				LOGF(FATAL, _T("GetQueuedCompletionStatus() returned FALSE\nGetLastError(): %d Completion Key: %p lpOverlapped: %p\n"), GetLastError(), pdi, lpOverlapped);
+				LOGF(FATAL, _T("GetCompletion() returned FALSE\nGetLastError(): %u Completion Key: %p\n"), GetLastError(), pdi);
 			}
 		}
 
 		if (pdi != nullptr)
 		{
-			/***********************************
-			The CDirWatchInfo::m_RunningState is pretty much the only member
-			of CDirWatchInfo that can be modified from the other thread.
-			The functions StartMonitor() and UnwatchDirecotry() are the functions that
-			can modify that variable.
+			pThis->_DispatchCompletion(pdi, numBytes);
+		}
 
-			So that I'm sure that I'm getting the right value,
-			I'm using a critical section to guard against another thread modifying it when I want
-			to read it...
+	} while (pdi != nullptr);
 
-			************************************/
+	pThis->On_ThreadExit();
+	return 0;
+}
 
-			bool bObjShouldBeOk = true;
-			try
-			{
-				pdi->LockProperties();
-			}
-			catch(...)
-			{
-				LOG(WARNING, ("CDirectoryChangeWatcher::MonitorDirectoryChanges() -- pdi->LockProperties() raised an exception!\n"));
-				bObjShouldBeOk = false;
-			}
+//
+//	A CDirWatchInfo is processed by one worker thread at a time, and in the order
+//	that its completions came out of the event source:  the watch is normally
+//	a single outstanding read, but StartMonitor()/SignalShutdown() post completions
+//	of their own, and those may be picked up by another worker while the read's completion
+//	is still being processed.  Such completions are queued on the pdi, and
+//	the worker that is processing it drains them before letting go.
+//
+void CDirectoryChangeWatcher::_DispatchCompletion(CDirWatchInfo * pdi, DWORD numBytes)
+{
+	pdi->LockProperties();
+	if (pdi->m_bProcessing)
+	{
+		pdi->m_deferredCompletions.push_back(numBytes);
+		pdi->UnlockProperties();
+		return;
+	}
+	pdi->m_bProcessing = true;
+	pdi->UnlockProperties();
 
-			if (bObjShouldBeOk)
-			{
-				auto runState = pdi->m_RunningState;
-				pdi->UnlockProperties();
-				/***********************************
-				Unlock it so that there isn't a DEADLOCK if
-				somebody tries to call a function which will
-				cause CDirWatchInfo::UnwatchDirectory() to be called
-				from within the context of this thread (eg: a function called because of
-				the handler for one of the CDirectoryChangeHandler::On_Filexxx() functions)
-
-				************************************/
-				
-				pdi->GetChangeHandler();
-				switch (runState)
-				{
-				case CDirectoryChangeWatcher::CDirWatchInfo::RUNNING_STATE_NOT_SET:
-					break;
-				case CDirectoryChangeWatcher::CDirWatchInfo::RUNNING_STATE_START_MONITORING:
-				{
-					//Issue the initial call to ReadDirectoryChangesW()
-
-					if (!ReadDirectoryChangesW(pdi->m_hDir,
-						pdi->m_Buffer,	//<--FILE_NOTIFY_INFORMATION records are put into this buffer
-						READ_DIR_CHANGE_BUFFER_SIZE,
-						pdi->m_bWatchSubDir,
-						pdi->m_dwChangeFilter,
-						&pdi->m_dwBufLength,		//this var not set when using asynchronous mechanisms...
-						&pdi->m_Overlapped,
-						nullptr))
-					{
-						pdi->m_dwReadDirError = GetLastError();
-						if (pdi->GetChangeHandler() != nullptr)
-						{
-							pdi->GetChangeHandler()->On_WatchStarted(pdi->m_dwReadDirError, pdi->m_strDirName);
-						}
-					}
-					else
-					{
-						// read directory changes was successful!
-						// allow it to run normally
-						pdi->m_RunningState = CDirWatchInfo::RUNNING_STATE_NORMAL;
-						pdi->m_dwReadDirError = ERROR_SUCCESS;
-						if (pdi->GetChangeHandler() != nullptr)
-						{
-							pdi->GetChangeHandler()->On_WatchStarted(ERROR_SUCCESS, pdi->m_strDirName);
-						}
-					}
-				}
-				break;
-				case CDirectoryChangeWatcher::CDirWatchInfo::RUNNING_STATE_STOP:
-				{
-					if (pdi->m_hDir != INVALID_HANDLE_VALUE)
-					{
-						// Since I've previously called ReadDirectoryChangesW() asynchronously, I am waiting
-						// for it to return via GetQueuedCompletionStatus().  When I close the
-						// handle that ReadDirectoryChangesW() is waiting on, it will
-						// cause GetQueuedCompletionStatus() to return again with this pdi object....
-						// Close the handle, and then wait for the call to GetQueuedCompletionStatus()
-						// to return again by breaking out of the switch, and letting GetQueuedCompletionStatus()
-						// get called again
-						pdi->CloseDirectoryHandle();
-
-						// back up step...GetQueuedCompletionStatus() will still need to return from the last time that ReadDirectoryChangesW() was called.....
-						pdi->m_RunningState = CDirWatchInfo::RUNNING_STATE_STOP_STEP2;
+	_RunStrand(pdi, true, numBytes);
+}
 
-					}
-					else
-					{
-						// either we weren't watching this directory in the first place,
-						// or we've already stopped monitoring it....
+//
+//	The caller has set pdi->m_bProcessing.   Processes a completion (bCompletion)
+//	or a rescan pass, then whatever got deferred in the meantime.
+//
+void CDirectoryChangeWatcher::_RunStrand(CDirWatchInfo * pdi, bool bCompletion, DWORD numBytes)
+{
+	bool bSignalStartStop = false;
+	for (;;)
+	{
+		if (!(bCompletion ? _ProcessCompletion(pdi, numBytes, bSignalStartStop) : _TimedPass(pdi)))
+		{
+			// pdi is gone
+			return;
+		}
 
-						// set the event that ReadDirectoryChangesW has returned and no further calls to it will be made...
-						pdi->m_StartStopEvent.SetEvent();
-					}
-				}
-				break;
-				case CDirectoryChangeWatcher::CDirWatchInfo::RUNNING_STATE_STOP_STEP2:
-				{
-					// GetQueuedCompletionStatus() has returned from the last
-					// time that ReadDirectoryChangesW was called...
-					// Using CloseHandle() on the directory handle used by
-					// ReadDirectoryChangesW will cause it to return via GetQueuedCompletionStatus()....
-					if (pdi->m_hDir == INVALID_HANDLE_VALUE)
-					{
-						// signal that no further calls to ReadDirectoryChangesW will be made
-						// and this pdi can be deleted
-						pdi->m_StartStopEvent.SetEvent();
-					}
-					else
-					{
-						pdi->CloseDirectoryHandle();
+		pdi->LockProperties();
+		if ((pdi->m_deferredCompletions.empty() && !pdi->m_bPassDeferred)
+			|| pdi->m_RunningState == CDirWatchInfo::RUNNING_STATE_STOPPED)
+		{
+			pdi->m_deferredCompletions.clear();
+			pdi->m_bPassDeferred = false;
+			pdi->m_bProcessing = false;
+			pdi->UnlockProperties();
+			break;
+		}
 
-						//wait for GetQueuedCompletionStatus() to return this pdi object again
-					}
-				}
-				break;
-				case CDirectoryChangeWatcher::CDirWatchInfo::RUNNING_STATE_STOPPED:
+		// completions first, they're what keeps the watch going
+		bCompletion = !pdi->m_deferredCompletions.empty();
+		if (bCompletion)
+		{
+			numBytes = pdi->m_deferredCompletions.front();
+			pdi->m_deferredCompletions.pop_front();
+		}
+		else
+		{
+			pdi->m_bPassDeferred = false;
+		}
+		pdi->UnlockProperties();
+	}
+
+	// this has to be the last time pdi is touched, the thread waiting in
+	// StartMonitor()/WaitForShutdown() may delete it as soon as it wakes up.
+	if (bSignalStartStop)
+	{
+		pdi->m_StartStopEvent.SetEvent();
+	}
+}
+
+//
+//	Processes one completion for pdi, see _DispatchCompletion().
+//	bSignalStartStop is set when CDirWatchInfo::StartMonitor() or CDirWatchInfo::WaitForShutdown()
+//	has to be woken up, the caller does that once it's done with pdi.
+//
+//	Returns FALSE if pdi has been deleted (the watch failed and has been unwatched).
+//
+BOOL CDirectoryChangeWatcher::_ProcessCompletion(CDirWatchInfo * pdi, DWORD numBytes, bool & bSignalStartStop)
+{
+	auto *pEventSource = _pEventSource.get();
+	BOOL bPdiValid = TRUE;
+
+	/***********************************
+	The CDirWatchInfo::m_RunningState is pretty much the only member
+	of CDirWatchInfo that can be modified from the other thread.
+	The functions StartMonitor() and UnwatchDirecotry() are the functions that
+	can modify that variable.
+
+	So that I'm sure that I'm getting the right value,
+	I'm using a critical section to guard against another thread modifying it when I want
+	to read it...
+
+	************************************/
+
+	bool bObjShouldBeOk = true;
+	try
+	{
+		pdi->LockProperties();
+	}
+	catch(...)
+	{
+		LOGF(WARNING, ("CDirectoryChangeWatcher::MonitorDirectoryChanges() -- pdi->LockProperties() raised an exception!\n"));
+		bObjShouldBeOk = false;
+	}
+
+	if (bObjShouldBeOk)
+	{
+		auto runState = pdi->m_RunningState;
+		pdi->UnlockProperties();
+		/***********************************
+		Unlock it so that there isn't a DEADLOCK if
+		somebody tries to call a function which will
+		cause CDirWatchInfo::UnwatchDirectory() to be called
+		from within the context of this thread (eg: a function called because of
+		the handler for one of the CDirectoryChangeHandler::On_Filexxx() functions)
+
+		************************************/
+		
+		switch (runState)
+		{
+		case CDirectoryChangeWatcher::CDirWatchInfo::RUNNING_STATE_NOT_SET:
+			break;
+		case CDirectoryChangeWatcher::CDirWatchInfo::RUNNING_STATE_START_MONITORING:
+		{
+			//Issue the initial call to ReadDirectoryChangesW()
+			DWORD dwStartError = pEventSource->IssueRead(pdi, 0UL);
+
+			// recorded before the read can complete on another worker, which may
+			// overwrite m_dwReadDirError before StartMonitor() gets to read it
+			pdi->LockProperties();
+			pdi->m_dwReadDirError = pdi->m_dwStartError = dwStartError;
+			if (dwStartError == ERROR_SUCCESS)
+			{
+				// read directory changes was successful!
+				// allow it to run normally
+				pdi->m_RunningState = CDirWatchInfo::RUNNING_STATE_NORMAL;
+			}
+			pdi->UnlockProperties();
+
+			if (dwStartError != ERROR_SUCCESS)
+			{
+				if (pdi->GetChangeHandler() != nullptr)
 				{
-					auto pChangeHandler = pdi->GetChangeHandler();
-					if (pChangeHandler != nullptr)
-					{
-						pChangeHandler->SetChangeDirectoryName(pdi->m_strDirName);
-					}
+					pdi->GetChangeHandler()->On_WatchStarted(dwStartError, pdi->m_strDirName);
+				}
+			}
+			else
+			{
+				if (pdi->GetChangeHandler() != nullptr)
+				{
+					pdi->GetChangeHandler()->On_WatchStarted(ERROR_SUCCESS, pdi->m_strDirName);
+				}
+			}
 
-					DWORD dwReadBuffOffset = 0UL;
-
-					// process the FILE_NOTIFY_INFORMATION records:
-					CFileNotifyInformation notifyInfo((LPBYTE)pdi->m_Buffer, READ_DIR_CHANGE_BUFFER_SIZE);
-					pThis->ProcessChangeNotifications(notifyInfo, pdi, dwReadBuffOffset);
-
-					//	Changes have been processed,
-					//	Reissue the watch command
-					//
-					if (!ReadDirectoryChangesW(pdi->m_hDir,
-						pdi->m_Buffer + dwReadBuffOffset,	//<--FILE_NOTIFY_INFORMATION records are put into this buffer 
-						READ_DIR_CHANGE_BUFFER_SIZE - dwReadBuffOffset,
-						pdi->m_bWatchSubDir,
-						pdi->m_dwChangeFilter,
-						&pdi->m_dwBufLength,		//this var not set when using asynchronous mechanisms...
-						&pdi->m_Overlapped,
-						nullptr))//no completion routine!
-					{
-						//
-						//	NOTE:  
-						//		In this case the thread will not wake up for 
-						//		this pdi object because it is no longer associated w/
-						//		the I/O completion port...there will be no more outstanding calls to ReadDirectoryChangesW
-						//		so I have to skip the normal shutdown routines(normal being what happens when CDirectoryChangeWatcher::UnwatchDirectory() is called.
-						//		and close this up, & cause it to be freed.
-						//
-						LOGF(WARNING, ("WARNING: ReadDirectoryChangesW has failed during normal operations...failed on directory: %s\n"), pdi->m_strDirName);
-
-						//
-						//	To help insure that this has been unwatched by the time
-						//	the main thread processes the On_ReadDirectoryChangesError() notification
-						//	bump the thread priority up temporarily.  The reason this works is because the notification
-						//	is really posted to another thread's message queue,...by setting this thread's priority
-						//	to highest, this thread will get to shutdown the watch by the time the other thread has a chance
-						//	to handle it. *note* not technically guaranteed 100% to be the case, but in practice it'll work.
-						int nOldThreadPriority = GetThreadPriority(GetCurrentThread());
-						SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
-
-						//
-						//	Notify the client object....(a CDirectoryChangeHandler derived class)
-						//
-						try
-						{
-							pdi->m_dwReadDirError = GetLastError();
-							pChangeHandler->On_ReadDiretoryChangesError(pdi->m_dwReadDirError, pdi->m_strDirName);
-
-							//Do the shutdown
-							pThis->UnwatchDirectoryBecauseOfError(pdi);
-							//pdi = NULL; <-- DO NOT set this to NULL, it will cause this worker thread to exit.
-							//pdi is INVALID at this point!!
-						}
-						catch(...)
-						{
-							//LOGF(WARNING, );
-						}
-
-						SetThreadPriority(GetCurrentThread(), nOldThreadPriority);
-					}
-					else
+			// let CDirWatchInfo::StartMonitor() know how it went
+			bSignalStartStop = true;
+		}
+		break;
+		case CDirectoryChangeWatcher::CDirWatchInfo::RUNNING_STATE_STOP:
+		{
+			if (pdi->m_hDir != INVALID_HANDLE_VALUE)
+			{
+				// Since I've previously called ReadDirectoryChangesW() asynchronously, I am waiting
+				// for it to return via GetCompletion().  When I close the
+				// handle that ReadDirectoryChangesW() is waiting on, it will
+				// cause GetCompletion() to return again with this pdi object....
+				// Close the handle, and then wait for the call to GetCompletion()
+				// to return again by breaking out of the switch, and letting GetCompletion()
+				// get called again
+				pdi->CloseDirectoryHandle();
+
+				if (pdi->m_bReadBlocked)
+				{
+					// BACKPRESSURE_BLOCK: there was no read outstanding, nothing's coming back
+					pdi->m_RunningState = CDirWatchInfo::RUNNING_STATE_STOPPED;
+					bSignalStartStop = true;
+				}
+				else
+				{
+					// back up step...GetCompletion() will still need to return from the last time that ReadDirectoryChangesW() was called.....
+					pdi->m_RunningState = CDirWatchInfo::RUNNING_STATE_STOP_STEP2;
+				}
+			}
+			else
+			{
+				// either we weren't watching this directory in the first place,
+				// or we've already stopped monitoring it....
+
+				// set the event that ReadDirectoryChangesW has returned and no further calls to it will be made...
+				pdi->m_RunningState = CDirWatchInfo::RUNNING_STATE_STOPPED;
+				bSignalStartStop = true;
+			}
+		}
+		break;
+		case CDirectoryChangeWatcher::CDirWatchInfo::RUNNING_STATE_STOP_STEP2:
+		{
+			// GetCompletion() has returned from the last
+			// time that ReadDirectoryChangesW was called...
+			// Using CloseHandle() on the directory handle used by
+			// ReadDirectoryChangesW will cause it to return via GetCompletion()....
+			if (pdi->m_hDir == INVALID_HANDLE_VALUE)
+			{
+				// signal that no further calls to ReadDirectoryChangesW will be made
+				// and this pdi can be deleted
+				pdi->m_RunningState = CDirWatchInfo::RUNNING_STATE_STOPPED;
+				bSignalStartStop = true;
+			}
+			else
+			{
+				pdi->CloseDirectoryHandle();
+
+				//wait for GetCompletion() to return this pdi object again
+			}
+		}
+		break;
+		case CDirectoryChangeWatcher::CDirWatchInfo::RUNNING_STATE_STOPPED:
+		{
+			// the watch has been shut down, nothing more to do for this pdi.
+		}
+		break;
+		case CDirectoryChangeWatcher::CDirWatchInfo::RUNNING_STATE_NORMAL:
+		{
+			auto pChangeHandler = pdi->GetChangeHandler();
+			if (pChangeHandler != nullptr)
+			{
+				pChangeHandler->SetChangeDirectoryName(pdi->m_strDirName);
+			}
+
+			DWORD dwReadBuffOffset = 0UL;
+
+			if (numBytes == 0UL)
+			{
+				// the buffer overflowed, notifications have been lost
+				_OnRecordsLost(pdi);
+			}
+
+			if (pdi->m_bDoubleBufferedReads)
+			{
+				//	Hand the filled buffer over and reissue the watch command into a fresh one
+				//	right away, the OS fills it while the changes are being processed.
+				//	A slow handler no longer widens the window in which the OS's buffer can overflow.
+				//	(the next completion for this pdi waits until this one's done, see _DispatchCompletion())
+				DWORD dwFilledSize = 0UL;
+				auto pFilled = pdi->SwapReadBuffer(numBytes, dwFilledSize);
+				pdi->m_dwReadDirError = _IssueRead(pdi, 0UL);
+
+				if (numBytes != 0UL)
+				{
+					CFileNotifyInformation notifyInfo((LPBYTE)pFilled, dwFilledSize);
+					ProcessChangeNotifications(notifyInfo, pdi, dwReadBuffOffset);
+				}
+				else if (!pdi->m_strPendingOldName.IsEmpty())
+				{
+					// the NEW_NAME record was lost in the overflow
+					std::vector<CDirChangeEvent> events;
+					if (pdi->m_bPendingOldNamePasses)
 					{
-						// success, continue as normal
-						pdi->m_dwReadDirError = ERROR_SUCCESS;
+						events.push_back(CDirChangeEvent{ FILE_ACTION_REMOVED, pdi->m_strPendingOldName, CString() });
 					}
+					_JournalEvents(events);
+					_PostEvents(pdi, std::move(events));
+					pdi->m_strPendingOldName.Empty();
 				}
-				break;
-				case CDirectoryChangeWatcher::CDirWatchInfo::RUNNING_STATE_NORMAL:
+
+				CReadBufferPool::Instance().Release(pFilled, dwFilledSize);
+			}
+			else
+			{
+				// process the FILE_NOTIFY_INFORMATION records:
+				// a completion w/ zero bytes means that the buffer overflowed, there's nothing to process.
+				if (numBytes != 0UL)
 				{
+					CFileNotifyInformation notifyInfo((LPBYTE)pdi->m_Buffer, pdi->m_dwBufferSize);
+					ProcessChangeNotifications(notifyInfo, pdi, dwReadBuffOffset);
 				}
-				break;
-				default:
-					LOGF(FATAL, ("MonitorDirectoryChanges() -- how did I get here?\n"));
-					break;
-				}
+
+				// no read is outstanding, so this is when the buffer can be resized
+				pdi->AdaptReadBuffer(numBytes, dwReadBuffOffset);
+
+				//	Changes have been processed,
+				//	Reissue the watch command
+				//
+				pdi->m_dwReadDirError = _IssueRead(pdi, dwReadBuffOffset);
+			}
+
+			if (pdi->m_pSnapshot != nullptr
+				&& pdi->m_pSnapshot->IsRescanPending())
+			{
+				// new directories, their contents have to be listed
+				_SchedulePass(pdi, std::chrono::steady_clock::now() + std::chrono::milliseconds(RESCAN_PASS_INTERVAL_MS));
+			}
+
+			if (pdi->m_dwReadDirError != ERROR_SUCCESS)
+			{
+				_OnReadFailed(pdi);
+				//pdi is INVALID at this point!!
+				bPdiValid = FALSE;
 			}
 		}
+		break;
+		default:
+			LOGF(FATAL, ("MonitorDirectoryChanges() -- how did I get here?\n"));
+			break;
+		}
+	}
 
-	} while (pdi != nullptr);
+	return bPdiValid;
+}
+
+
+
+//
+//	The watch's read has failed (pdi->m_dwReadDirError), it's unwatched.  pdi is deleted.
+//
+void CDirectoryChangeWatcher::_OnReadFailed(CDirWatchInfo * pdi)
+{
+	//
+	//	NOTE:  
+	//		In this case the thread will not wake up for 
+	//		this pdi object because it is no longer associated w/
+	//		the I/O completion port...there will be no more outstanding calls to ReadDirectoryChangesW
+	//		so I have to skip the normal shutdown routines(normal being what happens when CDirectoryChangeWatcher::UnwatchDirectory() is called.
+	//		and close this up, & cause it to be freed.
+	//
+	LOGF(WARNING, ("WARNING: ReadDirectoryChangesW has failed during normal operations...failed on directory: %s\n"), (LPCTSTR)pdi->m_strDirName);
+
+#ifdef _WIN32
+	//
+	//	To help insure that this has been unwatched by the time
+	//	the main thread processes the On_ReadDirectoryChangesError() notification
+	//	bump the thread priority up temporarily.  The reason this works is because the notification
+	//	is really posted to another thread's message queue,...by setting this thread's priority
+	//	to highest, this thread will get to shutdown the watch by the time the other thread has a chance
+	//	to handle it. *note* not technically guaranteed 100% to be the case, but in practice it'll work.
+	int nOldThreadPriority = GetThreadPriority(GetCurrentThread());
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+#endif
+
+	//
+	//	Notify the client object....(a CDirectoryChangeHandler derived class)
+	//
+	auto pChangeHandler = pdi->GetChangeHandler();
+	try
+	{
+		if (pChangeHandler != nullptr)
+		{
+			// BACKPRESSURE_BLOCK: what's been held back goes before the error
+			pChangeHandler->ReleaseBlockedPosts();
+			pChangeHandler->PostBlockedBatches();
+		}
+		pdi->FlushCoalescedEvents();
+		if (pChangeHandler != nullptr)
+		{
+			pChangeHandler->On_ReadDiretoryChangesError(pdi->m_dwReadDirError, pdi->m_strDirName);
+		}
+
+		//Do the shutdown
+		UnwatchDirectoryBecauseOfError(pdi);
+		//pdi is INVALID at this point!!
+	}
+	catch(...)
+	{
+		//LOGF(WARNING, );
+	}
+
+#ifdef _WIN32
+	SetThreadPriority(GetCurrentThread(), nOldThreadPriority);
+#endif
+}
+
+
+/************************************
+FILTERS_RESCAN_ON_OVERFLOW
+
+When the read buffer overflows (a completion w/ zero bytes) the notifications
+that didn't fit are gone, and the OS doesn't say what they were.
+Each watch keeps a CDirectorySnapshot of its tree instead, that the notifications
+keep up to date, and what was lost is found by diffing the directories against it.
+The differences are reported through the usual On_FileAdded()/On_FileRemoved()/On_FileModified().
+
+Only the directories whose records were lost are rescanned if the event source
+knows which ones they were (inotify), otherwise the whole tree is.
+
+The initial listing of the tree (the baseline) is taken while the watch is already armed.
+An overflow before it's done is reconciled once it is, by a rescan of the whole tree that
+also reports what was created since the watch started and never notified.
+A rescan can find a change whose notification is still queued, that notification is dropped
+when it arrives, so a change isn't reported twice (see CDirectorySnapshot).
+
+A rescan runs in passes of RESCAN_ENTRIES_PER_PASS entries, RESCAN_PASS_INTERVAL_MS
+apart, so a big tree doesn't hold up the watch's notifications.  A watch's rescans
+start at most every RESCAN_MIN_INTERVAL_MS, overflows in between are merged into
+the next one, so an overflow storm doesn't turn into back to back scans of the whole tree.
+
+A pass runs like a completion of the watch (see _RunStrand()), so it's never
+concurrent w/ its notifications.
+************************************/
+void CDirectoryChangeWatcher::_OnRecordsLost(CDirWatchInfo * pdi)
+{
+	if (pdi->m_pSnapshot == nullptr)
+	{
+		LOGF(WARNING, _T("CDirectoryChangeWatcher -- change notifications have been lost, the read buffer of %s overflowed\n"), (LPCTSTR)pdi->m_strDirName);
+		return;
+	}
+
+	std::vector<CDirectorySnapshot::tstring> relDirs;
+	if (_pEventSource->GetLostRecordDirectories(pdi, relDirs))
+	{
+		for (const auto & strRelDir : relDirs)
+		{
+			pdi->m_pSnapshot->RequestRescan(strRelDir, false);
+		}
+	}
+	else
+	{
+		pdi->m_pSnapshot->RequestRescan(CDirectorySnapshot::tstring(), true);
+	}
+
+	auto tDue = (std::max)(std::chrono::steady_clock::now(),
+		pdi->m_tLastRescan + std::chrono::milliseconds(RESCAN_MIN_INTERVAL_MS));
+	_SchedulePass(pdi, tDue);
+}
+
+//
+//	queues a pass for pdi, unless there's one queued already that's due by tDue.
+//
+void CDirectoryChangeWatcher::_SchedulePass(CDirWatchInfo * pdi, std::chrono::steady_clock::time_point tDue)
+{
+	pdi->LockProperties();
+	if (pdi->m_bPassScheduled
+		&& pdi->m_tPassDue <= tDue)
+	{
+		pdi->UnlockProperties();
+		return;
+	}
+	// a pass that's due later is superseded, it still runs but finds little or nothing to do
+	pdi->m_bPassScheduled = true;
+	pdi->m_tPassDue = tDue;
+	pdi->UnlockProperties();
+
+	_QueuePass(pdi, pdi->m_ulWatchId, tDue);
+}
+
+//
+//	pdi isn't touched, it may have been unwatched already: _DispatchPass() looks it up by ulWatchId.
+//
+void CDirectoryChangeWatcher::_QueuePass(CDirWatchInfo * pdi, uint64_t ulWatchId, std::chrono::steady_clock::time_point tDue)
+{
+	std::lock_guard<std::mutex> lk(_mutPasses);
+	_scheduledPasses.emplace(tDue, CScheduledPass{ pdi, ulWatchId });
+
+	if (!_passThread.joinable())
+	{
+		try
+		{
+			_passThread = std::thread(_RunScheduledPasses, this);
+		}
+		catch (const std::system_error& e)
+		{
+			LOGF(FATAL, _T("CDirectoryChangeWatcher::_SchedulePass()-- unable to start the pass thread! %s\n"), e.what());
+		}
+	}
+	_cvPasses.notify_one();
+}
+
+UINT CDirectoryChangeWatcher::_RunScheduledPasses(LPVOID lpThis)
+{
+	auto *pThis = reinterpret_cast<CDirectoryChangeWatcher*>(lpThis);
+
+	std::unique_lock<std::mutex> lk(pThis->_mutPasses);
+	while (!pThis->_bStopPasses)
+	{
+		if (pThis->_scheduledPasses.empty())
+		{
+			pThis->_cvPasses.wait(lk);
+			continue;
+		}
+
+		auto it = pThis->_scheduledPasses.begin();
+		if (it->first > std::chrono::steady_clock::now())
+		{
+			pThis->_cvPasses.wait_until(lk, it->first);
+			continue;
+		}
+
+		auto rescan = it->second;
+		pThis->_scheduledPasses.erase(it);
+
+		lk.unlock();
+		pThis->_DispatchPass(rescan.pdi, rescan.ulWatchId);
+		lk.lock();
+	}
 
-	pThis->On_ThreadExit();
 	return 0;
 }
 
+void CDirectoryChangeWatcher::_DispatchPass(CDirWatchInfo * pdi, uint64_t ulWatchId)
+{
+	{
+		// pdi may have been unwatched (and deleted) since the pass was scheduled.
+		// A watch can't be deleted while it's being processed, so once
+		// the pass has got pdi->m_bProcessing pdi is safe to use.
+		std::lock_guard<std::mutex> lk(_mutDirWatchInfo);
+		int nIdx = -1;
+		if (GetDirWatchInfo(pdi, nIdx) == nullptr
+			|| pdi->m_ulWatchId != ulWatchId)
+		{
+			return;
+		}
+
+		pdi->LockProperties();
+		if (pdi->m_bProcessing)
+		{
+			// the worker that's processing it runs the pass when it's done
+			pdi->m_bPassDeferred = true;
+			pdi->UnlockProperties();
+			return;
+		}
+		pdi->m_bProcessing = true;
+		pdi->UnlockProperties();
+	}
+
+	_RunStrand(pdi, false, 0UL);
+}
+
+//
+//	A scheduled pass, run like a completion of the watch (see _RunStrand()).
+//	Returns FALSE if pdi has been deleted (the read that had waited for the handler failed).
+//
+BOOL CDirectoryChangeWatcher::_TimedPass(CDirWatchInfo * pdi)
+{
+	pdi->LockProperties();
+	auto runState = pdi->m_RunningState;
+	pdi->m_bPassScheduled = false;
+	pdi->UnlockProperties();
+
+	if (runState != CDirWatchInfo::RUNNING_STATE_NORMAL)
+	{
+		return TRUE;
+	}
+
+	if (!_ResumeBlockedRead(pdi))
+	{
+		return FALSE;
+	}
+
+	auto tNow = std::chrono::steady_clock::now();
+	if (pdi->m_pSnapshot != nullptr)
+	{
+		_RescanPass(pdi, tNow);
+	}
+
+	if (pdi->m_pSettleTimer != nullptr)
+	{
+		auto & events = pdi->m_events;
+		events.clear();
+		pdi->m_pSettleTimer->TakeExpired(tNow, events);
+		// the files that have settled, in one batch.  reschedules for the rest.
+		_PostEvents(pdi, std::move(events));
+	}
+
+	if (pdi->m_pCoalescer != nullptr)
+	{
+		if (pdi->m_pCoalescer->IsFlushDue(tNow))
+		{
+			pdi->FlushCoalescedEvents();
+		}
+		else if (pdi->m_pCoalescer->HasPending())
+		{
+			// this pass was for a rescan, or it's been superseded
+			_SchedulePass(pdi, pdi->m_pCoalescer->GetFlushTime());
+		}
+	}
+	return TRUE;
+}
+
+//
+//	The watch's next read, unless its handler has batches held back (BACKPRESSURE_BLOCK):
+//	then the watch waits, w/o a read outstanding, until the handler has caught up.
+//	The handler's callback queues a pass then, which issues it (_ResumeBlockedRead()).
+//
+DWORD CDirectoryChangeWatcher::_IssueRead(CDirWatchInfo * pdi, DWORD dwOffset)
+{
+	auto pChangeHandler = pdi->GetChangeHandler();
+	if (pChangeHandler != nullptr
+		&& pChangeHandler->IsPostingBlocked())
+	{
+		pdi->m_bReadBlocked = true;
+		pdi->m_dwBlockedReadOffset = dwOffset;
+		return ERROR_SUCCESS;
+	}
+
+	return _pEventSource->IssueRead(pdi, dwOffset);
+}
+
+//
+//	The batches that the handler held back are posted, and the read that waited for them is issued,
+//	unless they're over the limit again.  Returns FALSE if pdi has been deleted (the read failed).
+//
+BOOL CDirectoryChangeWatcher::_ResumeBlockedRead(CDirWatchInfo * pdi)
+{
+	auto pChangeHandler = pdi->GetChangeHandler();
+	if (pChangeHandler != nullptr)
+	{
+		pChangeHandler->PostBlockedBatches();
+	}
+
+	if (!pdi->m_bReadBlocked)
+	{
+		return TRUE;
+	}
+	pdi->m_bReadBlocked = false;
+	pdi->m_dwReadDirError = _IssueRead(pdi, pdi->m_dwBlockedReadOffset);
+	if (pdi->m_dwReadDirError != ERROR_SUCCESS)
+	{
+		_OnReadFailed(pdi);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void CDirectoryChangeWatcher::_RescanPass(CDirWatchInfo * pdi, std::chrono::steady_clock::time_point tNow)
+{
+	auto pSnapshot = pdi->m_pSnapshot.get();
+	if (pSnapshot->HasRequestedRescans()
+		&& tNow >= pdi->m_tLastRescan + std::chrono::milliseconds(RESCAN_MIN_INTERVAL_MS))
+	{
+		pSnapshot->StartRequestedRescans();
+		pdi->m_tLastRescan = tNow;
+	}
+
+	auto pChangeHandler = pdi->GetChangeHandler();
+	if (pChangeHandler != nullptr)
+	{
+		pChangeHandler->SetChangeDirectoryName(pdi->m_strDirName);
+	}
+
+	CString strRoot(pdi->m_strDirName);
+	if (strRoot.IsEmpty()
+		|| strRoot[strRoot.GetLength() - 1] != DIR_SEPARATOR_CHAR)
+	{
+		strRoot += DIR_SEPARATOR_CHAR;
+	}
+
+	std::vector<CDirChangeEvent> events;
+	pSnapshot->RescanStep(RESCAN_ENTRIES_PER_PASS,
+		[pdi, pChangeHandler, &strRoot, &events](DWORD dwAction, const CDirectorySnapshot::tstring& strRelName, bool bDirectory)
+	{
+		// only what the watch asked for
+		auto dwNameFilter = bDirectory ? FILE_NOTIFY_CHANGE_DIR_NAME : FILE_NOTIFY_CHANGE_FILE_NAME;
+		if (pChangeHandler == nullptr
+			|| (dwAction != FILE_ACTION_MODIFIED && !(pdi->m_dwChangeFilter & dwNameFilter))
+			|| (dwAction == FILE_ACTION_MODIFIED && !(pdi->m_dwChangeFilter & (FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE))))
+		{
+			return;
+		}
+
+		// the include/exclude filters, as for the notifications (see ProcessChangeNotifications())
+		if (pChangeHandler->FiltersWhenPosted())
+		{
+#ifdef _WIN32
+			std::string strUtf8;
+			CUtf8Transcoder::AppendName(strRelName.c_str(), strRelName.size(), strUtf8);
+#else
+			const auto & strUtf8 = strRelName;
+#endif
+			if (!pChangeHandler->PassesFilterSpecs(strUtf8.data(), strUtf8.size()))
+			{
+				return;
+			}
+		}
+
+		events.push_back(CDirChangeEvent{ dwAction, strRoot + CString(strRelName.c_str()), CString() });
+	});
+
+	// what one pass found, in one batch
+	_JournalEvents(events);
+	_PostEvents(pdi, std::move(events));
+
+	if (pSnapshot->IsRescanPending())
+	{
+		_SchedulePass(pdi, tNow + std::chrono::milliseconds(RESCAN_PASS_INTERVAL_MS));
+	}
+	else if (pSnapshot->HasRequestedRescans())
+	{
+		_SchedulePass(pdi, pdi->m_tLastRescan + std::chrono::milliseconds(RESCAN_MIN_INTERVAL_MS));
+	}
+}
+
+//
+//	Hands the changes of one batch to the handler, through the coalescing stage if the watch has one.
+//	The watch's settle timer sees them first, as they happened.
+//
+void CDirectoryChangeWatcher::_PostEvents(CDirWatchInfo * pdi, std::vector<CDirChangeEvent>&& events)
+{
+	if (pdi->m_pSettleTimer != nullptr)
+	{
+		pdi->m_pSettleTimer->NoteEvents(events, std::chrono::steady_clock::now());
+		if (pdi->m_pSettleTimer->HasPending())
+		{
+			_SchedulePass(pdi, pdi->m_pSettleTimer->GetNextExpiry());
+		}
+	}
+
+	if (events.empty())
+	{
+		return;
+	}
+
+	if (pdi->m_pCoalescer == nullptr)
+	{
+		if (pdi->GetChangeHandler() != nullptr)
+		{
+			pdi->GetChangeHandler()->PostEventBatch(std::move(events));
+		}
+		return;
+	}
+
+	_ullEventsCoalesced += events.size();
+	_ullEventsFolded += pdi->m_pCoalescer->Add(std::move(events));
+
+	if (pdi->m_pCoalescer->IsFlushDue(std::chrono::steady_clock::now()))
+	{
+		pdi->FlushCoalescedEvents();
+	}
+	else if (pdi->m_pCoalescer->HasPending())
+	{
+		_SchedulePass(pdi, pdi->m_pCoalescer->GetFlushTime());
+	}
+}
+
+void CDirectoryChangeWatcher::SetJournal(std::shared_ptr<CChangeJournal> pJournal)
+{
+	std::atomic_store(&_pJournal, pJournal);
+}
+
+std::shared_ptr<CChangeJournal> CDirectoryChangeWatcher::GetJournal() const
+{
+	return std::atomic_load(&_pJournal);
+}
+
+//
+//	The changes as they've been read (or found by a rescan), w/ what the watch's include/exclude filters
+//	drop left out already, but before the handler's own filters (or the settle timer, or backpressure) see them.
+//	Only copied into the journal's mapping here, the journal's own thread syncs them.
+//
+void CDirectoryChangeWatcher::_JournalEvents(const std::vector<CDirChangeEvent>& events)
+{
+	if (events.empty())
+	{
+		return;
+	}
+	auto pJournal = std::atomic_load(&_pJournal);
+	if (pJournal != nullptr && !pJournal->Append(events))
+	{
+		LOGF(WARNING, _T("CDirectoryChangeWatcher -- %d changes couldn't be journaled\n"), (int)events.size());
+	}
+}
+
+CDirectoryChangeWatcher::CCoalescingStats CDirectoryChangeWatcher::GetCoalescingStats() const
+{
+	CCoalescingStats stats;
+	stats.ullEventsIn = _ullEventsCoalesced.load();
+	stats.ullEventsFolded = _ullEventsFolded.load();
+	return stats;
+}
+
+BOOL CDirectoryChangeWatcher::GetFilterCacheStats(const CString& strDirName, OUT CFilterVerdictCache::CStats& stats) const
+{
+	std::lock_guard<std::mutex> lock(_mutDirWatchInfo);
+	int nIdx = -1;
+	auto pDirInfo = GetDirWatchInfo(strDirName, nIdx);
+	if (pDirInfo == nullptr
+		|| pDirInfo->GetChangeHandler() == nullptr)
+	{
+		return FALSE;
+	}
+
+	stats = pDirInfo->GetChangeHandler()->GetFilterCacheStats();
+	return TRUE;
+}
+
+/************************************
+Backpressure
+
+A handler that's slower than its watch (eg: during a mass file copy) doesn't slow the watch down,
+the batches that have been read pile up between the watch and the notifier's thread instead.
+SetBackpressurePolicy() bounds them, per watch, to a number of changes:
+
+BACKPRESSURE_BLOCK			-- the batches over the limit are held back, and the watch doesn't read the
+							   directory until the handler has caught up: its next read isn't issued.
+							   Nothing waits meanwhile, the worker threads (and the pass thread) go on
+							   w/ the other watches.  Nothing is lost in between unless the OS's own
+							   buffer overflows.  A watch that's being unwatched isn't held up.
+BACKPRESSURE_DROP_OLDEST	-- the oldest changes go, GetBackpressureStats() counts them.
+BACKPRESSURE_RESCAN			-- all the changes that are waiting are dropped for a single On_SubtreeDirty()
+							   for the directory that has them all, the handler looks at that tree again.
+							   Later overflows are merged into it until it's been dispatched.
+************************************/
+BOOL CDirectoryChangeWatcher::SetBackpressurePolicy(const CString& strDirName, DWORD dwPolicy, size_t nMaxQueuedEvents)
+{
+	std::lock_guard<std::mutex> lock(_mutDirWatchInfo);
+	int nIdx = -1;
+	auto pDirInfo = GetDirWatchInfo(strDirName, nIdx);
+	if (pDirInfo == nullptr
+		|| pDirInfo->GetChangeHandler() == nullptr)
+	{
+		return FALSE;
+	}
+
+	pDirInfo->GetChangeHandler()->SetBackpressurePolicy(dwPolicy, nMaxQueuedEvents);
+	return TRUE;
+}
+
+BOOL CDirectoryChangeWatcher::GetBackpressureStats(const CString& strDirName, OUT CBackpressureStats& stats) const
+{
+	std::lock_guard<std::mutex> lock(_mutDirWatchInfo);
+	int nIdx = -1;
+	auto pDirInfo = GetDirWatchInfo(strDirName, nIdx);
+	if (pDirInfo == nullptr
+		|| pDirInfo->GetChangeHandler() == nullptr)
+	{
+		return FALSE;
+	}
+
+	stats = pDirInfo->GetChangeHandler()->GetBackpressureStats();
+	return TRUE;
+}
+
+void CDirectoryChangeWatcher::_StopPasses()
+{
+	std::thread rescanThread;
+	{
+		std::lock_guard<std::mutex> lk(_mutPasses);
+		_bStopPasses = true;
+		rescanThread.swap(_passThread);
+	}
+	_cvPasses.notify_all();
+
+	if (rescanThread.joinable())
+	{
+		rescanThread.join();
+	}
+
+	std::lock_guard<std::mutex> lk(_mutPasses);
+	_scheduledPasses.clear();
+	_bStopPasses = false;
+}
+
 
 
 //////////////////////////////////////////////////////////////////////////
-CDirectoryChangeWatcher::CDirWatchInfo::CDirWatchInfo(HANDLE hDir, const CString & strDirectoryName, 
+CDirectoryChangeWatcher::CDirWatchInfo::CDirWatchInfo(const CString & strDirectoryName, 
 	CDirectoryChangeHandler * pChangeHandler, DWORD dwChangeFilter, BOOL bWatchSubDir, bool bAppHasGUI, 
-	LPCTSTR szIncludeFilter, LPCTSTR szExcludeFilter, DWORD dwFilterFlags)
+	std::shared_ptr<CDelayedNotifier> pNotifier, const std::string& strIncludeFilter, const std::string& strExcludeFilter, DWORD dwFilterFlags,
+	DWORD dwReadBufferSize, bool bDoubleBufferedReads, DWORD dwCoalesceWindowMs, DWORD dwSettleTimeMs)
+	: m_pChangeHandler(nullptr)
+	, m_hDir(INVALID_HANDLE_VALUE)
+	, m_pEventSource(nullptr)
+	, m_dwChangeFilter(dwChangeFilter)
+	, m_bWatchSubDir(bWatchSubDir)
+	, m_strDirName(strDirectoryName)
+	, m_Buffer(nullptr)
+	, m_dwBufferSize(0UL)
+	, m_nQuietReads(0)
+	, m_bDoubleBufferedReads(bDoubleBufferedReads)
+	, m_bPendingOldNamePasses(false)
+	, m_dwBufLength(0UL)
+	, m_dwReadDirError(ERROR_SUCCESS)
+	, m_dwStartError(ERROR_SUCCESS)
+	, m_StartStopEvent(FALSE, TRUE) //NOT SIGNALLED, MANUAL RESET
+	, m_RunningState(RUNNING_STATE_NOT_SET)
+	, m_bProcessing(false)
+	, m_ulWatchId(++s_ulNextWatchId)
+	, m_bPassScheduled(false)
+	, m_bPassDeferred(false)
+	, m_bReadBlocked(false)
+	, m_dwBlockedReadOffset(0UL)
 {
+	ASSERT(pChangeHandler != nullptr);
+
+#ifdef _WIN32
+	memset(&m_Overlapped, 0, sizeof(m_Overlapped));
+#endif
+
+	dwReadBufferSize = (std::min)((std::max)(dwReadBufferSize, (DWORD)READ_DIR_CHANGE_BUFFER_MIN_SIZE),
+		(DWORD)READ_DIR_CHANGE_BUFFER_MAX_SIZE);
+	if (!_ResizeReadBuffer((dwReadBufferSize + 3UL) & ~3UL, 0UL))
+	{
+		// over the memory cap, every watch gets at least the minimum
+		m_Buffer = CReadBufferPool::Instance().Acquire(READ_DIR_CHANGE_BUFFER_MIN_SIZE, true);
+		m_dwBufferSize = READ_DIR_CHANGE_BUFFER_MIN_SIZE;
+	}
+	memset(m_Buffer, 0, m_dwBufferSize);
+
+	//
+	//	The handler is reference counted, the CDelayedDirectoryChangeHandler holds
+	//	a reference to it for as long as this directory is being watched.
+	//
+	pChangeHandler->AddRef();
+	std::shared_ptr<CDirectoryChangeHandler> pRealHandler(pChangeHandler,
+		[](CDirectoryChangeHandler * p) { p->Release(); });
+
+	m_pChangeHandler = std::make_shared<CDelayedDirectoryChangeHandler>(pRealHandler, bAppHasGUI,
+		strIncludeFilter, strExcludeFilter, dwFilterFlags, std::move(pNotifier));
+	m_pChangeHandler->SetPartialPathOffset(m_strDirName);
+
+	if (dwFilterFlags & CDirectoryChangeWatcher::FILTERS_RESCAN_ON_OVERFLOW)
+	{
+		m_pSnapshot.reset(new CDirectorySnapshot(m_strDirName, bWatchSubDir != FALSE));
+	}
 
+	if (dwFilterFlags & CDirectoryChangeWatcher::FILTERS_COALESCE_EVENTS)
+	{
+		m_pCoalescer.reset(new CEventCoalescer(dwCoalesceWindowMs));
+	}
+
+	if (dwSettleTimeMs != 0)
+	{
+		m_pSettleTimer.reset(new CSettleTimer(dwSettleTimeMs));
+	}
 }
 
 CDirectoryChangeWatcher::CDirWatchInfo::~CDirWatchInfo()
 {
+	CloseDirectoryHandle();
+
+	// the handler lives on until its last notification has been dispatched
+	m_pChangeHandler.reset();
 
+	CReadBufferPool::Instance().Release(m_Buffer, m_dwBufferSize);
+	m_Buffer = nullptr;
+}
+
+//
+//	Called between two reads.  Doubles the buffer after an overflow (zero bytes)
+//	or a read that came back mostly full, halves it after READ_BUFFER_SHRINK_AFTER reads
+//	in a row that used less than an eighth of it.  Bigger buffers mean fewer
+//	completions and rescans during bulk changes, smaller ones keep idle watches cheap.
+//
+//	dwPreserve is the size of the RENAMED_OLD_NAME record that ProcessChangeNotifications()
+//	saved at the beginning of the buffer, it's kept.
+//
+void CDirectoryChangeWatcher::CDirWatchInfo::AdaptReadBuffer(DWORD dwNumBytes, DWORD dwPreserve)
+{
+	auto dwNewSize = _AdaptedReadBufferSize(dwNumBytes);
+	if (dwNewSize != m_dwBufferSize
+		&& dwNewSize > dwPreserve)
+	{
+		_ResizeReadBuffer(dwNewSize, dwPreserve);
+	}
+}
+
+//
+//	Double buffered reads: replaces m_Buffer w/ a fresh one from the pool, sized like
+//	AdaptReadBuffer() would, and returns the filled buffer.   The caller gives that back
+//	to the pool (CReadBufferPool::Release()) once it's been processed.
+//
+CHAR * CDirectoryChangeWatcher::CDirWatchInfo::SwapReadBuffer(DWORD dwNumBytes, OUT DWORD & dwFilledSize)
+{
+	auto pFilled = m_Buffer;
+	dwFilledSize = m_dwBufferSize;
+
+	auto dwNewSize = _AdaptedReadBufferSize(dwNumBytes);
+	auto pFresh = CReadBufferPool::Instance().Acquire(dwNewSize, dwNewSize <= m_dwBufferSize);
+	if (pFresh == nullptr)
+	{
+		// can't grow, stay at the current size
+		dwNewSize = m_dwBufferSize;
+		pFresh = CReadBufferPool::Instance().Acquire(dwNewSize, true);
+	}
+
+	m_Buffer = pFresh;
+	m_dwBufferSize = dwNewSize;
+	return pFilled;
+}
+
+DWORD CDirectoryChangeWatcher::CDirWatchInfo::_AdaptedReadBufferSize(DWORD dwNumBytes)
+{
+	enum { READ_BUFFER_SHRINK_AFTER = 64 };
+
+	DWORD dwNewSize = m_dwBufferSize;
+	if (dwNumBytes == 0UL
+		|| dwNumBytes >= m_dwBufferSize / 4UL * 3UL)
+	{
+		m_nQuietReads = 0;
+		dwNewSize = (std::min)(m_dwBufferSize * 2, (DWORD)READ_DIR_CHANGE_BUFFER_MAX_SIZE);
+	}
+	else if (dwNumBytes < m_dwBufferSize / 8UL)
+	{
+		if (++m_nQuietReads >= READ_BUFFER_SHRINK_AFTER)
+		{
+			m_nQuietReads = 0;
+			dwNewSize = (std::max)(m_dwBufferSize / 2, (DWORD)READ_DIR_CHANGE_BUFFER_MIN_SIZE);
+		}
+	}
+	else
+	{
+		m_nQuietReads = 0;
+	}
+
+	return dwNewSize;
+}
+
+//
+//	returns false if growing the buffer would exceed the memory cap, the buffer is unchanged then.
+//
+bool CDirectoryChangeWatcher::CDirWatchInfo::_ResizeReadBuffer(DWORD dwNewSize, DWORD dwPreserve)
+{
+	// shrinking always succeeds
+	auto pNewBuffer = CReadBufferPool::Instance().Acquire(dwNewSize, dwNewSize <= m_dwBufferSize);
+	if (pNewBuffer == nullptr)
+	{
+		return false;
+	}
+
+	if (m_Buffer != nullptr && dwPreserve > 0UL)
+	{
+		memcpy(pNewBuffer, m_Buffer, dwPreserve);
+	}
+
+	CReadBufferPool::Instance().Release(m_Buffer, m_dwBufferSize);
+	m_Buffer = pNewBuffer;
+	m_dwBufferSize = dwNewSize;
+	return true;
 }
 
 void CDirectoryChangeWatcher::CDirWatchInfo::DeleteSelf(CDirectoryChangeWatcher * pWatcher)
 {
+	//
+	//	pWatcher is nullptr if the watch never started, 
+	//	in that case the handler never referenced the watcher.
+	//
+	if (pWatcher != nullptr)
+	{
+		pWatcher->ReleaseReferenceToWatcher(GetRealChangeHandler());
+	}
 
+	// the handler may outlive the watch (and the watcher), it mustn't call back into them
+	if (m_pChangeHandler != nullptr)
+	{
+		m_pChangeHandler->ReleaseBlockedPosts();
+	}
+
+	delete this;
 }
 
-DWORD CDirectoryChangeWatcher::CDirWatchInfo::StartMonitor(HANDLE hCompPort)
+//
+//	Sets the running state of the object to perform the initial call to ReadDirectoryChangesW()
+//	, wakes up the thread waiting on GetCompletion()
+//	and waits for an event to be set before returning....
+//
+//	The return value is either ERROR_SUCCESS if ReadDirectoryChangesW is successful,
+//	or is the value of GetLastError() for when ReadDirectoryChangesW() failed.
+//
+DWORD CDirectoryChangeWatcher::CDirWatchInfo::StartMonitor(CDirectoryEventSource * pEventSource)
 {
+	ASSERT(pEventSource != nullptr);
+
+	m_pEventSource = pEventSource;
+
+	m_cs.Lock();
+	m_RunningState = RUNNING_STATE_START_MONITORING;
+	m_dwStartError = ERROR_SUCCESS;
+	m_cs.Unlock();
 
+	m_StartStopEvent.ResetEvent();
+
+	// Signal the worker thread to issue the initial call to ReadDirectoryChangesW()
+	if (!pEventSource->PostCompletion(this))
+	{
+		return GetLastError() != ERROR_SUCCESS ? GetLastError() : ERROR_INVALID_HANDLE;
+	}
+
+	// wait for the Worker thread to signal that it has issued the ReadDirectoryChangesW call
+	m_StartStopEvent.Lock();
+	m_StartStopEvent.ResetEvent();
+
+	// not m_dwReadDirError: the reads that follow are processed by the other workers meanwhile
+	m_cs.Lock();
+	DWORD dwStartError = m_dwStartError;
+	m_cs.Unlock();
+	return dwStartError;
 }
 
-BOOL CDirectoryChangeWatcher::CDirWatchInfo::UnwatchDirectory(HANDLE hCompPort)
+//
+//	Sets the running state of the object to stop monitoring a directory,
+//	Causes the worker thread to wake up and to stop monitoring the directory
+//	and waits for it to do so.
+//
+BOOL CDirectoryChangeWatcher::CDirWatchInfo::UnwatchDirectory(CDirectoryEventSource * pEventSource)
 {
+	BOOL bRetVal = FALSE;
+	if (m_pChangeHandler != nullptr)
+	{
+		// BACKPRESSURE_BLOCK: nothing's held back from here on, the watch isn't resumed
+		m_pChangeHandler->ReleaseBlockedPosts();
+	}
+
+	if (SignalShutdown(pEventSource))
+	{
+		bRetVal = WaitForShutdown();
+
+		// nobody's processing this anymore, what's been held back goes before the stop
+		if (m_pChangeHandler != nullptr)
+		{
+			m_pChangeHandler->PostBlockedBatches();
+		}
+		FlushCoalescedEvents();
+
+		if (m_pChangeHandler != nullptr)
+		{
+			// not waiting for it to be dispatched, this is called w/ _mutDirWatchInfo held.
+			// the notification keeps the handlers alive until then.
+			m_pChangeHandler->On_WatchStopped(m_strDirName);
+		}
+	}
 
+	return bRetVal;
 }
 
-BOOL CDirectoryChangeWatcher::CDirWatchInfo::SignalShutdown(HANDLE hCompPort)
+//
+//	Sets the running state of the object to stop monitoring the directory
+//	and wakes up the worker thread.
+//
+BOOL CDirectoryChangeWatcher::CDirWatchInfo::SignalShutdown(CDirectoryEventSource * pEventSource)
 {
+	ASSERT(pEventSource != nullptr);
 
+	m_cs.Lock();
+	m_RunningState = RUNNING_STATE_STOP;
+	m_cs.Unlock();
+
+	m_StartStopEvent.ResetEvent();
+
+	return pEventSource->PostCompletion(this);
 }
 
+//
+//	Waits for the worker thread to signal that no further
+//	calls to ReadDirectoryChangesW() will be made for this directory.
+//
 BOOL CDirectoryChangeWatcher::CDirWatchInfo::WaitForShutdown()
 {
+	m_StartStopEvent.Lock();
+	m_StartStopEvent.ResetEvent();
+
+	return TRUE;
+}
+
+void CDirectoryChangeWatcher::CDirWatchInfo::FlushCoalescedEvents()
+{
+	if (m_pCoalescer == nullptr
+		|| !m_pCoalescer->HasPending())
+	{
+		return;
+	}
 
+	std::vector<CDirChangeEvent> events;
+	m_pCoalescer->TakePending(events);
+	if (m_pChangeHandler != nullptr)
+	{
+		m_pChangeHandler->PostEventBatch(std::move(events));
+	}
 }
 
 CDelayedDirectoryChangeHandler* CDirectoryChangeWatcher::CDirWatchInfo::GetChangeHandler() const
 {
+	return m_pChangeHandler.get();
+}
+
+bool CDirectoryChangeWatcher::CDirWatchInfo::IsInExcludedSubtree(LPCTSTR pszRelName, int nLength) const
+{
+	auto nDirLength = nLength;
+	while (nDirLength > 0 && pszRelName[nDirLength - 1] != DIR_SEPARATOR_CHAR)
+	{
+		--nDirLength;
+	}
+	if (nDirLength <= 1)
+	{
+		// right in the watched directory
+		return false;
+	}
+
+	return m_pChangeHandler->IsExcludedSubtree(pszRelName, (size_t)(nDirLength - 1));
+}
+
+bool CDirectoryChangeWatcher::CDirWatchInfo::IsInExcludedSubtreeUtf8(const char * pszRelName, size_t nLength) const
+{
+	auto nDirLength = nLength;
+	while (nDirLength > 0 && pszRelName[nDirLength - 1] != (char)DIR_SEPARATOR_CHAR)
+	{
+		--nDirLength;
+	}
+	if (nDirLength <= 1)
+	{
+		// right in the watched directory
+		return false;
+	}
 
+	return m_pChangeHandler->IsExcludedSubtreeUtf8(pszRelName, nDirLength - 1);
+}
+
+bool CDirectoryChangeWatcher::CDirWatchInfo::IsExcludedSubtree(const std::basic_string<TCHAR>& strRelDir) const
+{
+	return !strRelDir.empty()
+		&& m_pChangeHandler->IsExcludedSubtree(strRelDir.c_str(), strRelDir.size());
 }
 
 CDirectoryChangeHandler * CDirectoryChangeWatcher::CDirWatchInfo::GetRealChangeHandler() const
 {
+	if (m_pChangeHandler != nullptr)
+	{
+		return m_pChangeHandler->GetRealChangeHandler().get();
+	}
 
+	return nullptr;
 }
 
 CDirectoryChangeHandler * CDirectoryChangeWatcher::CDirWatchInfo::SetRealDirectoryChangeHandler(CDirectoryChangeHandler * pChangeHandler)
 {
+	if (m_pChangeHandler == nullptr)
+	{
+		return nullptr;
+	}
+
+	auto pOld = m_pChangeHandler->GetRealChangeHandler().get();
+	if (pChangeHandler != nullptr)
+	{
+		pChangeHandler->AddRef();
+		std::shared_ptr<CDirectoryChangeHandler> pRealHandler(pChangeHandler,
+			[](CDirectoryChangeHandler * p) { p->Release(); });
+		// read by the notifier's thread w/ GetRealChangeHandler()
+		std::atomic_store(&m_pChangeHandler->_pRealHandler, pRealHandler);
+	}
+	else
+	{
+		std::atomic_store(&m_pChangeHandler->_pRealHandler, std::shared_ptr<CDirectoryChangeHandler>());
+	}
 
+	return pOld;
 }
 
 BOOL CDirectoryChangeWatcher::CDirWatchInfo::CloseDirectoryHandle()
 {
+	if (m_hDir == INVALID_HANDLE_VALUE)
+	{
+		return TRUE;
+	}
 
+	// m_hDir was opened by m_pEventSource, so it's the one to close it
+	ASSERT(m_pEventSource != nullptr);
+	return m_pEventSource->CloseDirectory(this);
 }
@@ -1,14 +1,38 @@
 #pragma once
 #include "DirectoryChangeHandler.h"
 #include "FileNotifyInformation.h"
+#include "RcuDomain.h"
+#include "DirectorySnapshot.h"
+#include "EventCoalescer.h"
+#include "SettleTimer.h"
+#include "FilterVerdictCache.h"
+#include "Utf8Transcoder.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <memory>
+#include <thread>
 
 
-#define READ_DIR_CHANGE_BUFFER_SIZE 4096
+#define READ_DIR_CHANGE_BUFFER_SIZE 4096	//default initial size of a watch's read buffer
+#define READ_DIR_CHANGE_BUFFER_MIN_SIZE 4096
+#define READ_DIR_CHANGE_BUFFER_MAX_SIZE (64 * 1024)	//ReadDirectoryChangesW() fails w/ ERROR_INVALID_PARAMETER above 64K on network shares
+#define READ_DIR_CHANGE_BUFFER_MEMORY_CAP (64 * 1024 * 1024)	//default for SetReadBufferMemoryCap()
 
 
+class CDirectoryEventSource;
+class CDelayedDirectoryChangeHandler;
+class CDelayedNotifier;
+class CDelayedNotificationPollable;
+class CChangeJournal;
+
 class CDirectoryChangeWatcher : public std::enable_shared_from_this<CDirectoryChangeWatcher>
 {
 public:
@@ -22,25 +46,59 @@ public:
 		FILTERS_DONT_USE_HANDLER_FILTER = 32, //CDirectoryChangeHander::On_FilterNotification() won't be called.
 		FILTERS_NO_WATCHSTART_NOTIFICATION = 64,//CDirectoryChangeHander::On_WatchStarted() won't be called.
 		FILTERS_NO_WATCHSTOP_NOTIFICATION = 128,//CDirectoryChangeHander::On_WatchStopped() won't be called.
+		FILTERS_RESCAN_ON_OVERFLOW = 256,//keep a snapshot of each watched tree, and rescan it when notifications have been lost (the buffer overflowed). See WatchDirectory().
+		FILTERS_COALESCE_EVENTS = 512,//fold the changes to the same file within a window (eg: ADDED + MODIFIED x5 -> ADDED) before they're dispatched. See WatchDirectory().
+		FILTERS_PARALLEL_HANDLERS = 1024,//w/o a GUI: the handlers run on a pool of threads, the watches in parallel, each one's changes in order. See CDelayedNotificationPool.
+		FILTERS_POLLABLE_NOTIFICATIONS = 2048,//w/o a GUI, not on Windows: the handlers run on the application's thread, from its event loop. See GetNotificationFd().
 		FILTERS_DEFAULT_BEHAVIOR = (FILTERS_CHECK_FILE_NAME_ONLY),
 		FILTERS_DONT_USE_ANY_FILTER_TESTS = (FILTERS_DONT_USE_FILTERS | FILTERS_DONT_USE_HANDLER_FILTER),
 		FILTERS_NO_WATCH_STARTSTOP_NOTIFICATION = (FILTERS_NO_WATCHSTART_NOTIFICATION | FILTERS_NO_WATCHSTOP_NOTIFICATION)
 	};
 
-	CDirectoryChangeWatcher(bool bAppHasGUI = true, DWORD dwFilterFlags = FILTERS_DEFAULT_BEHAVIOR);
+	enum {	//values for the bWatchSubDirs parameter of WatchDirectory()
+			//
+		WATCH_SUBDIRS_NONE = FALSE,		//only the directory itself is watched.
+		WATCH_SUBDIRS = TRUE,			//the whole tree is watched. On Linux every subdirectory gets an inotify watch of its own.
+		WATCH_SUBDIRS_FILESYSTEM = 2	//the whole tree is watched. On Linux a single fanotify filesystem mark covers it, so setup
+										//doesn't depend on the size of the tree.  Requires CAP_SYS_ADMIN and CAP_DAC_READ_SEARCH, and Linux 5.9+.
+										//On Windows it's the same as WATCH_SUBDIRS.
+	};
+
+	enum {	//values for the dwPolicy parameter of SetBackpressurePolicy()
+			//
+		BACKPRESSURE_NONE = 0,			//the changes that wait to be dispatched aren't limited (the default)
+		BACKPRESSURE_BLOCK = 1,			//the watch stops reading until the handler has caught up, w/ what it's read already held back.
+										//No thread waits for it, the other watches go on.  The OS buffers the changes in the meantime,
+										//when its buffer overflows they're lost (see FILTERS_RESCAN_ON_OVERFLOW)
+		BACKPRESSURE_DROP_OLDEST = 2,	//the oldest changes that haven't been dispatched are dropped, and counted in GetBackpressureStats()
+		BACKPRESSURE_RESCAN = 3			//the changes that haven't been dispatched are replaced by one CDirectoryChangeHandler::On_SubtreeDirty()
+										//for the deepest directory that has all of them
+	};
+
+	enum {	//values for the dwNumWorkerThreads parameter of the constructor
+		WORKER_THREADS_DEFAULT = 1,	//one thread drains the completions of every watched directory
+		WORKER_THREADS_PER_CPU = 0	//one thread per processor
+	};
+
+	CDirectoryChangeWatcher(bool bAppHasGUI = true, DWORD dwFilterFlags = FILTERS_DEFAULT_BEHAVIOR,
+		DWORD dwNumWorkerThreads = WORKER_THREADS_DEFAULT);
 	virtual ~CDirectoryChangeWatcher();
 
 	std::shared_ptr<CDirectoryChangeWatcher> GetSharedPtr()
 	{
-		return std::shared_ptr<CDirectoryChangeWatcher>(this);
+		return shared_from_this();
 	}
 
 	DWORD	WatchDirectory(const CString & strDirToWatch,
 		DWORD dwChangesToWatchFor,
 		CDirectoryChangeHandler * pChangeHandler,
 		BOOL bWatchSubDirs = FALSE,
-		const std::string& strIncludeFilter = nullptr,
-		const std::string& strExcludeFilter = nullptr);
+		const std::string& strIncludeFilter = std::string(),
+		const std::string& strExcludeFilter = std::string(),
+		DWORD dwReadBufferSize = READ_DIR_CHANGE_BUFFER_SIZE,
+		bool bDoubleBufferedReads = false,
+		DWORD dwCoalesceWindowMs = 0,
+		DWORD dwSettleTimeMs = 0);
 
 	BOOL	IsWatchingDirectory(const CString& strDirName) const;
 	int		NumWatchedDirectories() const;
@@ -51,6 +109,54 @@ public:
 	DWORD	SetFilterFlags(DWORD dwFilterFlags);
 	DWORD	GetFilterFlags() const { return _dwFilterFlags;  }
 
+	//	upper limit for the read buffers of all the watches in the process together,
+	//	buffers don't grow beyond it.  returns the previous cap.
+	static size_t	SetReadBufferMemoryCap(size_t nBytes);
+	static size_t	GetReadBufferMemoryUsed();
+
+	//	FILTERS_COALESCE_EVENTS: the changes that went into the coalescing stage of all the watches,
+	//	and how many of them were folded away.
+	struct CCoalescingStats
+	{
+		uint64_t	ullEventsIn;
+		uint64_t	ullEventsFolded;
+	};
+	CCoalescingStats	GetCoalescingStats() const;
+
+	//	FILTERS_CHECK_FULL_PATH/FILTERS_CHECK_PARTIAL_PATH: how often the filter verdicts of strDirName's
+	//	directories were reused (see CFilterVerdictCache).  FALSE if strDirName isn't watched.
+	BOOL	GetFilterCacheStats(const CString& strDirName, OUT CFilterVerdictCache::CStats& stats) const;
+
+	//	bounds the changes of strDirName that have been read and are waiting to be dispatched
+	//	to nMaxQueuedEvents, what happens beyond that is up to dwPolicy (BACKPRESSURE_xxx).
+	//	FALSE if strDirName isn't watched.
+	BOOL	SetBackpressurePolicy(const CString& strDirName, DWORD dwPolicy, size_t nMaxQueuedEvents);
+	struct CBackpressureStats
+	{
+		uint64_t	ullEventsDropped;	//BACKPRESSURE_DROP_OLDEST
+		uint64_t	ullEventsCollapsed;	//BACKPRESSURE_RESCAN: the changes that On_SubtreeDirty() has stood in for
+		uint64_t	ullCollapses;
+		uint64_t	ullBlockedPosts;	//BACKPRESSURE_BLOCK: the times the watch stopped reading until the handler caught up
+		size_t		nQueuedEvents;
+		size_t		nQueuedEventsPeak;
+	};
+	BOOL	GetBackpressureStats(const CString& strDirName, OUT CBackpressureStats& stats) const;
+
+	//	every batch of changes that's read (of all the watches, w/ what their include/exclude filters drop left out,
+	//	but before the handlers' own filters) is appended to pJournal
+	//	as well, nullptr to stop.  The journal is opened by the application, see CChangeJournal.
+	void	SetJournal(std::shared_ptr<CChangeJournal> pJournal);
+	std::shared_ptr<CChangeJournal>	GetJournal() const;
+
+#ifndef _WIN32
+	//	FILTERS_POLLABLE_NOTIFICATIONS: one descriptor for all the watches, readable while notifications
+	//	are waiting to be dispatched.  Poll it in the application's event loop and call
+	//	DispatchPendingNotifications() when it's readable.  -1 w/o the flag.
+	int		GetNotificationFd() const;
+	//	runs the handler functions for whatever is waiting, on the calling thread. returns how many were dispatched.
+	size_t	DispatchPendingNotifications();
+#endif
+
 public:
 	// this class is used internally by CDirectoryChangeWatcher
 	// to help manage the watched directories
@@ -60,23 +166,28 @@ public:
 		CDirWatchInfo() = delete;
 		CDirWatchInfo& operator=(const CDirWatchInfo&) = delete;
 
-		CDirWatchInfo(HANDLE hDir, const CString & strDirectoryName,
+		CDirWatchInfo(const CString & strDirectoryName,
 			CDirectoryChangeHandler * pChangeHandler,
 			DWORD dwChangeFilter, BOOL bWatchSubDir,
 			bool bAppHasGUI,
-			LPCTSTR szIncludeFilter,
-			LPCTSTR szExcludeFilter,
-			DWORD dwFilterFlags);
+			std::shared_ptr<CDelayedNotifier> pNotifier,
+			const std::string& strIncludeFilter,
+			const std::string& strExcludeFilter,
+			DWORD dwFilterFlags,
+			DWORD dwReadBufferSize,
+			bool bDoubleBufferedReads,
+			DWORD dwCoalesceWindowMs,
+			DWORD dwSettleTimeMs);
 
 	private:
 		~CDirWatchInfo();//only I can delete myself....use DeleteSelf()
 	public:
 		void	DeleteSelf(CDirectoryChangeWatcher * pWatcher);
 
-		DWORD	StartMonitor(HANDLE hCompPort);
-		BOOL	UnwatchDirectory(HANDLE hCompPort);
+		DWORD	StartMonitor(CDirectoryEventSource * pEventSource);
+		BOOL	UnwatchDirectory(CDirectoryEventSource * pEventSource);
 	protected:
-		BOOL	SignalShutdown(HANDLE hCompPort);
+		BOOL	SignalShutdown(CDirectoryEventSource * pEventSource);
 		BOOL	WaitForShutdown();
 
 	public:
@@ -89,16 +200,44 @@ public:
 
 		BOOL CloseDirectoryHandle();
 
+		//	pszRelName[0..nLength) is in a directory that the filters exclude as a whole, its changes needn't be reported
+		bool	IsInExcludedSubtree(LPCTSTR pszRelName, int nLength) const;
+		//	the same w/ a UTF-8 name, eg: from m_nameArena
+		bool	IsInExcludedSubtreeUtf8(const char * pszRelName, size_t nLength) const;
+		//	nothing below the directory strRelDir is reported, it needn't be watched
+		bool	IsExcludedSubtree(const std::basic_string<TCHAR>& strRelDir) const;
+
+		//	posts the changes m_pCoalescer has held back
+		void	FlushCoalescedEvents();
+
+		void	AdaptReadBuffer(DWORD dwNumBytes, DWORD dwPreserve);
+		CHAR *	SwapReadBuffer(DWORD dwNumBytes, OUT DWORD & dwFilledSize);
+	private:
+		DWORD	_AdaptedReadBufferSize(DWORD dwNumBytes);
+		bool	_ResizeReadBuffer(DWORD dwNewSize, DWORD dwPreserve);
+	public:
+
 		//CDirectoryChangeHandler * m_pChangeHandler;
-		CDelayedDirectoryChangeHandler * m_pChangeHandler;
-		HANDLE      m_hDir;//handle to directory that we're watching
+		std::shared_ptr<CDelayedDirectoryChangeHandler> m_pChangeHandler;//shared w/ the notifications that haven't been dispatched yet
+		HANDLE      m_hDir;//handle to directory that we're watching, opened by CDirectoryEventSource::OpenDirectory()
+		CDirectoryEventSource * m_pEventSource;//the event source that m_hDir is associated with
 		DWORD		m_dwChangeFilter;
 		BOOL		m_bWatchSubDir;
 		CString     m_strDirName;//name of the directory that we're watching
-		CHAR        m_Buffer[READ_DIR_CHANGE_BUFFER_SIZE];//buffer for ReadDirectoryChangesW
+		CHAR *      m_Buffer;//buffer for ReadDirectoryChangesW, m_dwBufferSize bytes. only resized while no read is outstanding
+		DWORD       m_dwBufferSize;
+		int         m_nQuietReads;//reads in a row that used only a small part of m_Buffer
+		bool        m_bDoubleBufferedReads;//the next read goes into a fresh buffer before the filled one is processed
+		CString     m_strPendingOldName;//double buffered reads: a RENAMED_OLD_NAME that was the last record of its buffer
+		bool		m_bPendingOldNamePasses;//m_strPendingOldName passes the include/exclude filters
+		CUtf8NameArena	m_nameArena;//the names of the read being processed, in UTF-8, for the include/exclude filters
+		std::vector<CDirChangeEvent>	m_events;//the strand's batch being built, its buffer comes back from the notification it's posted w/
 		DWORD       m_dwBufLength;//length or returned data from ReadDirectoryChangesW -- ignored?...
+#ifdef _WIN32
 		OVERLAPPED  m_Overlapped;
+#endif
 		DWORD		m_dwReadDirError;//indicates the success of the call to ReadDirectoryChanges()
+		DWORD		m_dwStartError;//the result of the initial read, for StartMonitor(), guarded by m_cs
 		CCriticalSection m_cs;
 		CEvent		m_StartStopEvent;
 		enum eRunningState {
@@ -111,6 +250,20 @@ public:
 		};
 		eRunningState m_RunningState;
 
+		bool		m_bProcessing;//a worker thread is processing a completion for this directory
+		std::deque<DWORD>	m_deferredCompletions;//completions (their byte counts) that arrived while m_bProcessing, guarded by m_cs
+
+		uint64_t	m_ulWatchId;//unique per CDirWatchInfo, tells a scheduled rescan that the watch is still the same one
+		std::unique_ptr<CDirectorySnapshot>	m_pSnapshot;//FILTERS_RESCAN_ON_OVERFLOW, only used by whoever is processing this pdi
+		std::chrono::steady_clock::time_point	m_tLastRescan;//when the last rescan started, see _OnRecordsLost()
+		std::unique_ptr<CEventCoalescer>	m_pCoalescer;//FILTERS_COALESCE_EVENTS, only used by whoever is processing this pdi
+		std::unique_ptr<CSettleTimer>	m_pSettleTimer;//dwSettleTimeMs != 0, only used by whoever is processing this pdi
+		bool		m_bPassScheduled;//a pass (rescan, coalescer flush or settled files) is in _scheduledPasses, guarded by m_cs
+		std::chrono::steady_clock::time_point	m_tPassDue;//when it's due, guarded by m_cs
+		bool		m_bPassDeferred;//a pass came due while m_bProcessing, guarded by m_cs
+		bool		m_bReadBlocked;//BACKPRESSURE_BLOCK: the next read waits for the handler, only used by whoever is processing this pdi
+		DWORD		m_dwBlockedReadOffset;//where in m_Buffer it's to start then
+
 	};
 
 	//so that CDirWatchInfo can call the following function.
@@ -125,13 +278,15 @@ public:
 
 	BOOL	UnwatchDirectoryBecauseOfError(CDirWatchInfo * pWatchInfo);//called in case of error.
 	int		AddToWatchInfo(std::shared_ptr<CDirWatchInfo> pWatchInfo);
+	void	RemoveFromWatchInfo(int nIdx);
 
 	//
 	//	functions for retrieving the directory watch info based on different parameters
+	//	O(1), _mutDirWatchInfo must be locked
 	//
 	std::shared_ptr<CDirWatchInfo>	GetDirWatchInfo(IN const CString& strDirName, OUT int& ref_nIdx) const;
-	std::shared_ptr<CDirWatchInfo>	GetDirWatchInfo(IN std::shared_ptr<CDirWatchInfo> pWatchInfo, OUT int& ref_nIdx) const;
-	std::shared_ptr<CDirWatchInfo>	GetDirWatchInfo(IN std::shared_ptr<CDirectoryChangeHandler> pChangeHandler, OUT int& ref_nIdx) const;
+	std::shared_ptr<CDirWatchInfo>	GetDirWatchInfo(IN const CDirWatchInfo * pWatchInfo, OUT int& ref_nIdx) const;
+	std::shared_ptr<CDirWatchInfo>	GetDirWatchInfo(IN const CDirectoryChangeHandler * pChangeHandler, OUT int& ref_nIdx) const;
 
 protected:
 	//All file change notifications has taken place in the context of 
@@ -142,19 +297,80 @@ protected:
 	virtual void	On_ThreadExit() {}
 
 private:
-	BOOL		_UnWatchDirectory(std::shared_ptr<CDirectoryChangeHandler> pDirCH);
+	BOOL		_UnWatchDirectory(CDirectoryChangeHandler * pDirCH);
+	static std::basic_string<TCHAR>	_NormalizedDirName(const CString& strDirName);
+	void		_PublishWatchName(const std::basic_string<TCHAR>& strKey, bool bWatched);
+	void		_PublishNoWatchNames();
 	
 	UINT static _MonitorDirectoryChanges(LPVOID lpThis);
+	void		_DispatchCompletion(CDirWatchInfo * pdi, DWORD numBytes);
+	void		_RunStrand(CDirWatchInfo * pdi, bool bCompletion, DWORD numBytes);
+	BOOL		_ProcessCompletion(CDirWatchInfo * pdi, DWORD numBytes, bool & bSignalStartStop);
+
+	UINT static _RunScheduledPasses(LPVOID lpThis);
+	void		_OnRecordsLost(CDirWatchInfo * pdi);
+	void		_SchedulePass(CDirWatchInfo * pdi, std::chrono::steady_clock::time_point tDue);
+	void		_QueuePass(CDirWatchInfo * pdi, uint64_t ulWatchId, std::chrono::steady_clock::time_point tDue);
+	void		_DispatchPass(CDirWatchInfo * pdi, uint64_t ulWatchId);
+	BOOL		_TimedPass(CDirWatchInfo * pdi);
+	DWORD		_IssueRead(CDirWatchInfo * pdi, DWORD dwOffset);
+	BOOL		_ResumeBlockedRead(CDirWatchInfo * pdi);
+	void		_OnReadFailed(CDirWatchInfo * pdi);
+	void		_RescanPass(CDirWatchInfo * pdi, std::chrono::steady_clock::time_point tNow);
+	void		_PostEvents(CDirWatchInfo * pdi, std::vector<CDirChangeEvent>&& events);
+	void		_JournalEvents(const std::vector<CDirChangeEvent>& events);
+	void		_StopPasses();
 
 private:
 	friend	class CDirectoryChangeHandler;
 
-	HANDLE	_hCompPort;	//i/o completion port
-	HANDLE	_hThread;	//MonitorDirectoryChanges() thread handle
-	DWORD	_dwThreadID;
-	std::vector<std::shared_ptr<CDirWatchInfo>>	_directoriesToWatchVec;
-	std::mutex _mutDirWatchInfo;
+	std::unique_ptr<CDirectoryEventSource>	_pEventSource;	//ReadDirectoryChangesW()/i/o completion port, or inotify
+	std::vector<std::thread>	_workerThreads;	//MonitorDirectoryChanges() threads, all of them pull from _pEventSource
+	DWORD	_dwNumWorkerThreads;
+
+	//	Work that a watch schedules for later runs in passes, by _passThread when they come due:
+	//	FILTERS_RESCAN_ON_OVERFLOW: each pass lists a bounded number of entries, see _OnRecordsLost().
+	//	FILTERS_COALESCE_EVENTS: the changes held back for a time window are posted, see _PostEvents().
+	//	BACKPRESSURE_BLOCK: the read that waited for the handler is issued once it's caught up, see _IssueRead().
+	enum {
+		RESCAN_MIN_INTERVAL_MS = 1000,	//a watch's rescans start at most this often, overflows in between are merged
+		RESCAN_PASS_INTERVAL_MS = 50,	//between the passes of one rescan
+		RESCAN_ENTRIES_PER_PASS = 4096
+	};
+	struct CScheduledPass
+	{
+		CDirWatchInfo *	pdi;
+		uint64_t		ulWatchId;
+	};
+	std::thread	_passThread;	//_RunScheduledPasses(), started w/ the first pass
+	std::mutex	_mutPasses;
+	std::condition_variable	_cvPasses;
+	std::multimap<std::chrono::steady_clock::time_point, CScheduledPass>	_scheduledPasses;	//by due time
+	bool	_bStopPasses;
+	std::atomic<uint64_t>	_ullEventsCoalesced;	//CCoalescingStats
+	std::atomic<uint64_t>	_ullEventsFolded;
+	std::vector<std::shared_ptr<CDirWatchInfo>>	_directoriesToWatchVec;	//nullptr for the slots in _freeWatchSlots
+	std::vector<int>	_freeWatchSlots;
+	std::unordered_map<std::basic_string<TCHAR>, int>	_watchIdxByName;	//by _NormalizedDirName()
+	std::unordered_map<const CDirWatchInfo *, int>		_watchIdxByInfo;
+	std::unordered_map<const CDirectoryChangeHandler *, std::vector<int>>	_watchIdxByHandler;	//by the 'real' change handler
+
+	//	IsWatchingDirectory() and NumWatchedDirectories() don't lock _mutDirWatchInfo.
+	//	They read an immutable copy of the watched names instead, which the writers replace
+	//	(under _mutDirWatchInfo) and free once _rcuWatchNames says that no reader can still see it.
+	//	The names are split into shards so that a writer copies only a small part of them.
+	typedef std::unordered_set<std::basic_string<TCHAR>>	CWatchNameSet;
+	enum { WATCH_NAME_SHARDS = 64 };
+	std::atomic<const CWatchNameSet *>	_watchNameShards[WATCH_NAME_SHARDS];
+	mutable CRcuDomain	_rcuWatchNames;
+	std::atomic<int>	_nWatchedDirectories;
+	mutable std::mutex _mutDirWatchInfo;
 	bool	_bAppHasGUI;
 	DWORD	_dwFilterFlags;
+	std::shared_ptr<CChangeJournal>	_pJournal;	//std::atomic_load()/atomic_store(), see SetJournal()
+#ifndef _WIN32
+	void	_InitPollableNotifier();
+	std::shared_ptr<CDelayedNotificationPollable>	_pPollableNotifier;	//FILTERS_POLLABLE_NOTIFICATIONS, shared by the watches
+#endif
 };
 
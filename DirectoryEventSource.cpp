@@ -0,0 +1,17 @@
+#include "stdafx.h"
+#include "DirectoryEventSource.h"
+#ifdef _WIN32
+#include "IoCompletionEventSource.h"
+#else
+#include "InotifyEventSource.h"
+#endif
+
+
+std::unique_ptr<CDirectoryEventSource> CDirectoryEventSource::Create()
+{
+#ifdef _WIN32
+	return std::unique_ptr<CDirectoryEventSource>(new CIoCompletionEventSource());
+#else
+	return std::unique_ptr<CDirectoryEventSource>(new CInotifyEventSource());
+#endif
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include "DirectoryChangeWatcher.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+
+/*******************************
+
+The source of directory change records for CDirectoryChangeWatcher.
+
+CDirectoryChangeWatcher::_MonitorDirectoryChanges() is written against the
+semantics of an I/O completion port:  a watched directory is associated
+with the event source, a read is issued into CDirWatchInfo::m_Buffer, and the
+worker thread blocks in GetCompletion() until that read has completed
+(or has been aborted because the directory was closed).
+
+Every implementation fills the read buffer with FILE_NOTIFY_INFORMATION
+records, so CFileNotifyInformation, ProcessChangeNotifications() and the
+CDirectoryChangeHandler::On_Filexxx() functions behave the same whichever
+event source produced them.
+
+	CIoCompletionEventSource	-- ReadDirectoryChangesW() + I/O completion port (Windows)
+	CInotifyEventSource			-- inotify(7), events are read in batches with one read() (Linux)
+
+********************************/
+class CDirectoryEventSource
+{
+public:
+	CDirectoryEventSource() {}
+	virtual ~CDirectoryEventSource() {}
+
+	CDirectoryEventSource(const CDirectoryEventSource&) = delete;
+	CDirectoryEventSource& operator=(const CDirectoryEventSource&) = delete;
+
+	//	the native event source for this platform
+	static std::unique_ptr<CDirectoryEventSource> Create();
+
+	//	opens pdi->m_strDirName for monitoring and sets pdi->m_hDir.
+	//	returns ERROR_SUCCESS or an error code.
+	virtual DWORD	OpenDirectory(CDirectoryChangeWatcher::CDirWatchInfo * pdi) = 0;
+
+	//	closes pdi->m_hDir.  An outstanding read for pdi completes (with zero bytes).
+	virtual BOOL	CloseDirectory(CDirectoryChangeWatcher::CDirWatchInfo * pdi) = 0;
+
+	//	pdi becomes the completion key returned from GetCompletion()
+	virtual DWORD	Associate(CDirectoryChangeWatcher::CDirWatchInfo * pdi) = 0;
+
+	//	issues an asynchronous read of change records into
+	//	pdi->m_Buffer + dwOffset.   When it completes, GetCompletion() returns pdi.
+	virtual DWORD	IssueRead(CDirectoryChangeWatcher::CDirWatchInfo * pdi, DWORD dwOffset) = 0;
+
+	//	queues a completion for pdi without any i/o taking place.
+	//	a nullptr pdi tells one worker thread to exit.
+	virtual BOOL	PostCompletion(CDirectoryChangeWatcher::CDirWatchInfo * pdi) = 0;
+
+	//	blocks until a read has completed or a completion has been posted.
+	//	returns FALSE if the read failed or was aborted, pdi is still set in that case.
+	//	several worker threads may be waiting here at once, each completion goes to one of them.
+	virtual BOOL	GetCompletion(OUT CDirectoryChangeWatcher::CDirWatchInfo *& pdi, OUT DWORD & dwNumBytes) = 0;
+
+	//	after pdi's read completed w/ zero bytes (change records have been lost):
+	//	the directories, relative to pdi->m_strDirName, whose records were lost.
+	//	returns false if that isn't known, the whole tree has to be rescanned then.
+	//	ReadDirectoryChangesW() doesn't tell.
+	virtual bool	GetLostRecordDirectories(CDirectoryChangeWatcher::CDirWatchInfo * pdi,
+		OUT std::vector<std::basic_string<TCHAR>> & relDirs)
+	{
+		UNREFERENCED_PARAMETER(pdi);
+		UNREFERENCED_PARAMETER(relDirs);
+		return false;
+	}
+};
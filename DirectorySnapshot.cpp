@@ -0,0 +1,696 @@
+#include "stdafx.h"
+#include "DirectorySnapshot.h"
+#include <vector>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#endif
+
+
+CDirectorySnapshot::CDirectorySnapshot(const CString& strRoot, bool bRecursive)
+	: _strRoot((LPCTSTR)strRoot, strRoot.GetLength())
+	, _bRecursive(bRecursive)
+	, _bHasBaseline(false)
+	, _bLostDuringBaseline(false)
+	, _bReportUnknowns(false)
+	, _llWatchStart(_CoarseNow())
+{
+	while (_strRoot.size() > 1
+		&& _strRoot.back() == DIR_SEPARATOR_CHAR)
+	{
+		_strRoot.pop_back();
+	}
+
+	_QueueScan(tstring(), _bRecursive, true);
+}
+
+bool CDirectorySnapshot::NoteAdded(const tstring& strRelName)
+{
+	_NoteDelivered(strRelName, true);
+	_reportedRemovals.erase(strRelName);
+
+	tstring strParent, strName;
+	_SplitName(strRelName, strParent, strName);
+
+	auto itParent = _directories.find(strParent);
+	if (itParent == _directories.end())
+	{
+		// not listed yet, the scan that lists it will find it
+		return true;
+	}
+
+	auto itEntry = itParent->second.find(strName);
+	if (itEntry != itParent->second.end()
+		&& itEntry->second.dwReported == FILE_ACTION_ADDED)
+	{
+		// a rescan found it before its notification arrived
+		itEntry->second.dwReported = 0;
+		return false;
+	}
+
+	CEntry entry;
+	if (!_ReadEntry(strRelName, entry))
+	{
+		// already gone again
+		return true;
+	}
+	itParent->second[strName] = entry;
+
+	if (entry.bDirectory && _bRecursive)
+	{
+		// a directory that has been moved in comes w/ its contents, and only the directory is reported
+		_QueueScan(strRelName, true, true);
+	}
+	return true;
+}
+
+bool CDirectorySnapshot::NoteRemoved(const tstring& strRelName)
+{
+	_NoteDelivered(strRelName, false);
+	if (_reportedRemovals.erase(strRelName) != 0)
+	{
+		return false;
+	}
+
+	tstring strParent, strName;
+	_SplitName(strRelName, strParent, strName);
+
+	auto itParent = _directories.find(strParent);
+	if (itParent != _directories.end())
+	{
+		itParent->second.erase(strName);
+	}
+	_ForgetSubtree(strRelName, false, FuncReport());
+	return true;
+}
+
+bool CDirectorySnapshot::NoteModified(const tstring& strRelName)
+{
+	_NoteDelivered(strRelName, true);
+
+	tstring strParent, strName;
+	_SplitName(strRelName, strParent, strName);
+
+	auto itParent = _directories.find(strParent);
+	if (itParent == _directories.end())
+	{
+		return true;
+	}
+
+	auto itEntry = itParent->second.find(strName);
+	if (itEntry != itParent->second.end()
+		&& !itEntry->second.bDirectory)
+	{
+		if (itEntry->second.dwReported == FILE_ACTION_MODIFIED)
+		{
+			itEntry->second.dwReported = 0;
+			return false;
+		}
+
+		// stat()ing every modified file would cost more than the notification itself,
+		// remember when it was reported instead, see _IsModified().
+		itEntry->second.ullSize = UNKNOWN_SIZE;
+		itEntry->second.llLastWrite = _Now();
+	}
+	return true;
+}
+
+bool CDirectorySnapshot::NoteRenamed(const tstring& strOldRelName, const tstring& strNewRelName)
+{
+	_NoteDelivered(strOldRelName, false);
+	_NoteDelivered(strNewRelName, true);
+
+	tstring strOldParent, strOldName, strNewParent, strNewName;
+	_SplitName(strOldRelName, strOldParent, strOldName);
+	_SplitName(strNewRelName, strNewParent, strNewName);
+
+	auto itOldParent = _directories.find(strOldParent);
+	auto itNewParent = _directories.find(strNewParent);
+
+	if (itNewParent != _directories.end()
+		&& _reportedRemovals.count(strOldRelName) != 0)
+	{
+		auto itNewEntry = itNewParent->second.find(strNewName);
+		if (itNewEntry != itNewParent->second.end()
+			&& itNewEntry->second.dwReported == FILE_ACTION_ADDED)
+		{
+			// a rescan reported it as removed and added again
+			_reportedRemovals.erase(strOldRelName);
+			itNewEntry->second.dwReported = 0;
+			return false;
+		}
+	}
+
+	CEntry entry;
+	bool bHaveEntry = false;
+	if (itOldParent != _directories.end())
+	{
+		auto itEntry = itOldParent->second.find(strOldName);
+		if (itEntry != itOldParent->second.end())
+		{
+			entry = itEntry->second;
+			bHaveEntry = true;
+			itOldParent->second.erase(itEntry);
+		}
+	}
+
+	if (itNewParent == _directories.end())
+	{
+		// moved to a directory that hasn't been listed yet
+		_ForgetSubtree(strOldRelName, false, FuncReport());
+		return true;
+	}
+
+	if (!bHaveEntry
+		&& !_ReadEntry(strNewRelName, entry))
+	{
+		return true;
+	}
+	itNewParent->second[strNewName] = entry;
+
+	if (!entry.bDirectory)
+	{
+		return true;
+	}
+
+	// the listings of the directory and everything below it move along
+	auto strOldPrefix = strOldRelName + DIR_SEPARATOR_CHAR;
+	std::vector<tstring> movedDirs;
+	for (const auto & it : _directories)
+	{
+		if (it.first == strOldRelName
+			|| it.first.compare(0, strOldPrefix.size(), strOldPrefix) == 0)
+		{
+			movedDirs.push_back(it.first);
+		}
+	}
+
+	for (const auto & strOldDir : movedDirs)
+	{
+		auto itDir = _directories.find(strOldDir);
+		CListing listing;
+		listing.swap(itDir->second);
+		_directories.erase(itDir);
+		_directories[strNewRelName + strOldDir.substr(strOldRelName.size())].swap(listing);
+	}
+
+	if (movedDirs.empty() && _bRecursive)
+	{
+		_QueueScan(strNewRelName, true, true);
+	}
+	return true;
+}
+
+void CDirectorySnapshot::RequestRescan(const tstring& strRelDir, bool bRecursive)
+{
+	if (!_bHasBaseline)
+	{
+		// nothing to diff against yet, see RescanStep()
+		_bLostDuringBaseline = true;
+		return;
+	}
+
+	auto & bRequestedRecursive = _requestedScans[strRelDir];
+	bRequestedRecursive = bRequestedRecursive || bRecursive;
+}
+
+void CDirectorySnapshot::StartRequestedRescans()
+{
+	auto itRoot = _requestedScans.find(tstring());
+	if (itRoot != _requestedScans.end()
+		&& itRoot->second)
+	{
+		// the whole tree, that covers everything else
+		_QueueScan(tstring(), true, false);
+	}
+	else
+	{
+		for (const auto & it : _requestedScans)
+		{
+			_QueueScan(it.first, it.second, false);
+		}
+	}
+
+	_requestedScans.clear();
+}
+
+bool CDirectorySnapshot::RescanStep(size_t nMaxEntries, const FuncReport& report)
+{
+	size_t nEntries = 0;
+	while (!_pendingScans.empty()
+		&& nEntries < nMaxEntries)
+	{
+		auto scan = _pendingScans.front();
+		_pendingScans.pop_front();
+		_queuedDirs.erase(scan.strRelDir);
+
+		nEntries += _RescanDirectory(scan, _bHasBaseline && !scan.bSilent, report);
+	}
+
+	if (_pendingScans.empty())
+	{
+		if (!_bHasBaseline
+			&& _bLostDuringBaseline)
+		{
+			// the baseline may hold entries whose notifications were lost, they would never differ from it.
+			// Rescan everything and report what was created or written since the watch started
+			// that hasn't been reported, see _UnknownAction().
+			_bReportUnknowns = true;
+			_QueueScan(tstring(), true, false);
+		}
+		else
+		{
+			_bReportUnknowns = false;
+			_deliveredNames.clear();
+		}
+		_bHasBaseline = true;
+		_bLostDuringBaseline = false;
+	}
+
+	return !_pendingScans.empty();
+}
+
+void CDirectorySnapshot::_QueueScan(const tstring& strRelDir, bool bRecursive, bool bSilent)
+{
+	if (_queuedDirs.count(strRelDir) != 0)
+	{
+		// already queued, only make sure it goes deep enough
+		if (bRecursive)
+		{
+			for (auto & scan : _pendingScans)
+			{
+				if (scan.strRelDir == strRelDir)
+				{
+					scan.bRecursive = true;
+					break;
+				}
+			}
+		}
+		return;
+	}
+
+	_queuedDirs.insert(strRelDir);
+	_pendingScans.push_back(CPendingScan{ strRelDir, bRecursive, bSilent });
+}
+
+//
+//	lists one directory and diffs it against its cached listing, which it then replaces.
+//	returns the number of entries that were looked at.
+//
+size_t CDirectorySnapshot::_RescanDirectory(const CPendingScan& scan, bool bReport, const FuncReport& report)
+{
+	CListing current;
+	if (!_ListDirectory(scan.strRelDir, current))
+	{
+		// it's gone, and so is everything that was in it
+		_ForgetSubtree(scan.strRelDir, bReport, report);
+		return 1;
+	}
+
+	auto & cached = _directories[scan.strRelDir];
+
+	// both listings are sorted by name, walk them side by side
+	auto itCached = cached.begin();
+	auto itCurrent = current.begin();
+	while (itCached != cached.end()
+		|| itCurrent != current.end())
+	{
+		bool bRemoved = (itCurrent == current.end())
+			|| (itCached != cached.end() && itCached->first < itCurrent->first);
+		bool bAdded = !bRemoved
+			&& (itCached == cached.end() || itCurrent->first < itCached->first);
+		if (!bRemoved && !bAdded
+			&& itCached->second.bDirectory != itCurrent->second.bDirectory)
+		{
+			// replaced by something else w/ the same name
+			bRemoved = bAdded = true;
+		}
+
+		if (bRemoved)
+		{
+			auto strRelName = _JoinName(scan.strRelDir, itCached->first);
+			if (itCached->second.bDirectory)
+			{
+				_ForgetSubtree(strRelName, bReport, report);
+			}
+			if (bReport)
+			{
+				report(FILE_ACTION_REMOVED, strRelName, itCached->second.bDirectory);
+				_reportedRemovals.insert(strRelName);
+			}
+		}
+
+		if (bAdded)
+		{
+			auto strRelName = _JoinName(scan.strRelDir, itCurrent->first);
+			if (bReport)
+			{
+				report(FILE_ACTION_ADDED, strRelName, itCurrent->second.bDirectory);
+				itCurrent->second.dwReported = FILE_ACTION_ADDED;
+			}
+			if (itCurrent->second.bDirectory && _bRecursive)
+			{
+				// everything in it is new as well
+				_QueueScan(strRelName, true, !bReport);
+			}
+		}
+
+		if (!bRemoved && !bAdded)
+		{
+			auto strRelName = _JoinName(scan.strRelDir, itCurrent->first);
+			DWORD dwUnknown = (bReport && _bReportUnknowns) ? _UnknownAction(strRelName, itCurrent->second) : 0;
+			if (dwUnknown != 0)
+			{
+				report(dwUnknown, strRelName, itCurrent->second.bDirectory);
+				itCurrent->second.dwReported = dwUnknown;
+			}
+			else if (!itCurrent->second.bDirectory
+				&& bReport
+				&& _IsModified(itCached->second, itCurrent->second))
+			{
+				report(FILE_ACTION_MODIFIED, strRelName, false);
+				itCurrent->second.dwReported = FILE_ACTION_MODIFIED;
+			}
+
+			if (itCurrent->second.bDirectory
+				&& _bRecursive)
+			{
+				if (_directories.find(strRelName) == _directories.end())
+				{
+					_QueueScan(strRelName, true, true);
+				}
+				else if (scan.bRecursive)
+				{
+					_QueueScan(strRelName, true, scan.bSilent);
+				}
+			}
+		}
+
+		if (bRemoved)
+		{
+			++itCached;
+		}
+		else if (bAdded)
+		{
+			++itCurrent;
+		}
+		else
+		{
+			++itCached;
+			++itCurrent;
+		}
+
+		if (bRemoved && bAdded)
+		{
+			++itCurrent;
+		}
+	}
+
+	auto nEntries = current.size() + 1;
+	cached.swap(current);
+	return nEntries;
+}
+
+//
+//	drops the listings of strRelDir and of everything below it,
+//	reporting each entry as removed, deepest first.
+//
+void CDirectorySnapshot::_ForgetSubtree(const tstring& strRelDir, bool bReport, const FuncReport& report)
+{
+	auto itDir = _directories.find(strRelDir);
+	if (itDir == _directories.end())
+	{
+		return;
+	}
+
+	CListing listing;
+	listing.swap(itDir->second);
+	_directories.erase(itDir);
+
+	for (auto it = listing.rbegin(); it != listing.rend(); ++it)
+	{
+		auto strRelName = _JoinName(strRelDir, it->first);
+		if (it->second.bDirectory)
+		{
+			_ForgetSubtree(strRelName, bReport, report);
+		}
+		if (bReport)
+		{
+			report(FILE_ACTION_REMOVED, strRelName, it->second.bDirectory);
+			_reportedRemovals.insert(strRelName);
+		}
+	}
+}
+
+//
+//	until the baseline is reconciled, remembers what the notifications have reported.
+//
+void CDirectorySnapshot::_NoteDelivered(const tstring& strRelName, bool bDelivered)
+{
+	if (_bHasBaseline
+		&& !_bReportUnknowns)
+	{
+		return;
+	}
+
+	if (bDelivered)
+	{
+		_deliveredNames.insert(strRelName);
+	}
+	else
+	{
+		// gone, if it's back later that's another file
+		_deliveredNames.erase(strRelName);
+	}
+}
+
+//
+//	the rescan that follows a baseline w/ lost notifications: an entry of both listings
+//	that was created (or, a file, written) after the watch started, and that no notification
+//	has reported, is one whose notification was lost.  A file that existed before
+//	and whose change went unreported shows up as added when its birth time isn't known.
+//
+DWORD CDirectorySnapshot::_UnknownAction(const tstring& strRelName, const CEntry& current) const
+{
+	if (_deliveredNames.count(strRelName) != 0)
+	{
+		return 0;
+	}
+
+	if (current.llCreated >= _llWatchStart)
+	{
+		return FILE_ACTION_ADDED;
+	}
+
+	if (!current.bDirectory
+		&& current.llLastWrite >= _llWatchStart)
+	{
+		return FILE_ACTION_MODIFIED;
+	}
+
+	return 0;
+}
+
+bool CDirectorySnapshot::_IsModified(const CEntry& cached, const CEntry& current)
+{
+	if (cached.ullSize == UNKNOWN_SIZE)
+	{
+		// only the time of the last notification is known
+		return current.llLastWrite > cached.llLastWrite;
+	}
+
+	return cached.ullSize != current.ullSize
+		|| cached.llLastWrite != current.llLastWrite;
+}
+
+CDirectorySnapshot::tstring CDirectorySnapshot::_FullPath(const tstring& strRelName) const
+{
+	if (strRelName.empty())
+	{
+		return _strRoot;
+	}
+
+	auto strPath(_strRoot);
+	if (strPath.empty()
+		|| strPath.back() != DIR_SEPARATOR_CHAR)
+	{
+		strPath += DIR_SEPARATOR_CHAR;
+	}
+	return strPath + strRelName;
+}
+
+void CDirectorySnapshot::_SplitName(const tstring& strRelName, tstring& strParent, tstring& strName)
+{
+	auto nSep = strRelName.rfind(DIR_SEPARATOR_CHAR);
+	if (nSep == tstring::npos)
+	{
+		strParent.clear();
+		strName = strRelName;
+	}
+	else
+	{
+		strParent = strRelName.substr(0, nSep);
+		strName = strRelName.substr(nSep + 1);
+	}
+}
+
+CDirectorySnapshot::tstring CDirectorySnapshot::_JoinName(const tstring& strRelDir, const tstring& strName)
+{
+	if (strRelDir.empty())
+	{
+		return strName;
+	}
+	return strRelDir + DIR_SEPARATOR_CHAR + strName;
+}
+
+#ifdef _WIN32
+
+bool CDirectorySnapshot::_ReadEntry(const tstring& strRelName, CEntry& entry) const
+{
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesEx(_FullPath(strRelName).c_str(), GetFileExInfoStandard, &data))
+	{
+		return false;
+	}
+
+	entry.bDirectory = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+	entry.ullSize = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	entry.llLastWrite = (int64_t)(((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime);
+	entry.llCreated = (int64_t)(((uint64_t)data.ftCreationTime.dwHighDateTime << 32) | data.ftCreationTime.dwLowDateTime);
+	entry.dwReported = 0;
+	return true;
+}
+
+bool CDirectorySnapshot::_ListDirectory(const tstring& strRelDir, CListing& listing) const
+{
+	auto strPattern = _FullPath(strRelDir) + DIR_SEPARATOR_STR + _T("*");
+
+	WIN32_FIND_DATA fd;
+	auto hFind = FindFirstFileEx(strPattern.c_str(), FindExInfoBasic, &fd,
+		FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+	if (hFind == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	do
+	{
+		if (_tcscmp(fd.cFileName, _T(".")) == 0
+			|| _tcscmp(fd.cFileName, _T("..")) == 0)
+		{
+			continue;
+		}
+
+		CEntry entry;
+		entry.bDirectory = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		entry.ullSize = ((uint64_t)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+		entry.llLastWrite = (int64_t)(((uint64_t)fd.ftLastWriteTime.dwHighDateTime << 32) | fd.ftLastWriteTime.dwLowDateTime);
+		entry.llCreated = (int64_t)(((uint64_t)fd.ftCreationTime.dwHighDateTime << 32) | fd.ftCreationTime.dwLowDateTime);
+		entry.dwReported = 0;
+		listing.emplace(fd.cFileName, entry);
+	} while (FindNextFile(hFind, &fd));
+
+	FindClose(hFind);
+	return true;
+}
+
+int64_t CDirectorySnapshot::_Now()
+{
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	return (int64_t)(((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime);
+}
+
+int64_t CDirectorySnapshot::_CoarseNow()
+{
+	// the file times come from the same clock
+	return _Now();
+}
+
+#else	// !_WIN32
+
+//
+//	lstat() w/ the birth time where the kernel and the file system have one (statx(), Linux 4.11).
+//
+bool CDirectorySnapshot::_StatEntry(int fdDir, const char * pszName, CEntry& entry)
+{
+#ifdef STATX_BTIME
+	struct statx stx;
+	if (statx(fdDir, pszName, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS | STATX_BTIME, &stx) != 0)
+	{
+		return false;
+	}
+
+	auto nsOf = [](const struct statx_timestamp& ts) { return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec; };
+	entry.bDirectory = S_ISDIR(stx.stx_mode);
+	entry.ullSize = (uint64_t)stx.stx_size;
+	entry.llLastWrite = nsOf(stx.stx_mtime);
+	entry.llCreated = (stx.stx_mask & STATX_BTIME) ? nsOf(stx.stx_btime) : nsOf(stx.stx_ctime);
+#else
+	struct stat st;
+	if (fstatat(fdDir, pszName, &st, AT_SYMLINK_NOFOLLOW) != 0)
+	{
+		return false;
+	}
+
+	entry.bDirectory = S_ISDIR(st.st_mode);
+	entry.ullSize = (uint64_t)st.st_size;
+	entry.llLastWrite = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	entry.llCreated = (int64_t)st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+#endif
+	entry.dwReported = 0;
+	return true;
+}
+
+bool CDirectorySnapshot::_ReadEntry(const tstring& strRelName, CEntry& entry) const
+{
+	return _StatEntry(AT_FDCWD, _FullPath(strRelName).c_str(), entry);
+}
+
+bool CDirectorySnapshot::_ListDirectory(const tstring& strRelDir, CListing& listing) const
+{
+	auto pDir = opendir(_FullPath(strRelDir).c_str());
+	if (pDir == nullptr)
+	{
+		return false;
+	}
+
+	struct dirent * pEntry;
+	while ((pEntry = readdir(pDir)) != nullptr)
+	{
+		if (strcmp(pEntry->d_name, ".") == 0
+			|| strcmp(pEntry->d_name, "..") == 0)
+		{
+			continue;
+		}
+
+		CEntry entry;
+		if (!_StatEntry(dirfd(pDir), pEntry->d_name, entry))
+		{
+			// removed while listing
+			continue;
+		}
+		listing.emplace(pEntry->d_name, entry);
+	}
+
+	closedir(pDir);
+	return true;
+}
+
+int64_t CDirectorySnapshot::_Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int64_t CDirectorySnapshot::_CoarseNow()
+{
+	// the clock the file times come from, CLOCK_REALTIME can be ahead of it
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#endif	// _WIN32
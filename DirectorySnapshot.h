@@ -0,0 +1,120 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdint.h>
+
+
+//
+//	A cached listing of a watched tree (name, size and last write time of every entry),
+//	used to find out what changed while notifications were lost.
+//
+//	The notifications that do arrive keep it up to date (NoteXXX()), so a rescan only
+//	reports what the lost ones would have.   Rescans are incremental: directories are
+//	queued w/ QueueRescan() and listed a few at a time by RescanStep(), each one is diffed
+//	against its cached listing, and the differences are reported as FILE_ACTION_xxx values.
+//
+//	The initial scan runs while the watch is already armed, so it can't tell the entries that were
+//	there before from the ones created meanwhile.  It's the baseline: until it's done nothing is
+//	reconciled, an overflow only marks it as incomplete.  A rescan of the whole tree follows it then,
+//	which also reports the entries created (or written) since the watch started that no notification
+//	was delivered for.
+//
+//	A rescan races w/ the notifications that are still queued, the ones for what it reports
+//	are dropped when they arrive (the NoteXXX() return false), so nothing's reported twice.
+//
+//	Names are relative to the watched directory, w/ DIR_SEPARATOR_CHAR between the parts,
+//	exactly like the FileName of a FILE_NOTIFY_INFORMATION record.
+//
+//	Not thread safe, a CDirWatchInfo's snapshot is only used by the worker that is processing it.
+//
+class CDirectorySnapshot
+{
+public:
+	typedef std::basic_string<TCHAR>	tstring;
+	typedef std::function<void(DWORD dwAction, const tstring& strRelName, bool bDirectory)>	FuncReport;
+
+	//	queues the initial (silent) scan of the whole tree
+	CDirectorySnapshot(const CString& strRoot, bool bRecursive);
+
+	CDirectorySnapshot(const CDirectorySnapshot&) = delete;
+	CDirectorySnapshot& operator=(const CDirectorySnapshot&) = delete;
+
+	//	false: a rescan has reported the change already, the notification is a duplicate
+	bool	NoteAdded(const tstring& strRelName);
+	bool	NoteRemoved(const tstring& strRelName);
+	bool	NoteModified(const tstring& strRelName);
+	bool	NoteRenamed(const tstring& strOldRelName, const tstring& strNewRelName);
+
+	//	remembers that strRelDir ("" is the watched directory) has to be rescanned,
+	//	it's queued by the next StartRequestedRescans().  Requests are merged until then.
+	//	bRecursive rescans its subdirectories as well, otherwise only the ones that turn out to be new.
+	//	Before the baseline is done any request means the whole tree, once it is (see above).
+	void	RequestRescan(const tstring& strRelDir, bool bRecursive);
+	bool	HasRequestedRescans() const { return !_requestedScans.empty(); }
+	void	StartRequestedRescans();
+
+	//	lists queued directories until nMaxEntries entries have been looked at,
+	//	returns true if there's still some left to do.
+	bool	RescanStep(size_t nMaxEntries, const FuncReport& report);
+
+	bool	IsRescanPending() const { return !_pendingScans.empty(); }
+	//	false until the initial scan is done, differences found before that aren't reported
+	bool	HasBaseline() const { return _bHasBaseline; }
+
+private:
+	struct CEntry
+	{
+		int64_t		llLastWrite;	//FILETIME on Windows, ns since the epoch elsewhere
+		int64_t		llCreated;		//the birth time, or the last status change where there's none
+		uint64_t	ullSize;		//UNKNOWN_SIZE: noted from a notification, llLastWrite is when that arrived
+		DWORD		dwReported;		//the FILE_ACTION_xxx a rescan reported for it, until its own notification arrives
+		bool		bDirectory;
+	};
+	typedef std::map<tstring, CEntry>	CListing;	//by name
+
+	struct CPendingScan
+	{
+		tstring	strRelDir;
+		bool	bRecursive;
+		bool	bSilent;	//a directory that hasn't been listed yet, there's nothing to diff it against
+	};
+
+	enum : uint64_t { UNKNOWN_SIZE = ~0ULL };
+
+	void	_QueueScan(const tstring& strRelDir, bool bRecursive, bool bSilent);
+	size_t	_RescanDirectory(const CPendingScan& scan, bool bReport, const FuncReport& report);
+	void	_ForgetSubtree(const tstring& strRelDir, bool bReport, const FuncReport& report);
+	void	_NoteDelivered(const tstring& strRelName, bool bDelivered);
+	DWORD	_UnknownAction(const tstring& strRelName, const CEntry& current) const;
+	bool	_ReadEntry(const tstring& strRelName, CEntry& entry) const;
+	bool	_ListDirectory(const tstring& strRelDir, CListing& listing) const;
+	tstring	_FullPath(const tstring& strRelName) const;
+
+	static bool		_IsModified(const CEntry& cached, const CEntry& current);
+#ifndef _WIN32
+	static bool		_StatEntry(int fdDir, const char * pszName, CEntry& entry);
+#endif
+	static int64_t	_Now();
+	static int64_t	_CoarseNow();
+	static void		_SplitName(const tstring& strRelName, tstring& strParent, tstring& strName);
+	static tstring	_JoinName(const tstring& strRelDir, const tstring& strName);
+
+private:
+	tstring	_strRoot;
+	bool	_bRecursive;
+	bool	_bHasBaseline;
+	bool	_bLostDuringBaseline;
+	bool	_bReportUnknowns;	//the rescan that follows the baseline is running, see _UnknownAction()
+	int64_t	_llWatchStart;		//when the snapshot was created, before the watch was armed
+
+	std::unordered_map<tstring, CListing>	_directories;	//by relative name, "" is the watched directory
+	std::deque<CPendingScan>	_pendingScans;
+	std::unordered_set<tstring>	_queuedDirs;	//the strRelDir of _pendingScans
+	std::map<tstring, bool>		_requestedScans;	//strRelDir -> bRecursive
+	std::unordered_set<tstring>	_deliveredNames;	//what the notifications reported, until the baseline is reconciled
+	std::unordered_set<tstring>	_reportedRemovals;	//what a rescan reported as removed, until its own notification arrives
+};
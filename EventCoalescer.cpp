@@ -0,0 +1,195 @@
+#include "stdafx.h"
+#include "EventCoalescer.h"
+
+
+CEventCoalescer::CEventCoalescer(DWORD dwWindowMs)
+	: _window(dwWindowMs)
+	, _nLive(0)
+{
+}
+
+size_t CEventCoalescer::Add(std::vector<CDirChangeEvent>&& events)
+{
+	if (_nLive == 0)
+	{
+		// everything from the last window has been handed over or folded away
+		_Reset();
+		_tWindowStart = std::chrono::steady_clock::now();
+	}
+
+	size_t nFolded = 0;
+	for (auto & event : events)
+	{
+		_Add(std::move(event), nFolded);
+	}
+	events.clear();
+
+	return nFolded;
+}
+
+bool CEventCoalescer::IsFlushDue(time_point tNow) const
+{
+	return _nLive != 0
+		&& (_window.count() == 0
+			|| _pending.size() >= MAX_PENDING_EVENTS
+			|| tNow >= GetFlushTime());
+}
+
+void CEventCoalescer::TakePending(std::vector<CDirChangeEvent>& events)
+{
+	events.reserve(events.size() + _nLive);
+	for (size_t i = 0; i < _pending.size(); ++i)
+	{
+		if (!_dead[i])
+		{
+			events.push_back(std::move(_pending[i]));
+		}
+	}
+
+	_Reset();
+}
+
+void CEventCoalescer::_Add(CDirChangeEvent&& event, size_t& nFolded)
+{
+	if (event.dwAction == FILE_ACTION_RENAMED_OLD_NAME)
+	{
+		// the file that's renamed replaces whatever went by the new name
+		auto itNew = _lastByName.find(_CurrentName(event));
+		if (itNew != _lastByName.end()
+			&& (_pending[itNew->second].dwAction == FILE_ACTION_ADDED || _pending[itNew->second].dwAction == FILE_ACTION_MODIFIED))
+		{
+			_Kill(itNew->second);
+			++nFolded;
+		}
+	}
+
+	auto it = _lastByName.find(tstring((LPCTSTR)event.strFileName, event.strFileName.GetLength()));
+	if (it == _lastByName.end())
+	{
+		_Append(std::move(event));
+		return;
+	}
+
+	auto nLast = it->second;
+	auto dwLastAction = _pending[nLast].dwAction;
+	switch (event.dwAction)
+	{
+	case FILE_ACTION_MODIFIED:
+		if (dwLastAction == FILE_ACTION_ADDED
+			|| dwLastAction == FILE_ACTION_MODIFIED)
+		{
+			++nFolded;
+			return;
+		}
+		break;
+	case FILE_ACTION_REMOVED:
+		if (dwLastAction == FILE_ACTION_ADDED)
+		{
+			// never was, as far as the handler knows
+			_Kill(nLast);
+			nFolded += 2;
+			return;
+		}
+		if (dwLastAction == FILE_ACTION_MODIFIED)
+		{
+			_Kill(nLast);
+			++nFolded;
+		}
+		else if (dwLastAction == FILE_ACTION_RENAMED_OLD_NAME)
+		{
+			// it's the old name that's gone, fold that into whatever's held back for it
+			CString strOldFileName = _pending[nLast].strFileName;
+			_Kill(nLast);
+			++nFolded;
+			_Add(CDirChangeEvent{ FILE_ACTION_REMOVED, strOldFileName, CString() }, nFolded);
+			return;
+		}
+		break;
+	case FILE_ACTION_ADDED:
+		if (dwLastAction == FILE_ACTION_ADDED)
+		{
+			++nFolded;
+			return;
+		}
+		if (dwLastAction == FILE_ACTION_REMOVED)
+		{
+			// replaced
+			_Kill(nLast);
+			++nFolded;
+			event.dwAction = FILE_ACTION_MODIFIED;
+		}
+		break;
+	case FILE_ACTION_RENAMED_OLD_NAME:
+		if (dwLastAction == FILE_ACTION_ADDED)
+		{
+			_Kill(nLast);
+			++nFolded;
+			_Add(CDirChangeEvent{ FILE_ACTION_ADDED, event.strNewFileName, CString() }, nFolded);
+			return;
+		}
+		break;
+	}
+
+	_Append(std::move(event));
+}
+
+void CEventCoalescer::_Append(CDirChangeEvent&& event)
+{
+	size_t nPrevOfOldName = NO_EVENT;
+	if (event.dwAction == FILE_ACTION_RENAMED_OLD_NAME)
+	{
+		// the old name is gone
+		auto it = _lastByName.find(tstring((LPCTSTR)event.strFileName, event.strFileName.GetLength()));
+		if (it != _lastByName.end())
+		{
+			nPrevOfOldName = it->second;
+			_lastByName.erase(it);
+		}
+	}
+
+	_lastByName[_CurrentName(event)] = _pending.size();
+	_pending.push_back(std::move(event));
+	_dead.push_back(false);
+	_prevOfOldName.push_back(nPrevOfOldName);
+	++_nLive;
+}
+
+void CEventCoalescer::_Kill(size_t nIdx)
+{
+	ASSERT(!_dead[nIdx]);
+
+	_dead[nIdx] = true;
+	--_nLive;
+
+	auto it = _lastByName.find(_CurrentName(_pending[nIdx]));
+	if (it != _lastByName.end()
+		&& it->second == nIdx)
+	{
+		_lastByName.erase(it);
+	}
+
+	// a rename that's undone, what came before it under the old name is the last one again
+	auto nPrev = _prevOfOldName[nIdx];
+	if (nPrev != NO_EVENT
+		&& !_dead[nPrev])
+	{
+		const auto & strOldFileName = _pending[nIdx].strFileName;
+		_lastByName[tstring((LPCTSTR)strOldFileName, strOldFileName.GetLength())] = nPrev;
+	}
+}
+
+void CEventCoalescer::_Reset()
+{
+	// keeps the capacity for the next window
+	_pending.clear();
+	_dead.clear();
+	_prevOfOldName.clear();
+	_lastByName.clear();
+	_nLive = 0;
+}
+
+CEventCoalescer::tstring CEventCoalescer::_CurrentName(const CDirChangeEvent & event)
+{
+	const CString & strName = (event.dwAction == FILE_ACTION_RENAMED_OLD_NAME) ? event.strNewFileName : event.strFileName;
+	return tstring((LPCTSTR)strName, strName.GetLength());
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include "DirectoryChangeHandler.h"
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+//
+//	Folds the changes to the same path that happen within a window, before they're posted
+//	to the handler (FILTERS_COALESCE_EVENTS):
+//
+//		ADDED, MODIFIED...			-> ADDED
+//		ADDED, ..., REMOVED			-> (nothing)
+//		MODIFIED, MODIFIED...		-> MODIFIED
+//		MODIFIED, ..., REMOVED		-> REMOVED
+//		REMOVED, ADDED				-> MODIFIED (eg: an editor that saves by replacing the file)
+//		ADDED a, RENAMED a -> b		-> ADDED b
+//		RENAMED a -> b, REMOVED b	-> REMOVED a
+//
+//	What's left keeps the order in which it happened.  The window is either each batch
+//	(one read of the directory), or a time window that starts w/ the first change held back.
+//
+//	Not thread safe, a watch's coalescer is only used by whoever is processing the watch.
+//
+class CEventCoalescer
+{
+public:
+	typedef std::chrono::steady_clock::time_point	time_point;
+
+	enum { MAX_PENDING_EVENTS = 4096 };//a time window is cut short once this many changes are held back
+
+	//	dwWindowMs == 0: each batch is folded on its own
+	explicit CEventCoalescer(DWORD dwWindowMs);
+
+	CEventCoalescer(const CEventCoalescer&) = delete;
+	CEventCoalescer& operator=(const CEventCoalescer&) = delete;
+
+	//	folds events into the ones held back, returns how many of them were folded away
+	size_t	Add(std::vector<CDirChangeEvent>&& events);
+
+	bool		HasPending() const { return _nLive != 0; }
+	bool		IsFlushDue(time_point tNow) const;
+	time_point	GetFlushTime() const { return _tWindowStart + _window; }
+
+	//	hands over what's been held back, in order, and starts a new window
+	void	TakePending(std::vector<CDirChangeEvent>& events);
+
+private:
+	typedef std::basic_string<TCHAR>	tstring;
+
+	enum : size_t { NO_EVENT = ~(size_t)0 };
+
+	void	_Add(CDirChangeEvent&& event, size_t& nFolded);
+	void	_Append(CDirChangeEvent&& event);
+	void	_Kill(size_t nIdx);
+	void	_Reset();
+
+	//	the name a path goes by after the event, the new name of a rename
+	static tstring	_CurrentName(const CDirChangeEvent& event);
+
+private:
+	std::chrono::milliseconds	_window;
+	time_point	_tWindowStart;
+
+	std::vector<CDirChangeEvent>	_pending;//in the order they happened, w/ the folded ones marked in _dead
+	std::vector<bool>	_dead;
+	std::vector<size_t>	_prevOfOldName;//for a rename: the old name's last live event before it, NO_EVENT if none
+	size_t	_nLive;
+	std::unordered_map<tstring, size_t>	_lastByName;//a path's last live event in _pending, by _CurrentName()
+};
@@ -1,5 +1,7 @@
 #include "stdafx.h"
-#include "FileNotifyInfomation.h"
+#include "FileNotifyInformation.h"
+#include <algorithm>
+#include <vector>
 
 
 CFileNotifyInformation::CFileNotifyInformation(BYTE* lpFileNotifyInfoBuffer, DWORD dwBuffSize)
@@ -17,30 +19,43 @@ m_pCurrentRecord will still point to the last record in the buffer.
 ****************/
 BOOL CFileNotifyInformation::GetNextNotifyInformation()
 {
-	if (_pCurrentRecord != nullptr
-		&& _pCurrentRecord->NextEntryOffset != 0UL)
+	auto pNext = _NextRecord(_pCurrentRecord);
+	if (pNext != nullptr)
 	{
-		// set the current record to point to the 'next' record
-		PFILE_NOTIFY_INFORMATION pOld = _pCurrentRecord;
-		_pCurrentRecord = (PFILE_NOTIFY_INFORMATION)
-			((LPBYTE)_pCurrentRecord + _pCurrentRecord->NextEntryOffset);
+		_pCurrentRecord = pNext;
+		return TRUE;
+	}
 
-		ASSERT((DWORD)((BYTE*)_pCurrentRecord - _pBuffer) < _dwBufferSize);
+	return FALSE;
+}
 
-		if ((DWORD)((BYTE*)_pCurrentRecord - _pBuffer) > _dwBufferSize)
-		{
-			// we've gone too far.... this data is hosed.
-			//
-			// This sometimes happens if the watched directory becomes deleted... 
-			// remove the FILE_SHARE_DELETE flag when using CreateFile() 
-			// to get the handle to the directory...
-			_pCurrentRecord = pOld;
-		}
+/***************
+The record after pRecord, or nullptr if pRecord is the last one.
+****************/
+PFILE_NOTIFY_INFORMATION CFileNotifyInformation::_NextRecord(PFILE_NOTIFY_INFORMATION pRecord) const
+{
+	if (pRecord == nullptr
+		|| pRecord->NextEntryOffset == 0UL)
+	{
+		return nullptr;
+	}
+
+	// set the current record to point to the 'next' record
+	auto pNext = (PFILE_NOTIFY_INFORMATION)((LPBYTE)pRecord + pRecord->NextEntryOffset);
 
-		return (BOOL)(_pCurrentRecord != pOld);
+	ASSERT((DWORD)((BYTE*)pNext - _pBuffer) < _dwBufferSize);
+
+	if ((DWORD)((BYTE*)pNext - _pBuffer) > _dwBufferSize)
+	{
+		// we've gone too far.... this data is hosed.
+		//
+		// This sometimes happens if the watched directory becomes deleted... 
+		// remove the FILE_SHARE_DELETE flag when using CreateFile() 
+		// to get the handle to the directory...
+		return nullptr;
 	}
 
-	return FALSE;
+	return pNext;
 }
 
 /*****************************************
@@ -84,7 +99,7 @@ BOOL CFileNotifyInformation::CopyCurrentRecordToBeginningOfBuffer(OUT DWORD& dwS
 		}
 	}
 
-	return TRUE;
+	return bRetVal;
 }
 
 DWORD CFileNotifyInformation::GetAction() const
@@ -98,24 +113,25 @@ DWORD CFileNotifyInformation::GetAction() const
 }
 
 CString CFileNotifyInformation::GetFileName() const
+{
+	auto name = GetFileNameView();
+	return CString(name.pszName, name.nLength);
+}
+
+CFileNotifyInformation::CNameView CFileNotifyInformation::GetFileNameView() const
 {
 	if (_pCurrentRecord != nullptr)
 	{
-		TCHAR FileName[MAX_PATH + 1] = { 0 };
-		memcpy(FileName,
-			_pCurrentRecord->FileName,
-			min((MAX_PATH * sizeof(TCHAR)), _pCurrentRecord->FileNameLength));
-
-		return CString(FileName);
+		return CRecord(_pCurrentRecord).GetFileName();
 	}
 
-	return "";
+	return CNameView{ _T(""), 0 };
 }
 
 static inline bool HasTrailingBackslash(const CString& str)
 {
 	if (str.GetLength() > 0
-		&& str[str.GetLength() - 1] == _T('\\'))
+		&& str[str.GetLength() - 1] == DIR_SEPARATOR_CHAR)
 	{
 		return true;
 	}
@@ -125,12 +141,40 @@ static inline bool HasTrailingBackslash(const CString& str)
 
 CString CFileNotifyInformation::GetFileNameWithPath(const CString& rootPath) const
 {
-	auto strFileName(rootPath);
-	if (!HasTrailingBackslash(rootPath))
+	int nLength = 0;
+	auto pszFileName = GetFileNameWithPath(rootPath, nLength);
+	return CString(pszFileName, nLength);
+}
+
+LPCTSTR CFileNotifyInformation::GetFileNameWithPath(const CString& rootPath, OUT int& nLength) const
+{
+	return JoinPath(rootPath, GetFileNameView(), nLength);
+}
+
+//
+//	the buffer only ever grows, so once it's big enough for the longest path
+//	the thread sees, joining doesn't allocate any more.
+//
+LPCTSTR CFileNotifyInformation::JoinPath(const CString& rootPath, const CNameView& name, OUT int& nLength)
+{
+	static thread_local std::vector<TCHAR> pathBuffer;
+
+	bool bSeparator = !HasTrailingBackslash(rootPath);
+	nLength = rootPath.GetLength() + (bSeparator ? 1 : 0) + name.nLength;
+	if (pathBuffer.size() < (size_t)nLength + 1)
+	{
+		pathBuffer.resize((std::max)((size_t)nLength + 1, (size_t)MAX_PATH));
+	}
+
+	auto pDest = pathBuffer.data();
+	memcpy(pDest, (LPCTSTR)rootPath, rootPath.GetLength() * sizeof(TCHAR));
+	pDest += rootPath.GetLength();
+	if (bSeparator)
 	{
-		strFileName.Append(_T("\\"));
+		*pDest++ = DIR_SEPARATOR_CHAR;
 	}
+	memcpy(pDest, name.pszName, name.nLength * sizeof(TCHAR));
+	pDest[name.nLength] = 0;
 
-	strFileName += GetFileName();
-	return strFileName;
+	return pathBuffer.data();
 }
@@ -46,6 +46,54 @@ class CFileNotifyInformation
 public:
 	CFileNotifyInformation(BYTE* lpFileNotifyInfoBuffer, DWORD dwBuffSize);
 
+	//
+	//	A record's file name where it is in the read buffer, nothing is copied.
+	//	It's NOT NUL terminated, and only valid as long as the buffer is.
+	//
+	struct CNameView
+	{
+		LPCTSTR	pszName;
+		int		nLength;	//in TCHARs
+	};
+
+	//
+	//	Iterates the records in place:
+	//
+	//	for (const auto & record : notify_info)
+	//	{
+	//		record.GetAction(); record.GetFileName();
+	//	}
+	//
+	class CRecord
+	{
+	public:
+		explicit CRecord(PFILE_NOTIFY_INFORMATION pRecord) : _pRecord(pRecord) {}
+
+		DWORD		GetAction() const { return _pRecord->Action; }
+		CNameView	GetFileName() const { return CNameView{ _pRecord->FileName, (int)(_pRecord->FileNameLength / sizeof(TCHAR)) }; }
+
+	private:
+		PFILE_NOTIFY_INFORMATION	_pRecord;
+	};
+
+	class CIterator
+	{
+	public:
+		CIterator(const CFileNotifyInformation * pOwner, PFILE_NOTIFY_INFORMATION pRecord) : _pOwner(pOwner), _pRecord(pRecord) {}
+
+		CRecord		operator*() const { return CRecord(_pRecord); }
+		CIterator&	operator++() { _pRecord = _pOwner->_NextRecord(_pRecord); return *this; }
+		bool		operator==(const CIterator& other) const { return _pRecord == other._pRecord; }
+		bool		operator!=(const CIterator& other) const { return _pRecord != other._pRecord; }
+
+	private:
+		const CFileNotifyInformation *	_pOwner;
+		PFILE_NOTIFY_INFORMATION		_pRecord;
+	};
+
+	CIterator	begin() const { return CIterator(this, (PFILE_NOTIFY_INFORMATION)_pBuffer); }
+	CIterator	end() const { return CIterator(this, nullptr); }
+
 	BOOL GetNextNotifyInformation();
 	BOOL CopyCurrentRecordToBeginningOfBuffer(OUT DWORD& dwSizeOfCurrentRecord);
 	
@@ -53,6 +101,15 @@ public:
 	CString	GetFileName() const;
 	CString	GetFileNameWithPath(const CString& rootPath) const;
 
+	CNameView	GetFileNameView() const;
+	//	rootPath + the current record's name, assembled in a buffer that belongs to the
+	//	calling thread.  NUL terminated, valid until the thread's next call.
+	LPCTSTR		GetFileNameWithPath(const CString& rootPath, OUT int& nLength) const;
+	static LPCTSTR	JoinPath(const CString& rootPath, const CNameView& name, OUT int& nLength);
+
+private:
+	PFILE_NOTIFY_INFORMATION	_NextRecord(PFILE_NOTIFY_INFORMATION pRecord) const;
+
 private:
 	BYTE	*_pBuffer;
 	DWORD	_dwBufferSize;
@@ -0,0 +1,441 @@
+#include "stdafx.h"
+#include "FilterSpecMatcher.h"
+#include <cctype>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FILTER_SPEC_MATCHER_SSE2
+#include <emmintrin.h>
+#endif
+
+
+CFilterSpecMatcher::CFilterSpecMatcher()
+	: _nSpecs(0)
+	, _bMatchAll(false)
+	, _nWords(0)
+{
+	memset(_charClass, 0, sizeof(_charClass));
+}
+
+void CFilterSpecMatcher::Compile(const std::vector<std::string>& specs)
+{
+	_nSpecs = specs.size();
+	_bMatchAll = false;
+	for (size_t by = 0; by < 256; ++by)
+	{
+		_charClass[by] = _IsContinuation((uint8_t)by) ? CLASS_OTHER_CONTINUATION : CLASS_OTHER;
+	}
+	_continuationClass.assign(CLASS_FIRST_LITERAL, false);
+	_continuationClass[CLASS_OTHER_CONTINUATION] = true;
+
+	// the tokens of each spec, w/ runs of '*' collapsed into one
+	std::vector<std::string> tokenized;
+	size_t nStates = 0;
+	size_t nClasses = CLASS_FIRST_LITERAL;
+	for (const auto & strSpec : specs)
+	{
+		// as w/ PathMatchSpec(), "*.*" matches names w/o an extension too
+		if (strSpec == "*" || strSpec == "*.*")
+		{
+			_bMatchAll = true;
+		}
+
+		std::string strTokens;
+		for (char ch : strSpec)
+		{
+			if (ch == '*' && !strTokens.empty() && strTokens.back() == '*')
+			{
+				continue;
+			}
+			if (ch != '*' && ch != '?')
+			{
+				auto byLower = (uint8_t)tolower((unsigned char)ch);
+				if (_charClass[byLower] < CLASS_FIRST_LITERAL)
+				{
+					_charClass[byLower] = (uint8_t)nClasses;
+					_charClass[(uint8_t)toupper(byLower)] = (uint8_t)nClasses;
+					_continuationClass.push_back(_IsContinuation(byLower));
+					++nClasses;
+				}
+				ch = (char)byLower;
+			}
+			strTokens += ch;
+		}
+
+		nStates += strTokens.size() + 1;
+		tokenized.push_back(std::move(strTokens));
+	}
+
+	_nWords = (nStates + WORD_BITS - 1) / WORD_BITS;
+	_classMasks.assign(nClasses * _nWords, 0);
+	_initial.assign(_nWords, 0);
+	_selfLoops.assign(_nWords, 0);
+	_continuationLoops.assign(_nWords, 0);
+	_beforeStar.assign(_nWords, 0);
+	_final.assign(_nWords, 0);
+
+	size_t nFirst = 0;
+	for (const auto & strTokens : tokenized)
+	{
+		// state nFirst + k: the first k tokens have been matched
+		_SetBit(_initial, nFirst);
+		for (size_t k = 0; k < strTokens.size(); ++k)
+		{
+			auto nNext = nFirst + k + 1;
+			switch (strTokens[k])
+			{
+			case '*':
+				_SetBit(_selfLoops, nNext);
+				_SetBit(_continuationLoops, nNext);
+				_SetBit(_beforeStar, nFirst + k);
+				break;
+			case '?':
+				// taken by the first byte of a character, kept by the rest of it
+				for (size_t nClass = 0; nClass < nClasses; ++nClass)
+				{
+					if (!_continuationClass[nClass])
+					{
+						_classMasks[nClass * _nWords + nNext / WORD_BITS] |= word(1) << (nNext % WORD_BITS);
+					}
+				}
+				_SetBit(_continuationLoops, nNext);
+				break;
+			default:
+				{
+					auto nClass = _charClass[(uint8_t)strTokens[k]];
+					_classMasks[nClass * _nWords + nNext / WORD_BITS] |= word(1) << (nNext % WORD_BITS);
+				}
+				break;
+			}
+		}
+		_SetBit(_final, nFirst + strTokens.size());
+		nFirst += strTokens.size() + 1;
+	}
+
+	_Close(_initial.data());
+	_BuildPrefilter(tokenized);
+}
+
+bool CFilterSpecMatcher::Matches(const char * pszPath, size_t nLength) const
+{
+	if (_bMatchAll)
+	{
+		return true;
+	}
+	if (_nSpecs == 0
+		|| !_PassesPrefilter(pszPath, nLength))
+	{
+		return false;
+	}
+
+	return _Run(_initial.data(), pszPath, nLength);
+}
+
+bool CFilterSpecMatcher::Advance(const char * pszPrefix, size_t nLength, OUT CState& state) const
+{
+	state = _initial;
+	if (_nSpecs == 0)
+	{
+		return false;
+	}
+
+	CState next(_nWords);
+	for (size_t i = 0; i < nLength; ++i)
+	{
+		if (!_Step(state.data(), next.data(), _charClass[(uint8_t)pszPrefix[i]]))
+		{
+			return false;
+		}
+		state.swap(next);
+	}
+	return true;
+}
+
+bool CFilterSpecMatcher::MatchesAnyRest(const CState& state) const
+{
+	if (_bMatchAll)
+	{
+		return true;
+	}
+
+	// a spec that's matched up to a trailing '*'
+	for (size_t w = 0; w < _nWords; ++w)
+	{
+		if (state[w] & _final[w] & _selfLoops[w])
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool CFilterSpecMatcher::MatchesFrom(const CState& state, const char * pszPath, size_t nLength, size_t nPrefixLength) const
+{
+	ASSERT(nPrefixLength <= nLength && state.size() == _nWords);
+
+	if (_bMatchAll)
+	{
+		return true;
+	}
+	if (_nSpecs == 0
+		|| !_PassesPrefilter(pszPath, nLength))
+	{
+		return false;
+	}
+
+	return _Run(state.data(), pszPath + nPrefixLength, nLength - nPrefixLength);
+}
+
+//
+//	runs the automaton from pStart over pszPath[0..nLength), true if a spec has matched at the end
+//
+bool CFilterSpecMatcher::_Run(const word * pStart, const char * pszPath, size_t nLength) const
+{
+	// two state vectors, on the stack unless there are a lot of specs
+	word inlineStates[2 * INLINE_STATE_WORDS];
+	std::vector<word> heapStates;
+	word * pCurrent = inlineStates;
+	if (_nWords > INLINE_STATE_WORDS)
+	{
+		heapStates.resize(2 * _nWords);
+		pCurrent = heapStates.data();
+	}
+	word * pNext = pCurrent + _nWords;
+	memcpy(pCurrent, pStart, _nWords * sizeof(word));
+
+	for (size_t i = 0; i < nLength; ++i)
+	{
+		if (!_Step(pCurrent, pNext, _charClass[(uint8_t)pszPath[i]]))
+		{
+			return false;
+		}
+		std::swap(pCurrent, pNext);
+	}
+
+	for (size_t w = 0; w < _nWords; ++w)
+	{
+		if (pCurrent[w] & _final[w])
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+//
+//	pNext = the states reached from pCurrent w/ one byte of class byClass,
+//	returns false if there are none.
+//
+bool CFilterSpecMatcher::_Step(const word * pCurrent, word * pNext, uint8_t byClass) const
+{
+	const word * pMask = _classMasks.data() + byClass * _nWords;
+	const word * pLoops = _continuationClass[byClass] ? _continuationLoops.data() : _selfLoops.data();
+	word carry = 0;
+	word any = 0;
+	for (size_t w = 0; w < _nWords; ++w)
+	{
+		// a spec's last state shifts into the next spec's first one, which no mask lets through
+		word shifted = (pCurrent[w] << 1) | carry;
+		carry = pCurrent[w] >> (WORD_BITS - 1);
+		pNext[w] = (shifted & pMask[w]) | (pCurrent[w] & pLoops[w]);
+		any |= pNext[w];
+	}
+
+	if (any == 0)
+	{
+		return false;
+	}
+
+	_Close(pNext);
+	return true;
+}
+
+//
+//	the epsilon moves: a '*' may match nothing at all.
+//	One step is enough since there are no two '*'s in a row.
+//
+void CFilterSpecMatcher::_Close(word * pStates) const
+{
+	word carry = 0;
+	for (size_t w = 0; w < _nWords; ++w)
+	{
+		word before = pStates[w] & _beforeStar[w];
+		pStates[w] |= (before << 1) | carry;
+		carry = before >> (WORD_BITS - 1);
+	}
+}
+
+//
+//	Picks one literal per spec that a path has to have for the spec to match: the run of
+//	literal characters at its end (eg: the extension of "*.txt"), else the one at its start,
+//	else the longest one in between.  Only for a few specs, and only if every one of them has
+//	a literal: w/ many specs, looking for all the literals costs more than the automaton.
+//
+void CFilterSpecMatcher::_BuildPrefilter(const std::vector<std::string>& tokenized)
+{
+	_prefilter.clear();
+	if (_bMatchAll
+		|| tokenized.size() > MAX_PREFILTER_SPECS)
+	{
+		return;
+	}
+
+	for (const auto & strTokens : tokenized)
+	{
+		auto isWildcard = [](char ch) { return ch == '*' || ch == '?'; };
+
+		CRequiredLiteral literal;
+		size_t nLast = strTokens.find_last_of("*?");
+		size_t nFirst = strTokens.find_first_of("*?");
+		if (nLast == std::string::npos)
+		{
+			// no wildcards at all
+			literal.eWhere = CRequiredLiteral::ANCHOR_PREFIX;
+			literal.strLower = strTokens;
+		}
+		else if (nLast + 1 < strTokens.size())
+		{
+			literal.eWhere = CRequiredLiteral::ANCHOR_SUFFIX;
+			literal.strLower = strTokens.substr(nLast + 1);
+		}
+		else if (nFirst > 0)
+		{
+			literal.eWhere = CRequiredLiteral::ANCHOR_PREFIX;
+			literal.strLower = strTokens.substr(0, nFirst);
+		}
+		else
+		{
+			literal.eWhere = CRequiredLiteral::ANCHOR_NONE;
+			size_t i = 0;
+			while (i < strTokens.size())
+			{
+				auto nEnd = i;
+				while (nEnd < strTokens.size() && !isWildcard(strTokens[nEnd]))
+				{
+					++nEnd;
+				}
+				if (nEnd - i > literal.strLower.size())
+				{
+					literal.strLower = strTokens.substr(i, nEnd - i);
+				}
+				i = nEnd + 1;
+			}
+		}
+
+		if (literal.strLower.empty())
+		{
+			// all wildcards, eg: "???", nothing to go by
+			_prefilter.clear();
+			return;
+		}
+		_prefilter.push_back(std::move(literal));
+	}
+}
+
+bool CFilterSpecMatcher::_PassesPrefilter(const char * pszPath, size_t nLength) const
+{
+	if (_prefilter.empty())
+	{
+		return true;
+	}
+
+	for (const auto & literal : _prefilter)
+	{
+		auto nLiteral = literal.strLower.size();
+		switch (literal.eWhere)
+		{
+		case CRequiredLiteral::ANCHOR_PREFIX:
+			if (nLiteral <= nLength
+				&& _EqualsNoCase(pszPath, literal.strLower.data(), nLiteral))
+			{
+				return true;
+			}
+			break;
+		case CRequiredLiteral::ANCHOR_SUFFIX:
+			if (nLiteral <= nLength
+				&& _EqualsNoCase(pszPath + nLength - nLiteral, literal.strLower.data(), nLiteral))
+			{
+				return true;
+			}
+			break;
+		default:
+			if (_ContainsNoCase(pszPath, nLength, literal.strLower))
+			{
+				return true;
+			}
+			break;
+		}
+	}
+
+	return false;
+}
+
+bool CFilterSpecMatcher::_EqualsNoCase(const char * psz, const char * pszLower, size_t nLength)
+{
+	for (size_t i = 0; i < nLength; ++i)
+	{
+		if ((char)tolower((unsigned char)psz[i]) != pszLower[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+#if defined(FILTER_SPEC_MATCHER_SSE2)
+//	'A'..'Z' -> 'a'..'z', 16 bytes at a time
+static inline __m128i _ToLower16(__m128i bytes)
+{
+	auto offset = _mm_sub_epi8(bytes, _mm_set1_epi8('A'));
+	auto isUpper = _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(25)), offset);
+	return _mm_or_si128(bytes, _mm_and_si128(isUpper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+//
+//	Looks for strLower anywhere in the path.  The SSE2 path compares the literal's first and
+//	last bytes against 16 positions at once and only checks the rest of it where both match.
+//
+bool CFilterSpecMatcher::_ContainsNoCase(const char * pszPath, size_t nLength, const std::string& strLower)
+{
+	auto nLiteral = strLower.size();
+	if (nLiteral > nLength)
+	{
+		return false;
+	}
+
+	size_t i = 0;
+#if defined(FILTER_SPEC_MATCHER_SSE2)
+	auto first = _mm_set1_epi8(strLower.front());
+	auto last = _mm_set1_epi8(strLower.back());
+	for (; i + nLiteral - 1 + 16 <= nLength; i += 16)
+	{
+		auto blockFirst = _ToLower16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pszPath + i)));
+		auto blockLast = _ToLower16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pszPath + i + nLiteral - 1)));
+		auto nCandidates = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blockFirst, first),
+			_mm_cmpeq_epi8(blockLast, last)));
+		while (nCandidates != 0)
+		{
+			size_t nBit = 0;
+			while (!(nCandidates & (1u << nBit)))
+			{
+				++nBit;
+			}
+			if (_EqualsNoCase(pszPath + i + nBit, strLower.data(), nLiteral))
+			{
+				return true;
+			}
+			nCandidates &= nCandidates - 1;
+		}
+	}
+#endif
+
+	for (; i + nLiteral <= nLength; ++i)
+	{
+		if (_EqualsNoCase(pszPath + i, strLower.data(), nLiteral))
+		{
+			return true;
+		}
+	}
+	return false;
+}
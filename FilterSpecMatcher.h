@@ -0,0 +1,95 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+
+//
+//	A set of wildcard specs (the include or the exclude filter of a watch, eg: "*.txt;*.cpp;*.h"),
+//	compiled once into a single bit-parallel automaton that tells in one pass over a path
+//	whether any of the specs matches it.
+//
+//	Same semantics as PathMatchSpec() applied to each spec: a spec is a sequence of literal
+//	characters, '?' (any one character) and '*' (any run of characters), matched against the
+//	whole path, case insensitive (ASCII); "*.*" matches everything.  Paths and specs are UTF-8,
+//	a '?' takes a whole multi byte character, like PathMatchSpec()'s CharNext().  A spec of n
+//	tokens gets n + 1 state bits, all the specs side by side in one bit vector, and every
+//	character of the path moves all of them at once w/ a shift and a few ANDs/ORs per 64 states
+//	(Shift-And, w/ self loops and epsilon moves for the '*'s).  No backtracking, and the cost
+//	doesn't depend on how the specs are written: O(path length x number of states / 64).
+//	The path is rejected as soon as no state is left.
+//
+//	Before that, a handful of specs are looked at through the literals that a path must contain
+//	for each of them to match (see _BuildPrefilter()): "*.txt" needs the suffix ".txt", "*\.git\*"
+//	the substring "\.git\".  A path w/ none of them is rejected w/o running the automaton,
+//	substrings are searched for 16 bytes at a time w/ SSE2.
+//
+//	Immutable once compiled, Matches() may be called from any thread.
+//
+class CFilterSpecMatcher
+{
+public:
+	CFilterSpecMatcher();
+
+	//	replaces whatever was compiled before
+	void	Compile(const std::vector<std::string>& specs);
+
+	bool	IsEmpty() const { return _nSpecs == 0; }
+	size_t	GetSpecCount() const { return _nSpecs; }
+
+	//	true if any of the specs matches the whole of pszPath[0..nLength)
+	bool	Matches(const char * pszPath, size_t nLength) const;
+	bool	Matches(const std::string& strPath) const { return Matches(strPath.data(), strPath.size()); }
+
+	//
+	//	Matching in two steps, for callers that see the same prefixes over and over (CFilterVerdictCache):
+	//	the states after a prefix are computed once, the rest of each path is matched from there.
+	//
+	typedef std::vector<uint64_t>	CState;
+	//	state = the states after pszPrefix[0..nLength), returns false if no spec can match anything that starts w/ it
+	bool	Advance(const char * pszPrefix, size_t nLength, OUT CState& state) const;
+	//	true if every path that starts w/ the prefix of state matches, eg: "*\node_modules\*" after "a\node_modules\"
+	bool	MatchesAnyRest(const CState& state) const;
+	//	Matches(pszPath, nLength), w/ state being the states after pszPath[0..nPrefixLength)
+	bool	MatchesFrom(const CState& state, const char * pszPath, size_t nLength, size_t nPrefixLength) const;
+
+private:
+	typedef uint64_t	word;
+	enum { WORD_BITS = 64, INLINE_STATE_WORDS = 16, MAX_PREFILTER_SPECS = 16 };
+	enum { CLASS_OTHER = 0, CLASS_OTHER_CONTINUATION = 1, CLASS_FIRST_LITERAL = 2 };
+
+	//	a literal that every path matching one of the specs contains
+	struct CRequiredLiteral
+	{
+		enum eAnchor { ANCHOR_PREFIX, ANCHOR_SUFFIX, ANCHOR_NONE };
+		eAnchor		eWhere;
+		std::string	strLower;
+	};
+
+	bool	_Run(const word * pStart, const char * pszPath, size_t nLength) const;
+	bool	_Step(const word * pCurrent, word * pNext, uint8_t byClass) const;
+	void	_Close(word * pStates) const;
+	void	_BuildPrefilter(const std::vector<std::string>& tokenized);
+	bool	_PassesPrefilter(const char * pszPath, size_t nLength) const;
+
+	static bool	_ContainsNoCase(const char * pszPath, size_t nLength, const std::string& strLower);
+	static bool	_IsContinuation(uint8_t by) { return (by & 0xC0) == 0x80; }
+	static bool	_EqualsNoCase(const char * psz, const char * pszLower, size_t nLength);
+	static void	_SetBit(std::vector<word>& bits, size_t nBit) { bits[nBit / WORD_BITS] |= word(1) << (nBit % WORD_BITS); }
+
+private:
+	size_t	_nSpecs;
+	bool	_bMatchAll;		//one of the specs is "*" (or "*.*")
+	size_t	_nWords;		//per state vector
+
+	uint8_t	_charClass[256];	//byte -> column of _classMasks, the bytes that no spec names are CLASS_OTHER(_CONTINUATION)
+	std::vector<bool>	_continuationClass;	//per class: its bytes are the 2nd..4th of a UTF-8 sequence
+	std::vector<word>	_classMasks;	//per class: the states that a character of the class leads into
+	std::vector<word>	_initial;	//the states before the first character, closed
+	std::vector<word>	_selfLoops;	//the states after a '*', which any character keeps
+	std::vector<word>	_continuationLoops;	//_selfLoops + the states after a '?', which the rest of a multi byte character keeps
+	std::vector<word>	_beforeStar;	//the states in front of a '*', which reach the one after it w/o a character
+	std::vector<word>	_final;		//a spec has matched
+
+	std::vector<CRequiredLiteral>	_prefilter;	//a path has to have one of these, empty: no prefilter
+};
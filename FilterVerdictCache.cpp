@@ -0,0 +1,105 @@
+#include "stdafx.h"
+#include "FilterVerdictCache.h"
+#include <cstring>
+
+
+CFilterVerdictCache::CFilterVerdictCache(const CFilterSpecMatcher& includeSpecs, const CFilterSpecMatcher& excludeSpecs)
+	: _includeSpecs(includeSpecs)
+	, _excludeSpecs(excludeSpecs)
+{
+	memset(&_stats, 0, sizeof(_stats));
+}
+
+bool CFilterVerdictCache::Passes(const char * pszPath, size_t nLength)
+{
+	auto nDirLength = nLength;
+	while (nDirLength > 0 && pszPath[nDirLength - 1] != (char)DIR_SEPARATOR_CHAR)
+	{
+		--nDirLength;
+	}
+	if (nDirLength == 0)
+	{
+		// nothing to cache for the files right in the watched directory
+		return (_includeSpecs.IsEmpty() || _includeSpecs.Matches(pszPath, nLength))
+			&& !_excludeSpecs.Matches(pszPath, nLength);
+	}
+
+	std::lock_guard<std::mutex> lock(_mut);
+	const auto & verdict = _Lookup(pszPath, nDirLength);
+	if (_IsExcluded(verdict))
+	{
+		++_stats.ullSubtreesSkipped;
+		return false;
+	}
+
+	bool bIncluded = verdict.eInclude == SUBTREE_ALL
+		|| _includeSpecs.MatchesFrom(verdict.includeState, pszPath, nLength, nDirLength);
+	return bIncluded
+		&& (verdict.eExclude == SUBTREE_NONE
+			|| !_excludeSpecs.MatchesFrom(verdict.excludeState, pszPath, nLength, nDirLength));
+}
+
+bool CFilterVerdictCache::IsExcludedSubtree(const char * pszDir, size_t nLength)
+{
+	std::lock_guard<std::mutex> lock(_mut);
+	if (_IsExcluded(_Lookup(pszDir, nLength)))
+	{
+		++_stats.ullSubtreesSkipped;
+		return true;
+	}
+	return false;
+}
+
+CFilterVerdictCache::CStats CFilterVerdictCache::GetStats() const
+{
+	std::lock_guard<std::mutex> lock(_mut);
+	return _stats;
+}
+
+const CFilterVerdictCache::CDirVerdict & CFilterVerdictCache::_Lookup(const char * pszDir, size_t nLength)
+{
+	++_stats.ullLookups;
+
+	_strKey.assign(pszDir, nLength);
+	auto it = _verdicts.find(_strKey);
+	if (it != _verdicts.end())
+	{
+		++_stats.ullHits;
+		_lru.splice(_lru.begin(), _lru, it->second.itLru);
+		return it->second;
+	}
+
+	if (_verdicts.size() >= MAX_DIRECTORIES)
+	{
+		// by iterator, the key that _lru points to goes w/ the entry
+		auto itOldest = _verdicts.find(*_lru.back());
+		_lru.pop_back();
+		_verdicts.erase(itOldest);
+	}
+
+	CDirVerdict verdict;
+	verdict.eInclude = _Advance(_includeSpecs, _strKey, true, verdict.includeState);
+	verdict.eExclude = _Advance(_excludeSpecs, _strKey, false, verdict.excludeState);
+	it = _verdicts.emplace(_strKey, std::move(verdict)).first;
+	// the map's keys don't move, rehashing leaves them where they are
+	it->second.itLru = _lru.insert(_lru.begin(), &it->first);
+	return it->second;
+}
+
+CFilterVerdictCache::eSubtree CFilterVerdictCache::_Advance(const CFilterSpecMatcher& specs, const std::string& strDir,
+	bool bEmptyMatchesAll, OUT CFilterSpecMatcher::CState& state) const
+{
+	if (specs.IsEmpty())
+	{
+		return bEmptyMatchesAll ? SUBTREE_ALL : SUBTREE_NONE;
+	}
+	if (!specs.Advance(strDir.data(), strDir.size(), state))
+	{
+		return SUBTREE_NONE;
+	}
+	if (specs.MatchesAnyRest(state))
+	{
+		return SUBTREE_ALL;
+	}
+	return SUBTREE_SOME;
+}
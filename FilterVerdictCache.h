@@ -0,0 +1,76 @@
+#pragma once
+#include "FilterSpecMatcher.h"
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+
+
+//
+//	Remembers what the include/exclude filters of a watch make of the directories that events
+//	come from, so that the files of a busy directory are matched from the end of its path only
+//	(FILTERS_CHECK_PARTIAL_PATH/FILTERS_CHECK_FULL_PATH, where the directories are part of what's matched).
+//
+//	A directory's verdict is the automaton states of both filters after its path, plus what they
+//	decide for everything below it: a subtree that no include spec can match, or that an exclude
+//	spec matches whatever comes after it (eg: "*\node_modules\*"), is excluded as a whole and its
+//	files are never matched at all.
+//
+//	Bounded: the MAX_DIRECTORIES most recently used directories are kept.  Thread safe.
+//
+class CFilterVerdictCache
+{
+public:
+	enum { MAX_DIRECTORIES = 1024 };
+
+	struct CStats
+	{
+		uint64_t	ullLookups;	//paths that went through the cache
+		uint64_t	ullHits;	//their directory's verdict was cached already
+		uint64_t	ullSubtreesSkipped;	//their directory was excluded as a whole, the file wasn't matched (or not even parsed, see IsExcludedSubtree())
+	};
+
+	//	the matchers have to outlive the cache
+	CFilterVerdictCache(const CFilterSpecMatcher& includeSpecs, const CFilterSpecMatcher& excludeSpecs);
+
+	CFilterVerdictCache(const CFilterVerdictCache&) = delete;
+	CFilterVerdictCache& operator=(const CFilterVerdictCache&) = delete;
+
+	//	true if pszPath[0..nLength) passes the include filter (an empty one passes everything) and not the exclude filter
+	bool	Passes(const char * pszPath, size_t nLength);
+	bool	Passes(const std::string& strPath) { return Passes(strPath.data(), strPath.size()); }
+	//	true if nothing below pszDir[0..nLength) (w/ its trailing separator) can pass the filters
+	bool	IsExcludedSubtree(const char * pszDir, size_t nLength);
+	bool	IsExcludedSubtree(const std::string& strDir) { return IsExcludedSubtree(strDir.data(), strDir.size()); }
+
+	CStats	GetStats() const;
+
+private:
+	enum eSubtree { SUBTREE_NONE, SUBTREE_SOME, SUBTREE_ALL };	//which of the paths below a directory a filter matches
+
+	struct CDirVerdict
+	{
+		eSubtree	eInclude;
+		eSubtree	eExclude;
+		CFilterSpecMatcher::CState	includeState;	//SUBTREE_SOME: the states after the directory
+		CFilterSpecMatcher::CState	excludeState;
+		std::list<const std::string *>::iterator	itLru;
+	};
+
+	//	the verdict for pszDir[0..nLength), _mut must be locked
+	const CDirVerdict &	_Lookup(const char * pszDir, size_t nLength);
+	static bool	_IsExcluded(const CDirVerdict& verdict) { return verdict.eInclude == SUBTREE_NONE || verdict.eExclude == SUBTREE_ALL; }
+	eSubtree	_Advance(const CFilterSpecMatcher& specs, const std::string& strDir, bool bEmptyMatchesAll,
+		OUT CFilterSpecMatcher::CState& state) const;
+
+private:
+	const CFilterSpecMatcher &	_includeSpecs;
+	const CFilterSpecMatcher &	_excludeSpecs;
+
+	mutable std::mutex	_mut;
+	std::unordered_map<std::string, CDirVerdict>	_verdicts;	//by directory, w/ its trailing separator
+	std::list<const std::string *>	_lru;	//the keys of _verdicts, most recently used first
+	std::string	_strKey;	//reused for the lookups, so that a hit doesn't allocate
+	CStats	_stats;
+};
@@ -0,0 +1,1461 @@
+#include "stdafx.h"
+#include "InotifyEventSource.h"
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cstddef>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+// fanotify events are translated w/ the inotify helpers, the bits are the same
+static_assert(FAN_MODIFY == IN_MODIFY && FAN_ATTRIB == IN_ATTRIB && FAN_ACCESS == IN_ACCESS
+	&& FAN_CREATE == IN_CREATE && FAN_DELETE == IN_DELETE
+	&& FAN_MOVED_FROM == IN_MOVED_FROM && FAN_MOVED_TO == IN_MOVED_TO
+	&& FAN_ONDIR == IN_ISDIR, "fanotify/inotify event bits differ");
+static_assert(sizeof(fsid_t) == sizeof(uint64_t), "unexpected fsid_t");
+
+
+CInotifyEventSource::CInotifyEventSource()
+	: _fdInotify(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+	, _fdWakeup(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+	, _fdFanotify(-1)
+	, _bFanotifyRename(true)
+	, _readBuffer(INOTIFY_READ_BUFFER_SIZE)
+{
+	if (_fdInotify < 0 || _fdWakeup < 0)
+	{
+		LOGF(FATAL, "CInotifyEventSource -- unable to create the inotify/eventfd descriptors! errno: %d", errno);
+	}
+}
+
+CInotifyEventSource::~CInotifyEventSource()
+{
+	if (_fdInotify >= 0)
+	{
+		close(_fdInotify);
+	}
+	if (_fdWakeup >= 0)
+	{
+		close(_fdWakeup);
+	}
+	for (auto & it : _filesystemMarks)
+	{
+		close(it.second.fdMount);
+	}
+	if (_fdFanotify >= 0)
+	{
+		close(_fdFanotify);
+	}
+}
+
+DWORD CInotifyEventSource::OpenDirectory(CDirectoryChangeWatcher::CDirWatchInfo * pdi)
+{
+	if (_fdInotify < 0)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	std::lock_guard<std::mutex> lk(_mutState);
+
+	auto & state = _watchStates[pdi];
+	state = CWatchState();
+	state.dwInotifyMask = _InotifyMask(pdi->m_dwChangeFilter, pdi->m_bWatchSubDir);
+	state.dwOffset = state.dwFilled = 0UL;
+	state.dwLastRecord = NO_RECORD;
+	state.bArmed = state.bOverflow = state.bRootGone = state.bFilesystemMark = false;
+	state.bLostAnywhere = false;
+	state.ulFsid = 0ULL;
+
+	if (_IsFilesystemWatch(pdi))
+	{
+		// the fanotify mark reports everything else
+		state.dwInotifyMask = IN_ONLYDIR | IN_MASK_ADD | IN_DELETE_SELF | IN_MOVE_SELF;
+	}
+
+	auto wd = _AddWatch(pdi, state, _FullPath(pdi, std::string()), std::string());
+	DWORD dwError = (wd < 0) ? (DWORD)errno : ERROR_SUCCESS;
+
+	if (dwError == ERROR_SUCCESS && _IsFilesystemWatch(pdi))
+	{
+		dwError = _AddFilesystemMark(pdi, state);
+	}
+	else if (dwError == ERROR_SUCCESS && pdi->m_bWatchSubDir)
+	{
+		// every subdirectory needs a watch of its own...
+		// ENOSPC here means that fs.inotify.max_user_watches is too low for this tree
+		dwError = _AddSubdirectoryWatches(pdi, state, std::string(), false);
+	}
+
+	if (dwError != ERROR_SUCCESS)
+	{
+		_RemoveWatches(pdi, state, std::string());
+		_RemoveFilesystemMark(state);
+		_watchStates.erase(pdi);
+		pdi->m_hDir = INVALID_HANDLE_VALUE;
+		return dwError;
+	}
+
+	pdi->m_hDir = (HANDLE)(intptr_t)wd;
+	return ERROR_SUCCESS;
+}
+
+BOOL CInotifyEventSource::CloseDirectory(CDirectoryChangeWatcher::CDirWatchInfo * pdi)
+{
+	std::lock_guard<std::mutex> lk(_mutState);
+
+	pdi->m_hDir = INVALID_HANDLE_VALUE;
+
+	auto it = _watchStates.find(pdi);
+	if (it == _watchStates.end())
+	{
+		return TRUE;
+	}
+
+	_RemoveWatches(pdi, it->second, std::string());
+	_RemoveFilesystemMark(it->second);
+
+	// like closing the directory handle passed to ReadDirectoryChangesW(),
+	// the outstanding read is aborted and completes one last time.
+	if (it->second.bArmed)
+	{
+		_PushCompletion(pdi, 0UL, FALSE);
+	}
+
+	_watchStates.erase(it);
+	return TRUE;
+}
+
+DWORD CInotifyEventSource::Associate(CDirectoryChangeWatcher::CDirWatchInfo * pdi)
+{
+	std::lock_guard<std::mutex> lk(_mutState);
+
+	return (_watchStates.find(pdi) != _watchStates.end()) ? ERROR_SUCCESS : ERROR_INVALID_HANDLE;
+}
+
+DWORD CInotifyEventSource::IssueRead(CDirectoryChangeWatcher::CDirWatchInfo * pdi, DWORD dwOffset)
+{
+	std::lock_guard<std::mutex> lk(_mutState);
+
+	auto it = _watchStates.find(pdi);
+	if (it == _watchStates.end()
+		|| pdi->m_hDir == INVALID_HANDLE_VALUE)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	auto & state = it->second;
+	if (state.bRootGone)
+	{
+		// ReadDirectoryChangesW() fails the same way once the watched directory is gone
+		return (DWORD)ENOENT;
+	}
+
+	if (dwOffset >= pdi->m_dwBufferSize)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	// records are DWORD aligned, just like the ones from ReadDirectoryChangesW().
+	// If there's a record saved at the beginning of the buffer (see ProcessChangeNotifications())
+	// it is linked to the first record of this read.
+	state.dwOffset = state.dwFilled = (dwOffset + 3UL) & ~3UL;
+	state.dwLastRecord = (dwOffset > 0UL) ? 0UL : (DWORD)NO_RECORD;
+	state.bArmed = true;
+
+	if (state.bOverflow
+		|| _FlushBacklog(pdi, state))
+	{
+		_CompleteRead(pdi, state, TRUE);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+BOOL CInotifyEventSource::PostCompletion(CDirectoryChangeWatcher::CDirWatchInfo * pdi)
+{
+	std::lock_guard<std::mutex> lk(_mutState);
+
+	_PushCompletion(pdi, pdi != nullptr ? sizeof(pdi) : 0UL, TRUE);
+	return TRUE;
+}
+
+BOOL CInotifyEventSource::GetCompletion(OUT CDirectoryChangeWatcher::CDirWatchInfo *& pdi, OUT DWORD & dwNumBytes)
+{
+	pdi = nullptr;
+	dwNumBytes = 0UL;
+
+	for (;;)
+	{
+		int fdFanotify = -1;	// poll() ignores negative descriptors
+		{
+			std::lock_guard<std::mutex> lk(_mutState);
+			fdFanotify = _fdFanotify;
+			if (!_completions.empty())
+			{
+				auto completion = _completions.front();
+				_completions.pop_front();
+
+				// the wakeup for the rest may have been consumed by this thread,
+				// pass it on to the next worker thread that's waiting in poll()
+				if (!_completions.empty())
+				{
+					uint64_t ulOne = 1;
+					(void)write(_fdWakeup, &ulOne, sizeof(ulOne));
+				}
+
+				pdi = completion.pdi;
+				dwNumBytes = completion.dwNumBytes;
+				return completion.bResult;
+			}
+		}
+
+		// a descriptor created by OpenDirectory() while blocked here is picked up
+		// on the next round, StartMonitor() posts a completion right after it.
+		struct pollfd fds[3] = {
+			{ _fdInotify, POLLIN, 0 },
+			{ _fdWakeup, POLLIN, 0 },
+			{ fdFanotify, POLLIN, 0 }
+		};
+
+		if (poll(fds, 3, -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			LOGF(FATAL, "CInotifyEventSource::GetCompletion() -- poll() failed! errno: %d", errno);
+			return FALSE;
+		}
+
+		if (fds[1].revents & POLLIN)
+		{
+			uint64_t ulCount = 0;
+			(void)read(_fdWakeup, &ulCount, sizeof(ulCount));
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			std::lock_guard<std::mutex> lk(_mutState);
+			_ReadEvents();
+		}
+
+		if (fds[2].revents & POLLIN)
+		{
+			std::lock_guard<std::mutex> lk(_mutState);
+			_ReadFanotifyEvents();
+		}
+	}
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+int CInotifyEventSource::_AddWatch(CDirWatchInfo * pdi, CWatchState & state,
+	const std::string & strPath, const std::string & strRelPath)
+{
+	auto wd = inotify_add_watch(_fdInotify, strPath.c_str(), state.dwInotifyMask);
+	if (wd < 0)
+	{
+		return wd;
+	}
+
+	auto & nodes = _watchNodes[wd];
+	auto itNode = std::find_if(nodes.begin(), nodes.end(),
+		[pdi](const CWatchNode & node) { return node.pdi == pdi; });
+	if (itNode == nodes.end())
+	{
+		nodes.push_back(CWatchNode{ pdi, strRelPath });
+		state.wds.push_back(wd);
+	}
+	else
+	{
+		itNode->strRelPath = strRelPath;
+	}
+
+	return wd;
+}
+
+//
+//	Adds a watch for every directory below strRelPath.
+//	When bReportContents is true, an FILE_ACTION_ADDED record is queued for everything
+//	that is found: the directory was just created (or moved in), and its contents may have been
+//	created before the watch on it existed.  ReadDirectoryChangesW() reports those too.
+//
+DWORD CInotifyEventSource::_AddSubdirectoryWatches(CDirWatchInfo * pdi, CWatchState & state,
+	const std::string & strRelPath, bool bReportContents)
+{
+	std::vector<std::string> dirsToScan(1, strRelPath);
+
+	while (!dirsToScan.empty())
+	{
+		auto strDir = dirsToScan.back();
+		dirsToScan.pop_back();
+
+		auto strFullDir = _FullPath(pdi, strDir);
+		auto pDir = opendir(strFullDir.c_str());
+		if (pDir == nullptr)
+		{
+			// it may already be gone again, that's not an error
+			continue;
+		}
+
+		while (auto pEntry = readdir(pDir))
+		{
+			if (strcmp(pEntry->d_name, ".") == 0
+				|| strcmp(pEntry->d_name, "..") == 0)
+			{
+				continue;
+			}
+
+			auto strChild = _JoinPath(strDir, pEntry->d_name);
+			bool bIsDir = (pEntry->d_type == DT_DIR);
+			if (pEntry->d_type == DT_UNKNOWN)
+			{
+				struct stat st;
+				bIsDir = (lstat(_FullPath(pdi, strChild).c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+			}
+
+			if (bReportContents
+				&& _WantsAction(pdi->m_dwChangeFilter, FILE_ACTION_ADDED, IN_CREATE | (bIsDir ? IN_ISDIR : 0)))
+			{
+				_QueueRecord(pdi, FILE_ACTION_ADDED, strChild);
+			}
+
+			if (bIsDir
+				&& !pdi->IsExcludedSubtree(strChild))
+			{
+				if (_AddWatch(pdi, state, _FullPath(pdi, strChild), strChild) < 0
+					&& errno != ENOENT)
+				{
+					auto dwError = (DWORD)errno;
+					closedir(pDir);
+					return dwError;
+				}
+				dirsToScan.push_back(strChild);
+			}
+		}
+
+		closedir(pDir);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+//
+//	removes pdi's watches on strRelPath and everything below it.
+//	an empty strRelPath removes all of pdi's watches.
+//
+void CInotifyEventSource::_RemoveWatches(CDirWatchInfo * pdi, CWatchState & state, const std::string & strRelPath)
+{
+	auto isInSubtree = [&strRelPath](const std::string & strPath) {
+		return strRelPath.empty()
+			|| strPath == strRelPath
+			|| (strPath.size() > strRelPath.size()
+				&& strPath.compare(0, strRelPath.size(), strRelPath) == 0
+				&& strPath[strRelPath.size()] == DIR_SEPARATOR_CHAR);
+	};
+
+	std::vector<int> remainingWds;
+	for (auto wd : state.wds)
+	{
+		auto itNodes = _watchNodes.find(wd);
+		if (itNodes == _watchNodes.end())
+		{
+			continue;
+		}
+
+		auto & nodes = itNodes->second;
+		auto itNode = std::find_if(nodes.begin(), nodes.end(),
+			[pdi](const CWatchNode & node) { return node.pdi == pdi; });
+		if (itNode == nodes.end())
+		{
+			continue;
+		}
+
+		if (!isInSubtree(itNode->strRelPath))
+		{
+			remainingWds.push_back(wd);
+			continue;
+		}
+
+		nodes.erase(itNode);
+		if (nodes.empty())
+		{
+			inotify_rm_watch(_fdInotify, wd);
+			_watchNodes.erase(itNodes);
+		}
+	}
+
+	state.wds.swap(remainingWds);
+}
+
+void CInotifyEventSource::_RenameWatches(CDirWatchInfo * pdi, CWatchState & state,
+	const std::string & strOldRelPath, const std::string & strNewRelPath)
+{
+	for (auto wd : state.wds)
+	{
+		auto itNodes = _watchNodes.find(wd);
+		if (itNodes == _watchNodes.end())
+		{
+			continue;
+		}
+
+		for (auto & node : itNodes->second)
+		{
+			if (node.pdi != pdi)
+			{
+				continue;
+			}
+
+			auto & strPath = node.strRelPath;
+			if (strPath == strOldRelPath)
+			{
+				strPath = strNewRelPath;
+			}
+			else if (strPath.size() > strOldRelPath.size()
+				&& strPath.compare(0, strOldRelPath.size(), strOldRelPath) == 0
+				&& strPath[strOldRelPath.size()] == DIR_SEPARATOR_CHAR)
+			{
+				strPath = strNewRelPath + strPath.substr(strOldRelPath.size());
+			}
+		}
+	}
+}
+
+//	the kernel dropped this watch descriptor (IN_IGNORED)
+void CInotifyEventSource::_ForgetWatchDescriptor(int wd)
+{
+	auto itNodes = _watchNodes.find(wd);
+	if (itNodes == _watchNodes.end())
+	{
+		return;
+	}
+
+	for (const auto & node : itNodes->second)
+	{
+		auto itState = _watchStates.find(node.pdi);
+		if (itState != _watchStates.end())
+		{
+			auto & wds = itState->second.wds;
+			wds.erase(std::remove(wds.begin(), wds.end(), wd), wds.end());
+		}
+	}
+
+	_watchNodes.erase(itNodes);
+}
+
+//
+//	Reads everything that's pending on the inotify descriptor with one read()
+//	and translates it into FILE_NOTIFY_INFORMATION records.
+//
+void CInotifyEventSource::_ReadEvents()
+{
+	auto nRead = read(_fdInotify, _readBuffer.data(), _readBuffer.size());
+	if (nRead <= 0)
+	{
+		return;
+	}
+
+	const char * pCur = _readBuffer.data();
+	const char * pEnd = pCur + nRead;
+	while (pCur < pEnd)
+	{
+		auto pEvent = reinterpret_cast<const struct inotify_event *>(pCur);
+		pCur += sizeof(struct inotify_event) + pEvent->len;
+
+		if (pEvent->mask & IN_Q_OVERFLOW)
+		{
+			// the kernel queue overflowed, events have been lost for every watch.
+			for (auto & it : _watchStates)
+			{
+				_DropBacklog(it.second, false);
+				_CompleteRead(it.first, it.second, TRUE);
+			}
+			continue;
+		}
+
+		// the kernel queues both halves of a rename back to back.
+		// if the IN_MOVED_TO didn't make it into this batch, the move is reported
+		// as a remove, and the IN_MOVED_TO (if any) as an add.
+		auto pNext = (pCur < pEnd) ? reinterpret_cast<const struct inotify_event *>(pCur) : nullptr;
+		if ((pEvent->mask & IN_MOVED_FROM)
+			&& pNext != nullptr
+			&& (pNext->mask & IN_MOVED_TO)
+			&& pNext->cookie == pEvent->cookie)
+		{
+			_TranslateRename(pEvent, pNext);
+			pCur += sizeof(struct inotify_event) + pNext->len;
+			continue;
+		}
+
+		_TranslateEvent(pEvent);
+	}
+
+	_CompleteTouchedReads();
+}
+
+//	completes the reads that got records in this batch
+void CInotifyEventSource::_CompleteTouchedReads()
+{
+	for (auto pdi : _touchedReads)
+	{
+		auto itState = _watchStates.find(pdi);
+		if (itState != _watchStates.end()
+			&& itState->second.dwFilled > itState->second.dwOffset)
+		{
+			_CompleteRead(pdi, itState->second, TRUE);
+		}
+	}
+	_touchedReads.clear();
+}
+
+void CInotifyEventSource::_TranslateEvent(const struct inotify_event * pEvent)
+{
+	auto itNodes = _watchNodes.find(pEvent->wd);
+	if (itNodes == _watchNodes.end())
+	{
+		return;
+	}
+
+	if (pEvent->mask & IN_IGNORED)
+	{
+		_ForgetWatchDescriptor(pEvent->wd);
+		return;
+	}
+
+	bool bIsDir = (pEvent->mask & IN_ISDIR) != 0;
+
+	auto nodes = itNodes->second;	// copy, new watches may be added below
+	for (const auto & node : nodes)
+	{
+		auto pdi = node.pdi;
+		auto itState = _watchStates.find(pdi);
+		if (itState == _watchStates.end())
+		{
+			continue;
+		}
+		auto & state = itState->second;
+
+		if (pEvent->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT))
+		{
+			// for subdirectories the parent directory's watch reports this.
+			if (node.strRelPath.empty())
+			{
+				state.bRootGone = true;
+				_CompleteRead(pdi, state, FALSE);
+			}
+			continue;
+		}
+
+		if (state.bFilesystemMark
+			|| pEvent->len == 0)
+		{
+			// a change to the watched directory itself
+			continue;
+		}
+
+		auto strFileName = _JoinPath(node.strRelPath, pEvent->name);
+
+		if (pEvent->mask & (IN_CREATE | IN_MOVED_TO))
+		{
+			if (_WantsAction(pdi->m_dwChangeFilter, FILE_ACTION_ADDED, pEvent->mask))
+			{
+				_QueueRecord(pdi, FILE_ACTION_ADDED, strFileName);
+			}
+
+			if (bIsDir && pdi->m_bWatchSubDir
+				&& !pdi->IsExcludedSubtree(strFileName))
+			{
+				if (_AddWatch(pdi, state, _FullPath(pdi, strFileName), strFileName) >= 0)
+				{
+					_AddSubdirectoryWatches(pdi, state, strFileName, true);
+				}
+				else if (errno != ENOENT)
+				{
+					LOGF(WARNING, "CInotifyEventSource -- unable to watch new directory %s errno: %d", strFileName.c_str(), errno);
+				}
+			}
+		}
+		else if (pEvent->mask & (IN_DELETE | IN_MOVED_FROM))
+		{
+			if (_WantsAction(pdi->m_dwChangeFilter, FILE_ACTION_REMOVED, pEvent->mask))
+			{
+				_QueueRecord(pdi, FILE_ACTION_REMOVED, strFileName);
+			}
+
+			if (bIsDir && pdi->m_bWatchSubDir)
+			{
+				_RemoveWatches(pdi, state, strFileName);
+			}
+		}
+		else if (pEvent->mask & (IN_MODIFY | IN_ATTRIB | IN_ACCESS))
+		{
+			if (_WantsAction(pdi->m_dwChangeFilter, FILE_ACTION_MODIFIED, pEvent->mask))
+			{
+				_QueueRecord(pdi, FILE_ACTION_MODIFIED, strFileName);
+			}
+		}
+	}
+}
+
+void CInotifyEventSource::_TranslateRename(const struct inotify_event * pFrom, const struct inotify_event * pTo)
+{
+	std::vector<CWatchNode> fromNodes, toNodes;
+
+	auto itFrom = _watchNodes.find(pFrom->wd);
+	if (itFrom != _watchNodes.end())
+	{
+		fromNodes = itFrom->second;
+	}
+	auto itTo = _watchNodes.find(pTo->wd);
+	if (itTo != _watchNodes.end())
+	{
+		toNodes = itTo->second;
+	}
+
+	bool bIsDir = (pFrom->mask & IN_ISDIR) != 0;
+
+	for (const auto & fromNode : fromNodes)
+	{
+		auto pdi = fromNode.pdi;
+		auto itState = _watchStates.find(pdi);
+		if (itState == _watchStates.end())
+		{
+			continue;
+		}
+		auto & state = itState->second;
+		if (state.bFilesystemMark)
+		{
+			continue;
+		}
+
+		auto strOldName = _JoinPath(fromNode.strRelPath, pFrom->name);
+		auto itToNode = std::find_if(toNodes.begin(), toNodes.end(),
+			[pdi](const CWatchNode & node) { return node.pdi == pdi; });
+
+		if (itToNode != toNodes.end())
+		{
+			// renamed within the watched tree
+			auto strNewName = _JoinPath(itToNode->strRelPath, pTo->name);
+			if (_WantsAction(pdi->m_dwChangeFilter, FILE_ACTION_RENAMED_OLD_NAME, pFrom->mask))
+			{
+				_QueueRenameRecords(pdi, strOldName, strNewName);
+			}
+
+			if (bIsDir && pdi->m_bWatchSubDir)
+			{
+				_RenameWatches(pdi, state, strOldName, strNewName);
+
+				// renamed into or out of a subtree that the filters exclude
+				bool bOldExcluded = pdi->IsExcludedSubtree(strOldName);
+				bool bNewExcluded = pdi->IsExcludedSubtree(strNewName);
+				if (bNewExcluded && !bOldExcluded)
+				{
+					_RemoveWatches(pdi, state, strNewName);
+				}
+				else if (bOldExcluded && !bNewExcluded
+					&& _AddWatch(pdi, state, _FullPath(pdi, strNewName), strNewName) >= 0)
+				{
+					_AddSubdirectoryWatches(pdi, state, strNewName, false);
+				}
+			}
+		}
+		else
+		{
+			// moved out of the watched tree
+			if (_WantsAction(pdi->m_dwChangeFilter, FILE_ACTION_REMOVED, pFrom->mask))
+			{
+				_QueueRecord(pdi, FILE_ACTION_REMOVED, strOldName);
+			}
+
+			if (bIsDir && pdi->m_bWatchSubDir)
+			{
+				_RemoveWatches(pdi, state, strOldName);
+			}
+		}
+	}
+
+	// moved into a tree that the source directory isn't part of
+	for (const auto & toNode : toNodes)
+	{
+		auto pdi = toNode.pdi;
+		if (std::find_if(fromNodes.begin(), fromNodes.end(),
+			[pdi](const CWatchNode & node) { return node.pdi == pdi; }) == fromNodes.end())
+		{
+			auto itState = _watchStates.find(pdi);
+			if (itState == _watchStates.end()
+				|| itState->second.bFilesystemMark)
+			{
+				continue;
+			}
+
+			auto strFileName = _JoinPath(toNode.strRelPath, pTo->name);
+
+			if (_WantsAction(pdi->m_dwChangeFilter, FILE_ACTION_ADDED, pTo->mask))
+			{
+				_QueueRecord(pdi, FILE_ACTION_ADDED, strFileName);
+			}
+
+			if (bIsDir && pdi->m_bWatchSubDir
+				&& !pdi->IsExcludedSubtree(strFileName)
+				&& _AddWatch(pdi, itState->second, _FullPath(pdi, strFileName), strFileName) >= 0)
+			{
+				_AddSubdirectoryWatches(pdi, itState->second, strFileName, true);
+			}
+		}
+	}
+}
+
+//
+//	Marks the filesystem that pdi's directory lives on.  The first mark on a
+//	filesystem costs one fanotify_mark() no matter how big the tree is, later
+//	watches on the same filesystem only extend the mask.
+//
+DWORD CInotifyEventSource::_AddFilesystemMark(CDirWatchInfo * pdi, CWatchState & state)
+{
+	if (_fdFanotify < 0)
+	{
+		// directory file handles + names, the only way to get CREATE/DELETE/MOVE events out of a filesystem mark
+		_fdFanotify = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC,
+			O_RDONLY | O_LARGEFILE);
+		if (_fdFanotify < 0)
+		{
+			auto dwError = (DWORD)errno;
+			LOGF(WARNING, "CInotifyEventSource -- fanotify_init() failed, errno: %d", (int)dwError);
+			return dwError;
+		}
+	}
+
+	auto strRoot = _FullPath(pdi, std::string());
+
+	struct statfs stfs;
+	if (statfs(strRoot.c_str(), &stfs) != 0)
+	{
+		return (DWORD)errno;
+	}
+	uint64_t ulFsid = 0ULL;
+	memcpy(&ulFsid, &stfs.f_fsid, sizeof(ulFsid));
+
+	auto itMark = _filesystemMarks.find(ulFsid);
+	auto dwMask = _FanotifyMask(pdi->m_dwChangeFilter);
+	if (itMark != _filesystemMarks.end())
+	{
+		dwMask |= itMark->second.dwMask;
+	}
+
+	int fdMount = (itMark != _filesystemMarks.end())
+		? itMark->second.fdMount
+		: open(strRoot.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fdMount < 0)
+	{
+		return (DWORD)errno;
+	}
+
+	int nResult = -1;
+	bool bMarked = false;
+#ifdef FAN_RENAME
+	if (_bFanotifyRename
+		&& (dwMask & FAN_MOVED_FROM))
+	{
+		// one event w/ both names (5.17+), so renames can be reported as renames
+		dwMask = (dwMask & ~(FAN_MOVED_FROM | FAN_MOVED_TO)) | FAN_RENAME;
+		nResult = fanotify_mark(_fdFanotify, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, dwMask, fdMount, nullptr);
+		bMarked = true;
+		if (nResult != 0 && errno == EINVAL)
+		{
+			_bFanotifyRename = false;
+			dwMask = (dwMask & ~FAN_RENAME) | FAN_MOVED_FROM | FAN_MOVED_TO;
+			bMarked = false;
+		}
+	}
+#endif
+	if (!bMarked)
+	{
+		nResult = fanotify_mark(_fdFanotify, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, dwMask, fdMount, nullptr);
+	}
+
+	if (nResult != 0)
+	{
+		auto dwError = (DWORD)errno;
+		LOGF(WARNING, "CInotifyEventSource -- fanotify_mark() failed for %s errno: %d", strRoot.c_str(), (int)dwError);
+		if (itMark == _filesystemMarks.end())
+		{
+			close(fdMount);
+		}
+		return dwError;
+	}
+
+	if (itMark == _filesystemMarks.end())
+	{
+		_filesystemMarks.emplace(ulFsid, CFilesystemMark{ fdMount, dwMask, 1 });
+	}
+	else
+	{
+		itMark->second.dwMask = dwMask;
+		itMark->second.nRefCount++;
+	}
+
+	state.bFilesystemMark = true;
+	state.ulFsid = ulFsid;
+	return ERROR_SUCCESS;
+}
+
+//
+//	The mask isn't narrowed when one of several watches on a filesystem goes away,
+//	_WantsAction() drops whatever the remaining watches didn't ask for.
+//
+void CInotifyEventSource::_RemoveFilesystemMark(CWatchState & state)
+{
+	if (!state.bFilesystemMark)
+	{
+		return;
+	}
+	state.bFilesystemMark = false;
+
+	auto itMark = _filesystemMarks.find(state.ulFsid);
+	if (itMark == _filesystemMarks.end()
+		|| --itMark->second.nRefCount > 0)
+	{
+		return;
+	}
+
+	fanotify_mark(_fdFanotify, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM,
+		itMark->second.dwMask, itMark->second.fdMount, nullptr);
+	close(itMark->second.fdMount);
+	_filesystemMarks.erase(itMark);
+
+	// the cached paths belong to that filesystem...
+	_dirHandleCache.clear();
+}
+
+//
+//	Reads everything that's pending on the fanotify descriptor with one read().
+//	Every event carries the file handle of the directory + the name of the entry,
+//	both are turned back into a path and handed to _TranslateFanotifyEvent().
+//
+void CInotifyEventSource::_ReadFanotifyEvents()
+{
+	auto nRead = read(_fdFanotify, _readBuffer.data(), _readBuffer.size());
+	if (nRead <= 0)
+	{
+		return;
+	}
+
+	bool bDirectoryMoved = false;
+	auto pMeta = reinterpret_cast<const struct fanotify_event_metadata *>(_readBuffer.data());
+	for (; FAN_EVENT_OK(pMeta, nRead); pMeta = FAN_EVENT_NEXT(pMeta, nRead))
+	{
+		if (pMeta->vers != FANOTIFY_METADATA_VERSION)
+		{
+			LOGF(WARNING, "CInotifyEventSource -- unexpected fanotify metadata version %d", (int)pMeta->vers);
+			break;
+		}
+
+		if (pMeta->fd >= 0)
+		{
+			// not w/ FID reporting, but an open descriptor must never leak
+			close(pMeta->fd);
+		}
+
+		if (pMeta->mask & FAN_Q_OVERFLOW)
+		{
+			for (auto & it : _watchStates)
+			{
+				if (it.second.bFilesystemMark)
+				{
+					_DropBacklog(it.second, false);
+					_CompleteRead(it.first, it.second, TRUE);
+				}
+			}
+			continue;
+		}
+
+		std::string strPath, strNewPath;
+		auto pInfo = reinterpret_cast<const char *>(pMeta) + pMeta->metadata_len;
+		auto pInfoEnd = reinterpret_cast<const char *>(pMeta) + pMeta->event_len;
+		while (pInfo + sizeof(struct fanotify_event_info_header) <= pInfoEnd)
+		{
+			auto pHeader = reinterpret_cast<const struct fanotify_event_info_header *>(pInfo);
+			if (pHeader->len == 0)
+			{
+				break;
+			}
+
+			auto pstrTarget = &strPath;
+#ifdef FAN_RENAME
+			if (pHeader->info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME)
+			{
+				pstrTarget = &strNewPath;
+			}
+			else if (pHeader->info_type != FAN_EVENT_INFO_TYPE_DFID_NAME
+				&& pHeader->info_type != FAN_EVENT_INFO_TYPE_OLD_DFID_NAME)
+			{
+				pstrTarget = nullptr;
+			}
+#else
+			if (pHeader->info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+			{
+				pstrTarget = nullptr;
+			}
+#endif
+
+			if (pstrTarget != nullptr)
+			{
+				auto pFid = reinterpret_cast<const struct fanotify_event_info_fid *>(pInfo);
+				auto pHandle = reinterpret_cast<const struct file_handle *>(pFid->handle);
+				auto szName = reinterpret_cast<const char *>(pHandle->f_handle) + pHandle->handle_bytes;
+
+				uint64_t ulFsid = 0ULL;
+				memcpy(&ulFsid, &pFid->fsid, sizeof(ulFsid));
+
+				std::string strDir;
+				if (_ResolveDirectoryHandle(ulFsid, pHandle, strDir))
+				{
+					*pstrTarget = strDir;
+					if (strcmp(szName, ".") != 0)
+					{
+						if (pstrTarget->back() != DIR_SEPARATOR_CHAR)
+						{
+							*pstrTarget += DIR_SEPARATOR_CHAR;
+						}
+						*pstrTarget += szName;
+					}
+				}
+			}
+
+			pInfo += pHeader->len;
+		}
+
+		if (!strPath.empty() || !strNewPath.empty())
+		{
+			_TranslateFanotifyEvent((uint32_t)pMeta->mask, strPath, strNewPath);
+		}
+
+		if ((pMeta->mask & FAN_ONDIR)
+			&& (pMeta->mask & (FAN_DELETE | FAN_MOVED_FROM
+#ifdef FAN_RENAME
+				| FAN_RENAME
+#endif
+				)))
+		{
+			bDirectoryMoved = true;
+		}
+	}
+
+	// cached paths below a moved/deleted directory are stale now.
+	// events that were already queued for its contents have been resolved
+	// to the current path of the directory, there's no way around that w/ fanotify.
+	if (bDirectoryMoved)
+	{
+		_dirHandleCache.clear();
+	}
+
+	_CompleteTouchedReads();
+}
+
+void CInotifyEventSource::_TranslateFanotifyEvent(uint32_t dwMask, const std::string & strPath, const std::string & strNewPath)
+{
+	for (auto & it : _watchStates)
+	{
+		auto pdi = it.first;
+		if (!it.second.bFilesystemMark)
+		{
+			continue;
+		}
+
+		auto strRoot = _FullPath(pdi, std::string());
+		std::string strRelPath, strNewRelPath;
+		bool bInTree = !strPath.empty() && _RelativePath(strRoot, strPath, strRelPath);
+		bool bNewInTree = !strNewPath.empty() && _RelativePath(strRoot, strNewPath, strNewRelPath);
+
+#ifdef FAN_RENAME
+		if (dwMask & FAN_RENAME)
+		{
+			if (bInTree && bNewInTree)
+			{
+				if (_WantsAction(pdi->m_dwChangeFilter, FILE_ACTION_RENAMED_OLD_NAME, dwMask))
+				{
+					_QueueRenameRecords(pdi, strRelPath, strNewRelPath);
+				}
+			}
+			else if (bInTree)
+			{
+				if (_WantsAction(pdi->m_dwChangeFilter, FILE_ACTION_REMOVED, dwMask))
+				{
+					_QueueRecord(pdi, FILE_ACTION_REMOVED, strRelPath);
+				}
+			}
+			else if (bNewInTree)
+			{
+				if (_WantsAction(pdi->m_dwChangeFilter, FILE_ACTION_ADDED, dwMask))
+				{
+					_QueueRecord(pdi, FILE_ACTION_ADDED, strNewRelPath);
+				}
+			}
+			continue;
+		}
+#endif
+
+		// a change to the watched directory itself, or outside of it
+		if (!bInTree
+			|| strRelPath.empty())
+		{
+			continue;
+		}
+
+		// w/o FAN_RENAME the two halves of a move can't be paired,
+		// they're reported as a remove and an add.
+		if (dwMask & (FAN_CREATE | FAN_MOVED_TO))
+		{
+			if (_WantsAction(pdi->m_dwChangeFilter, FILE_ACTION_ADDED, dwMask))
+			{
+				_QueueRecord(pdi, FILE_ACTION_ADDED, strRelPath);
+			}
+		}
+		else if (dwMask & (FAN_DELETE | FAN_MOVED_FROM))
+		{
+			if (_WantsAction(pdi->m_dwChangeFilter, FILE_ACTION_REMOVED, dwMask))
+			{
+				_QueueRecord(pdi, FILE_ACTION_REMOVED, strRelPath);
+			}
+		}
+		else if (dwMask & (FAN_MODIFY | FAN_ATTRIB | FAN_ACCESS))
+		{
+			if (_WantsAction(pdi->m_dwChangeFilter, FILE_ACTION_MODIFIED, dwMask))
+			{
+				_QueueRecord(pdi, FILE_ACTION_MODIFIED, strRelPath);
+			}
+		}
+	}
+}
+
+//
+//	directory file handle -> path, w/ open_by_handle_at() (needs CAP_DAC_READ_SEARCH)
+//	and the /proc/self/fd link.   Most events land in a few hot directories, so the
+//	paths are cached.   Returns false if the directory no longer exists.
+//
+bool CInotifyEventSource::_ResolveDirectoryHandle(uint64_t ulFsid, const struct file_handle * pHandle, std::string & strPath)
+{
+	std::string strKey(reinterpret_cast<const char *>(&ulFsid), sizeof(ulFsid));
+	strKey.append(reinterpret_cast<const char *>(pHandle), sizeof(struct file_handle) + pHandle->handle_bytes);
+
+	auto itCached = _dirHandleCache.find(strKey);
+	if (itCached != _dirHandleCache.end())
+	{
+		strPath = itCached->second;
+		return true;
+	}
+
+	auto itMark = _filesystemMarks.find(ulFsid);
+	if (itMark == _filesystemMarks.end())
+	{
+		return false;
+	}
+
+	// open_by_handle_at() doesn't take a const handle
+	std::vector<char> handle(strKey.begin() + sizeof(ulFsid), strKey.end());
+	int fd = open_by_handle_at(itMark->second.fdMount,
+		reinterpret_cast<struct file_handle *>(handle.data()), O_PATH | O_CLOEXEC);
+	if (fd < 0)
+	{
+		// ESTALE: already gone
+		return false;
+	}
+
+	char szLink[32];
+	snprintf(szLink, sizeof(szLink), "/proc/self/fd/%d", fd);
+	char szPath[PATH_MAX];
+	auto nLength = readlink(szLink, szPath, sizeof(szPath));
+	close(fd);
+	if (nLength <= 0
+		|| nLength >= (ssize_t)sizeof(szPath))
+	{
+		return false;
+	}
+
+	static const char szDeleted[] = " (deleted)";
+	strPath.assign(szPath, nLength);
+	if (strPath.size() > sizeof(szDeleted) - 1
+		&& strPath.compare(strPath.size() - (sizeof(szDeleted) - 1), std::string::npos, szDeleted) == 0)
+	{
+		return false;
+	}
+
+	if (_dirHandleCache.size() >= MAX_DIR_HANDLE_CACHE)
+	{
+		_dirHandleCache.clear();
+	}
+	_dirHandleCache.emplace(std::move(strKey), strPath);
+	return true;
+}
+
+void CInotifyEventSource::_QueueRecord(CDirWatchInfo * pdi, DWORD dwAction, const std::string & strFileName)
+{
+	auto itState = _watchStates.find(pdi);
+	if (itState == _watchStates.end())
+	{
+		return;
+	}
+	auto & state = itState->second;
+
+	if (state.bArmed && state.backlog.empty())
+	{
+		if (_WriteRecord(pdi, state, dwAction, strFileName))
+		{
+			return;
+		}
+
+		// the read buffer is full, hand it over and keep the rest for the next read
+		_CompleteRead(pdi, state, TRUE);
+	}
+
+	if (state.backlog.size() >= MAX_BACKLOG_RECORDS)
+	{
+		_NoteLostRecord(state, strFileName);
+		_DropBacklog(state, true);
+		return;
+	}
+
+	state.backlog.push_back(CPendingRecord{ dwAction, strFileName });
+}
+
+//
+//	the OLD_NAME and NEW_NAME records of a rename always end up in the same read
+//
+void CInotifyEventSource::_QueueRenameRecords(CDirWatchInfo * pdi, const std::string & strOldName, const std::string & strNewName)
+{
+	auto itState = _watchStates.find(pdi);
+	if (itState == _watchStates.end())
+	{
+		return;
+	}
+	auto & state = itState->second;
+
+	if (state.bArmed && state.backlog.empty())
+	{
+		if (_WriteRecord(pdi, state, FILE_ACTION_RENAMED_OLD_NAME, strOldName, _RecordSize(strNewName)))
+		{
+			_WriteRecord(pdi, state, FILE_ACTION_RENAMED_NEW_NAME, strNewName);
+			return;
+		}
+
+		_CompleteRead(pdi, state, TRUE);
+	}
+
+	if (state.backlog.size() + 1 >= MAX_BACKLOG_RECORDS)
+	{
+		_NoteLostRecord(state, strOldName);
+		_NoteLostRecord(state, strNewName);
+		_DropBacklog(state, true);
+		return;
+	}
+
+	state.backlog.push_back(CPendingRecord{ FILE_ACTION_RENAMED_OLD_NAME, strOldName });
+	state.backlog.push_back(CPendingRecord{ FILE_ACTION_RENAMED_NEW_NAME, strNewName });
+}
+
+bool CInotifyEventSource::_WriteRecord(CDirWatchInfo * pdi, CWatchState & state,
+	DWORD dwAction, const std::string & strFileName, DWORD dwRoomToLeave /*= 0*/)
+{
+	auto dwRecordSize = _RecordSize(strFileName);
+	if (state.dwFilled + dwRecordSize + dwRoomToLeave > pdi->m_dwBufferSize)
+	{
+		return false;
+	}
+
+	auto pRecord = reinterpret_cast<PFILE_NOTIFY_INFORMATION>(pdi->m_Buffer + state.dwFilled);
+	pRecord->NextEntryOffset = 0UL;
+	pRecord->Action = dwAction;
+	pRecord->FileNameLength = (DWORD)strFileName.size();
+	memcpy(pRecord->FileName, strFileName.data(), strFileName.size());
+
+	if (state.dwLastRecord != NO_RECORD)
+	{
+		reinterpret_cast<PFILE_NOTIFY_INFORMATION>(pdi->m_Buffer + state.dwLastRecord)->NextEntryOffset
+			= state.dwFilled - state.dwLastRecord;
+	}
+
+	if (state.dwFilled == state.dwOffset)
+	{
+		_touchedReads.push_back(pdi);
+	}
+
+	state.dwLastRecord = state.dwFilled;
+	state.dwFilled += dwRecordSize;
+	return true;
+}
+
+//	returns true if anything was written to the read buffer
+bool CInotifyEventSource::_FlushBacklog(CDirWatchInfo * pdi, CWatchState & state)
+{
+	while (!state.backlog.empty())
+	{
+		const auto & record = state.backlog.front();
+		if (record.dwAction == FILE_ACTION_RENAMED_OLD_NAME
+			&& state.backlog.size() > 1)
+		{
+			const auto & newNameRecord = state.backlog[1];
+			if (!_WriteRecord(pdi, state, record.dwAction, record.strFileName, _RecordSize(newNameRecord.strFileName)))
+			{
+				break;
+			}
+			_WriteRecord(pdi, state, newNameRecord.dwAction, newNameRecord.strFileName);
+			state.backlog.pop_front();
+			state.backlog.pop_front();
+			continue;
+		}
+
+		if (!_WriteRecord(pdi, state, record.dwAction, record.strFileName))
+		{
+			break;
+		}
+		state.backlog.pop_front();
+	}
+
+	return state.dwFilled > state.dwOffset;
+}
+
+//
+//	the records in the backlog are lost, the next read completes w/ zero bytes.
+//	bKnowWhere: the lost records are the backlog's (+ the ones passed to _NoteLostRecord()),
+//	otherwise the kernel dropped events and they could have been anywhere.
+//
+void CInotifyEventSource::_DropBacklog(CWatchState & state, bool bKnowWhere)
+{
+	if (bKnowWhere)
+	{
+		for (const auto & record : state.backlog)
+		{
+			_NoteLostRecord(state, record.strFileName);
+		}
+	}
+	else
+	{
+		state.bLostAnywhere = true;
+	}
+
+	state.backlog.clear();
+	state.bOverflow = true;
+}
+
+void CInotifyEventSource::_NoteLostRecord(CWatchState & state, const std::string & strFileName)
+{
+	if (state.bLostAnywhere)
+	{
+		return;
+	}
+
+	auto nSep = strFileName.rfind('/');
+	state.lostDirs.insert(nSep == std::string::npos ? std::string() : strFileName.substr(0, nSep));
+	if (state.lostDirs.size() > MAX_LOST_DIRS)
+	{
+		// rescanning the whole tree is cheaper than this many subtrees
+		state.bLostAnywhere = true;
+		state.lostDirs.clear();
+	}
+}
+
+bool CInotifyEventSource::GetLostRecordDirectories(CDirectoryChangeWatcher::CDirWatchInfo * pdi,
+	OUT std::vector<std::string> & relDirs)
+{
+	std::lock_guard<std::mutex> lk(_mutState);
+
+	auto it = _watchStates.find(pdi);
+	if (it == _watchStates.end())
+	{
+		return false;
+	}
+	auto & state = it->second;
+
+	bool bKnown = !state.bLostAnywhere && !state.lostDirs.empty();
+	if (bKnown)
+	{
+		relDirs.assign(state.lostDirs.begin(), state.lostDirs.end());
+	}
+
+	state.lostDirs.clear();
+	state.bLostAnywhere = false;
+	return bKnown;
+}
+
+void CInotifyEventSource::_CompleteRead(CDirWatchInfo * pdi, CWatchState & state, BOOL bResult)
+{
+	if (!state.bArmed)
+	{
+		return;
+	}
+
+	// after an overflow the read completes w/ zero bytes, same as ReadDirectoryChangesW()
+	DWORD dwNumBytes = state.bOverflow ? 0UL : (state.dwFilled - state.dwOffset);
+
+	state.bArmed = false;
+	state.bOverflow = false;
+	_PushCompletion(pdi, dwNumBytes, bResult);
+}
+
+//	_mutState must be locked
+void CInotifyEventSource::_PushCompletion(CDirWatchInfo * pdi, DWORD dwNumBytes, BOOL bResult)
+{
+	_completions.push_back(CCompletion{ pdi, dwNumBytes, bResult });
+
+	uint64_t ulOne = 1;
+	(void)write(_fdWakeup, &ulOne, sizeof(ulOne));
+}
+
+uint32_t CInotifyEventSource::_InotifyMask(DWORD dwChangeFilter, BOOL bWatchSubDir)
+{
+	uint32_t dwMask = IN_ONLYDIR | IN_MASK_ADD | IN_EXCL_UNLINK | IN_DELETE_SELF | IN_MOVE_SELF;
+
+	if ((dwChangeFilter & (FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME))
+		|| bWatchSubDir)	// needed to follow subdirectories as they come and go
+	{
+		dwMask |= IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+	}
+	if (dwChangeFilter & (FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE))
+	{
+		dwMask |= IN_MODIFY;
+	}
+	if (dwChangeFilter & (FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SECURITY
+		| FILE_NOTIFY_CHANGE_CREATION | FILE_NOTIFY_CHANGE_LAST_WRITE))
+	{
+		dwMask |= IN_ATTRIB;
+	}
+	if (dwChangeFilter & FILE_NOTIFY_CHANGE_LAST_ACCESS)
+	{
+		dwMask |= IN_ACCESS;
+	}
+
+	return dwMask;
+}
+
+//
+//	The watch descriptors may be shared by several CDirWatchInfo objects (and IN_MASK_ADD
+//	merges their masks), so check that this event is one that the watch asked for.
+//
+bool CInotifyEventSource::_WantsAction(DWORD dwChangeFilter, DWORD dwAction, uint32_t dwInotifyEvent)
+{
+	switch (dwAction)
+	{
+	case FILE_ACTION_ADDED:
+	case FILE_ACTION_REMOVED:
+	case FILE_ACTION_RENAMED_OLD_NAME:
+	case FILE_ACTION_RENAMED_NEW_NAME:
+		return (dwChangeFilter & ((dwInotifyEvent & IN_ISDIR) ? FILE_NOTIFY_CHANGE_DIR_NAME : FILE_NOTIFY_CHANGE_FILE_NAME)) != 0;
+	case FILE_ACTION_MODIFIED:
+		if (dwInotifyEvent & IN_MODIFY)
+		{
+			return (dwChangeFilter & (FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE)) != 0;
+		}
+		if (dwInotifyEvent & IN_ATTRIB)
+		{
+			return (dwChangeFilter & (FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SECURITY
+				| FILE_NOTIFY_CHANGE_CREATION | FILE_NOTIFY_CHANGE_LAST_WRITE)) != 0;
+		}
+		return (dwChangeFilter & FILE_NOTIFY_CHANGE_LAST_ACCESS) != 0;
+	default:
+		return false;
+	}
+}
+
+uint32_t CInotifyEventSource::_FanotifyMask(DWORD dwChangeFilter)
+{
+	// the watched directory itself is a subdirectory as far as the filesystem mark is concerned
+	uint32_t dwMask = FAN_ONDIR;
+
+	if (dwChangeFilter & (FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME))
+	{
+		dwMask |= FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO;
+	}
+	if (dwChangeFilter & (FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE))
+	{
+		dwMask |= FAN_MODIFY;
+	}
+	if (dwChangeFilter & (FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SECURITY
+		| FILE_NOTIFY_CHANGE_CREATION | FILE_NOTIFY_CHANGE_LAST_WRITE))
+	{
+		dwMask |= FAN_ATTRIB;
+	}
+	if (dwChangeFilter & FILE_NOTIFY_CHANGE_LAST_ACCESS)
+	{
+		dwMask |= FAN_ACCESS;
+	}
+
+	return dwMask;
+}
+
+bool CInotifyEventSource::_IsFilesystemWatch(const CDirWatchInfo * pdi)
+{
+	return pdi->m_bWatchSubDir == CDirectoryChangeWatcher::WATCH_SUBDIRS_FILESYSTEM;
+}
+
+//	true if strPath is strRoot or below it, strRelPath is empty for strRoot itself
+bool CInotifyEventSource::_RelativePath(const std::string & strRoot, const std::string & strPath, std::string & strRelPath)
+{
+	if (strPath.compare(0, strRoot.size(), strRoot) != 0)
+	{
+		return false;
+	}
+
+	if (strPath.size() == strRoot.size())
+	{
+		strRelPath.clear();
+		return true;
+	}
+
+	// strRoot is "/" or a prefix of the name of a sibling
+	auto nSkip = strRoot.size();
+	if (strRoot.back() != DIR_SEPARATOR_CHAR)
+	{
+		if (strPath[nSkip] != DIR_SEPARATOR_CHAR)
+		{
+			return false;
+		}
+		nSkip++;
+	}
+
+	strRelPath = strPath.substr(nSkip);
+	return true;
+}
+
+std::string CInotifyEventSource::_JoinPath(const std::string & strRelPath, const char * szName)
+{
+	if (strRelPath.empty())
+	{
+		return std::string(szName);
+	}
+
+	return strRelPath + DIR_SEPARATOR_CHAR + szName;
+}
+
+std::string CInotifyEventSource::_FullPath(const CDirWatchInfo * pdi, const std::string & strRelPath)
+{
+	std::string strPath((LPCTSTR)pdi->m_strDirName);
+	while (strPath.size() > 1 && strPath.back() == DIR_SEPARATOR_CHAR)
+	{
+		strPath.pop_back();
+	}
+
+	if (!strRelPath.empty())
+	{
+		strPath += DIR_SEPARATOR_CHAR;
+		strPath += strRelPath;
+	}
+
+	return strPath;
+}
+
+//	size of the FILE_NOTIFY_INFORMATION record for this name, DWORD aligned
+DWORD CInotifyEventSource::_RecordSize(const std::string & strFileName)
+{
+	return (DWORD)((offsetof(FILE_NOTIFY_INFORMATION, FileName) + strFileName.size() + 3) & ~(size_t)3);
+}
+
+#endif // __linux__
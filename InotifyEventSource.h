@@ -0,0 +1,159 @@
+#pragma once
+#include "DirectoryEventSource.h"
+
+#ifdef __linux__
+
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+
+//
+//	CDirectoryEventSource implemented w/ inotify(7).
+//
+//	All watched directories share one inotify descriptor.  Pending events are
+//	read in large batches with a single read(), translated into
+//	FILE_NOTIFY_INFORMATION records and written into the read buffer of the
+//	CDirWatchInfo that they belong to, exactly like ReadDirectoryChangesW() would.
+//
+//	inotify isn't recursive, so when bWatchSubDirs is specified
+//	every subdirectory gets its own watch descriptor, and watches are
+//	added/renamed/removed as subdirectories come and go.
+//
+//	Records that arrive while a CDirWatchInfo has no read outstanding
+//	(ie: its notifications are being processed) are kept in a backlog and
+//	delivered by the next IssueRead().  When the backlog or the kernel
+//	queue (IN_Q_OVERFLOW) overflows the read completes with zero bytes,
+//	which is what ReadDirectoryChangesW() does when its buffer overflows.
+//
+//	Watches made w/ CDirectoryChangeWatcher::WATCH_SUBDIRS_FILESYSTEM don't
+//	get per-directory watches.  Instead the filesystem gets a fanotify(7) mark
+//	that reports directory file handles + names (FAN_REPORT_DFID_NAME), which
+//	are resolved back to paths w/ open_by_handle_at().  The watched directory
+//	itself keeps an inotify watch so that its deletion is still noticed.
+//
+class CInotifyEventSource : public CDirectoryEventSource
+{
+public:
+	CInotifyEventSource();
+	virtual ~CInotifyEventSource();
+
+	virtual DWORD	OpenDirectory(CDirectoryChangeWatcher::CDirWatchInfo * pdi) override;
+	virtual BOOL	CloseDirectory(CDirectoryChangeWatcher::CDirWatchInfo * pdi) override;
+	virtual DWORD	Associate(CDirectoryChangeWatcher::CDirWatchInfo * pdi) override;
+	virtual DWORD	IssueRead(CDirectoryChangeWatcher::CDirWatchInfo * pdi, DWORD dwOffset) override;
+	virtual BOOL	PostCompletion(CDirectoryChangeWatcher::CDirWatchInfo * pdi) override;
+	virtual BOOL	GetCompletion(OUT CDirectoryChangeWatcher::CDirWatchInfo *& pdi, OUT DWORD & dwNumBytes) override;
+	virtual bool	GetLostRecordDirectories(CDirectoryChangeWatcher::CDirWatchInfo * pdi,
+		OUT std::vector<std::string> & relDirs) override;
+
+private:
+	typedef CDirectoryChangeWatcher::CDirWatchInfo	CDirWatchInfo;
+
+	// one CDirWatchInfo's view of a watch descriptor.
+	// several CDirWatchInfo objects may watch the same directory (ie: nested watched trees),
+	// inotify hands out one watch descriptor per inode so they share it.
+	struct CWatchNode
+	{
+		CDirWatchInfo *	pdi;
+		std::string		strRelPath;	// relative to pdi->m_strDirName, empty for the watched directory itself
+	};
+
+	struct CPendingRecord
+	{
+		DWORD			dwAction;
+		std::string		strFileName;
+	};
+
+	struct CWatchState
+	{
+		std::vector<int>	wds;
+		uint32_t	dwInotifyMask;
+		DWORD		dwOffset;		// offset into pdi->m_Buffer the outstanding read started at
+		DWORD		dwFilled;		// offset the next record will be written at
+		DWORD		dwLastRecord;	// offset of the last record written, NO_RECORD if none
+		bool		bArmed;			// a read is outstanding
+		bool		bOverflow;		// records have been lost, the next read completes with zero bytes
+		bool		bRootGone;		// the watched directory has been deleted or moved
+		bool		bFilesystemMark;	// covered by the fanotify mark of ulFsid
+		uint64_t	ulFsid;
+		std::deque<CPendingRecord>	backlog;
+		std::set<std::string>	lostDirs;	// directories of the records dropped w/ the backlog, see GetLostRecordDirectories()
+		bool		bLostAnywhere;	// records have been lost, and it isn't known where (or lostDirs got too big)
+	};
+
+	// one fanotify mark per filesystem, shared by the watches on it
+	struct CFilesystemMark
+	{
+		int			fdMount;	// any directory on the filesystem, for open_by_handle_at()
+		uint32_t	dwMask;
+		int			nRefCount;
+	};
+
+	struct CCompletion
+	{
+		CDirWatchInfo *	pdi;
+		DWORD			dwNumBytes;
+		BOOL			bResult;
+	};
+
+	enum { NO_RECORD = 0xFFFFFFFFUL };
+	enum { INOTIFY_READ_BUFFER_SIZE = 64 * 1024 };
+	enum { MAX_BACKLOG_RECORDS = 16 * 1024 };
+	enum { MAX_DIR_HANDLE_CACHE = 4096 };
+	enum { MAX_LOST_DIRS = 64 };
+
+	int		_AddWatch(CDirWatchInfo * pdi, CWatchState & state, const std::string & strPath, const std::string & strRelPath);
+	DWORD	_AddSubdirectoryWatches(CDirWatchInfo * pdi, CWatchState & state, const std::string & strRelPath, bool bReportContents);
+	void	_RemoveWatches(CDirWatchInfo * pdi, CWatchState & state, const std::string & strRelPath);
+	void	_RenameWatches(CDirWatchInfo * pdi, CWatchState & state, const std::string & strOldRelPath, const std::string & strNewRelPath);
+	void	_ForgetWatchDescriptor(int wd);
+	DWORD	_AddFilesystemMark(CDirWatchInfo * pdi, CWatchState & state);
+	void	_RemoveFilesystemMark(CWatchState & state);
+
+	void	_ReadEvents();
+	void	_TranslateEvent(const struct inotify_event * pEvent);
+	void	_TranslateRename(const struct inotify_event * pFrom, const struct inotify_event * pTo);
+	void	_ReadFanotifyEvents();
+	void	_TranslateFanotifyEvent(uint32_t dwMask, const std::string & strPath, const std::string & strNewPath);
+	bool	_ResolveDirectoryHandle(uint64_t ulFsid, const struct file_handle * pHandle, std::string & strPath);
+	void	_CompleteTouchedReads();
+	void	_QueueRecord(CDirWatchInfo * pdi, DWORD dwAction, const std::string & strFileName);
+	void	_QueueRenameRecords(CDirWatchInfo * pdi, const std::string & strOldName, const std::string & strNewName);
+	bool	_WriteRecord(CDirWatchInfo * pdi, CWatchState & state, DWORD dwAction, const std::string & strFileName, DWORD dwRoomToLeave = 0);
+	bool	_FlushBacklog(CDirWatchInfo * pdi, CWatchState & state);
+	void	_DropBacklog(CWatchState & state, bool bKnowWhere);
+	static void	_NoteLostRecord(CWatchState & state, const std::string & strFileName);
+	void	_CompleteRead(CDirWatchInfo * pdi, CWatchState & state, BOOL bResult);
+	void	_PushCompletion(CDirWatchInfo * pdi, DWORD dwNumBytes, BOOL bResult);
+
+	static uint32_t	_InotifyMask(DWORD dwChangeFilter, BOOL bWatchSubDir);
+	static uint32_t	_FanotifyMask(DWORD dwChangeFilter);
+	static bool		_IsFilesystemWatch(const CDirWatchInfo * pdi);
+	static bool		_RelativePath(const std::string & strRoot, const std::string & strPath, std::string & strRelPath);
+	static bool		_WantsAction(DWORD dwChangeFilter, DWORD dwAction, uint32_t dwInotifyEvent);
+	static std::string	_JoinPath(const std::string & strRelPath, const char * szName);
+	static std::string	_FullPath(const CDirWatchInfo * pdi, const std::string & strRelPath);
+	static DWORD	_RecordSize(const std::string & strFileName);
+
+private:
+	int		_fdInotify;
+	int		_fdWakeup;	// eventfd, wakes up GetCompletion() for PostCompletion()
+	int		_fdFanotify;	// created w/ the first WATCH_SUBDIRS_FILESYSTEM watch
+	bool	_bFanotifyRename;	// the kernel supports FAN_RENAME
+
+	std::mutex	_mutState;
+	std::unordered_map<int, std::vector<CWatchNode>>	_watchNodes;
+	std::unordered_map<CDirWatchInfo *, CWatchState>	_watchStates;
+	std::deque<CCompletion>	_completions;
+	std::vector<CDirWatchInfo *>	_touchedReads;	// reads that got records from the current batch
+	std::vector<char>		_readBuffer;
+	std::unordered_map<uint64_t, CFilesystemMark>	_filesystemMarks;	// by fsid
+	std::unordered_map<std::string, std::string>	_dirHandleCache;	// fsid + file handle -> directory path
+};
+
+#endif // __linux__
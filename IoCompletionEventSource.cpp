@@ -0,0 +1,116 @@
+#include "stdafx.h"
+#include "IoCompletionEventSource.h"
+
+#ifdef _WIN32
+
+CIoCompletionEventSource::CIoCompletionEventSource()
+	: _hCompPort(nullptr)
+{
+}
+
+CIoCompletionEventSource::~CIoCompletionEventSource()
+{
+	if (_hCompPort != nullptr)
+	{
+		CloseHandle(_hCompPort);
+		_hCompPort = nullptr;
+	}
+}
+
+DWORD CIoCompletionEventSource::OpenDirectory(CDirectoryChangeWatcher::CDirWatchInfo * pdi)
+{
+	// open the directory to watch
+	pdi->m_hDir = CreateFile(pdi->m_strDirName,
+		FILE_LIST_DIRECTORY,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		nullptr,
+		OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS | //<- the required privileges for this flag are: SE_BACKUP_NAME and SE_RESTORE_NAME
+		FILE_FLAG_OVERLAPPED,
+		nullptr);
+	if (pdi->m_hDir == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	return ERROR_SUCCESS;
+}
+
+BOOL CIoCompletionEventSource::CloseDirectory(CDirectoryChangeWatcher::CDirWatchInfo * pdi)
+{
+	BOOL bRetVal = TRUE;
+	if (pdi->m_hDir != INVALID_HANDLE_VALUE)
+	{
+		// closing the handle aborts the outstanding ReadDirectoryChangesW(),
+		// GetQueuedCompletionStatus() will return this pdi once more.
+		bRetVal = CloseHandle(pdi->m_hDir);
+		pdi->m_hDir = INVALID_HANDLE_VALUE;
+	}
+
+	return bRetVal;
+}
+
+DWORD CIoCompletionEventSource::Associate(CDirectoryChangeWatcher::CDirWatchInfo * pdi)
+{
+	// Create a IO completion port/or associate this key with
+	// the existing IO completion port
+	_hCompPort = CreateIoCompletionPort(pdi->m_hDir,
+		_hCompPort, // if _hCompPort is NULL, hDir is associated with a NEW completion port,
+					// if _hCompPort is NON-NULL, hDir is associated with the existing completion port that the handle _hCompPort references
+		(ULONG_PTR)pdi, // the completion 'key'... this ptr is returned from GetQueuedCompletionStatus()
+						// when one of the events in the dwChangesToWatchFor filter takes place
+		0);
+	if (_hCompPort == nullptr)
+	{
+		return GetLastError();
+	}
+
+	return ERROR_SUCCESS;
+}
+
+DWORD CIoCompletionEventSource::IssueRead(CDirectoryChangeWatcher::CDirWatchInfo * pdi, DWORD dwOffset)
+{
+	if (!ReadDirectoryChangesW(pdi->m_hDir,
+		pdi->m_Buffer + dwOffset,	//<--FILE_NOTIFY_INFORMATION records are put into this buffer
+		pdi->m_dwBufferSize - dwOffset,
+		pdi->m_bWatchSubDir,
+		pdi->m_dwChangeFilter,
+		&pdi->m_dwBufLength,		//this var not set when using asynchronous mechanisms...
+		&pdi->m_Overlapped,
+		nullptr))//no completion routine!
+	{
+		return GetLastError();
+	}
+
+	return ERROR_SUCCESS;
+}
+
+BOOL CIoCompletionEventSource::PostCompletion(CDirectoryChangeWatcher::CDirWatchInfo * pdi)
+{
+	if (_hCompPort == nullptr)
+	{
+		return FALSE;
+	}
+
+	return PostQueuedCompletionStatus(_hCompPort,
+		pdi != nullptr ? sizeof(pdi) : 0,
+		(ULONG_PTR)pdi,
+		pdi != nullptr ? &pdi->m_Overlapped : nullptr);
+}
+
+BOOL CIoCompletionEventSource::GetCompletion(OUT CDirectoryChangeWatcher::CDirWatchInfo *& pdi, OUT DWORD & dwNumBytes)
+{
+	ULONG_PTR ulKey = 0;
+	LPOVERLAPPED lpOverlapped = nullptr;
+
+	// Retrieve the directory info for this directory
+	// through the io port's completion key
+	BOOL bRetVal = GetQueuedCompletionStatus(_hCompPort,
+		&dwNumBytes, &ulKey,
+		&lpOverlapped, INFINITE);
+
+	pdi = reinterpret_cast<CDirectoryChangeWatcher::CDirWatchInfo *>(ulKey);
+	return bRetVal;
+}
+
+#endif // _WIN32
@@ -0,0 +1,28 @@
+#pragma once
+#include "DirectoryEventSource.h"
+
+#ifdef _WIN32
+
+//
+//	CDirectoryEventSource implemented w/ ReadDirectoryChangesW() and
+//	an I/O completion port.   Every watched directory handle is associated
+//	with the same completion port, the completion key is the CDirWatchInfo.
+//
+class CIoCompletionEventSource : public CDirectoryEventSource
+{
+public:
+	CIoCompletionEventSource();
+	virtual ~CIoCompletionEventSource();
+
+	virtual DWORD	OpenDirectory(CDirectoryChangeWatcher::CDirWatchInfo * pdi) override;
+	virtual BOOL	CloseDirectory(CDirectoryChangeWatcher::CDirWatchInfo * pdi) override;
+	virtual DWORD	Associate(CDirectoryChangeWatcher::CDirWatchInfo * pdi) override;
+	virtual DWORD	IssueRead(CDirectoryChangeWatcher::CDirWatchInfo * pdi, DWORD dwOffset) override;
+	virtual BOOL	PostCompletion(CDirectoryChangeWatcher::CDirWatchInfo * pdi) override;
+	virtual BOOL	GetCompletion(OUT CDirectoryChangeWatcher::CDirWatchInfo *& pdi, OUT DWORD & dwNumBytes) override;
+
+private:
+	HANDLE	_hCompPort;	//i/o completion port
+};
+
+#endif // _WIN32
@@ -0,0 +1,185 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+//
+//	A bounded multi producer / single consumer queue, w/o locks.
+//
+//	The slots are a ring of a power of 2 size, each w/ a sequence number that says whose
+//	turn it is: a producer claims the next position w/ a CAS on the enqueue position and
+//	publishes its item by moving the slot's sequence on, the consumer takes the items in
+//	position order as their slots get published.  A full ring fails TryPush() instead of
+//	waiting, it's up to the caller what to do w/ the item.
+//
+//	The positions and every slot sit on cache lines of their own, so that producers don't
+//	bounce the consumer's line (and each other's) around.  The slots are allocated on a cache
+//	line boundary.  The positions are a cache line apart, but only on a boundary if the ring is.
+//	Before C++17, a ring that's allocated w/ new (or std::make_shared) isn't.
+//
+//	TryPush() may be called from any thread, TryPop()/PopBatch()/HasItems() only from the one
+//	consumer thread.
+//
+template <typename T>
+class CMpscRing
+{
+public:
+	enum { CACHE_LINE_SIZE = 64 };
+
+	explicit CMpscRing(size_t nCapacity)
+		: _nMask(_RoundUpToPowerOf2(nCapacity) - 1)
+		, _slots(_AllocateSlots(_nMask + 1))
+		, _nEnqueuePos(0)
+		, _nDequeuePos(0)
+	{
+		for (size_t i = 0; i <= _nMask; ++i)
+		{
+			_slots[i].nSequence.store(i, std::memory_order_relaxed);
+		}
+	}
+	CMpscRing(const CMpscRing&) = delete;
+	CMpscRing& operator=(const CMpscRing&) = delete;
+
+	size_t	GetCapacity() const { return _nMask + 1; }
+
+	//	moves value into the ring, leaves it alone and returns false if the ring is full
+	bool	TryPush(T& value)
+	{
+		auto nPos = _nEnqueuePos.load(std::memory_order_relaxed);
+		CSlot * pSlot;
+		for (;;)
+		{
+			pSlot = &_slots[nPos & _nMask];
+			auto nSequence = pSlot->nSequence.load(std::memory_order_acquire);
+			auto nDiff = (intptr_t)nSequence - (intptr_t)nPos;
+			if (nDiff == 0)
+			{
+				if (_nEnqueuePos.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (nDiff < 0)
+			{
+				// the consumer hasn't taken this slot's item of the previous lap yet
+				return false;
+			}
+			else
+			{
+				// another producer has claimed it
+				nPos = _nEnqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+		pSlot->value = std::move(value);
+		pSlot->nSequence.store(nPos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool	TryPop(T& value)
+	{
+		auto & slot = _slots[_nDequeuePos & _nMask];
+		if (slot.nSequence.load(std::memory_order_acquire) != _nDequeuePos + 1)
+		{
+			// empty, or the producer that claimed the slot is still moving its item in
+			return false;
+		}
+
+		value = std::move(slot.value);
+		slot.value = T();
+		slot.nSequence.store(_nDequeuePos + _nMask + 1, std::memory_order_release);
+		++_nDequeuePos;
+		return true;
+	}
+
+	//	takes up to nMax items in one go, returns how many
+	size_t	PopBatch(T * pValues, size_t nMax)
+	{
+		size_t nPopped = 0;
+		while (nPopped < nMax && TryPop(pValues[nPopped]))
+		{
+			++nPopped;
+		}
+		return nPopped;
+	}
+
+	bool	HasItems() const
+	{
+		return _slots[_nDequeuePos & _nMask].nSequence.load(std::memory_order_acquire) == _nDequeuePos + 1;
+	}
+
+private:
+	struct alignas(CACHE_LINE_SIZE) CSlot
+	{
+		std::atomic<size_t>	nSequence;
+		T					value;
+	};
+	static_assert(sizeof(CSlot) == CACHE_LINE_SIZE, "a slot takes up one cache line");
+
+	//	new CSlot[] only has to align them as much as malloc() does, before C++17
+	struct CSlotsDeleter
+	{
+		size_t	nSlots;
+
+		void operator()(CSlot * pSlots) const
+		{
+			for (size_t i = 0; i < nSlots; ++i)
+			{
+				pSlots[i].~CSlot();
+			}
+#ifdef _WIN32
+			_aligned_free(pSlots);
+#else
+			free(pSlots);
+#endif
+		}
+	};
+
+	static std::unique_ptr<CSlot[], CSlotsDeleter>	_AllocateSlots(size_t nSlots)
+	{
+		void * pMemory = nullptr;
+#ifdef _WIN32
+		pMemory = _aligned_malloc(nSlots * sizeof(CSlot), CACHE_LINE_SIZE);
+#else
+		if (posix_memalign(&pMemory, CACHE_LINE_SIZE, nSlots * sizeof(CSlot)) != 0)
+		{
+			pMemory = nullptr;
+		}
+#endif
+		if (pMemory == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+
+		// T() doesn't throw for what's kept in a ring (eg: a std::shared_ptr)
+		auto pSlots = static_cast<CSlot *>(pMemory);
+		for (size_t i = 0; i < nSlots; ++i)
+		{
+			new (&pSlots[i]) CSlot();
+		}
+		return std::unique_ptr<CSlot[], CSlotsDeleter>(pSlots, CSlotsDeleter{ nSlots });
+	}
+
+	static size_t	_RoundUpToPowerOf2(size_t n)
+	{
+		size_t nPower = 2;
+		while (nPower < n)
+		{
+			nPower <<= 1;
+		}
+		return nPower;
+	}
+
+private:
+	const size_t	_nMask;
+	std::unique_ptr<CSlot[], CSlotsDeleter>	_slots;
+
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t>	_nEnqueuePos;	//shared by the producers
+	alignas(CACHE_LINE_SIZE) size_t	_nDequeuePos;	//the consumer's own
+};
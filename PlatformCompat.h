@@ -0,0 +1,254 @@
+#pragma once
+
+/*******************************
+
+The directory watcher core (CDirectoryChangeWatcher, CDirectoryChangeHandler,
+CFileNotifyInformation, ...) is written against the Win32/MFC types.
+
+On Windows those come from MFC (see stdafx.h).
+Everywhere else this header supplies the small subset of them that the
+watcher core uses, so that the inotify event source can be built and
+load-tested on Linux.  The dialog/application classes are Windows only.
+
+********************************/
+
+#ifdef _WIN32
+
+#define DIR_SEPARATOR_CHAR	_T('\\')
+#define DIR_SEPARATOR_STR	_T("\\")
+
+#else	// !_WIN32
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <strings.h>
+#include <sys/stat.h>
+
+#define DIR_SEPARATOR_CHAR	'/'
+#define DIR_SEPARATOR_STR	"/"
+
+//	the Windows sizes (LLP64): DWORD and LONG are 32 bits wide everywhere,
+//	so FILE_NOTIFY_INFORMATION below keeps the winnt.h layout and 4 byte alignment.
+typedef uint32_t		DWORD;
+typedef int32_t			LONG;
+typedef uint32_t		ULONG;
+typedef int				BOOL;
+typedef unsigned char	BYTE;
+typedef BYTE *			LPBYTE;
+typedef char			CHAR;
+typedef char			TCHAR;
+typedef wchar_t			WCHAR;
+typedef const char *	LPCSTR;
+typedef const char *	LPCTSTR;
+typedef char *			LPTSTR;
+typedef void *			LPVOID;
+typedef unsigned int	UINT;
+typedef void *			HANDLE;
+typedef void *			HMODULE;
+typedef uintptr_t		ULONG_PTR;
+
+#ifndef TRUE
+#define TRUE	1
+#define FALSE	0
+#endif
+
+#define IN
+#define OUT
+#define _T(x)		x
+#define STDAPICALLTYPE
+#define MAX_PATH	260
+#define INFINITE	0xFFFFFFFFUL
+#define INVALID_HANDLE_VALUE	((HANDLE)(intptr_t)-1)
+
+#define ASSERT(f)	assert(f)
+#define UNREFERENCED_PARAMETER(p)	(void)(p)
+#define TRACE(...)	((void)0)
+#define AfxIsValidAddress(p, n)	((p) != nullptr)
+
+template <typename T> inline T min(T a, T b) { return (a < b) ? a : b; }
+template <typename T> inline T max(T a, T b) { return (a < b) ? b : a; }
+
+//	error codes are errno values, ERROR_SUCCESS is still 0.
+#define ERROR_SUCCESS				0UL
+#define ERROR_INVALID_PARAMETER		((DWORD)EINVAL)
+#define ERROR_INVALID_HANDLE		((DWORD)EBADF)
+#define ERROR_BAD_PATHNAME			((DWORD)ENOTDIR)
+#define ERROR_MAX_THRDS_REACHED		((DWORD)EAGAIN)
+#define ERROR_NOTIFY_ENUM_DIR		((DWORD)EOVERFLOW)
+#define ERROR_NOT_ENOUGH_MEMORY		((DWORD)ENOMEM)
+#define ERROR_PATH_NOT_FOUND		((DWORD)ENOENT)
+#define ERROR_INVALID_DATA			((DWORD)EBADMSG)
+#define ERROR_CANNOT_MAKE			((DWORD)EIO)
+
+inline DWORD & _LastErrorRef() { static thread_local DWORD dwLastError = 0; return dwLastError; }
+inline DWORD GetLastError() { return (_LastErrorRef() != 0) ? _LastErrorRef() : (DWORD)errno; }
+inline void SetLastError(DWORD dwError) { _LastErrorRef() = dwError; }
+
+inline long InterlockedIncrement(long volatile * p) { return __sync_add_and_fetch(p, 1L); }
+inline long InterlockedDecrement(long volatile * p) { return __sync_sub_and_fetch(p, 1L); }
+
+//	winnt.h
+#define FILE_NOTIFY_CHANGE_FILE_NAME	0x00000001
+#define FILE_NOTIFY_CHANGE_DIR_NAME		0x00000002
+#define FILE_NOTIFY_CHANGE_ATTRIBUTES	0x00000004
+#define FILE_NOTIFY_CHANGE_SIZE			0x00000008
+#define FILE_NOTIFY_CHANGE_LAST_WRITE	0x00000010
+#define FILE_NOTIFY_CHANGE_LAST_ACCESS	0x00000020
+#define FILE_NOTIFY_CHANGE_CREATION		0x00000040
+#define FILE_NOTIFY_CHANGE_SECURITY		0x00000100
+
+#define FILE_ACTION_ADDED				0x00000001
+#define FILE_ACTION_REMOVED				0x00000002
+#define FILE_ACTION_MODIFIED			0x00000003
+#define FILE_ACTION_RENAMED_OLD_NAME	0x00000004
+#define FILE_ACTION_RENAMED_NEW_NAME	0x00000005
+
+//	same layout as winnt.h, except that FileName holds UTF-8 (TCHAR) instead of WCHAR.
+//	FileNameLength is in bytes.
+typedef struct _FILE_NOTIFY_INFORMATION {
+	DWORD NextEntryOffset;
+	DWORD Action;
+	DWORD FileNameLength;
+	TCHAR FileName[1];
+} FILE_NOTIFY_INFORMATION, *PFILE_NOTIFY_INFORMATION;
+
+//
+//	The subset of the ATL/MFC CString interface used by the watcher core.
+//
+class CString
+{
+public:
+	CString() {}
+	CString(LPCTSTR sz) : _str(sz != nullptr ? sz : "") {}
+	CString(LPCTSTR sz, int nLength) : _str(sz, nLength) {}
+	explicit CString(const std::string & str) : _str(str) {}
+
+	int		GetLength() const { return (int)_str.length(); }
+	bool	IsEmpty() const { return _str.empty(); }
+	void	Empty() { _str.clear(); }
+	TCHAR	GetAt(int nIdx) const { return _str[nIdx]; }
+	TCHAR	operator[](int nIdx) const { return _str[nIdx]; }
+	LPCTSTR	GetString() const { return _str.c_str(); }
+	operator LPCTSTR() const { return _str.c_str(); }
+
+	void	Append(LPCTSTR sz) { _str.append(sz); }
+	void	Append(LPCTSTR sz, int nLength) { _str.append(sz, nLength); }
+	CString & operator+=(LPCTSTR sz) { _str.append(sz); return *this; }
+	CString & operator+=(TCHAR ch) { _str.push_back(ch); return *this; }
+	CString & operator+=(const CString & str) { _str.append(str._str); return *this; }
+	friend CString operator+(const CString & a, const CString & b) { CString s(a); s += b; return s; }
+	friend CString operator+(const CString & a, LPCTSTR b) { CString s(a); s += b; return s; }
+
+	int		Compare(LPCTSTR sz) const { return strcmp(_str.c_str(), sz); }
+	int		CompareNoCase(LPCTSTR sz) const { return strcasecmp(_str.c_str(), sz); }
+	bool	operator==(LPCTSTR sz) const { return Compare(sz) == 0; }
+	bool	operator!=(LPCTSTR sz) const { return Compare(sz) != 0; }
+	bool	operator==(const CString & str) const { return _str == str._str; }
+	bool	operator!=(const CString & str) const { return _str != str._str; }
+
+	int		Find(TCHAR ch, int nStart = 0) const { auto n = _str.find(ch, nStart); return n == std::string::npos ? -1 : (int)n; }
+	int		ReverseFind(TCHAR ch) const { auto n = _str.rfind(ch); return n == std::string::npos ? -1 : (int)n; }
+	CString	Left(int nCount) const { return CString(_str.substr(0, nCount)); }
+	CString	Mid(int nFirst) const { return CString(_str.substr(min<size_t>(nFirst, _str.length()))); }
+	CString	Mid(int nFirst, int nCount) const { return CString(_str.substr(min<size_t>(nFirst, _str.length()), nCount)); }
+	CString & MakeLower() { std::transform(_str.begin(), _str.end(), _str.begin(), ::tolower); return *this; }
+	CString & TrimRight(TCHAR ch) { while (!_str.empty() && _str.back() == ch) _str.pop_back(); return *this; }
+
+private:
+	std::string	_str;
+};
+
+//
+//	afxmt.h
+//
+class CCriticalSection
+{
+public:
+	BOOL	Lock() { _mut.lock(); return TRUE; }
+	BOOL	Unlock() { _mut.unlock(); return TRUE; }
+
+private:
+	std::recursive_mutex	_mut;
+};
+
+class CEvent
+{
+public:
+	CEvent(BOOL bInitiallyOwn = FALSE, BOOL bManualReset = FALSE)
+		: _bSignaled(bInitiallyOwn != FALSE)
+		, _bManualReset(bManualReset != FALSE)
+	{
+	}
+
+	BOOL	SetEvent() { std::lock_guard<std::mutex> lk(_mut); _bSignaled = true; _cv.notify_all(); return TRUE; }
+	BOOL	ResetEvent() { std::lock_guard<std::mutex> lk(_mut); _bSignaled = false; return TRUE; }
+
+	BOOL	Lock(DWORD dwTimeout = INFINITE)
+	{
+		std::unique_lock<std::mutex> lk(_mut);
+		if (dwTimeout == INFINITE)
+		{
+			_cv.wait(lk, [this] { return _bSignaled; });
+		}
+		else if (!_cv.wait_for(lk, std::chrono::milliseconds(dwTimeout), [this] { return _bSignaled; }))
+		{
+			return FALSE;
+		}
+
+		if (!_bManualReset)
+		{
+			_bSignaled = false;
+		}
+		return TRUE;
+	}
+
+private:
+	std::mutex				_mut;
+	std::condition_variable	_cv;
+	bool	_bSignaled;
+	bool	_bManualReset;
+};
+
+//
+//	g3log: LOGF() writes to stderr, INFO only w/ DWATCHER_LOG_INFO set in the environment.
+//	The format is checked like printf()'s, a CString is passed as (LPCTSTR).
+//
+enum CLogLevel { LOG_LEVEL_INFO, LOG_LEVEL_WARNING, LOG_LEVEL_FATAL };
+
+inline void _LogF(CLogLevel level, const char * pszFormat, ...) __attribute__((format(printf, 2, 3)));
+inline void _LogF(CLogLevel level, const char * pszFormat, ...)
+{
+	static const bool bInfo = (getenv("DWATCHER_LOG_INFO") != nullptr);
+	if (level == LOG_LEVEL_INFO && !bInfo)
+	{
+		return;
+	}
+
+	static const char * const levelNames[] = { "INFO", "WARNING", "FATAL" };
+	va_list args;
+	va_start(args, pszFormat);
+	fprintf(stderr, "%s: ", levelNames[level]);
+	vfprintf(stderr, pszFormat, args);
+	va_end(args);
+}
+
+#define LOGF(level, ...)	_LogF(LOG_LEVEL_##level, __VA_ARGS__)
+
+inline static BOOL IsDirectory(const CString& path)
+{
+	struct stat st;
+	return (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) ? TRUE : FALSE;
+}
+
+#endif	// _WIN32
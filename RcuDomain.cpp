@@ -0,0 +1,30 @@
+#include "stdafx.h"
+#include "RcuDomain.h"
+#include <thread>
+
+
+CRcuDomain::CRcuDomain()
+	: _nEpoch(0U)
+{
+	_nReaders[0] = 0L;
+	_nReaders[1] = 0L;
+}
+
+//
+//	Returns once every reader that entered before the call has left.
+//
+//	A reader that can still see the old version entered before it was replaced, so
+//	it's counted in one of the two slots.  The epoch is moved on before each slot is
+//	drained, so that new readers go to the other slot and can't keep the writer waiting forever.
+//
+void CRcuDomain::Synchronize()
+{
+	for (int nPhase = 0; nPhase < 2; ++nPhase)
+	{
+		auto nSlot = _nEpoch.fetch_add(1U) & 1U;
+		while (_nReaders[nSlot].load() != 0L)
+		{
+			std::this_thread::yield();
+		}
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <atomic>
+
+//
+//	A minimal epoch based RCU (read-copy-update).
+//
+//	Readers never wait and never take a lock: a CReadLock only bumps the
+//	reader count of the current epoch.  A writer publishes a new version of
+//	the data w/ an atomic pointer store, then calls Synchronize(), which moves
+//	the epoch on and waits until every reader that might still see the old
+//	version has left.  After that the old version can be freed.
+//
+//	Writers have to be serialized by the caller.
+//
+class CRcuDomain
+{
+public:
+	CRcuDomain();
+	CRcuDomain(const CRcuDomain&) = delete;
+	CRcuDomain& operator=(const CRcuDomain&) = delete;
+
+	class CReadLock
+	{
+	public:
+		explicit CReadLock(CRcuDomain & domain)
+			: _domain(domain)
+			, _nSlot(domain._EnterRead())
+		{
+		}
+		~CReadLock() { _domain._LeaveRead(_nSlot); }
+
+		CReadLock(const CReadLock&) = delete;
+		CReadLock& operator=(const CReadLock&) = delete;
+
+	private:
+		CRcuDomain &	_domain;
+		unsigned		_nSlot;
+	};
+
+	void	Synchronize();
+
+private:
+	unsigned	_EnterRead()
+	{
+		unsigned nSlot = _nEpoch.load() & 1U;
+		_nReaders[nSlot].fetch_add(1);
+		return nSlot;
+	}
+	void		_LeaveRead(unsigned nSlot) { _nReaders[nSlot].fetch_sub(1); }
+
+private:
+	std::atomic<unsigned>	_nEpoch;
+	std::atomic<long>		_nReaders[2];	//readers that entered during an even/odd epoch
+};
@@ -0,0 +1,75 @@
+#include "stdafx.h"
+#include "ReadBufferPool.h"
+#include "DirectoryChangeWatcher.h"	// READ_DIR_CHANGE_BUFFER_MEMORY_CAP
+
+
+CReadBufferPool::CReadBufferPool()
+	: _nMemoryCap(READ_DIR_CHANGE_BUFFER_MEMORY_CAP)
+	, _nMemoryUsed(0)
+{
+}
+
+CReadBufferPool::~CReadBufferPool()
+{
+	for (auto & it : _freeBuffers)
+	{
+		for (auto pBuffer : it.second)
+		{
+			delete [] pBuffer;
+		}
+	}
+}
+
+CReadBufferPool& CReadBufferPool::Instance()
+{
+	static CReadBufferPool instance;
+	return instance;
+}
+
+CHAR * CReadBufferPool::Acquire(DWORD dwSize, bool bForce /*= false*/)
+{
+	{
+		std::lock_guard<std::mutex> lk(_mutFree);
+		auto it = _freeBuffers.find(dwSize);
+		if (it != _freeBuffers.end()
+			&& !it->second.empty())
+		{
+			auto pBuffer = it->second.back();
+			it->second.pop_back();
+			return pBuffer;
+		}
+	}
+
+	if (_nMemoryUsed.fetch_add(dwSize) + dwSize > _nMemoryCap.load()
+		&& !bForce)
+	{
+		_nMemoryUsed -= dwSize;
+		return nullptr;
+	}
+
+	return new CHAR[dwSize];
+}
+
+void CReadBufferPool::Release(CHAR * pBuffer, DWORD dwSize)
+{
+	if (pBuffer == nullptr)
+	{
+		return;
+	}
+
+	{
+		// keep it unless there are plenty of this size already, or the pool is over the cap
+		// (the cap may have been lowered)
+		std::lock_guard<std::mutex> lk(_mutFree);
+		auto & freeBuffers = _freeBuffers[dwSize];
+		if (freeBuffers.size() < MAX_FREE_BUFFERS_PER_SIZE
+			&& _nMemoryUsed.load() <= _nMemoryCap.load())
+		{
+			freeBuffers.push_back(pBuffer);
+			return;
+		}
+	}
+
+	_nMemoryUsed -= dwSize;
+	delete [] pBuffer;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+//
+//	Process wide pool of the buffers that ReadDirectoryChangesW() (or the inotify
+//	event source) fills.  Double buffered watches trade buffers w/ it on every
+//	read, so the released ones are kept for reuse instead of going back to the heap.
+//
+//	The pool also enforces the memory cap for all read buffers together,
+//	see CDirectoryChangeWatcher::SetReadBufferMemoryCap().
+//
+class CReadBufferPool
+{
+private:
+	CReadBufferPool();
+
+public:
+	~CReadBufferPool();
+
+	static CReadBufferPool& Instance();
+
+	//	returns nullptr if the buffer would exceed the memory cap and bForce is false
+	CHAR *	Acquire(DWORD dwSize, bool bForce = false);
+	void	Release(CHAR * pBuffer, DWORD dwSize);
+
+	size_t	SetMemoryCap(size_t nBytes) { return _nMemoryCap.exchange(nBytes); }
+	size_t	GetMemoryUsed() const { return _nMemoryUsed.load(); }
+
+private:
+	enum { MAX_FREE_BUFFERS_PER_SIZE = 16 };
+
+	std::atomic<size_t>	_nMemoryCap;
+	std::atomic<size_t>	_nMemoryUsed;	//buffers in use + the free ones
+
+	std::mutex	_mutFree;
+	std::unordered_map<DWORD, std::vector<CHAR *>>	_freeBuffers;	//by size
+};
@@ -0,0 +1,85 @@
+#include "stdafx.h"
+#include "SettleTimer.h"
+
+
+CSettleTimer::CSettleTimer(DWORD dwSettleTimeMs)
+	: _settleTime(dwSettleTimeMs)
+{
+}
+
+void CSettleTimer::NoteEvents(const std::vector<CDirChangeEvent>& events, time_point tNow)
+{
+	auto tDeadline = tNow + _settleTime;
+	for (const auto & event : events)
+	{
+		switch (event.dwAction)
+		{
+		case FILE_ACTION_ADDED:
+		case FILE_ACTION_MODIFIED:
+			_Arm(event.strFileName, tDeadline);
+			break;
+		case FILE_ACTION_REMOVED:
+			_Cancel(event.strFileName);
+			break;
+		case FILE_ACTION_RENAMED_OLD_NAME:
+			_Cancel(event.strFileName);
+			_Arm(event.strNewFileName, tDeadline);
+			break;
+		default:
+			// FILE_ACTION_QUIESCENT, what this reported itself
+			break;
+		}
+	}
+}
+
+CSettleTimer::time_point CSettleTimer::GetNextExpiry() const
+{
+	ASSERT(HasPending());
+
+	auto it = _pendingFiles.find(*_order.front());
+	return it->second.tDeadline + std::chrono::milliseconds(SETTLE_RESOLUTION_MS);
+}
+
+void CSettleTimer::TakeExpired(time_point tNow, std::vector<CDirChangeEvent>& events)
+{
+	while (!_order.empty())
+	{
+		auto it = _pendingFiles.find(*_order.front());
+		ASSERT(it != _pendingFiles.end());
+		if (it->second.tDeadline > tNow)
+		{
+			break;
+		}
+
+		events.push_back(CDirChangeEvent{ FILE_ACTION_QUIESCENT, CString(it->first.c_str(), (int)it->first.size()), CString() });
+		_order.pop_front();
+		_pendingFiles.erase(it);
+	}
+}
+
+void CSettleTimer::_Arm(const CString & strFileName, time_point tDeadline)
+{
+	auto result = _pendingFiles.emplace(tstring((LPCTSTR)strFileName, strFileName.GetLength()), CPendingFile());
+	auto & pendingFile = result.first->second;
+	if (result.second)
+	{
+		// the map's keys don't move, rehashing leaves them where they are
+		pendingFile.itOrder = _order.insert(_order.end(), &result.first->first);
+	}
+	else
+	{
+		// changed again, its deadline is now the latest
+		_order.splice(_order.end(), _order, pendingFile.itOrder);
+	}
+	pendingFile.tDeadline = tDeadline;
+}
+
+void CSettleTimer::_Cancel(const CString & strFileName)
+{
+	auto it = _pendingFiles.find(tstring((LPCTSTR)strFileName, strFileName.GetLength()));
+	if (it != _pendingFiles.end())
+	{
+		_order.erase(it->second.itOrder);
+		_pendingFiles.erase(it);
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "DirectoryChangeHandler.h"
+#include <chrono>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+//
+//	Keeps track of the files of a watch that are still changing, and tells when one
+//	has been left alone for the settle time (see CDirectoryChangeWatcher::WatchDirectory(), dwSettleTimeMs).
+//
+//	Every file of a watch has the same timeout, so the files come due in the order in
+//	which they were last changed: the pending files are kept in a list in that order,
+//	and a change moves its file to the back.  Like the slots of a timer wheel, w/o the
+//	slots: arming, re-arming, cancelling and expiring a file are all O(1), there's no timer per file,
+//	and 100k pending files cost a list node and a hash map entry each.
+//	Files are expired SETTLE_RESOLUTION_MS at a time, so the ones that settle together are reported together.
+//
+//	Not thread safe, a watch's settle timer is only used by whoever is processing the watch.
+//
+class CSettleTimer
+{
+public:
+	typedef std::chrono::steady_clock::time_point	time_point;
+
+	enum { SETTLE_RESOLUTION_MS = 10 };
+
+	explicit CSettleTimer(DWORD dwSettleTimeMs);
+
+	CSettleTimer(const CSettleTimer&) = delete;
+	CSettleTimer& operator=(const CSettleTimer&) = delete;
+
+	//	(re)arms the files that have been added, modified or renamed, forgets the ones that are gone
+	void	NoteEvents(const std::vector<CDirChangeEvent>& events, time_point tNow);
+
+	bool		HasPending() const { return !_order.empty(); }
+	size_t		GetPendingCount() const { return _order.size(); }
+	//	when the next files come due
+	time_point	GetNextExpiry() const;
+
+	//	appends a FILE_ACTION_QUIESCENT event for each file that's settled by tNow
+	void	TakeExpired(time_point tNow, std::vector<CDirChangeEvent>& events);
+
+private:
+	typedef std::basic_string<TCHAR>	tstring;
+
+	struct CPendingFile
+	{
+		time_point	tDeadline;
+		std::list<const tstring *>::iterator	itOrder;
+	};
+
+	void	_Arm(const CString& strFileName, time_point tDeadline);
+	void	_Cancel(const CString& strFileName);
+
+private:
+	std::chrono::milliseconds	_settleTime;
+
+	std::unordered_map<tstring, CPendingFile>	_pendingFiles;//by full path
+	std::list<const tstring *>	_order;//the keys of _pendingFiles, by deadline
+};
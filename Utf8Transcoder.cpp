@@ -0,0 +1,188 @@
+#include "stdafx.h"
+#include "Utf8Transcoder.h"
+
+#if defined(__AVX2__)
+#define UTF8_TRANSCODER_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UTF8_TRANSCODER_SSE2
+#include <emmintrin.h>
+#endif
+
+
+void CUtf8Transcoder::Append(const uint16_t * pSrc, size_t nLength, std::string & strDest)
+{
+	// at most 3 bytes per code unit (a surrogate pair is 4 bytes for 2 units)
+	auto nOldSize = strDest.size();
+	strDest.resize(nOldSize + nLength * 3);
+	char * pOut = &strDest[0] + nOldSize;
+
+	size_t i = 0;
+	while (i < nLength)
+	{
+#if defined(UTF8_TRANSCODER_AVX2)
+		while (i + 16 <= nLength)
+		{
+			auto units = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pSrc + i));
+			if (!_mm256_testz_si256(units, _mm256_set1_epi16((short)0xFF80)))
+			{
+				break;
+			}
+			// packus works per 128 bit lane, put the two halves back in order
+			auto bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(units, units), 0xD8);
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(pOut), _mm256_castsi256_si128(bytes));
+			i += 16;
+			pOut += 16;
+		}
+#endif
+#if defined(UTF8_TRANSCODER_AVX2) || defined(UTF8_TRANSCODER_SSE2)
+		while (i + 8 <= nLength)
+		{
+			auto units = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pSrc + i));
+			auto nonAscii = _mm_and_si128(units, _mm_set1_epi16((short)0xFF80));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(nonAscii, _mm_setzero_si128())) != 0xFFFF)
+			{
+				break;
+			}
+			_mm_storel_epi64(reinterpret_cast<__m128i *>(pOut), _mm_packus_epi16(units, units));
+			i += 8;
+			pOut += 8;
+		}
+#endif
+		// a chunk that isn't all ASCII (or the tail): one code point at a time,
+		// for a whole chunk so that names w/o any ASCII don't retry the vector path every time.
+		auto nChunkEnd = (std::min)(nLength, i + 8);
+		while (i < nChunkEnd)
+		{
+			size_t nWritten = 0;
+			i += _EncodeCodePoint(pSrc + i, nLength - i, pOut, nWritten);
+			pOut += nWritten;
+		}
+	}
+
+	strDest.resize(pOut - strDest.data());
+}
+
+void CUtf8Transcoder::AppendScalar(const uint16_t * pSrc, size_t nLength, std::string & strDest)
+{
+	auto nOldSize = strDest.size();
+	strDest.resize(nOldSize + nLength * 3);
+	char * pOut = &strDest[0] + nOldSize;
+
+	size_t i = 0;
+	while (i < nLength)
+	{
+		size_t nWritten = 0;
+		i += _EncodeCodePoint(pSrc + i, nLength - i, pOut, nWritten);
+		pOut += nWritten;
+	}
+
+	strDest.resize(pOut - strDest.data());
+}
+
+//
+//	converts the code point at pSrc, returns the number of code units it took up.
+//
+size_t CUtf8Transcoder::_EncodeCodePoint(const uint16_t * pSrc, size_t nLength, char * pDest, OUT size_t & nWritten)
+{
+	uint32_t c = pSrc[0];
+	size_t nConsumed = 1;
+
+	if (c < 0x80)
+	{
+		pDest[0] = (char)c;
+		nWritten = 1;
+		return nConsumed;
+	}
+
+	if (c < 0x800)
+	{
+		pDest[0] = (char)(0xC0 | (c >> 6));
+		pDest[1] = (char)(0x80 | (c & 0x3F));
+		nWritten = 2;
+		return nConsumed;
+	}
+
+	if (c >= 0xD800 && c <= 0xDFFF)
+	{
+		if (c <= 0xDBFF
+			&& nLength > 1
+			&& pSrc[1] >= 0xDC00 && pSrc[1] <= 0xDFFF)
+		{
+			c = 0x10000 + ((c - 0xD800) << 10) + (pSrc[1] - 0xDC00);
+			pDest[0] = (char)(0xF0 | (c >> 18));
+			pDest[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+			pDest[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+			pDest[3] = (char)(0x80 | (c & 0x3F));
+			nWritten = 4;
+			return 2;
+		}
+
+		// unpaired surrogate
+		c = 0xFFFD;
+	}
+
+	pDest[0] = (char)(0xE0 | (c >> 12));
+	pDest[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+	pDest[2] = (char)(0x80 | (c & 0x3F));
+	nWritten = 3;
+	return nConsumed;
+}
+
+void CUtf8Transcoder::AppendName(const char * pszName, size_t nLength, std::string & strDest)
+{
+	strDest.append(pszName, nLength);
+}
+
+#ifdef _WIN32
+void CUtf8Transcoder::AppendName(const wchar_t * pszName, size_t nLength, std::string & strDest)
+{
+	static_assert(sizeof(wchar_t) == sizeof(uint16_t), "wchar_t is UTF-16 on Windows");
+	Append(reinterpret_cast<const uint16_t *>(pszName), nLength, strDest);
+}
+#endif
+
+std::string CUtf8Transcoder::ToUtf8(const CString & str)
+{
+	std::string strUtf8;
+	AppendName((LPCTSTR)str, (size_t)str.GetLength(), strUtf8);
+	return strUtf8;
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+void CUtf8NameArena::Assign(const CFileNotifyInformation & notify_info)
+{
+	Clear();
+
+	// size the arena for the whole batch first, so that it's converted w/o reallocating
+	size_t nUnits = 0;
+	for (const auto & record : notify_info)
+	{
+		nUnits += record.GetFileName().nLength;
+	}
+	_strNames.reserve(nUnits * (sizeof(TCHAR) == 1 ? 1 : 3));
+
+	for (const auto & record : notify_info)
+	{
+		auto name = record.GetFileName();
+		_offsets.push_back(_strNames.size());
+		CUtf8Transcoder::AppendName(name.pszName, (size_t)name.nLength, _strNames);
+	}
+	_offsets.push_back(_strNames.size());
+}
+
+void CUtf8NameArena::Clear()
+{
+	// keeps the capacity
+	_strNames.clear();
+	_offsets.clear();
+}
+
+const char * CUtf8NameArena::GetName(size_t nIdx, OUT size_t & nLength) const
+{
+	ASSERT(nIdx < GetCount());
+
+	nLength = _offsets[nIdx + 1] - _offsets[nIdx];
+	return _strNames.data() + _offsets[nIdx];
+}
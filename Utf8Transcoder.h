@@ -0,0 +1,54 @@
+#pragma once
+#include "FileNotifyInformation.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+
+//
+//	UTF-16 -> UTF-8, for the std::string based consumers of the notifications
+//	(the include/exclude filters of CDelayedDirectoryChangeHandler).
+//
+//	File names are mostly ASCII, so runs of ASCII are converted 16 (AVX2) or 8 (SSE2)
+//	code units at a time, everything else one code point at a time.  The vector path
+//	is picked at compile time, builds w/o SSE2 get the scalar one only.
+//	Unpaired surrogates become U+FFFD.
+//
+class CUtf8Transcoder
+{
+public:
+	//	appends the conversion of pSrc[0..nLength) to strDest
+	static void		Append(const uint16_t * pSrc, size_t nLength, std::string & strDest);
+	static void		AppendScalar(const uint16_t * pSrc, size_t nLength, std::string & strDest);
+
+	//	a name w/ TCHARs: converted on Windows, copied as it is where TCHAR is already UTF-8
+	static void		AppendName(const char * pszName, size_t nLength, std::string & strDest);
+#ifdef _WIN32
+	static void		AppendName(const wchar_t * pszName, size_t nLength, std::string & strDest);
+#endif
+
+	static std::string	ToUtf8(const CString & str);
+
+private:
+	static size_t	_EncodeCodePoint(const uint16_t * pSrc, size_t nLength, char * pDest, OUT size_t & nWritten);
+};
+
+//
+//	The names of all the records in a read buffer, converted to UTF-8 in one pass
+//	and stored back to back in one string.  Assign() reuses the memory of the
+//	previous batch, so a busy watch stops allocating once the arena has grown to its load.
+//
+class CUtf8NameArena
+{
+public:
+	void	Assign(const CFileNotifyInformation & notify_info);
+	void	Clear();
+
+	size_t	GetCount() const { return _offsets.empty() ? 0 : _offsets.size() - 1; }
+	//	the nIdx'th record's name, NOT NUL terminated
+	const char *	GetName(size_t nIdx, OUT size_t & nLength) const;
+
+private:
+	std::string			_strNames;
+	std::vector<size_t>	_offsets;	//where each name starts, followed by the end of the last one
+};
@@ -5,6 +5,8 @@
 
 #pragma once
 
+#ifdef _WIN32
+
 #ifndef VC_EXTRALEAN
 #define VC_EXTRALEAN            // Exclude rarely-used stuff from Windows headers
 #endif
@@ -32,12 +34,18 @@
 #endif // _AFX_NO_AFXCMN_SUPPORT
 
 #include <afxcontrolbars.h>     // MFC support for ribbons and control bars
+#include <afxmt.h>              // CCriticalSection, CEvent
+
+#endif // _WIN32
 
+#include "PlatformCompat.h"
 
+#ifdef _WIN32
 #include "g3log/g3log.hpp"
 #include "g3log/logworker.hpp"
 
 extern std::unique_ptr<g3::LogWorker>	gLogWorker;
+#endif
 
 
 #ifdef _UNICODE
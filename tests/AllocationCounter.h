@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+
+//
+//	Counts the heap allocations of the whole process, by replacing the global operator new.
+//	The replacements are defined here: only one file of a test may include this.
+//	They're kept out of line, GCC takes an inlined free() for a mismatched delete otherwise.
+//
+static std::atomic<size_t>	g_nAllocations(0);
+
+inline size_t GetAllocationCount()
+{
+	return g_nAllocations.load(std::memory_order_relaxed);
+}
+
+__attribute__((noinline)) void * operator new(size_t nSize)
+{
+	g_nAllocations.fetch_add(1, std::memory_order_relaxed);
+	if (auto p = malloc(nSize != 0 ? nSize : 1))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void * operator new[](size_t nSize)
+{
+	return operator new(nSize);
+}
+
+__attribute__((noinline)) void operator delete(void * p) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void * p) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete(void * p, size_t) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void * p, size_t) noexcept
+{
+	free(p);
+}
@@ -0,0 +1,114 @@
+#include "TestSupport.h"
+#include "DirectoryChangeWatcher.h"
+#include "DirChangeStream.h"
+#include <atomic>
+
+
+//
+//	BACKPRESSURE_BLOCK holds up the watch whose handler is behind, and only that one.
+//
+//	Watch A is read by a stream that nobody takes anything from: after its first batch it stops
+//	reading.  Watch B, on the same worker thread, is still read and dispatched meanwhile.
+//	Once A's consumer catches up, A goes on where it stopped, w/ nothing lost or reordered.
+//
+
+class CCountingHandler : public CDirectoryChangeHandler
+{
+public:
+	CCountingHandler() : _nEvents(0) {}
+
+	void On_EventBatch(const CDirChangeEventBatch & batch) override
+	{
+		_nEvents.fetch_add(batch.size());
+	}
+
+	size_t GetEventCount() const { return _nEvents.load(); }
+
+private:
+	std::atomic<size_t>	_nEvents;
+};
+
+static std::string FileName(int i)
+{
+	char szName[32];
+	snprintf(szName, sizeof(szName), "file_%03d", i);
+	return szName;
+}
+
+//	the names that A's consumer takes, until there are nCount of them or it's waited for nTimeoutMs
+static std::vector<std::string> Take(CDirChangeStream * pStream, size_t nCount, DWORD dwTimeoutMs)
+{
+	std::vector<std::string> names;
+	std::vector<CDirChangeEvent> events;
+	while (names.size() < nCount && pStream->NextBatch(events, dwTimeoutMs) && !events.empty())
+	{
+		for (const auto & event : events)
+		{
+			std::string strName = (LPCTSTR)event.strFileName;
+			names.push_back(strName.substr(strName.rfind('/') + 1));
+		}
+	}
+	return names;
+}
+
+int main()
+{
+	enum { A_FILES = 20, B_FILES = 100 };
+
+	auto strDirA = MakeTestDirectory("block_a");
+	auto strDirB = MakeTestDirectory("block_b");
+
+	// one worker thread for both
+	auto pWatcher = std::make_shared<CDirectoryChangeWatcher>(false,
+		CDirectoryChangeWatcher::FILTERS_DEFAULT_BEHAVIOR | CDirectoryChangeWatcher::FILTERS_NO_WATCH_STARTSTOP_NOTIFICATION);
+	auto pStream = new CDirChangeStream();
+	pStream->AddRef();
+	auto pHandlerB = new CCountingHandler();
+	pHandlerB->AddRef();
+	CHECK(pWatcher->WatchDirectory(strDirA.c_str(), FILE_NOTIFY_CHANGE_FILE_NAME, pStream) == ERROR_SUCCESS);
+	CHECK(pWatcher->WatchDirectory(strDirB.c_str(), FILE_NOTIFY_CHANGE_FILE_NAME, pHandlerB) == ERROR_SUCCESS);
+	CHECK(pWatcher->SetBackpressurePolicy(strDirA.c_str(), CDirectoryChangeWatcher::BACKPRESSURE_BLOCK, 1));
+	CHECK(pWatcher->SetBackpressurePolicy(strDirB.c_str(), CDirectoryChangeWatcher::BACKPRESSURE_BLOCK, 1000));
+
+	// one read each, A is blocked after the second
+	CDirectoryChangeWatcher::CBackpressureStats stats;
+	for (int i = 0; i < A_FILES; ++i)
+	{
+		TouchFile(strDirA + "/" + FileName(i));
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	CHECK(WaitFor([&]() { return pWatcher->GetBackpressureStats(strDirA.c_str(), stats) && stats.ullBlockedPosts >= 1; }, 10000));
+	CHECK(stats.ullBlockedPosts == 1);
+	CHECK(stats.nQueuedEvents == 1);
+
+	// B isn't held up by A
+	for (int i = 0; i < B_FILES; ++i)
+	{
+		TouchFile(strDirB + "/" + FileName(i));
+	}
+	CHECK(WaitFor([pHandlerB]() { return pHandlerB->GetEventCount() == B_FILES; }, 10000));
+	CHECK(pWatcher->GetBackpressureStats(strDirB.c_str(), stats));
+	CHECK(stats.ullBlockedPosts == 0);
+
+	// A hasn't read any further
+	CHECK(pWatcher->GetBackpressureStats(strDirA.c_str(), stats));
+	CHECK(stats.ullBlockedPosts == 1);
+
+	// and goes on once its consumer catches up: all of them, in order
+	auto names = Take(pStream, A_FILES, 10000);
+	CHECK(names.size() == A_FILES);
+	for (int i = 0; i < A_FILES; ++i)
+	{
+		CHECK(names[i] == FileName(i));
+	}
+
+	// reading again
+	TouchFile(strDirA + "/" + FileName(A_FILES));
+	names = Take(pStream, 1, 10000);
+	CHECK(names.size() == 1 && names[0] == FileName(A_FILES));
+
+	pWatcher->UnWatchAllDirectory();
+	pStream->Release();
+	pHandlerB->Release();
+	return 0;
+}
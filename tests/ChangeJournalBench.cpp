@@ -0,0 +1,81 @@
+#include "TestSupport.h"
+#include "ChangeJournal.h"
+#include <algorithm>
+#include <sys/resource.h>
+
+
+//
+//	How long CChangeJournal::Append() takes, per batch, as the watcher's thread sees it: w/ 8 and
+//	32 events per batch, and segments of 4 and 64 MB (the rollovers, the spare segments being
+//	created and the syncs all happen while it's appending).
+//
+//	The appending thread isn't to wait for anything: its voluntary context switches stay at 0.
+//	The maximum is mostly preemption w/ fewer cores than threads (the journal's thread syncs meanwhile).
+//	Appending as fast as it can, it can outrun the disk: what's held back, and refused, is counted.
+//
+//	argv[1] is the number of batches.
+//
+
+typedef std::chrono::steady_clock	CClock;
+
+static void Run(size_t nEventsPerBatch, size_t nSegmentSize, size_t nBatches)
+{
+	auto strDir = MakeTestDirectory("journal_bench");
+	CChangeJournal journal;
+	CHECK(journal.Open(strDir.c_str(), nSegmentSize) == ERROR_SUCCESS);
+
+	std::vector<CDirChangeEvent> events;
+	for (size_t i = 0; i < nEventsPerBatch; ++i)
+	{
+		events.push_back(CDirChangeEvent{ FILE_ACTION_MODIFIED,
+			CString(("/home/user/projects/watched/src/module_" + std::to_string(i % 17) + "/file_" + std::to_string(i) + ".cpp").c_str()),
+			CString() });
+	}
+
+	// the thread's encoding buffer, and a first page fault, out of the way
+	CHECK(journal.Append(events));
+
+	std::vector<double> times;
+	times.reserve(nBatches);
+	struct rusage usage;
+	CHECK(getrusage(RUSAGE_THREAD, &usage) == 0);
+	auto nSwitches = usage.ru_nvcsw;
+	size_t nRefused = 0;
+	for (size_t i = 0; i < nBatches; ++i)
+	{
+		auto t0 = CClock::now();
+		nRefused += journal.Append(events) ? 0 : 1;
+		times.push_back(std::chrono::duration<double, std::micro>(CClock::now() - t0).count());
+	}
+	CHECK(getrusage(RUSAGE_THREAD, &usage) == 0);
+	nSwitches = usage.ru_nvcsw - nSwitches;
+
+	CHECK(journal.Flush());
+	CHECK(journal.GetDurableSequence() == journal.GetLastSequence());
+	CHECK(journal.GetLastSequence() == (nBatches + 1 - nRefused) * nEventsPerBatch);
+	auto stats = journal.GetStats();
+	CHECK(stats.ullRefusedBatches == nRefused);
+	journal.Close();
+
+	double dTotal = 0;
+	for (auto d : times)
+	{
+		dTotal += d;
+	}
+	std::sort(times.begin(), times.end());
+	printf("%2zu events/batch, %2zu MB segments: %6.2f us mean, %6.2f us p99, %8.1f us max, blocked %ld times | %llu batches held back (%zu KB at most), %zu refused\n",
+		nEventsPerBatch, nSegmentSize >> 20, dTotal / times.size(), times[times.size() * 99 / 100], times.back(), nSwitches,
+		(unsigned long long)stats.ullHeldBackBatches, stats.nHeldBackBytesPeak >> 10, nRefused);
+}
+
+int main(int argc, char * argv[])
+{
+	size_t nBatches = (argc > 1) ? (size_t)atoi(argv[1]) : 20000;
+	printf("%u cores\n", std::thread::hardware_concurrency());
+
+	Run(32, 64 << 20, nBatches);
+	Run(32, 4 << 20, nBatches);
+	Run(8, 64 << 20, nBatches);
+	Run(8, 4 << 20, nBatches);
+	return 0;
+}
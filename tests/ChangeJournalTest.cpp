@@ -0,0 +1,346 @@
+#include "TestSupport.h"
+#include "ChangeJournal.h"
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+
+
+//
+//	CChangeJournal/CChangeJournalReader: what's appended is read back in order, w/ contiguous sequence
+//	numbers, across reopening the journal, full segments, deleted ones and a torn last record.
+//
+
+typedef CChangeJournalReader::CRecord	CRecord;
+
+//	nCount changes from ullFirst on, named after their sequence numbers (every 5th one a rename)
+static std::vector<CDirChangeEvent> MakeEvents(uint64_t ullFirst, size_t nCount, size_t nNameLength = 0)
+{
+	std::vector<CDirChangeEvent> events;
+	for (uint64_t ullSequence = ullFirst; ullSequence < ullFirst + nCount; ++ullSequence)
+	{
+		auto strName = "/watched/dir/file_" + std::to_string(ullSequence);
+		strName.resize((std::max)(strName.size(), nNameLength), 'x');
+		if (ullSequence % 5 == 0)
+		{
+			events.push_back(CDirChangeEvent{ FILE_ACTION_RENAMED_OLD_NAME, CString(strName.c_str()), CString((strName + ".new").c_str()) });
+		}
+		else
+		{
+			events.push_back(CDirChangeEvent{ FILE_ACTION_MODIFIED, CString(strName.c_str()), CString() });
+		}
+	}
+	return events;
+}
+
+static void CheckEvent(const CDirChangeEvent& event, uint64_t ullSequence)
+{
+	auto strName = "/watched/dir/file_" + std::to_string(ullSequence);
+	CHECK(strncmp((LPCTSTR)event.strFileName, strName.c_str(), strName.size()) == 0);
+	CHECK(event.dwAction == ((ullSequence % 5 == 0) ? (DWORD)FILE_ACTION_RENAMED_OLD_NAME : (DWORD)FILE_ACTION_MODIFIED));
+	CHECK(event.strNewFileName.IsEmpty() == (ullSequence % 5 != 0));
+}
+
+//	what's left of the journal, checked to be contiguous from its first record on
+static std::vector<CRecord> ReadAll(const std::string& strDir)
+{
+	CChangeJournalReader reader;
+	CHECK(reader.Open(strDir.c_str()) == ERROR_SUCCESS);
+
+	std::vector<CRecord> records;
+	CRecord record;
+	while (reader.Next(record))
+	{
+		CHECK(!record.events.empty());
+		if (!records.empty())
+		{
+			CHECK(record.ullFirstSequence == records.back().ullFirstSequence + records.back().events.size());
+			CHECK(record.ullTimestamp >= records.back().ullTimestamp);
+		}
+		for (size_t i = 0; i < record.events.size(); ++i)
+		{
+			CheckEvent(record.events[i], record.ullFirstSequence + i);
+		}
+		records.push_back(std::move(record));
+	}
+	return records;
+}
+
+static uint64_t LastSequence(const std::vector<CRecord>& records)
+{
+	return records.empty() ? 0 : records.back().ullFirstSequence + records.back().events.size() - 1;
+}
+
+//	the paths of the segment files, in order
+static std::vector<std::string> ListSegments(const std::string& strDir)
+{
+	std::vector<std::string> paths;
+	auto pDir = opendir(strDir.c_str());
+	CHECK(pDir != nullptr);
+	while (auto pEntry = readdir(pDir))
+	{
+		std::string strName = pEntry->d_name;
+		if (strName.size() > 4 && strName.compare(strName.size() - 4, 4, JOURNAL_SEGMENT_EXT) == 0)
+		{
+			paths.push_back(strDir + "/" + strName);
+		}
+	}
+	closedir(pDir);
+	std::sort(paths.begin(), paths.end());
+	return paths;
+}
+
+static void TestAppendAndReopen()
+{
+	auto strDir = MakeTestDirectory("journal_reopen");
+	uint64_t ullNext = 1;
+	{
+		CChangeJournal journal;
+		CHECK(journal.Open(strDir.c_str(), CChangeJournal::SEGMENT_SIZE_MIN) == ERROR_SUCCESS);
+		CHECK(journal.GetLastSequence() == 0);
+		for (size_t nCount = 1; nCount <= 20; ++nCount)
+		{
+			CHECK(journal.Append(MakeEvents(ullNext, nCount)));
+			ullNext += nCount;
+		}
+		CHECK(journal.Append(std::vector<CDirChangeEvent>()));
+		CHECK(journal.GetLastSequence() == ullNext - 1);
+		CHECK(journal.Flush());
+		CHECK(journal.GetDurableSequence() == ullNext - 1);
+	}
+
+	auto records = ReadAll(strDir);
+	CHECK(records.size() == 20);
+	CHECK(records.front().ullFirstSequence == 1);
+	CHECK(LastSequence(records) == ullNext - 1);
+
+	// on from where it was
+	{
+		CChangeJournal journal;
+		CHECK(journal.Open(strDir.c_str(), CChangeJournal::SEGMENT_SIZE_MIN) == ERROR_SUCCESS);
+		CHECK(journal.GetLastSequence() == ullNext - 1);
+		CHECK(journal.GetDurableSequence() == ullNext - 1);
+		CHECK(journal.Append(MakeEvents(ullNext, 7)));
+		ullNext += 7;
+	}
+
+	records = ReadAll(strDir);
+	CHECK(records.size() == 21);
+	CHECK(LastSequence(records) == ullNext - 1);
+}
+
+static void TestSeek()
+{
+	auto strDir = MakeTestDirectory("journal_seek");
+	CChangeJournal journal;
+	CHECK(journal.Open(strDir.c_str(), CChangeJournal::SEGMENT_SIZE_MIN) == ERROR_SUCCESS);
+
+	// enough records for the index, a few of them w/ the same time
+	uint64_t ullNext = 1;
+	for (int i = 0; i < 2000; ++i)
+	{
+		CHECK(journal.Append(MakeEvents(ullNext, 4)));
+		ullNext += 4;
+		if (i % 100 == 0)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		}
+	}
+	CHECK(journal.Flush());
+	auto records = ReadAll(strDir);
+	CHECK(records.size() == 2000);
+
+	CChangeJournalReader reader;
+	CHECK(reader.Open(strDir.c_str()) == ERROR_SUCCESS);
+	CRecord record;
+
+	// to the start of a record, and into one: the changes before it are left out
+	CHECK(reader.SeekToSequence(4001));
+	CHECK(reader.Next(record));
+	CHECK(record.ullFirstSequence == 4001 && record.events.size() == 4);
+	CheckEvent(record.events[0], 4001);
+	CHECK(reader.SeekToSequence(4003));
+	CHECK(reader.Next(record));
+	CHECK(record.ullFirstSequence == 4003 && record.events.size() == 2);
+	CheckEvent(record.events[0], 4003);
+	CHECK(reader.Next(record));
+	CHECK(record.ullFirstSequence == 4005);
+	CHECK(reader.SeekToSequence(1));
+	CHECK(reader.Next(record));
+	CHECK(record.ullFirstSequence == 1);
+
+	// beyond the end: picked up from there once it's been appended
+	CHECK(!reader.SeekToSequence(ullNext + 2));
+	CHECK(!reader.Next(record));
+	CHECK(journal.Append(MakeEvents(ullNext, 4)));
+	ullNext += 4;
+	CHECK(journal.Flush());
+	CHECK(reader.Next(record));
+	CHECK(record.ullFirstSequence == ullNext - 2 && record.events.size() == 2);
+	CHECK(!reader.Next(record));
+
+	// the first record at or after the time
+	for (size_t nIdx : { (size_t)0, (size_t)1, (size_t)777, (size_t)1500, records.size() - 1 })
+	{
+		auto ullTimestamp = records[nIdx].ullTimestamp;
+		size_t nFirst = nIdx;
+		while (nFirst > 0 && records[nFirst - 1].ullTimestamp >= ullTimestamp)
+		{
+			--nFirst;
+		}
+		CHECK(reader.SeekToTime(ullTimestamp));
+		CHECK(reader.Next(record));
+		CHECK(record.ullFirstSequence == records[nFirst].ullFirstSequence);
+		CHECK(record.events.size() == 4);
+	}
+	CHECK(reader.SeekToTime(0));
+	CHECK(reader.Next(record));
+	CHECK(record.ullFirstSequence == 1);
+	CHECK(!reader.SeekToTime(records.back().ullTimestamp + 60ULL * 1000 * 1000 * 1000));
+}
+
+//	past nMaxSegments, the oldest segments are deleted: the journal starts later, and is still contiguous
+static void TestMaxSegments()
+{
+	auto strDir = MakeTestDirectory("journal_rotation");
+	CChangeJournal journal;
+	CHECK(journal.Open(strDir.c_str(), CChangeJournal::SEGMENT_SIZE_MIN, CChangeJournal::SYNC_INTERVAL_MS_DEFAULT, 2) == ERROR_SUCCESS);
+
+	// about 6 segments' worth, flushed every half a segment so that the spare one's always there
+	uint64_t ullNext = 1;
+	for (int i = 0; i < 1200; ++i)
+	{
+		CHECK(journal.Append(MakeEvents(ullNext, 64, 80)));
+		ullNext += 64;
+		if (i % 50 == 49)
+		{
+			CHECK(journal.Flush());
+		}
+	}
+	CHECK(journal.Flush());
+	auto stats = journal.GetStats();
+	CHECK(stats.ullBatches == 1200 && stats.ullRefusedBatches == 0);
+
+	// the 2 most recent ones, and the spare one
+	CHECK(WaitFor([&strDir] { return ListSegments(strDir).size() <= 3; }, 10000));
+	auto records = ReadAll(strDir);
+	CHECK(!records.empty());
+	CHECK(records.front().ullFirstSequence > 1);
+	CHECK(LastSequence(records) == ullNext - 1);
+
+	// the oldest that's left
+	CChangeJournalReader reader;
+	CHECK(reader.Open(strDir.c_str()) == ERROR_SUCCESS);
+	CRecord record;
+	CHECK(reader.SeekToSequence(1));
+	CHECK(reader.Next(record));
+	CHECK(record.ullFirstSequence == records.front().ullFirstSequence);
+}
+
+//	a crash while the last record was being written: the journal ends before it, and goes on from there
+static void TestTornRecord()
+{
+	auto strDir = MakeTestDirectory("journal_torn");
+	uint64_t ullNext = 1;
+	{
+		CChangeJournal journal;
+		CHECK(journal.Open(strDir.c_str(), CChangeJournal::SEGMENT_SIZE_MIN) == ERROR_SUCCESS);
+		for (int i = 0; i < 10; ++i)
+		{
+			CHECK(journal.Append(MakeEvents(ullNext, 3)));
+			ullNext += 3;
+		}
+	}
+	CHECK(ReadAll(strDir).size() == 10);
+
+	// the segment that's been started (the other one's the spare): a byte of its last record's names
+	std::string strSegment;
+	for (const auto & strPath : ListSegments(strDir))
+	{
+		int fd = open(strPath.c_str(), O_RDONLY);
+		CHECK(fd >= 0);
+		uint64_t ullFirstSequence = 0;
+		CHECK(pread(fd, &ullFirstSequence, sizeof(ullFirstSequence), 24) == sizeof(ullFirstSequence));
+		close(fd);
+		if (ullFirstSequence != 0)
+		{
+			strSegment = strPath;
+		}
+	}
+	CHECK(!strSegment.empty());
+
+	int fd = open(strSegment.c_str(), O_RDWR);
+	CHECK(fd >= 0);
+	const off_t nRecords = 64 * 1024;
+	off_t nOffset = nRecords;
+	off_t nLast = 0;
+	for (;;)
+	{
+		uint32_t dwLength = 0;
+		CHECK(pread(fd, &dwLength, sizeof(dwLength), nOffset) == sizeof(dwLength));
+		if (dwLength == 0)
+		{
+			break;
+		}
+		nLast = nOffset;
+		nOffset += dwLength;
+	}
+	CHECK(nLast > nRecords);
+	char ch = 0;
+	CHECK(pread(fd, &ch, 1, nLast + 40) == 1);
+	ch ^= 0x55;
+	CHECK(pwrite(fd, &ch, 1, nLast + 40) == 1);
+	close(fd);
+
+	auto records = ReadAll(strDir);
+	CHECK(records.size() == 9);
+	ullNext -= 3;
+	CHECK(LastSequence(records) == ullNext - 1);
+
+	{
+		CChangeJournal journal;
+		CHECK(journal.Open(strDir.c_str(), CChangeJournal::SEGMENT_SIZE_MIN) == ERROR_SUCCESS);
+		CHECK(journal.GetLastSequence() == ullNext - 1);
+		CHECK(journal.Append(MakeEvents(ullNext, 2)));
+		ullNext += 2;
+	}
+
+	records = ReadAll(strDir);
+	CHECK(records.size() == 10);
+	CHECK(records.back().events.size() == 2);
+	CHECK(LastSequence(records) == ullNext - 1);
+}
+
+//	a batch that's larger than a segment goes on in the next one(s)
+static void TestLargeBatch()
+{
+	auto strDir = MakeTestDirectory("journal_large");
+	CChangeJournal journal;
+	CHECK(journal.Open(strDir.c_str(), CChangeJournal::SEGMENT_SIZE_MIN) == ERROR_SUCCESS);
+	CHECK(journal.Append(MakeEvents(1, 10)));
+	CHECK(journal.Flush());
+
+	// about 1.5 segments
+	CHECK(journal.Append(MakeEvents(11, 12000, 120)));
+	CHECK(journal.Flush());
+	CHECK(journal.GetLastSequence() == 12010);
+	CHECK(journal.GetStats().ullRefusedBatches == 0);
+	CHECK(journal.Append(MakeEvents(12011, 5)));
+	CHECK(journal.Flush());
+
+	auto records = ReadAll(strDir);
+	CHECK(records.size() >= 4);
+	CHECK(records.front().ullFirstSequence == 1);
+	CHECK(LastSequence(records) == 12015);
+	CHECK(records.back().ullFirstSequence == 12011);
+	CHECK(ListSegments(strDir).size() >= 2);
+}
+
+int main()
+{
+	TestAppendAndReopen();
+	TestSeek();
+	TestMaxSegments();
+	TestTornRecord();
+	TestLargeBatch();
+	return 0;
+}
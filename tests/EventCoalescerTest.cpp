@@ -0,0 +1,167 @@
+#include "TestSupport.h"
+#include "EventCoalescer.h"
+#include <algorithm>
+
+
+//
+//	What CEventCoalescer folds the changes to a path into, and what it leaves alone.
+//	Every case is one window: the events in, what's handed over and how many were folded away
+//	(in == out + folded, always).
+//
+
+static CDirChangeEvent Event(DWORD dwAction, const char * pszName, const char * pszNewName = "")
+{
+	return CDirChangeEvent{ dwAction, CString(pszName), CString(pszNewName) };
+}
+
+static bool Same(const CDirChangeEvent & a, const CDirChangeEvent & b)
+{
+	return a.dwAction == b.dwAction
+		&& a.strFileName == b.strFileName
+		&& (a.dwAction != FILE_ACTION_RENAMED_OLD_NAME || a.strNewFileName == b.strNewFileName);
+}
+
+//	folds in, one event per batch (or all in one batch), checks what comes out and the count
+static void Check(const char * pszCase, const std::vector<CDirChangeEvent>& in, const std::vector<CDirChangeEvent>& expected)
+{
+	for (bool bOneBatch : { false, true })
+	{
+		CEventCoalescer coalescer(1000);
+		size_t nFolded = 0;
+		if (bOneBatch)
+		{
+			auto events = in;
+			nFolded = coalescer.Add(std::move(events));
+			CHECK(events.empty());
+		}
+		else
+		{
+			for (const auto & event : in)
+			{
+				nFolded += coalescer.Add(std::vector<CDirChangeEvent>{ event });
+			}
+		}
+
+		std::vector<CDirChangeEvent> out;
+		coalescer.TakePending(out);
+		if (out.size() != expected.size()
+			|| !std::equal(out.begin(), out.end(), expected.begin(), Same))
+		{
+			fprintf(stderr, "%s:\n", pszCase);
+			for (const auto & event : out)
+			{
+				fprintf(stderr, "\t%#x %s %s\n", (unsigned)event.dwAction, (LPCTSTR)event.strFileName, (LPCTSTR)event.strNewFileName);
+			}
+		}
+		CHECK(out.size() == expected.size());
+		CHECK(std::equal(out.begin(), out.end(), expected.begin(), Same));
+		CHECK(nFolded == in.size() - out.size());
+		CHECK(!coalescer.HasPending());
+	}
+}
+
+int main()
+{
+	const DWORD ADDED = FILE_ACTION_ADDED, REMOVED = FILE_ACTION_REMOVED, MODIFIED = FILE_ACTION_MODIFIED,
+		RENAMED = FILE_ACTION_RENAMED_OLD_NAME, QUIESCENT = FILE_ACTION_QUIESCENT;
+
+	Check("added, removed",
+		{ Event(ADDED, "/w/a"), Event(MODIFIED, "/w/a"), Event(REMOVED, "/w/a") },
+		{});
+	Check("added, modified",
+		{ Event(ADDED, "/w/a"), Event(MODIFIED, "/w/a"), Event(MODIFIED, "/w/a") },
+		{ Event(ADDED, "/w/a") });
+	Check("modified x 5",
+		{ Event(MODIFIED, "/w/a"), Event(MODIFIED, "/w/a"), Event(MODIFIED, "/w/a"), Event(MODIFIED, "/w/a"), Event(MODIFIED, "/w/a") },
+		{ Event(MODIFIED, "/w/a") });
+	Check("modified, removed",
+		{ Event(MODIFIED, "/w/a"), Event(MODIFIED, "/w/a"), Event(REMOVED, "/w/a") },
+		{ Event(REMOVED, "/w/a") });
+	Check("removed, added",
+		{ Event(REMOVED, "/w/a"), Event(ADDED, "/w/a") },
+		{ Event(MODIFIED, "/w/a") });
+	Check("other paths keep their order",
+		{ Event(MODIFIED, "/w/a"), Event(ADDED, "/w/b"), Event(MODIFIED, "/w/a"), Event(REMOVED, "/w/c"), Event(MODIFIED, "/w/b") },
+		{ Event(MODIFIED, "/w/a"), Event(ADDED, "/w/b"), Event(REMOVED, "/w/c") });
+
+	// renames
+	Check("added, renamed",
+		{ Event(ADDED, "/w/a"), Event(RENAMED, "/w/a", "/w/b") },
+		{ Event(ADDED, "/w/b") });
+	Check("added, renamed, renamed",
+		{ Event(ADDED, "/w/a"), Event(RENAMED, "/w/a", "/w/b"), Event(RENAMED, "/w/b", "/w/c"), Event(MODIFIED, "/w/c") },
+		{ Event(ADDED, "/w/c") });
+	Check("renamed, renamed",
+		{ Event(RENAMED, "/w/a", "/w/b"), Event(RENAMED, "/w/b", "/w/c") },
+		{ Event(RENAMED, "/w/a", "/w/b"), Event(RENAMED, "/w/b", "/w/c") });
+	Check("renamed over an added file",
+		{ Event(ADDED, "/w/b"), Event(RENAMED, "/w/a", "/w/b") },
+		{ Event(RENAMED, "/w/a", "/w/b") });
+	Check("added, renamed, removed",
+		{ Event(ADDED, "/w/a"), Event(RENAMED, "/w/a", "/w/b"), Event(REMOVED, "/w/b") },
+		{});
+
+	// a rename that's undone: what was held back for the old name is its last event again
+	Check("renamed, removed",
+		{ Event(RENAMED, "/w/a", "/w/b"), Event(REMOVED, "/w/b") },
+		{ Event(REMOVED, "/w/a") });
+	Check("modified, renamed, removed",
+		{ Event(MODIFIED, "/w/a"), Event(RENAMED, "/w/a", "/w/b"), Event(REMOVED, "/w/b") },
+		{ Event(REMOVED, "/w/a") });
+	Check("modified, renamed, renamed back, removed",
+		{ Event(MODIFIED, "/w/a"), Event(RENAMED, "/w/a", "/w/b"), Event(RENAMED, "/w/b", "/w/a"), Event(REMOVED, "/w/a") },
+		{ Event(REMOVED, "/w/a") });
+	Check("removed, renamed, removed",
+		{ Event(REMOVED, "/w/a"), Event(RENAMED, "/w/c", "/w/b"), Event(REMOVED, "/w/b") },
+		{ Event(REMOVED, "/w/a"), Event(REMOVED, "/w/c") });
+
+	// the settle timer's FILE_ACTION_QUIESCENT in the middle of a window: never folded, and the
+	// file's changes aren't folded across it (they'd move from before it to after it, or the other way)
+	Check("modified, quiescent, modified",
+		{ Event(MODIFIED, "/w/a"), Event(MODIFIED, "/w/a"), Event(QUIESCENT, "/w/a"), Event(MODIFIED, "/w/a"), Event(MODIFIED, "/w/a") },
+		{ Event(MODIFIED, "/w/a"), Event(QUIESCENT, "/w/a"), Event(MODIFIED, "/w/a") });
+	Check("added, quiescent, removed",
+		{ Event(ADDED, "/w/a"), Event(QUIESCENT, "/w/a"), Event(REMOVED, "/w/a") },
+		{ Event(ADDED, "/w/a"), Event(QUIESCENT, "/w/a"), Event(REMOVED, "/w/a") });
+	Check("quiescent, renamed away, removed",
+		{ Event(QUIESCENT, "/w/a"), Event(RENAMED, "/w/a", "/w/b"), Event(REMOVED, "/w/b") },
+		{ Event(QUIESCENT, "/w/a"), Event(REMOVED, "/w/a") });
+
+	// the windows
+	{
+		CEventCoalescer coalescer(100);
+		CHECK(!coalescer.HasPending());
+		CHECK(!coalescer.IsFlushDue(std::chrono::steady_clock::now()));
+
+		auto tBefore = std::chrono::steady_clock::now();
+		CHECK(coalescer.Add({ Event(ADDED, "/w/a"), Event(REMOVED, "/w/a") }) == 2);
+		CHECK(!coalescer.HasPending());
+
+		// the window starts w/ the first change that's held back
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		CHECK(coalescer.Add({ Event(MODIFIED, "/w/a") }) == 0);
+		CHECK(coalescer.GetFlushTime() >= tBefore + std::chrono::milliseconds(120));
+		CHECK(!coalescer.IsFlushDue(coalescer.GetFlushTime() - std::chrono::milliseconds(1)));
+		CHECK(coalescer.IsFlushDue(coalescer.GetFlushTime()));
+
+		std::vector<CDirChangeEvent> out;
+		coalescer.TakePending(out);
+		CHECK(out.size() == 1 && !coalescer.HasPending());
+
+		// cut short once it's holding MAX_PENDING_EVENTS
+		std::vector<CDirChangeEvent> events;
+		for (int i = 0; i < CEventCoalescer::MAX_PENDING_EVENTS; ++i)
+		{
+			events.push_back(Event(MODIFIED, ("/w/file_" + std::to_string(i)).c_str()));
+		}
+		CHECK(coalescer.Add(std::move(events)) == 0);
+		CHECK(coalescer.IsFlushDue(std::chrono::steady_clock::now()));
+	}
+	{
+		// each batch on its own
+		CEventCoalescer coalescer(0);
+		CHECK(coalescer.Add({ Event(MODIFIED, "/w/a"), Event(MODIFIED, "/w/a") }) == 1);
+		CHECK(coalescer.IsFlushDue(std::chrono::steady_clock::now()));
+	}
+	return 0;
+}
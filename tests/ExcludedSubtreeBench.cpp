@@ -0,0 +1,130 @@
+#include "TestSupport.h"
+#include "DirectoryChangeWatcher.h"
+#include <atomic>
+#include <sys/resource.h>
+
+
+//
+//	A build-output storm: nFiles written below build/ (excluded) while a few source files change.
+//
+//	"handler filter" is what the exclusion cost before the filters could drop whole subtrees:
+//	build/ is watched, its changes read, translated and queued, and thrown away only when they're
+//	dispatched (by the handler's On_FilterNotification(), which can't keep a subtree from being watched).
+//	"exclude filter" is "build/*" w/ FILTERS_CHECK_PARTIAL_PATH: build/ isn't watched at all.
+//
+//	The CPU time is the watcher's: the process's, less the thread that writes the files.
+//
+//	argv[1] is the number of files.
+//
+
+static double CpuSeconds(int nWho)
+{
+	struct rusage usage;
+	CHECK(getrusage(nWho, &usage) == 0);
+	return (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+		+ (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+class CSourceHandler : public CDirectoryChangeHandler
+{
+public:
+	explicit CSourceHandler(bool bFilterBuild) : _bFilterBuild(bFilterBuild), _nFiltered(0), _nSourceEvents(0), _nBuildEvents(0) {}
+
+	bool On_FilterNotification(DWORD, LPCTSTR szFileName, LPCTSTR) override
+	{
+		_nFiltered.fetch_add(1);
+		return !(_bFilterBuild && strstr(szFileName, "/build/") != nullptr);
+	}
+
+	void On_EventBatch(const CDirChangeEventBatch & batch) override
+	{
+		for (const auto & event : batch)
+		{
+			if (strstr((LPCTSTR)event.strFileName, "/build/") != nullptr)
+			{
+				_nBuildEvents.fetch_add(1);
+			}
+			else if (strstr((LPCTSTR)event.strFileName, "/src/") != nullptr)
+			{
+				_nSourceEvents.fetch_add(1);
+			}
+		}
+	}
+
+	size_t GetActivity() const { return _nFiltered.load() + _nSourceEvents.load() + _nBuildEvents.load(); }
+	size_t GetFilteredCount() const { return _nFiltered.load(); }
+	size_t GetSourceEventCount() const { return _nSourceEvents.load(); }
+	size_t GetBuildEventCount() const { return _nBuildEvents.load(); }
+
+private:
+	bool	_bFilterBuild;
+	std::atomic<size_t>	_nFiltered;
+	std::atomic<size_t>	_nSourceEvents;
+	std::atomic<size_t>	_nBuildEvents;
+};
+
+static void Run(const char * pszName, bool bExcludeFilter, int nFiles)
+{
+	enum { BUILD_DIRS = 20, SOURCE_FILES = 100 };
+
+	auto strDir = MakeTestDirectory("excluded_subtree");
+	CHECK(mkdir((strDir + "/src").c_str(), 0755) == 0);
+	CHECK(mkdir((strDir + "/build").c_str(), 0755) == 0);
+	for (int i = 0; i < BUILD_DIRS; ++i)
+	{
+		CHECK(mkdir((strDir + "/build/obj" + std::to_string(i)).c_str(), 0755) == 0);
+	}
+
+	auto pWatcher = std::make_shared<CDirectoryChangeWatcher>(false,
+		CDirectoryChangeWatcher::FILTERS_CHECK_PARTIAL_PATH | CDirectoryChangeWatcher::FILTERS_NO_WATCH_STARTSTOP_NOTIFICATION);
+	auto pHandler = new CSourceHandler(!bExcludeFilter);
+	pHandler->AddRef();
+	CHECK(pWatcher->WatchDirectory(strDir.c_str(),
+		FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE,
+		pHandler, TRUE, std::string(), bExcludeFilter ? "build/*" : std::string()) == ERROR_SUCCESS);
+
+	auto dProcess = CpuSeconds(RUSAGE_SELF);
+	auto dWriter = CpuSeconds(RUSAGE_THREAD);
+	for (int i = 0; i < nFiles; ++i)
+	{
+		auto pFile = fopen((strDir + "/build/obj" + std::to_string(i % BUILD_DIRS) + "/unit_" + std::to_string(i) + ".o").c_str(), "w");
+		CHECK(pFile != nullptr);
+		fputs("object code", pFile);
+		fclose(pFile);
+
+		if (i % (nFiles / SOURCE_FILES) == 0)
+		{
+			TouchFile(strDir + "/src/source_" + std::to_string(i) + ".cpp");
+		}
+	}
+	dWriter = CpuSeconds(RUSAGE_THREAD) - dWriter;
+
+	// until the watcher has been idle for a while
+	size_t nActivity = (size_t)-1;
+	for (int nQuiet = 0; nQuiet < 3;)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		auto nNow = pHandler->GetActivity();
+		nQuiet = (nNow == nActivity) ? nQuiet + 1 : 0;
+		nActivity = nNow;
+	}
+	auto dWatcher = CpuSeconds(RUSAGE_SELF) - dProcess - dWriter;
+
+	printf("%-15s %d files below build/: watcher CPU %7.1f ms (%.2f us/file), %6zu changes filtered at dispatch, %zu source changes\n",
+		pszName, nFiles, dWatcher * 1e3, dWatcher * 1e6 / nFiles,
+		pHandler->GetFilteredCount(), pHandler->GetSourceEventCount());
+	CHECK(pHandler->GetSourceEventCount() >= SOURCE_FILES);
+	CHECK(pHandler->GetBuildEventCount() == 0);
+
+	pWatcher->UnWatchAllDirectory();
+	pHandler->Release();
+}
+
+int main(int argc, char * argv[])
+{
+	int nFiles = (argc > 1) ? atoi(argv[1]) : 10000;
+
+	Run("handler filter", false, nFiles);
+	Run("exclude filter", true, nFiles);
+	return 0;
+}
@@ -0,0 +1,168 @@
+#include "TestSupport.h"
+#include "FilterSpecMatcher.h"
+#include <cctype>
+#include <random>
+
+
+//
+//	The compiled matcher against the specs tested one at a time w/ a backtracking wildcard match
+//	(wildcmp(), what the handler fell back on w/o PathMatchSpec()), for 10 and 1000 specs.
+//	Both have to agree on every path, so it runs as a test too.
+//
+//	argv[1] is the number of rounds, argv[2] the number of paths.
+//
+
+typedef std::chrono::steady_clock	CClock;
+
+//	case insensitive (ASCII), '*' and '?', "*.*" matches everything: the same semantics as the matcher's
+static bool WildCmp(const char * pszWild, const char * pszString)
+{
+	if (strcmp(pszWild, "*.*") == 0)
+	{
+		return true;
+	}
+
+	const char * pszMp = nullptr;
+	const char * pszCp = nullptr;
+	while (*pszString && *pszWild != '*')
+	{
+		if (tolower((unsigned char)*pszWild) != tolower((unsigned char)*pszString) && *pszWild != '?')
+		{
+			return false;
+		}
+		++pszWild;
+		++pszString;
+	}
+	while (*pszString)
+	{
+		if (*pszWild == '*')
+		{
+			if (!*++pszWild)
+			{
+				return true;
+			}
+			pszMp = pszWild;
+			pszCp = pszString + 1;
+		}
+		else if (tolower((unsigned char)*pszWild) == tolower((unsigned char)*pszString) || *pszWild == '?')
+		{
+			++pszWild;
+			++pszString;
+		}
+		else
+		{
+			pszWild = pszMp;
+			pszString = pszCp++;
+		}
+	}
+	while (*pszWild == '*')
+	{
+		++pszWild;
+	}
+	return !*pszWild;
+}
+
+//	extensions, directories, name prefixes and names w/ a '?' in them, in turn
+static std::vector<std::string> MakeSpecs(size_t nCount)
+{
+	std::vector<std::string> specs;
+	for (size_t i = 0; i < nCount; ++i)
+	{
+		auto strN = std::to_string(i);
+		switch (i % 4)
+		{
+		case 0: specs.push_back("*.ext" + strN); break;
+		case 1: specs.push_back("*/dir_" + strN + "/*"); break;
+		case 2: specs.push_back("prefix_" + strN + "*"); break;
+		default: specs.push_back("*name?" + strN + ".log"); break;
+		}
+	}
+	return specs;
+}
+
+//	"src/dir_12/module_3/file_4567.ext89"-like, some of them matched by the specs
+static std::vector<std::string> MakePaths(size_t nCount)
+{
+	std::mt19937 rng(4321);
+	std::uniform_int_distribution<int> number(0, 1999);
+	std::uniform_int_distribution<int> kind(0, 9);
+
+	std::vector<std::string> paths;
+	for (size_t i = 0; i < nCount; ++i)
+	{
+		std::string strPath = "src/dir_" + std::to_string(number(rng)) + "/module_" + std::to_string(number(rng) % 50) + "/";
+		switch (kind(rng))
+		{
+		case 0: strPath = "prefix_" + std::to_string(number(rng)) + "/readme.txt"; break;
+		case 1: strPath += "name_" + std::to_string(number(rng)) + ".log"; break;
+		default: strPath += "file_" + std::to_string(number(rng)) + ".ext" + std::to_string(number(rng)); break;
+		}
+		paths.push_back(strPath);
+	}
+	return paths;
+}
+
+static void Run(size_t nSpecs, int nRounds, size_t nPaths)
+{
+	auto specs = MakeSpecs(nSpecs);
+	auto paths = MakePaths(nPaths);
+
+	CFilterSpecMatcher matcher;
+	matcher.Compile(specs);
+
+	auto matchLoop = [&specs](const std::string& strPath)
+	{
+		for (const auto & strSpec : specs)
+		{
+			if (WildCmp(strSpec.c_str(), strPath.c_str()))
+			{
+				return true;
+			}
+		}
+		return false;
+	};
+
+	size_t nMatched = 0;
+	for (const auto & strPath : paths)
+	{
+		bool bMatched = matcher.Matches(strPath);
+		CHECK(bMatched == matchLoop(strPath));
+		nMatched += bMatched ? 1 : 0;
+	}
+
+	CClock::duration compiled{}, loop{};
+	size_t nCompiledMatches = 0, nLoopMatches = 0;
+	for (int i = 0; i < nRounds; ++i)
+	{
+		auto t0 = CClock::now();
+		for (const auto & strPath : paths)
+		{
+			nCompiledMatches += matcher.Matches(strPath) ? 1 : 0;
+		}
+		auto t1 = CClock::now();
+		for (const auto & strPath : paths)
+		{
+			nLoopMatches += matchLoop(strPath) ? 1 : 0;
+		}
+		compiled += t1 - t0;
+		loop += CClock::now() - t1;
+	}
+	CHECK(nCompiledMatches == nLoopMatches);
+
+	auto nsPerPath = [&paths, nRounds](CClock::duration elapsed)
+	{
+		return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / (double)(paths.size() * nRounds);
+	};
+	printf("%4zu specs, %zu of %zu paths matched: compiled %8.1f ns/path, one spec at a time %9.1f ns/path (x%.1f)\n",
+		nSpecs, nMatched, paths.size(), nsPerPath(compiled), nsPerPath(loop), nsPerPath(loop) / nsPerPath(compiled));
+}
+
+int main(int argc, char * argv[])
+{
+	int nRounds = (argc > 1) ? atoi(argv[1]) : 1;
+	size_t nPaths = (argc > 2) ? (size_t)atoi(argv[2]) : 2000;
+
+	Run(10, nRounds, nPaths);
+	Run(1000, nRounds, nPaths);
+	return 0;
+}
@@ -0,0 +1,113 @@
+#include "TestSupport.h"
+#include "DirectoryChangeWatcher.h"
+#include <mutex>
+#include <set>
+#include <tuple>
+
+
+//
+//	The include/exclude filters: checked on the UTF-8 names of the read before the changes are posted,
+//	or when they're dispatched w/ FILTERS_TEST_HANDLER_FIRST.  Either way the handler gets the same changes.
+//
+
+typedef std::set<std::tuple<DWORD, std::string, std::string>>	CChanges;
+
+class CRecordingHandler : public CDirectoryChangeHandler
+{
+public:
+	explicit CRecordingHandler(const std::string& strDir) : _strPrefix(strDir + "/") {}
+
+	void On_EventBatch(const CDirChangeEventBatch & batch) override
+	{
+		std::lock_guard<std::mutex> lk(_mut);
+		for (const auto & event : batch)
+		{
+			_changes.emplace(event.dwAction, _Rel(event.strFileName), _Rel(event.strNewFileName));
+		}
+	}
+
+	CChanges GetChanges()
+	{
+		std::lock_guard<std::mutex> lk(_mut);
+		return _changes;
+	}
+
+	bool Has(DWORD dwAction, const std::string& strName)
+	{
+		std::lock_guard<std::mutex> lk(_mut);
+		for (const auto & change : _changes)
+		{
+			if (std::get<0>(change) == dwAction && std::get<1>(change) == strName)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	std::string _Rel(const CString& strName) const
+	{
+		std::string str((LPCTSTR)strName);
+		return str.compare(0, _strPrefix.size(), _strPrefix) == 0 ? str.substr(_strPrefix.size()) : str;
+	}
+
+	std::string	_strPrefix;
+	std::mutex	_mut;
+	CChanges	_changes;
+};
+
+static CChanges Watch(const char * pszName, DWORD dwFilterFlags, const std::string& strInclude, const std::string& strExclude)
+{
+	auto strDir = MakeTestDirectory(pszName);
+	CHECK(mkdir((strDir + "/sub").c_str(), 0755) == 0);
+	CHECK(mkdir((strDir + "/skip").c_str(), 0755) == 0);
+	TouchFile(strDir + "/renamed_out.txt");
+	TouchFile(strDir + "/renamed_in.log");
+	TouchFile(strDir + "/neither.log");
+
+	auto pWatcher = std::make_shared<CDirectoryChangeWatcher>(false, dwFilterFlags);
+	auto pHandler = new CRecordingHandler(strDir);
+	pHandler->AddRef();
+	CHECK(pWatcher->WatchDirectory(strDir.c_str(), FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME,
+		pHandler, TRUE, strInclude, strExclude) == ERROR_SUCCESS);
+
+	TouchFile(strDir + "/a.txt");
+	TouchFile(strDir + "/b.log");
+	TouchFile(strDir + "/sub/c.txt");
+	TouchFile(strDir + "/skip/d.txt");
+	CHECK(rename((strDir + "/renamed_out.txt").c_str(), (strDir + "/renamed_out.log").c_str()) == 0);
+	CHECK(rename((strDir + "/renamed_in.log").c_str(), (strDir + "/renamed_in.txt").c_str()) == 0);
+	CHECK(rename((strDir + "/neither.log").c_str(), (strDir + "/neither.dat").c_str()) == 0);
+	CHECK(unlink((strDir + "/a.txt").c_str()) == 0);
+	TouchFile(strDir + "/zz_last.txt");
+
+	CHECK(WaitFor([pHandler] { return pHandler->Has(FILE_ACTION_ADDED, "zz_last.txt"); }, 10000));
+	pWatcher->UnWatchAllDirectory();
+
+	auto changes = pHandler->GetChanges();
+	pHandler->Release();
+	return changes;
+}
+
+int main()
+{
+	const CChanges expected = {
+		std::make_tuple((DWORD)FILE_ACTION_ADDED, std::string("a.txt"), std::string()),
+		std::make_tuple((DWORD)FILE_ACTION_ADDED, std::string("sub/c.txt"), std::string()),
+		std::make_tuple((DWORD)FILE_ACTION_RENAMED_OLD_NAME, std::string("renamed_out.txt"), std::string("renamed_out.log")),
+		std::make_tuple((DWORD)FILE_ACTION_RENAMED_OLD_NAME, std::string("renamed_in.log"), std::string("renamed_in.txt")),
+		std::make_tuple((DWORD)FILE_ACTION_REMOVED, std::string("a.txt"), std::string()),
+		std::make_tuple((DWORD)FILE_ACTION_ADDED, std::string("zz_last.txt"), std::string()),
+	};
+
+	// checked when they're posted
+	CHECK(Watch("filter_partial", CDirectoryChangeWatcher::FILTERS_CHECK_PARTIAL_PATH, "*.txt", "skip/*") == expected);
+	CHECK(Watch("filter_name_only", CDirectoryChangeWatcher::FILTERS_CHECK_FILE_NAME_ONLY, "*.txt", "d.*") == expected);
+	CHECK(Watch("filter_full", CDirectoryChangeWatcher::FILTERS_CHECK_FULL_PATH, "*.txt", "*/skip/*") == expected);
+
+	// checked when they're dispatched
+	CHECK(Watch("filter_handler_first", CDirectoryChangeWatcher::FILTERS_CHECK_PARTIAL_PATH
+		| CDirectoryChangeWatcher::FILTERS_TEST_HANDLER_FIRST, "*.txt", "skip/*") == expected);
+	return 0;
+}
@@ -0,0 +1,132 @@
+#include "TestSupport.h"
+#include "DelayedDirectoryChangeHandler.h"
+#include "DelayedNotificationPool.h"
+#include "DelayedNotificationThread.h"
+#include <mutex>
+
+
+//
+//	The control notifications' priority lane, on one notification thread, and on a pool of one:
+//	watch A has a backlog its slow handler takes a while to get through, watch B is unwatched meanwhile.
+//	B's On_WatchStopped() is dispatched long before A's backlog is, w/ B's own changes right before it,
+//	and A's On_WatchStopped() still comes after all of A's changes.
+//	(The pool lets the shard it's running finish its SHARD_BATCH_SIZE notifications first.)
+//
+
+//	what each watch's handler has been called for, in order: the names, then "stopped"
+class CRecordingHandler : public CDirectoryChangeHandler
+{
+public:
+	explicit CRecordingHandler(int nDelayUs) : _nDelayUs(nDelayUs) {}
+
+	void On_EventBatch(const CDirChangeEventBatch & batch) override
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(_nDelayUs));
+		std::lock_guard<std::mutex> lock(_mut);
+		for (const auto & event : batch)
+		{
+			_calls.push_back((LPCTSTR)event.strFileName);
+		}
+	}
+
+	void On_WatchStopped(const CString &) override
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		_calls.push_back("stopped");
+	}
+
+	std::vector<std::string> GetCalls() const
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		return _calls;
+	}
+
+private:
+	int		_nDelayUs;
+	mutable std::mutex	_mut;
+	std::vector<std::string>	_calls;
+};
+
+class CTestDelayedHandler : public CDelayedDirectoryChangeHandler
+{
+public:
+	using CDelayedDirectoryChangeHandler::CDelayedDirectoryChangeHandler;
+	using CDelayedDirectoryChangeHandler::PostEventBatch;
+	using CDelayedDirectoryChangeHandler::On_WatchStopped;
+	using CDelayedDirectoryChangeHandler::WaitForOnWatchStoppedDispatched;
+};
+
+struct CWatch
+{
+	CWatch(const std::shared_ptr<CDelayedNotifier>& pNotifier, int nDelayUs)
+	{
+		pRecording = new CRecordingHandler(nDelayUs);
+		pRecording->AddRef();
+		std::shared_ptr<CDirectoryChangeHandler> pRealHandler(pRecording, [](CDirectoryChangeHandler * p) { p->Release(); });
+		pHandler = std::make_shared<CTestDelayedHandler>(pRealHandler, false, std::string(), std::string(),
+			(DWORD)CDirectoryChangeWatcher::FILTERS_DEFAULT_BEHAVIOR, pNotifier);
+	}
+
+	void Post(const char * pszWatch, int nBatches)
+	{
+		for (int i = 0; i < nBatches; ++i)
+		{
+			std::vector<CDirChangeEvent> events;
+			events.push_back(CDirChangeEvent{ FILE_ACTION_MODIFIED, CString(Name(pszWatch, i).c_str()), CString() });
+			pHandler->PostEventBatch(std::move(events));
+		}
+	}
+
+	static std::string Name(const char * pszWatch, int i)
+	{
+		return std::string("/") + pszWatch + "/file_" + std::to_string(i);
+	}
+
+	CRecordingHandler *	pRecording;
+	std::shared_ptr<CTestDelayedHandler>	pHandler;
+};
+
+//	all of the watch's changes, in order, then its stop
+static void CheckCalls(const std::vector<std::string>& calls, const char * pszWatch, int nBatches)
+{
+	CHECK(calls.size() == (size_t)nBatches + 1);
+	for (int i = 0; i < nBatches; ++i)
+	{
+		CHECK(calls[i] == CWatch::Name(pszWatch, i));
+	}
+	CHECK(calls.back() == "stopped");
+}
+
+static void Run(const char * pszName, const std::shared_ptr<CDelayedNotifier>& pNotifier)
+{
+	enum { A_BATCHES = 500, B_BATCHES = 20, A_DELAY_US = 2000 };
+
+	CWatch a(pNotifier, A_DELAY_US);
+	CWatch b(pNotifier, 0);
+
+	// A's backlog takes a second, B's changes are behind it
+	a.Post("a", A_BATCHES);
+	b.Post("b", B_BATCHES);
+	auto tStart = std::chrono::steady_clock::now();
+	b.pHandler->On_WatchStopped(CString("/b"));
+	CHECK(b.pHandler->WaitForOnWatchStoppedDispatched());
+	auto elapsed = std::chrono::steady_clock::now() - tStart;
+
+	auto nDispatchedA = a.pRecording->GetCalls().size();
+	CheckCalls(b.pRecording->GetCalls(), "b", B_BATCHES);
+	printf("%-6s B stopped in %5.1f ms, w/ %zu of A's %d batches dispatched\n",
+		pszName, std::chrono::duration<double, std::milli>(elapsed).count(), nDispatchedA, (int)A_BATCHES);
+	CHECK(nDispatchedA < A_BATCHES / 2);
+
+	// A's stop waits for its own changes
+	a.pHandler->On_WatchStopped(CString("/a"));
+	CHECK(a.pHandler->WaitForOnWatchStoppedDispatched());
+	CheckCalls(a.pRecording->GetCalls(), "a", A_BATCHES);
+}
+
+int main()
+{
+	Run("thread", std::make_shared<CDelayedNotificationThread>());
+	Run("pool", std::make_shared<CDelayedNotificationPool>(1));
+	return 0;
+}
@@ -0,0 +1,122 @@
+#include "TestSupport.h"
+#include "DelayedDirectoryChangeHandler.h"
+#include "DelayedNotificationPool.h"
+#include <atomic>
+
+
+//
+//	Many watches posting to CDelayedNotificationPool from several threads at once, w/ the shards
+//	requeued and stolen all along: each watch's handler is called one notification at a time,
+//	w/ its batches in the order they were posted, and then its On_WatchStopped().
+//
+//	argv[1] is the number of batches per watch.
+//
+
+//	checks its calls as they come
+class CCheckingHandler : public CDirectoryChangeHandler
+{
+public:
+	CCheckingHandler() : _nInside(0), _nNext(0), _bStopped(false) {}
+
+	void On_EventBatch(const CDirChangeEventBatch & batch) override
+	{
+		_Enter();
+		for (const auto & event : batch)
+		{
+			CHECK(!_bStopped);
+			CHECK(atoi((LPCTSTR)event.strFileName) == _nNext);
+			++_nNext;
+		}
+		// now and then, long enough for another worker to try and run this watch too
+		if (_nNext % 64 == 0)
+		{
+			std::this_thread::yield();
+		}
+		_Leave();
+	}
+
+	void On_WatchStopped(const CString &) override
+	{
+		_Enter();
+		_bStopped = true;
+		_Leave();
+	}
+
+	int GetCount() const { return _nNext; }
+
+private:
+	void _Enter() { CHECK(_nInside.fetch_add(1) == 0); }
+	void _Leave() { CHECK(_nInside.fetch_sub(1) == 1); }
+
+private:
+	std::atomic<int>	_nInside;
+	//	only touched by whoever's inside
+	int		_nNext;
+	bool	_bStopped;
+};
+
+class CTestDelayedHandler : public CDelayedDirectoryChangeHandler
+{
+public:
+	using CDelayedDirectoryChangeHandler::CDelayedDirectoryChangeHandler;
+	using CDelayedDirectoryChangeHandler::PostEventBatch;
+	using CDelayedDirectoryChangeHandler::On_WatchStopped;
+	using CDelayedDirectoryChangeHandler::WaitForOnWatchStoppedDispatched;
+};
+
+int main(int argc, char * argv[])
+{
+	enum { PRODUCERS = 8, WATCHES_PER_PRODUCER = 8, POOL_THREADS = 4, MAX_EVENTS_PER_BATCH = 4 };
+	int nBatches = (argc > 1) ? atoi(argv[1]) : 10000;
+
+	std::shared_ptr<CDelayedNotifier> pNotifier = std::make_shared<CDelayedNotificationPool>(POOL_THREADS);
+
+	std::vector<CCheckingHandler *> checking;
+	std::vector<std::shared_ptr<CTestDelayedHandler>> handlers;
+	for (int i = 0; i < PRODUCERS * WATCHES_PER_PRODUCER; ++i)
+	{
+		auto pChecking = new CCheckingHandler();
+		pChecking->AddRef();
+		std::shared_ptr<CDirectoryChangeHandler> pRealHandler(pChecking, [](CDirectoryChangeHandler * p) { p->Release(); });
+		checking.push_back(pChecking);
+		handlers.push_back(std::make_shared<CTestDelayedHandler>(pRealHandler, false, std::string(), std::string(),
+			(DWORD)CDirectoryChangeWatcher::FILTERS_DEFAULT_BEHAVIOR, pNotifier));
+	}
+
+	// each producer posts for its own watches, in turns, and stops them
+	std::vector<int> posted(handlers.size(), 0);
+	std::vector<std::thread> producers;
+	for (int nProducer = 0; nProducer < PRODUCERS; ++nProducer)
+	{
+		producers.emplace_back([&, nProducer]()
+		{
+			for (int nBatch = 0; nBatch < nBatches; ++nBatch)
+			{
+				for (int nWatch = nProducer * WATCHES_PER_PRODUCER; nWatch < (nProducer + 1) * WATCHES_PER_PRODUCER; ++nWatch)
+				{
+					std::vector<CDirChangeEvent> events;
+					for (int i = 0; i <= (nBatch + nWatch) % MAX_EVENTS_PER_BATCH; ++i)
+					{
+						events.push_back(CDirChangeEvent{ FILE_ACTION_MODIFIED, CString(std::to_string(posted[nWatch]++).c_str()), CString() });
+					}
+					handlers[nWatch]->PostEventBatch(std::move(events));
+				}
+			}
+			for (int nWatch = nProducer * WATCHES_PER_PRODUCER; nWatch < (nProducer + 1) * WATCHES_PER_PRODUCER; ++nWatch)
+			{
+				handlers[nWatch]->On_WatchStopped(CString("/w"));
+			}
+		});
+	}
+	for (auto & producer : producers)
+	{
+		producer.join();
+	}
+
+	for (size_t i = 0; i < handlers.size(); ++i)
+	{
+		CHECK(handlers[i]->WaitForOnWatchStoppedDispatched());
+		CHECK(checking[i]->GetCount() == posted[i]);
+	}
+	return 0;
+}
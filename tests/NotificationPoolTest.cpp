@@ -0,0 +1,79 @@
+#include "TestSupport.h"
+#include "AllocationCounter.h"
+#include "DelayedDirectoryChangeHandler.h"
+
+
+//
+//	Once the notification pool is warm, posting and dispatching a batch allocates nothing:
+//	the notification comes back from the pool, and the batch's buffer from the notification.
+//	The names are short enough for CString not to allocate, longer ones do (they're the events').
+//
+
+class CCountingHandler : public CDirectoryChangeHandler
+{
+public:
+	CCountingHandler() : _nEvents(0) {}
+
+	void On_EventBatch(const CDirChangeEventBatch & batch) override
+	{
+		_nEvents.fetch_add(batch.size());
+	}
+
+	size_t GetEventCount() const { return _nEvents.load(); }
+
+private:
+	std::atomic<size_t>	_nEvents;
+};
+
+class CTestDelayedHandler : public CDelayedDirectoryChangeHandler
+{
+public:
+	using CDelayedDirectoryChangeHandler::CDelayedDirectoryChangeHandler;
+	using CDelayedDirectoryChangeHandler::PostEventBatch;
+};
+
+int main()
+{
+	enum { EVENTS_PER_BATCH = 32, WARMUP_BATCHES = 1000, BATCHES = 10000 };
+
+	auto pCounting = new CCountingHandler();
+	pCounting->AddRef();
+	std::shared_ptr<CDirectoryChangeHandler> pRealHandler(pCounting, [](CDirectoryChangeHandler * p) { p->Release(); });
+	auto pHandler = std::make_shared<CTestDelayedHandler>(pRealHandler, false, std::string(), std::string(),
+		(DWORD)CDirectoryChangeWatcher::FILTERS_DEFAULT_BEHAVIOR);
+
+	const CString strName(_T("/w/file.txt"));
+	std::vector<CDirChangeEvent> events;
+	size_t nPosted = 0;
+	size_t nAllocations = 0;
+	for (int i = 0; i < WARMUP_BATCHES + BATCHES; ++i)
+	{
+		if (i == WARMUP_BATCHES)
+		{
+			CHECK(WaitFor([pCounting, nPosted] { return pCounting->GetEventCount() == nPosted; }, 10000));
+			nAllocations = GetAllocationCount();
+		}
+
+		for (int j = 0; j < EVENTS_PER_BATCH; ++j)
+		{
+			events.push_back(CDirChangeEvent{ FILE_ACTION_MODIFIED, strName, CString() });
+		}
+		pHandler->PostEventBatch(std::move(events));
+		nPosted += EVENTS_PER_BATCH;
+
+		// one batch in flight, as a watch that the handler keeps up w/.  Two during the warm-up: the
+		// one that's handed out is the one that's been disposed of first, w/ only one in the pool
+		// the notifier may not have let go of it yet, and another's allocated.
+		size_t nInFlight = (i < WARMUP_BATCHES) ? EVENTS_PER_BATCH : 0;
+		while (pCounting->GetEventCount() + nInFlight < nPosted)
+		{
+			std::this_thread::yield();
+		}
+		CHECK(events.empty());
+	}
+	nAllocations = GetAllocationCount() - nAllocations;
+
+	printf("%d batches of %d events: %zu allocations\n", BATCHES, EVENTS_PER_BATCH, nAllocations);
+	CHECK(nAllocations == 0);
+	return 0;
+}
@@ -0,0 +1,233 @@
+#include "TestSupport.h"
+#include "DelayedDirectoryChangeHandler.h"
+#include "DelayedNotificationThread.h"
+#include "DirChangeNotification.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sys/resource.h>
+
+
+//
+//	1, 4 and 16 watches posting to the notification thread at once, each from a thread of its own.
+//
+//	"locked" is the thread as it was: a deque under a mutex, a condition variable notified for
+//	every notification, one notification taken at a time.  "ring" is CDelayedNotificationThread.
+//
+//	The throughput is the watches posting as fast as they can, until everything's been dispatched.
+//	The latency is from PostEventBatch() to the handler, w/ one notification in flight per watch.
+//	W/ fewer cores than threads, both depend as much on the scheduler as on the queue.  The times
+//	the threads blocked (voluntary context switches, per notification) don't.
+//
+//	argv[1] is the number of notifications per watch for the throughput, argv[2] for the latency.
+//
+
+typedef std::chrono::steady_clock	CClock;
+
+class CLockedNotificationThread : public CDelayedNotifier
+{
+public:
+	CLockedNotificationThread() : _bStop(false), _thread([this] { _ThreadProc(); }) {}
+
+	~CLockedNotificationThread()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mut);
+			_bStop = true;
+		}
+		_cv.notify_all();
+		_thread.join();
+	}
+
+	void PostNotification(std::shared_ptr<CDirChangeNotification> pNotification) override
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mut);
+			_notifications.push_back(std::move(pNotification));
+		}
+		_cv.notify_one();
+	}
+
+	BOOL WaitForDispatch(CEvent & evDispatched) override
+	{
+		return evDispatched.Lock();
+	}
+
+private:
+	void _ThreadProc()
+	{
+		std::unique_lock<std::mutex> lock(_mut);
+		for (;;)
+		{
+			_cv.wait(lock, [this] { return !_notifications.empty() || _bStop; });
+			if (_notifications.empty())
+			{
+				break;
+			}
+
+			auto pNotification = std::move(_notifications.front());
+			_notifications.pop_front();
+			lock.unlock();
+
+			CDirChangeNotification::DispatchNotificationFunction(pNotification);
+			pNotification.reset();
+
+			lock.lock();
+		}
+	}
+
+private:
+	std::mutex	_mut;
+	std::condition_variable	_cv;
+	std::deque<std::shared_ptr<CDirChangeNotification>>	_notifications;
+	bool	_bStop;
+	std::thread	_thread;
+};
+
+//	a watch's handler: when each of its notifications arrived
+class CTimingHandler : public CDirectoryChangeHandler
+{
+public:
+	explicit CTimingHandler(size_t nCount) : _received(nCount), _nReceived(0) {}
+
+	void On_EventBatch(const CDirChangeEventBatch & batch) override
+	{
+		auto now = CClock::now();
+		auto nReceived = _nReceived.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < batch.size(); ++i)
+		{
+			_received[nReceived + i] = now;
+		}
+		_nReceived.store(nReceived + batch.size(), std::memory_order_release);
+	}
+
+	size_t GetReceivedCount() const { return _nReceived.load(std::memory_order_acquire); }
+	CClock::time_point GetReceived(size_t i) const { return _received[i]; }
+
+private:
+	std::vector<CClock::time_point>	_received;
+	std::atomic<size_t>	_nReceived;
+};
+
+class CTestDelayedHandler : public CDelayedDirectoryChangeHandler
+{
+public:
+	using CDelayedDirectoryChangeHandler::CDelayedDirectoryChangeHandler;
+	using CDelayedDirectoryChangeHandler::PostEventBatch;
+};
+
+struct CWatch
+{
+	CTimingHandler *	pTiming;
+	std::shared_ptr<CTestDelayedHandler>	pHandler;
+	std::vector<CClock::time_point>	posted;
+};
+
+static void Run(const std::shared_ptr<CDelayedNotifier>& pNotifier, int nProducers, size_t nCount, bool bPaced,
+	std::vector<double>& latencies, double& dPerSecond, double& dBlocked)
+{
+	std::vector<CWatch> watches(nProducers);
+	for (auto & watch : watches)
+	{
+		watch.pTiming = new CTimingHandler(nCount);
+		watch.pTiming->AddRef();
+		std::shared_ptr<CDirectoryChangeHandler> pRealHandler(watch.pTiming, [](CDirectoryChangeHandler * p) { p->Release(); });
+		watch.pHandler = std::make_shared<CTestDelayedHandler>(pRealHandler, false, std::string(), std::string(),
+			(DWORD)CDirectoryChangeWatcher::FILTERS_DEFAULT_BEHAVIOR, pNotifier);
+		watch.posted.resize(nCount);
+	}
+
+	const CString strName(_T("/w/file.txt"));
+	std::atomic<int> nReady(0);
+	std::atomic<bool> bGo(false);
+	std::vector<std::thread> producers;
+	for (auto & watch : watches)
+	{
+		producers.emplace_back([&]()
+		{
+			std::vector<CDirChangeEvent> events;
+			++nReady;
+			while (!bGo.load())
+			{
+				std::this_thread::yield();
+			}
+			for (size_t i = 0; i < nCount; ++i)
+			{
+				events.push_back(CDirChangeEvent{ FILE_ACTION_MODIFIED, strName, CString() });
+				watch.posted[i] = CClock::now();
+				watch.pHandler->PostEventBatch(std::move(events));
+				while (bPaced && watch.pTiming->GetReceivedCount() <= i)
+				{
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+	while (nReady.load() != nProducers)
+	{
+		std::this_thread::yield();
+	}
+
+	struct rusage usage;
+	CHECK(getrusage(RUSAGE_SELF, &usage) == 0);
+	auto nSwitches = usage.ru_nvcsw;
+	auto tStart = CClock::now();
+	bGo = true;
+	for (auto & producer : producers)
+	{
+		producer.join();
+	}
+	for (auto & watch : watches)
+	{
+		CHECK(WaitFor([&watch, nCount] { return watch.pTiming->GetReceivedCount() == nCount; }, 60000));
+	}
+	auto elapsed = CClock::now() - tStart;
+	CHECK(getrusage(RUSAGE_SELF, &usage) == 0);
+
+	dPerSecond = (double)(nCount * nProducers) / std::chrono::duration<double>(elapsed).count();
+	dBlocked = (double)(usage.ru_nvcsw - nSwitches) / (double)(nCount * nProducers);
+	latencies.clear();
+	for (const auto & watch : watches)
+	{
+		for (size_t i = 0; i < nCount; ++i)
+		{
+			latencies.push_back(std::chrono::duration<double, std::micro>(watch.pTiming->GetReceived(i) - watch.posted[i]).count());
+		}
+	}
+	std::sort(latencies.begin(), latencies.end());
+}
+
+int main(int argc, char * argv[])
+{
+	size_t nThroughputCount = (argc > 1) ? (size_t)atoi(argv[1]) : 20000;
+	size_t nLatencyCount = (argc > 2) ? (size_t)atoi(argv[2]) : 2000;
+	printf("%u cores\n", std::thread::hardware_concurrency());
+
+	for (int nProducers : { 1, 4, 16 })
+	{
+		for (bool bRing : { false, true })
+		{
+			const char * pszName = bRing ? "ring" : "locked";
+			std::shared_ptr<CDelayedNotifier> pNotifier;
+			if (bRing)
+			{
+				pNotifier = CDelayedNotificationThread::Instance();
+			}
+			else
+			{
+				pNotifier = std::make_shared<CLockedNotificationThread>();
+			}
+
+			std::vector<double> latencies;
+			double dPerSecond = 0, dPacedPerSecond = 0, dBlocked = 0, dPacedBlocked = 0;
+			Run(pNotifier, nProducers, nThroughputCount, false, latencies, dPerSecond, dBlocked);
+			Run(pNotifier, nProducers, nLatencyCount, true, latencies, dPacedPerSecond, dPacedBlocked);
+
+			auto percentile = [&latencies](double d) { return latencies[(size_t)(d * (latencies.size() - 1))]; };
+			printf("%-6s %2d producers: %9.0f notifications/s, %.2f blocked/notification | latency %5.1f us median, %6.1f us p99, %8.1f us max, %.2f blocked/notification\n",
+				pszName, nProducers, dPerSecond, dBlocked, percentile(0.5), percentile(0.99), latencies.back(), dPacedBlocked);
+		}
+	}
+	return 0;
+}
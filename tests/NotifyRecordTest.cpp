@@ -0,0 +1,88 @@
+#include "TestSupport.h"
+#include "AllocationCounter.h"
+#include "FileNotifyInformation.h"
+
+
+//
+//	Going through a read's records allocates nothing: the names are views into the buffer,
+//	and the full paths are joined in a buffer of the thread's own, once it's grown to the longest.
+//	The CString returning calls are there for comparison, they allocate once per record.
+//
+
+int main()
+{
+	enum { RECORDS = 1000 };
+
+	std::vector<std::string> names;
+	for (int i = 0; i < RECORDS; ++i)
+	{
+		// longer than what std::string keeps inline
+		names.push_back("some/sub/directory_" + std::to_string(i % 37) + "/file_name_" + std::to_string(i) + ".cpp");
+	}
+	auto buffer = MakeNotifyBuffer(names, FILE_ACTION_ADDED);
+	const CString strRoot(_T("/home/user/projects/watched"));
+	const auto dwSize = (DWORD)(buffer.size() * sizeof(DWORD));
+
+	// the range
+	auto iterate = [&]() -> size_t
+	{
+		CFileNotifyInformation notify_info((LPBYTE)buffer.data(), dwSize);
+		size_t nRecords = 0;
+		for (const auto & record : notify_info)
+		{
+			auto name = record.GetFileName();
+			int nLength = 0;
+			auto pszPath = CFileNotifyInformation::JoinPath(strRoot, name, nLength);
+
+			CHECK(record.GetAction() == FILE_ACTION_ADDED);
+			CHECK((size_t)name.nLength == names[nRecords].size());
+			CHECK(memcmp(name.pszName, names[nRecords].data(), name.nLength) == 0);
+			CHECK(nLength == strRoot.GetLength() + 1 + name.nLength && pszPath[nLength] == 0);
+			CHECK(memcmp(pszPath + strRoot.GetLength() + 1, name.pszName, name.nLength) == 0);
+			++nRecords;
+		}
+		return nRecords;
+	};
+
+	// the current record, as ProcessChangeNotifications() goes through them
+	auto walk = [&]() -> size_t
+	{
+		CFileNotifyInformation notify_info((LPBYTE)buffer.data(), dwSize);
+		size_t nRecords = 0;
+		do
+		{
+			auto name = notify_info.GetFileNameView();
+			int nLength = 0;
+			auto pszPath = notify_info.GetFileNameWithPath(strRoot, nLength);
+			CHECK((size_t)name.nLength == names[nRecords].size());
+			CHECK(nLength == strRoot.GetLength() + 1 + name.nLength && pszPath[nLength] == 0);
+			++nRecords;
+		} while (notify_info.GetNextNotifyInformation());
+		return nRecords;
+	};
+
+	// the thread's path buffer grows to the longest path first
+	CHECK(iterate() == RECORDS);
+
+	auto nAllocations = GetAllocationCount();
+	CHECK(iterate() == RECORDS);
+	CHECK(walk() == RECORDS);
+	nAllocations = GetAllocationCount() - nAllocations;
+
+	size_t nCStringAllocations = GetAllocationCount();
+	{
+		CFileNotifyInformation notify_info((LPBYTE)buffer.data(), dwSize);
+		do
+		{
+			auto strPath = notify_info.GetFileNameWithPath(strRoot);
+			CHECK(strPath.GetLength() > strRoot.GetLength());
+		} while (notify_info.GetNextNotifyInformation());
+	}
+	nCStringAllocations = GetAllocationCount() - nCStringAllocations;
+
+	printf("%d records, twice: %zu allocations w/ the views, %zu w/ the CStrings (once)\n",
+		RECORDS, nAllocations, nCStringAllocations);
+	CHECK(nAllocations == 0);
+	CHECK(nCStringAllocations >= (size_t)RECORDS);
+	return 0;
+}
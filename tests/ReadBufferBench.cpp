@@ -0,0 +1,115 @@
+#include "TestSupport.h"
+#include "DirectoryChangeWatcher.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <sys/resource.h>
+
+
+//
+//	A bulk operation (an untar: nFiles created as fast as possible) w/ a read buffer that stays
+//	at 4K, as it used to, and w/ one that adapts to the load.  The 4K one is kept from growing
+//	by a memory cap below what's in use already (see SetReadBufferMemoryCap()).
+//
+//	The handler holds on to the first batch until all the files have been created, and the watch
+//	(BACKPRESSURE_BLOCK) stops reading meanwhile: the changes pile up, as they do behind a busy
+//	handler or a slow worker, and are read afterwards as fast as the buffer allows.
+//
+//	A read is what a ReadDirectoryChangesW() call and the completion that it's dequeued w/ are
+//	on Windows: two system calls, and a pass through ProcessChangeNotifications().  The inotify
+//	backend fills the watches' buffers the same way, so the reads per event carry over.
+//	The time and the CPU time (this process's) are the catching up's, once the handler lets go.
+//
+//	argv[1] is the number of files.
+//
+
+typedef std::chrono::steady_clock	CClock;
+
+class CCountingHandler : public CDirectoryChangeHandler
+{
+public:
+	CCountingHandler() : _nEvents(0), _nBatches(0), _bOpen(false) {}
+
+	void On_EventBatch(const CDirChangeEventBatch & batch) override
+	{
+		{
+			std::unique_lock<std::mutex> lk(_mut);
+			_cvOpen.wait(lk, [this] { return _bOpen; });
+		}
+		_nEvents.fetch_add(batch.size());
+		_nBatches.fetch_add(1);
+	}
+
+	void Open()
+	{
+		{
+			std::lock_guard<std::mutex> lk(_mut);
+			_bOpen = true;
+		}
+		_cvOpen.notify_all();
+	}
+
+	size_t GetEventCount() const { return _nEvents.load(); }
+	size_t GetBatchCount() const { return _nBatches.load(); }
+
+private:
+	std::atomic<size_t>	_nEvents;
+	std::atomic<size_t>	_nBatches;
+	std::mutex	_mut;
+	std::condition_variable	_cvOpen;
+	bool	_bOpen;
+};
+
+static double CpuSeconds()
+{
+	struct rusage usage;
+	CHECK(getrusage(RUSAGE_SELF, &usage) == 0);
+	return (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+		+ (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void Run(const char * pszName, bool bAdaptive, int nFiles)
+{
+	auto strDir = MakeTestDirectory("read_buffer");
+
+	auto pWatcher = std::make_shared<CDirectoryChangeWatcher>(false,
+		CDirectoryChangeWatcher::FILTERS_DEFAULT_BEHAVIOR | CDirectoryChangeWatcher::FILTERS_DONT_USE_ANY_FILTER_TESTS);
+	auto pHandler = new CCountingHandler();
+	pHandler->AddRef();
+	CHECK(pWatcher->WatchDirectory(strDir.c_str(), FILE_NOTIFY_CHANGE_FILE_NAME, pHandler) == ERROR_SUCCESS);
+	CHECK(pWatcher->SetBackpressurePolicy(strDir.c_str(), CDirectoryChangeWatcher::BACKPRESSURE_BLOCK, 1));
+
+	auto nOldCap = CDirectoryChangeWatcher::SetReadBufferMemoryCap(
+		bAdaptive ? (size_t)READ_DIR_CHANGE_BUFFER_MEMORY_CAP : CDirectoryChangeWatcher::GetReadBufferMemoryUsed());
+
+	for (int i = 0; i < nFiles; ++i)
+	{
+		TouchFile(strDir + "/file_" + std::to_string(i) + ".o");
+	}
+
+	auto dCpu = CpuSeconds();
+	auto tStart = CClock::now();
+	pHandler->Open();
+	CHECK(WaitFor([pHandler, nFiles] { return pHandler->GetEventCount() >= (size_t)nFiles; }, 60000));
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(CClock::now() - tStart).count();
+	dCpu = CpuSeconds() - dCpu;
+
+	auto nEvents = pHandler->GetEventCount();
+	auto nReads = pHandler->GetBatchCount();
+	pWatcher->UnWatchAllDirectory();
+	CDirectoryChangeWatcher::SetReadBufferMemoryCap(nOldCap);
+	pHandler->Release();
+
+	CHECK(nEvents == (size_t)nFiles);
+	printf("%-12s %d files: %6zu reads, %.4f reads/event (%.4f system calls/event on Windows), %.2f us CPU/event, caught up in %lld ms\n",
+		pszName, nFiles, nReads, (double)nReads / nEvents, 2.0 * nReads / nEvents, dCpu * 1e6 / nEvents, (long long)elapsed);
+}
+
+int main(int argc, char * argv[])
+{
+	int nFiles = (argc > 1) ? atoi(argv[1]) : 10000;
+
+	Run("fixed 4K", false, nFiles);
+	Run("adaptive", true, nFiles);
+	return 0;
+}
@@ -0,0 +1,173 @@
+#include "TestSupport.h"
+#include "DirectoryChangeWatcher.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <sys/resource.h>
+
+
+//
+//	IsWatchingDirectory()/NumWatchedDirectories() while another thread registers and unregisters
+//	watches of a tree (an inotify watch per directory, the slow OS calls).
+//
+//	"locked" is the registry as it was: the readers took the mutex that the writer held across
+//	WatchDirectory()/UnWatchDirectory().  It's emulated w/ a mutex of the benchmark's own around
+//	the same calls, "lock-free" is the registry as it is.
+//
+//	The latencies depend on the machine (w/ fewer cores than threads they're mostly preemption),
+//	the voluntary context switches of the readers don't: a reader only makes one when it blocks.
+//
+//	argv[1] is how long each run lasts, in ms.
+//
+
+typedef std::chrono::steady_clock	CClock;
+
+class CNullHandler : public CDirectoryChangeHandler
+{
+};
+
+struct CReaderStats
+{
+	size_t		nCalls;
+	CClock::duration	total;
+	CClock::duration	longest;
+	size_t		nStalls;	//calls that took over STALL_US
+	long		nBlocked;	//voluntary context switches
+};
+
+enum { STALL_US = 100 };
+
+static void Run(const char * pszName, bool bLocked, int nReaders, int nRunMs,
+	const std::string& strTree, const std::string& strOther)
+{
+	auto pWatcher = std::make_shared<CDirectoryChangeWatcher>(false,
+		CDirectoryChangeWatcher::FILTERS_DEFAULT_BEHAVIOR | CDirectoryChangeWatcher::FILTERS_NO_WATCH_STARTSTOP_NOTIFICATION);
+	auto pHandler = new CNullHandler();
+	pHandler->AddRef();
+
+	// what the readers look up stays watched
+	const CString strWatched(strOther.c_str());
+	CHECK(pWatcher->WatchDirectory(strWatched, FILE_NOTIFY_CHANGE_FILE_NAME, pHandler) == ERROR_SUCCESS);
+
+	std::mutex mutRegistry;
+	std::atomic<bool> bStop(false);
+	std::atomic<size_t> nRegistrations(0);
+
+	std::thread writer([&]()
+	{
+		const CString strDir(strTree.c_str());
+		while (!bStop.load())
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutRegistry, std::defer_lock);
+				if (bLocked)
+				{
+					lock.lock();
+				}
+				CHECK(pWatcher->WatchDirectory(strDir, FILE_NOTIFY_CHANGE_FILE_NAME, pHandler, TRUE) == ERROR_SUCCESS);
+			}
+			{
+				std::unique_lock<std::mutex> lock(mutRegistry, std::defer_lock);
+				if (bLocked)
+				{
+					lock.lock();
+				}
+				pWatcher->UnWatchDirectory(strDir);
+			}
+			++nRegistrations;
+		}
+	});
+
+	std::vector<CReaderStats> stats(nReaders, CReaderStats{ 0, CClock::duration(), CClock::duration(), 0, 0 });
+	std::vector<std::thread> readers;
+	for (int i = 0; i < nReaders; ++i)
+	{
+		readers.emplace_back([&, i]()
+		{
+			auto & s = stats[i];
+			struct rusage usage;
+			CHECK(getrusage(RUSAGE_THREAD, &usage) == 0);
+			s.nBlocked = -usage.ru_nvcsw;
+			while (!bStop.load())
+			{
+				auto t0 = CClock::now();
+				{
+					std::unique_lock<std::mutex> lock(mutRegistry, std::defer_lock);
+					if (bLocked)
+					{
+						lock.lock();
+					}
+					CHECK(pWatcher->IsWatchingDirectory(strWatched));
+					CHECK(pWatcher->NumWatchedDirectories() >= 1);
+				}
+				auto elapsed = CClock::now() - t0;
+
+				++s.nCalls;
+				s.total += elapsed;
+				s.longest = (std::max)(s.longest, elapsed);
+				if (elapsed > std::chrono::microseconds(STALL_US))
+				{
+					++s.nStalls;
+				}
+			}
+			CHECK(getrusage(RUSAGE_THREAD, &usage) == 0);
+			s.nBlocked += usage.ru_nvcsw;
+		});
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(nRunMs));
+	bStop = true;
+	writer.join();
+	for (auto & reader : readers)
+	{
+		reader.join();
+	}
+	pWatcher->UnWatchAllDirectory();
+	pHandler->Release();
+
+	CReaderStats all{ 0, CClock::duration(), CClock::duration(), 0, 0 };
+	for (const auto & s : stats)
+	{
+		all.nCalls += s.nCalls;
+		all.total += s.total;
+		all.longest = (std::max)(all.longest, s.longest);
+		all.nStalls += s.nStalls;
+		all.nBlocked += s.nBlocked;
+	}
+	CHECK(all.nCalls > 0);
+
+	using std::chrono::duration_cast;
+	printf("%-9s %d readers: %9.0f lookups/s, %6.1f ns avg, %6lld us max, %4zu over %d us, blocked %5ld times | %3zu registrations\n",
+		pszName, nReaders,
+		(double)all.nCalls * 1000.0 / nRunMs,
+		(double)duration_cast<std::chrono::nanoseconds>(all.total).count() / (double)all.nCalls,
+		(long long)duration_cast<std::chrono::microseconds>(all.longest).count(),
+		all.nStalls, STALL_US, all.nBlocked, nRegistrations.load());
+}
+
+int main(int argc, char * argv[])
+{
+	int nRunMs = (argc > 1) ? atoi(argv[1]) : 300;
+	printf("%u cores\n", std::thread::hardware_concurrency());
+
+	// a tree of 200 directories, so that a registration takes a while
+	auto strTree = MakeTestDirectory("registry_tree");
+	for (int i = 0; i < 20; ++i)
+	{
+		auto strSub = strTree + "/" + std::to_string(i);
+		CHECK(mkdir(strSub.c_str(), 0755) == 0);
+		for (int j = 0; j < 10; ++j)
+		{
+			CHECK(mkdir((strSub + "/" + std::to_string(j)).c_str(), 0755) == 0);
+		}
+	}
+	auto strOther = MakeTestDirectory("registry_other");
+
+	for (int nReaders : { 1, 4 })
+	{
+		Run("locked", true, nReaders, nRunMs, strTree, strOther);
+		Run("lock-free", false, nReaders, nRunMs, strTree, strOther);
+	}
+	return 0;
+}
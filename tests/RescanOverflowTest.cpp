@@ -0,0 +1,195 @@
+#include "TestSupport.h"
+#include "DirectoryChangeWatcher.h"
+#include "DirectorySnapshot.h"
+#include <map>
+#include <mutex>
+#include <vector>
+
+
+//
+//	FILTERS_RESCAN_ON_OVERFLOW: when notifications are lost nothing goes unreported,
+//	and nothing is reported twice, whether the snapshot's baseline was done or not.
+//
+//	The overflows are forced w/ a small inotify queue: /proc/sys/fs/inotify/max_queued_events
+//	is lowered while the watcher is created (it's read by inotify_init()) and restored right after.
+//	W/o root only the snapshot is tested.
+//
+
+static const char * QUEUE_LIMIT_PATH = "/proc/sys/fs/inotify/max_queued_events";
+
+typedef std::vector<std::pair<DWORD, std::string>>	CReports;
+
+static CReports RunRescan(CDirectorySnapshot& snapshot)
+{
+	CReports reports;
+	while (snapshot.RescanStep(16, [&reports](DWORD dwAction, const CDirectorySnapshot::tstring& strRelName, bool)
+	{
+		reports.emplace_back(dwAction, strRelName);
+	}))
+	{
+	}
+	return reports;
+}
+
+//	a rescan that finds a change first drops its notification
+static void TestRescanBeforeNotification()
+{
+	auto strDir = MakeTestDirectory("rescan_dedupe");
+	TouchFile(strDir + "/old");
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+	CDirectorySnapshot snapshot(CString(strDir.c_str()), true);
+	CHECK(RunRescan(snapshot).empty());
+	CHECK(snapshot.HasBaseline());
+
+	TouchFile(strDir + "/new");
+	CHECK(unlink((strDir + "/old").c_str()) == 0);
+	snapshot.RequestRescan("", false);
+	snapshot.StartRequestedRescans();
+
+	auto reports = RunRescan(snapshot);
+	CHECK(reports.size() == 2);
+	CHECK(reports[0] == std::make_pair((DWORD)FILE_ACTION_ADDED, std::string("new")));
+	CHECK(reports[1] == std::make_pair((DWORD)FILE_ACTION_REMOVED, std::string("old")));
+
+	// their notifications were still queued
+	CHECK(!snapshot.NoteAdded("new"));
+	CHECK(!snapshot.NoteRemoved("old"));
+
+	// and what comes after them is new again
+	CHECK(snapshot.NoteModified("new"));
+	CHECK(snapshot.NoteRemoved("new"));
+}
+
+//	an overflow before the baseline is done reports what the notifications didn't
+static void TestLostDuringBaseline()
+{
+	auto strDir = MakeTestDirectory("rescan_baseline");
+	TouchFile(strDir + "/before");
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+	CDirectorySnapshot snapshot(CString(strDir.c_str()), true);
+	TouchFile(strDir + "/delivered");
+	TouchFile(strDir + "/lost");
+	CHECK(snapshot.NoteAdded("delivered"));
+
+	snapshot.RequestRescan("", true);
+	CHECK(!snapshot.HasRequestedRescans());
+
+	auto reports = RunRescan(snapshot);
+	CHECK(reports.size() == 1);
+	CHECK(reports[0] == std::make_pair((DWORD)FILE_ACTION_ADDED, std::string("lost")));
+	CHECK(snapshot.HasBaseline());
+	CHECK(!snapshot.NoteAdded("lost"));
+
+	// reconciled, the next overflow is diffed as usual
+	snapshot.RequestRescan("", true);
+	snapshot.StartRequestedRescans();
+	CHECK(RunRescan(snapshot).empty());
+}
+
+class CCountingHandler : public CDirectoryChangeHandler
+{
+public:
+	void On_EventBatch(const CDirChangeEventBatch & batch) override
+	{
+		std::lock_guard<std::mutex> lk(_mut);
+		for (const auto & event : batch)
+		{
+			if (event.dwAction == FILE_ACTION_ADDED)
+			{
+				++_added[(LPCTSTR)event.strFileName];
+			}
+		}
+	}
+
+	size_t CountAdded(const std::string& strPrefix, size_t& nDuplicates)
+	{
+		std::lock_guard<std::mutex> lk(_mut);
+		size_t nAdded = 0;
+		nDuplicates = 0;
+		for (const auto & it : _added)
+		{
+			if (it.first.compare(0, strPrefix.size(), strPrefix) == 0)
+			{
+				++nAdded;
+				nDuplicates += it.second - 1;
+			}
+		}
+		return nAdded;
+	}
+
+private:
+	std::mutex	_mut;
+	std::map<std::string, int>	_added;
+};
+
+//
+//	nFiles created in <dir>/new after nDelayMs, while the baseline lists nBaselineFiles
+//	in <dir>/big (listed before <dir>/new).
+//
+static void TestOverflow(int nDelayMs, int nBaselineFiles, int nFiles)
+{
+	auto strDir = MakeTestDirectory("rescan_overflow");
+	CHECK(mkdir((strDir + "/big").c_str(), 0755) == 0);
+	CHECK(mkdir((strDir + "/new").c_str(), 0755) == 0);
+	for (int i = 0; i < nBaselineFiles; ++i)
+	{
+		TouchFile(strDir + "/big/" + std::to_string(i));
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+	char szLimit[32] = {};
+	auto pLimit = fopen(QUEUE_LIMIT_PATH, "r+");
+	CHECK(pLimit != nullptr && fgets(szLimit, sizeof(szLimit), pLimit) != nullptr);
+	CHECK(fseek(pLimit, 0, SEEK_SET) == 0 && fputs("64\n", pLimit) >= 0 && fflush(pLimit) == 0);
+
+	auto pWatcher = std::make_shared<CDirectoryChangeWatcher>(false,
+		CDirectoryChangeWatcher::FILTERS_DEFAULT_BEHAVIOR | CDirectoryChangeWatcher::FILTERS_RESCAN_ON_OVERFLOW);
+
+	CHECK(fseek(pLimit, 0, SEEK_SET) == 0 && fputs(szLimit, pLimit) >= 0);
+	fclose(pLimit);
+
+	auto pHandler = new CCountingHandler();
+	pHandler->AddRef();
+	CHECK(pWatcher->WatchDirectory(strDir.c_str(), FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME,
+		pHandler, TRUE) == ERROR_SUCCESS);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(nDelayMs));
+	for (int i = 0; i < nFiles; ++i)
+	{
+		TouchFile(strDir + "/new/" + std::to_string(i));
+	}
+
+	size_t nDuplicates = 0;
+	WaitFor([&] { return pHandler->CountAdded(strDir + "/new/", nDuplicates) == (size_t)nFiles; }, 30000);
+	// whatever is still queued
+	std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+	pWatcher->UnWatchAllDirectory();
+
+	auto nAdded = pHandler->CountAdded(strDir + "/new/", nDuplicates);
+	printf("delay %d ms, %d files in the baseline: %zu of %d added, %zu duplicates\n",
+		nDelayMs, nBaselineFiles, nAdded, nFiles, nDuplicates);
+	CHECK(nAdded == (size_t)nFiles);
+	CHECK(nDuplicates == 0);
+
+	pHandler->Release();
+}
+
+int main()
+{
+	TestRescanBeforeNotification();
+	TestLostDuringBaseline();
+
+	if (access(QUEUE_LIMIT_PATH, W_OK) != 0)
+	{
+		printf("%s isn't writable, the overflow tests are skipped\n", QUEUE_LIMIT_PATH);
+		return TEST_SKIPPED;
+	}
+
+	// while the baseline is being built
+	TestOverflow(0, 20000, 6000);
+	// once it's done
+	TestOverflow(1500, 0, 6000);
+	return 0;
+}
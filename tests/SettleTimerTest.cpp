@@ -0,0 +1,197 @@
+#include "TestSupport.h"
+#include "DirectoryChangeWatcher.h"
+#include "SettleTimer.h"
+#include <map>
+#include <mutex>
+#include <set>
+
+
+//
+//	CSettleTimer on its own: re-arming, cancelling, renames, the resolution.  Then a watch w/ a
+//	settle time, which has to reschedule its passes for it: one FILE_ACTION_QUIESCENT per file,
+//	no sooner than the settle time after the file's last change, and none for a file that's gone.
+//	Then nFiles paths armed, re-armed and expired, timed.
+//
+//	argv[1] is the number of paths for the timing.
+//
+
+typedef std::chrono::steady_clock	CClock;
+
+static CDirChangeEvent Event(DWORD dwAction, const std::string& strName, const std::string& strNewName = std::string())
+{
+	return CDirChangeEvent{ dwAction, CString(strName.c_str()), CString(strNewName.c_str()) };
+}
+
+static std::vector<std::string> TakeExpired(CSettleTimer& timer, CClock::time_point tNow)
+{
+	std::vector<CDirChangeEvent> events;
+	timer.TakeExpired(tNow, events);
+
+	std::vector<std::string> names;
+	for (const auto & event : events)
+	{
+		CHECK(event.dwAction == FILE_ACTION_QUIESCENT);
+		names.push_back((LPCTSTR)event.strFileName);
+	}
+	return names;
+}
+
+static void TestTimer()
+{
+	typedef std::vector<std::string>	names;
+	const auto ms = [](int n) { return std::chrono::milliseconds(n); };
+	const auto t0 = CClock::now();
+
+	CSettleTimer timer(100);
+	CHECK(!timer.HasPending());
+
+	// armed, in the order they came due
+	timer.NoteEvents({ Event(FILE_ACTION_ADDED, "/w/a") }, t0);
+	timer.NoteEvents({ Event(FILE_ACTION_MODIFIED, "/w/b"), Event(FILE_ACTION_MODIFIED, "/w/c") }, t0 + ms(10));
+	CHECK(timer.GetPendingCount() == 3);
+	CHECK(timer.GetNextExpiry() == t0 + ms(100 + CSettleTimer::SETTLE_RESOLUTION_MS));
+	CHECK(TakeExpired(timer, t0 + ms(99)).empty());
+
+	// re-armed: a goes to the back, once
+	timer.NoteEvents({ Event(FILE_ACTION_MODIFIED, "/w/a"), Event(FILE_ACTION_MODIFIED, "/w/a") }, t0 + ms(50));
+	CHECK(timer.GetPendingCount() == 3);
+	CHECK(timer.GetNextExpiry() == t0 + ms(110 + CSettleTimer::SETTLE_RESOLUTION_MS));
+	CHECK(TakeExpired(timer, t0 + ms(100)).empty());
+	CHECK((TakeExpired(timer, t0 + ms(110)) == names{ "/w/b", "/w/c" }));
+	CHECK(TakeExpired(timer, t0 + ms(149)).empty());
+	CHECK((TakeExpired(timer, t0 + ms(150)) == names{ "/w/a" }));
+	CHECK(!timer.HasPending());
+
+	// cancelled, and what it reports itself isn't armed
+	timer.NoteEvents({ Event(FILE_ACTION_ADDED, "/w/d"), Event(FILE_ACTION_ADDED, "/w/e"), Event(FILE_ACTION_REMOVED, "/w/d") }, t0);
+	timer.NoteEvents({ Event(FILE_ACTION_QUIESCENT, "/w/f"), Event(FILE_ACTION_REMOVED, "/w/g") }, t0);
+	CHECK(timer.GetPendingCount() == 1);
+	CHECK((TakeExpired(timer, t0 + ms(1000)) == names{ "/w/e" }));
+
+	// renamed: the report moves to the new name, and to the back
+	timer.NoteEvents({ Event(FILE_ACTION_ADDED, "/w/h"), Event(FILE_ACTION_ADDED, "/w/i") }, t0);
+	timer.NoteEvents({ Event(FILE_ACTION_RENAMED_OLD_NAME, "/w/h", "/w/j") }, t0 + ms(30));
+	CHECK(timer.GetPendingCount() == 2);
+	CHECK((TakeExpired(timer, t0 + ms(100)) == names{ "/w/i" }));
+	CHECK((TakeExpired(timer, t0 + ms(130)) == names{ "/w/j" }));
+
+	// a file that wasn't changed, renamed
+	timer.NoteEvents({ Event(FILE_ACTION_RENAMED_OLD_NAME, "/w/k", "/w/l") }, t0);
+	CHECK((TakeExpired(timer, t0 + ms(100)) == names{ "/w/l" }));
+	CHECK(!timer.HasPending());
+}
+
+//	when each file was reported quiescent
+class CQuiescentHandler : public CDirectoryChangeHandler
+{
+public:
+	void On_FileQuiescent(const CString & strFileName) override
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		_quiescent.emplace_back((LPCTSTR)strFileName, CClock::now());
+	}
+
+	std::vector<std::pair<std::string, CClock::time_point>> GetQuiescent() const
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		return _quiescent;
+	}
+
+private:
+	mutable std::mutex	_mut;
+	std::vector<std::pair<std::string, CClock::time_point>>	_quiescent;
+};
+
+static void TestWatch()
+{
+	enum { FILES = 10, WRITES = 5, SETTLE_MS = 200 };
+
+	auto strDir = MakeTestDirectory("settle");
+	auto pWatcher = std::make_shared<CDirectoryChangeWatcher>(false,
+		CDirectoryChangeWatcher::FILTERS_DEFAULT_BEHAVIOR | CDirectoryChangeWatcher::FILTERS_NO_WATCH_STARTSTOP_NOTIFICATION);
+	auto pHandler = new CQuiescentHandler();
+	pHandler->AddRef();
+	CHECK(pWatcher->WatchDirectory(strDir.c_str(), FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE, pHandler,
+		FALSE, std::string(), std::string(), READ_DIR_CHANGE_BUFFER_SIZE, false, 0, SETTLE_MS) == ERROR_SUCCESS);
+
+	// every file written to a few times, further apart than the reads
+	std::map<std::string, CClock::time_point> lastChanged;
+	for (int nWrite = 0; nWrite < WRITES; ++nWrite)
+	{
+		for (int i = 0; i < FILES; ++i)
+		{
+			auto strPath = strDir + "/file_" + std::to_string(i);
+			lastChanged[strPath] = CClock::now();
+			auto pFile = fopen(strPath.c_str(), "a");
+			CHECK(pFile != nullptr);
+			fputs("more", pFile);
+			fclose(pFile);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	// before they've settled: one's gone, one's renamed
+	CHECK(unlink((strDir + "/file_0").c_str()) == 0);
+	lastChanged.erase(strDir + "/file_0");
+	lastChanged.erase(strDir + "/file_1");
+	lastChanged[strDir + "/renamed_1"] = CClock::now();
+	CHECK(rename((strDir + "/file_1").c_str(), (strDir + "/renamed_1").c_str()) == 0);
+
+	CHECK(WaitFor([&]() { return pHandler->GetQuiescent().size() >= lastChanged.size(); }, 10000));
+	// and nothing after that
+	std::this_thread::sleep_for(std::chrono::milliseconds(3 * SETTLE_MS));
+
+	auto quiescent = pHandler->GetQuiescent();
+	CHECK(quiescent.size() == lastChanged.size());
+	std::set<std::string> reported;
+	for (const auto & file : quiescent)
+	{
+		auto it = lastChanged.find(file.first);
+		CHECK(it != lastChanged.end());
+		CHECK(reported.insert(file.first).second);
+		CHECK(file.second - it->second >= std::chrono::milliseconds(SETTLE_MS));
+	}
+
+	pWatcher->UnWatchAllDirectory();
+	pHandler->Release();
+}
+
+static void TimeTimer(size_t nFiles)
+{
+	std::vector<CDirChangeEvent> events;
+	for (size_t i = 0; i < nFiles; ++i)
+	{
+		events.push_back(Event(FILE_ACTION_MODIFIED, "/home/user/projects/watched/src/module_" + std::to_string(i % 97) + "/file_" + std::to_string(i) + ".cpp"));
+	}
+
+	CSettleTimer timer(1000);
+	auto t0 = CClock::now();
+
+	auto tStart = CClock::now();
+	timer.NoteEvents(events, t0);
+	auto tArmed = CClock::now();
+	timer.NoteEvents(events, t0 + std::chrono::milliseconds(500));
+	auto tRearmed = CClock::now();
+	CHECK(timer.GetPendingCount() == nFiles);
+
+	std::vector<CDirChangeEvent> expired;
+	timer.TakeExpired(t0 + std::chrono::milliseconds(1499), expired);
+	CHECK(expired.empty());
+	auto tExpiring = CClock::now();
+	timer.TakeExpired(t0 + std::chrono::milliseconds(1500), expired);
+	auto tExpired = CClock::now();
+	CHECK(expired.size() == nFiles && !timer.HasPending());
+
+	auto perFile = [nFiles](CClock::duration d) { return std::chrono::duration<double, std::nano>(d).count() / nFiles; };
+	printf("%zu files: armed %.0f ns/file, re-armed %.0f ns/file, expired %.0f ns/file\n",
+		nFiles, perFile(tArmed - tStart), perFile(tRearmed - tArmed), perFile(tExpired - tExpiring));
+}
+
+int main(int argc, char * argv[])
+{
+	size_t nFiles = (argc > 1) ? (size_t)atoi(argv[1]) : 100000;
+
+	TestTimer();
+	TestWatch();
+	TimeTimer(nFiles);
+	return 0;
+}
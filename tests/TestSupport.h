@@ -0,0 +1,76 @@
+#pragma once
+#include "stdafx.h"
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+
+//
+//	What the tests share.  A test is a main() that returns 0 when it passes,
+//	CHECK() ends it w/ 1 when something's wrong, and TEST_SKIPPED tells ctest
+//	it can't run here (see tests/CMakeLists.txt).
+//
+enum { TEST_SKIPPED = 77 };
+
+#define CHECK(expr) \
+	do { if (!(expr)) { fprintf(stderr, "%s(%d): CHECK(%s) failed\n", __FILE__, __LINE__, #expr); exit(1); } } while (0)
+
+//	an empty directory named pszName under the current one (the build's tests directory)
+inline std::string MakeTestDirectory(const char * pszName)
+{
+	char szCwd[PATH_MAX];
+	CHECK(getcwd(szCwd, sizeof(szCwd)) != nullptr);
+
+	auto strDir = std::string(szCwd) + "/" + pszName;
+	CHECK(system(("rm -rf '" + strDir + "' && mkdir -p '" + strDir + "'").c_str()) == 0);
+	return strDir;
+}
+
+inline void TouchFile(const std::string& strPath)
+{
+	auto pFile = fopen(strPath.c_str(), "w");
+	CHECK(pFile != nullptr);
+	fclose(pFile);
+}
+
+//	polls pred until it's true or nTimeoutMs have passed, returns pred()
+inline bool WaitFor(const std::function<bool()>& pred, int nTimeoutMs)
+{
+	auto tEnd = std::chrono::steady_clock::now() + std::chrono::milliseconds(nTimeoutMs);
+	while (!pred())
+	{
+		if (std::chrono::steady_clock::now() >= tEnd)
+		{
+			return pred();
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return true;
+}
+
+//	a read buffer as the event source fills it: one record per name (in TCHARs), all w/ dwAction
+inline std::vector<DWORD> MakeNotifyBuffer(const std::vector<std::string>& names, DWORD dwAction)
+{
+	std::vector<DWORD> buffer;
+	size_t nLast = 0;
+	for (const auto & strName : names)
+	{
+		auto nRecordSize = (offsetof(FILE_NOTIFY_INFORMATION, FileName) + strName.size() + 3) / 4 * 4;
+		nLast = buffer.size();
+		buffer.resize(nLast + nRecordSize / 4);
+
+		auto pRecord = (PFILE_NOTIFY_INFORMATION)&buffer[nLast];
+		pRecord->NextEntryOffset = (DWORD)nRecordSize;
+		pRecord->Action = dwAction;
+		pRecord->FileNameLength = (DWORD)strName.size();
+		memcpy(pRecord->FileName, strName.data(), strName.size());
+	}
+	((PFILE_NOTIFY_INFORMATION)&buffer[nLast])->NextEntryOffset = 0;
+	return buffer;
+}
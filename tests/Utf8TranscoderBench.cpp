@@ -0,0 +1,154 @@
+#include "TestSupport.h"
+#include "FileNotifyInformation.h"
+#include "Utf8Transcoder.h"
+#include <random>
+#include <vector>
+
+
+//
+//	What the filters' names cost: the scalar and the vector transcoder over names of realistic
+//	lengths (mostly ASCII, a few w/ accents or CJK), and a read's worth of names converted
+//	one event at a time (a CString each, as the filters used to get them) or into a CUtf8NameArena.
+//
+//	The results are checked against each other, so it runs as a test too: short by default,
+//	argv[1] is the number of rounds.
+//
+
+typedef std::chrono::steady_clock	CClock;
+
+//	"src/module_12/Component.cpp"-like, 4 to 120 code units, ~22 on average
+static std::vector<std::u16string> MakeNames(size_t nCount)
+{
+	std::mt19937 rng(12345);
+	std::lognormal_distribution<double> length(3.0, 0.5);
+	std::uniform_int_distribution<int> ascii('a', 'z');
+	std::uniform_int_distribution<int> percent(0, 99);
+
+	std::vector<std::u16string> names;
+	for (size_t i = 0; i < nCount; ++i)
+	{
+		auto nLength = (std::min)((size_t)120, (std::max)((size_t)4, (size_t)length(rng)));
+		auto nKind = percent(rng);
+		std::u16string strName;
+		for (size_t j = 0; j < nLength; ++j)
+		{
+			if (j % 9 == 8)
+			{
+				strName += u'/';
+			}
+			else if (nKind < 3 && j % 4 == 0)
+			{
+				strName += (char16_t)(0x00E0 + j % 16);//Latin-1 accents
+			}
+			else if (nKind < 5)
+			{
+				strName += (char16_t)(0x4E00 + j);//CJK
+			}
+			else
+			{
+				strName += (char16_t)ascii(rng);
+			}
+		}
+		names.push_back(strName);
+	}
+	return names;
+}
+
+static double NsPerName(CClock::duration elapsed, size_t nNames)
+{
+	return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / (double)nNames;
+}
+
+int main(int argc, char * argv[])
+{
+	int nRounds = (argc > 1) ? atoi(argv[1]) : 20;
+	const size_t NAMES = 4096;
+
+	auto names = MakeNames(NAMES);
+	size_t nUnits = 0;
+	for (const auto & strName : names)
+	{
+		nUnits += strName.size();
+	}
+
+	std::string strScalar, strVector;
+	auto transcode = [&names](std::string& strDest, bool bVector)
+	{
+		strDest.clear();
+		for (const auto & strName : names)
+		{
+			auto pSrc = reinterpret_cast<const uint16_t *>(strName.data());
+			if (bVector)
+			{
+				CUtf8Transcoder::Append(pSrc, strName.size(), strDest);
+			}
+			else
+			{
+				CUtf8Transcoder::AppendScalar(pSrc, strName.size(), strDest);
+			}
+		}
+	};
+	transcode(strScalar, false);
+	transcode(strVector, true);
+	CHECK(strScalar == strVector);
+
+	CClock::duration scalar{}, vector{};
+	for (int i = 0; i < nRounds; ++i)
+	{
+		auto t0 = CClock::now();
+		transcode(strScalar, false);
+		auto t1 = CClock::now();
+		transcode(strVector, true);
+		scalar += t1 - t0;
+		vector += CClock::now() - t1;
+	}
+	printf("%zu names, %.1f code units on average\n", NAMES, (double)nUnits / NAMES);
+	printf("UTF-16 -> UTF-8, scalar: %6.1f ns/name\n", NsPerName(scalar, NAMES * nRounds));
+	printf("UTF-16 -> UTF-8, vector: %6.1f ns/name\n", NsPerName(vector, NAMES * nRounds));
+
+	// the names of one read, as the event source reports them
+	std::vector<std::string> tnames;
+	tnames.reserve(names.size());
+	for (const auto & strName : names)
+	{
+		auto pSrc = reinterpret_cast<const uint16_t *>(strName.data());
+		tnames.push_back(std::string());
+		CUtf8Transcoder::Append(pSrc, strName.size(), tnames.back());
+	}
+	auto buffer = MakeNotifyBuffer(tnames, FILE_ACTION_MODIFIED);
+	CFileNotifyInformation notify_info((LPBYTE)buffer.data(), (DWORD)(buffer.size() * sizeof(DWORD)));
+	const CString strRoot(_T("/home/user/projects/watched"));
+
+	CUtf8NameArena arena;
+	arena.Assign(notify_info);
+	CHECK(arena.GetCount() == NAMES);
+
+	CClock::duration perEvent{}, arenaAssign{};
+	size_t nChecked = 0;
+	for (int i = 0; i < nRounds; ++i)
+	{
+		auto t0 = CClock::now();
+		// the full path, and its part after the watched directory in UTF-8
+		CFileNotifyInformation records((LPBYTE)buffer.data(), (DWORD)(buffer.size() * sizeof(DWORD)));
+		do
+		{
+			auto strFileName = records.GetFileNameWithPath(strRoot);
+			auto strUtf8 = CUtf8Transcoder::ToUtf8(strFileName.Mid(strRoot.GetLength() + 1));
+			nChecked += strUtf8.size();
+		} while (records.GetNextNotifyInformation());
+		auto t1 = CClock::now();
+		arena.Assign(notify_info);
+		for (size_t j = 0; j < arena.GetCount(); ++j)
+		{
+			size_t nLength = 0;
+			arena.GetName(j, nLength);
+			nChecked -= nLength;
+		}
+		perEvent += t1 - t0;
+		arenaAssign += CClock::now() - t1;
+	}
+	CHECK(nChecked == 0);
+	printf("a read's names, per event:  %6.1f ns/name\n", NsPerName(perEvent, NAMES * nRounds));
+	printf("a read's names, name arena: %6.1f ns/name\n", NsPerName(arenaAssign, NAMES * nRounds));
+	return 0;
+}